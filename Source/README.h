@@ -79,7 +79,11 @@ startup, such as your app delegate's
 
 The SquashCocoa::reportErrors method loads any errors recorded from previous crashes and
 transmits them to Squash. Errors are only removed from this queue when Squash
-successfully receives them.
+successfully receives them, or when Squash rejects them outright (a 4xx other
+than 408 or 429), since sending them again would not change the answer. After
+the first call, the queue is also flushed whenever the Squash host becomes
+reachable again, and retried with exponential backoff when the host responds
+with server errors or times out.
 
 the SquashCocoa::hook method adds the uncaught-exception and default signal handlers that
 allow Squash to record new crashes.
@@ -109,17 +113,126 @@ available:
     set to `/api/1.0/notify`.
 \li `timeout`: The amount of time to wait before giving up on trasmitting an
     error. By default it's 15 seconds.
+\li `maximumConcurrentUploads`: The number of occurrences that may be in flight
+    to Squash at once. By default it's 4.
+\li `minimumRetryInterval`: How long to wait before flushing again after a flush
+    fails with a server error or timeout. The wait doubles with each consecutive
+    failure and is randomized per device. By default it's 30 seconds.
+\li `maximumRetryInterval`: The longest wait between failed flushes; a longer
+    `Retry-After` from the server still wins. By default it's one hour.
+\li `maximumQueueBytes`, `maximumQueueCount`: Limits on the disk space (5 MiB)
+    and number (200) of queued occurrences. Over a limit, duplicates are merged
+    and then the occurrences seen longest ago are evicted, non-fatal ones first;
+    the number evicted is sent with the next upload. Enforced at startup and
+    whenever the queue grows a quarter past a limit. Set to 0 for no limit.
+\li `maximumQueueAge`: Queued occurrences older than this many seconds are
+    evicted. By default it's 30 days.
+\li `batchingEnabled`: If `YES`, pending occurrences are grouped into compressed
+    batches and posted to `batchNotifyPath` instead of one request each. Your
+    Squash host must support the batch endpoint. By default it's `NO`.
+\li `batchNotifyPath`: The path to post batches of occurrences to. By default
+    it's set to `/api/1.0/notify/batch`.
+\li `maximumBatchBytes`, `maximumBatchCount`: The uncompressed size and number
+    of occurrences allowed in one batch. By default they're 512 KiB and 50.
+\li `compression`: The content coding applied to batch bodies:
+    `SCCompressionGzip` (the default), `SCCompressionDeflate`, or
+    `SCCompressionNone`.
+\li `deduplicatesContext`: If `YES`, the environment variables, launch
+    arguments, host name, device, operating system and version fields are sent
+    once per session under a content hash, and later occurrences send only the
+    hash as `context_id`. Your Squash host must support context references. By
+    default it's `NO`.
+\li `uploadsClientStats`: If `YES`, a snapshot of the library's own telemetry
+    (`[[SquashCocoa sharedClient] telemetry]`: capture latency, payload sizes,
+    queue depth, upload latency and status codes) is sent with each upload as
+    `client_stats`. You can also poll `telemetry` yourself, or set a `delegate` to
+    receive it after each flush. By default it's `NO`.
 
 \subsection Exception Filtering
 
 \li `ignoredExceptions`: A set of `NSException` names that will not be reported to
     Squash.
 \li `handledSignals`: A set of signals (represented as `NSNumber`s) that Squash
-    will trap. By default it's `SIGABRT`, `SIGBUS`, `SIGFPE`, `SIGILL`, `SIGSEGV`,
-    and `SIGTRAP`.
+    will trap, read when `hook` is called. By default it's `SIGABRT`, `SIGBUS`,
+    `SIGFPE`, `SIGILL`, `SIGSEGV`, and `SIGTRAP`.
 \li `filterUserInfoKeys`: Keys to remove from the `userInfo` dictionary of any
     `NSException`. These keys might contain sensitive or personal information, for
     example.
+\li `maximumUserDataBytes`, `maximumUserDataDepth`, `maximumUserDataCount`,
+    `userDataTimeBudget`: Limits on the size (64 KiB), nesting (8), collection
+    length (100) and time (50 ms) spent serializing an exception's `userInfo`.
+    Anything past a limit is truncated or replaced with a marker.
+\li `userDataRepresentations`: Which representations (`description`, keyed
+    archive, JSON) are produced for `userInfo` values that aren't plain JSON. By
+    default it's `SCValueRepresentationAll`.
+\li `coalescingWindow`: Repeats of an occurrence (same exception class and top
+    frames) within this many seconds of the first are folded into it, with a count,
+    first- and last-seen times, and a few differing messages, instead of being
+    stored and uploaded separately. Set to 0 to disable. By default it's 60.
+\li `fingerprintFrameCount`: The number of faulting-thread frames used to decide
+    whether two occurrences are repeats. By default it's 5.
+\li `maximumVariants`: The maximum number of differing messages kept for a
+    coalesced occurrence. By default it's 3.
+\li `includesAllThreadRegisters`: Whether crash reports include every thread's
+    registers, rather than just the crashed thread's. Threads parked in identical
+    stacks are sent once, with the list of thread numbers they stand for. By
+    default it's `NO`.
+\li `capturesAllThreads`: Whether handled exceptions also record the stacks of
+    every other thread, for diagnosing contention. The other threads are paused
+    only while their stacks are walked. By default it's `NO`.
+\li `monitorsHangs`: Whether to watch for stalls of the main thread. A stall
+    longer than `hangThreshold` (2 seconds) is recorded right away as a "Hang"
+    occurrence with the main thread's stack, and resampled while it lasts, so it
+    is reported even if the system kills the app. The main thread is pinged every
+    `hangPingInterval` (0.5 seconds). Set before calling `hook`. By default it's
+    `NO`.
+\li `performanceFlushInterval`: How often recorded timings are summarized and
+    queued for upload. Set before calling `hook`. By default it's 15 minutes.
+\li `memorySampleInterval`: How often the memory footprint is sampled into the
+    session state file (see **Terminations** below). By default it's 10 seconds.
+\li `reportsBackgroundTerminations`: Whether unexplained terminations in the
+    background are recorded too. By default it's `NO`.
+\li `rateLimit`: The sustained number of exceptions of any one class recorded per
+    second; the rest are dropped before any work is done. Set to 0 to disable. By
+    default it's 1.
+\li `rateLimitBurst`: The number of exceptions of one class that can be recorded
+    in a burst before `rateLimit` applies. By default it's 10.
+\li `sampleRate`: The fraction of exceptions (0 to 1) considered for recording.
+    Counts of exceptions dropped by sampling or rate limiting are sent with the
+    next recorded occurrence. By default it's 1.
+
+Sampling and rate limiting apply only to handled exceptions. Uncaught
+exceptions are always recorded, as fatal occurrences.
+
+\section Breadcrumbs
+
+Call `[[SquashCocoa sharedClient] leaveBreadcrumb:@"Opened settings"
+category:@"navigation"]` to record app events such as screen transitions,
+network calls and user actions. The last 64 breadcrumbs are sent with every
+occurrence. They are kept in a memory-mapped file, so a crash report uploaded on
+the next launch includes the breadcrumbs that led up to the crash. Leaving a
+breadcrumb takes no locks and doesn't allocate, so it is cheap enough to call
+from any thread.
+
+\section Performance
+
+Call `[[SquashCocoa sharedClient] recordDuration:elapsed ofOperation:@"launch"]`
+to time app launch, screen loads, network calls or anything else. Timings are
+aggregated on the device into a log-bucketed histogram per operation (accurate
+to about 6%), along with the call stack of each operation's slowest sample.
+Every `performanceFlushInterval` the histograms are queued as a single
+"Performance" occurrence and uploaded like any other, so a period's worth of
+timings costs a few kilobytes rather than an event each.
+
+\section Terminations
+
+Out-of-memory kills and watchdog terminations leave no crash report. Squash
+keeps a small memory-mapped file recording whether the app exited cleanly,
+whether it is in the foreground, and its recent memory footprint. When a launch
+finds that the previous one ended without a clean exit, crash, debugger, or app
+or OS update, it records an "Out of Memory" occurrence (or "Watchdog
+Termination" if the main thread was hung) carrying the last and peak footprint,
+memory warnings and footprint timeline, plus the previous launch's breadcrumbs.
 
 \section Error Transmission
 
@@ -171,4 +284,29 @@ own projects, there are a few things you should be aware of:
 \li The path "@loader_path/../Frameworks" was added to the application's Runpath
     Search Paths build setting. This allows it to find the embedded SquashCocoa
     framework.
+
+\subsection Benchmarks
+
+The OS X tester also contains a benchmark suite that measures what SquashCocoa
+costs the host app. Launch it with `-STBenchmark <output path>` and it will time
+and count the allocations of building an occurrence from an exception and from
+crash reports, serializing `userInfo`, generating JSON, appending to the
+journal, and uploading to a stand-in Squash server running in the same process.
+It then writes the results as JSON to the output path and exits. Use
+`-STBenchmarkIterations`, `-STBenchmarkCrashReports` (a directory of `.plcrash`
+files), `-STBenchmarkLatency` and `-STBenchmarkFailureRate` to change the run.
+
+\subsection CrashReportTests Crash Report Tests
+
+The in-place crash report reader (`SCCrashReportConverter.c`) is plain C, so its
+tests run on any platform, including Linux. `Tests/SCCrashReportConverterTests.c`
+checks it against the reports in `Tests/Fixtures`, along with truncated and
+corrupted copies of them. Build and run it with the sanitizers:
+
+\code
+cc -std=c99 -Wall -Wextra -fsanitize=address,undefined -ISource \
+    -o crash-report-tests \
+    Tests/SCCrashReportConverterTests.c Source/SCCrashReportConverter.c
+./crash-report-tests Tests/Fixtures
+\endcode
 */
@@ -0,0 +1,239 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+@class SCJSONWriter;
+
+/*! Identifies a serialized SCBacktrace. */
+#define SCBacktraceMagic 0x53434254
+
+/*! The current version of the serialized SCBacktrace layout. */
+#define SCBacktraceVersion 2
+
+/*! The string index of a frame that isn't inside a known binary image. */
+#define SCBacktraceNoImage UINT32_MAX
+
+/*!
+ The JSON shapes a backtrace can be sent in. Both are understood by Squash; the
+ shape records where the backtrace came from.
+ */
+typedef enum {
+    /*!
+     Threads are `[name, faulted, frames]` arrays and frames are
+     `["_RETURN_ADDRESS_", address]` arrays, followed by the image UUID and
+     offset when known. Used for exceptions and trapped signals.
+     */
+    SCBacktraceStyleReturnAddresses = 0,
+    /*!
+     Threads are dictionaries with `name`, `faulted`, `backtrace`, and
+     (optionally) `registers` keys; frames are dictionaries with `type`,
+     `address`, `image_uuid`, and `image_offset` keys. Used for PLCrashReporter
+     reports.
+     */
+    SCBacktraceStyleCrashReport = 1
+} SCBacktraceStyle;
+
+/*!
+ The call stacks of an occurrence, stored as a handful of contiguous C arrays
+ rather than a graph of `NSArray`s, `NSDictionary`s, and `NSNumber`s. Thread
+ metadata (name, flags, and where its frames and registers start), frames
+ (address, image, and offset), and registers (name and value) are each kept in
+ parallel arrays. Thread names, image UUIDs, and register names are stored once
+ each in a string table and referred to by index.
+
+ A 60-thread crash report therefore costs a few dozen allocations instead of
+ thousands. The Foundation shapes Squash expects are only produced while the
+ occurrence is streamed to JSON (SCBacktrace::writeJSONTo:); the journal stores
+ the compact binary form (SCBacktrace::dataRepresentation).
+
+ Threads are built in order: SCBacktrace::beginThreadNamed:faulted:registers:
+ starts a thread, and the frames and registers added next belong to it.
+
+ Idle threads tend to be parked in the same few stacks.
+ SCBacktrace::coalesceIdenticalThreads folds threads with identical stacks into
+ one entry that lists the thread numbers it stands for (see
+ SCBacktrace::addThreadNumber:).
+ */
+@interface SCBacktrace : NSObject <NSCoding> {
+    SCBacktraceStyle style;
+
+    NSUInteger threadCount;
+    NSUInteger threadCapacity;
+    uint32_t *threadNames;
+    uint8_t *threadFlags;
+    uint32_t *threadFrameStarts;
+    uint32_t *threadRegisterStarts;
+    uint32_t *threadNumberStarts;
+
+    NSUInteger threadNumberCount;
+    NSUInteger threadNumberCapacity;
+    uint32_t *threadNumbers;
+
+    NSUInteger frameCount;
+    NSUInteger frameCapacity;
+    uint64_t *frameAddresses;
+    uint64_t *frameOffsets;
+    uint32_t *frameImages;
+
+    NSUInteger registerCount;
+    NSUInteger registerCapacity;
+    uint32_t *registerNames;
+    uint64_t *registerValues;
+
+    NSMutableArray *strings;
+    NSMutableDictionary *stringIndexes;
+}
+
+#pragma mark Properties
+
+/*! The JSON shape the backtrace is sent in. */
+@property (readonly) SCBacktraceStyle style;
+
+/*! The number of threads. */
+@property (readonly) NSUInteger threadCount;
+
+#pragma mark Initializers
+
+/*!
+ Creates an empty backtrace.
+ @param style The JSON shape to send it in.
+ @return The initialized instance.
+ */
+- (id) initWithStyle:(SCBacktraceStyle)style;
+
+/*!
+ Creates a backtrace from its SCBacktrace::dataRepresentation.
+ @param bytes The start of the representation. The bytes are not retained.
+ @param length The length of the representation, in bytes.
+ @return The initialized instance, or `nil` if the representation is invalid.
+ */
+- (id) initWithBytes:(const void *)bytes length:(NSUInteger)length;
+
+/*!
+ Creates a backtrace from the nested arrays and dictionaries that earlier
+ versions of this library stored, in either SCBacktraceStyle.
+ @param threads The threads, as found in an older journal or archive.
+ @return The initialized instance.
+ */
+- (id) initWithPropertyList:(NSArray *)threads;
+
+#pragma mark Building
+
+/*!
+ Starts a new thread. Frames and registers added afterwards belong to it.
+ @param name The thread's name.
+ @param faulted Whether this is the thread that raised or crashed.
+ @param registers Whether to send a (possibly empty) `registers` list for the
+ thread. Only used with SCBacktraceStyleCrashReport.
+ */
+- (void) beginThreadNamed:(NSString *)name faulted:(BOOL)faulted registers:(BOOL)registers;
+
+/*!
+ Adds a frame to the current thread, resolving it against the images loaded in
+ this process (see SCBinaryImageForAddress).
+ @param address The return address.
+ @param resolve Whether to look up the address's image. Addresses from another
+ process must not be resolved.
+ */
+- (void) addFrameWithAddress:(uint64_t)address resolve:(BOOL)resolve;
+
+/*!
+ Adds a frame whose image is already known to the current thread.
+ @param address The return address.
+ @param image The image UUID's index (SCBacktrace::indexOfString:), or
+ SCBacktraceNoImage.
+ @param offset The address's offset from the image's load address.
+ */
+- (void) addFrameWithAddress:(uint64_t)address image:(uint32_t)image offset:(uint64_t)offset;
+
+/*!
+ Adds a register to the current thread.
+ @param name The register's name.
+ @param value The register's value.
+ */
+- (void) addRegisterNamed:(NSString *)name value:(uint64_t)value;
+
+/*!
+ Records that the current thread is the thread with this number in its report.
+ A thread that other threads have been coalesced into lists all their numbers.
+ @param number The thread's number.
+ */
+- (void) addThreadNumber:(uint32_t)number;
+
+/*!
+ Folds every non-faulted thread whose frames are identical to those of an
+ earlier thread into that thread. The surviving entry keeps its name and lists
+ the numbers of every thread it stands for, and is sent with `thread_count`
+ and `thread_numbers` keys (SCBacktraceStyleCrashReport only). Threads with
+ registers are left alone, because their register values differ.
+ @return The number of threads folded away.
+ */
+- (NSUInteger) coalesceIdenticalThreads;
+
+/*!
+ Returns the index of a string in the string table, adding it if necessary.
+ @param string A thread name, image UUID, or register name.
+ @return The string's index.
+ */
+- (uint32_t) indexOfString:(NSString *)string;
+
+#pragma mark Reading
+
+/*!
+ Returns the first thread marked as faulted.
+ @return The thread's index, or `NSNotFound`.
+ */
+- (NSUInteger) faultedThread;
+
+/*!
+ Returns the number of frames in a thread.
+ @param thread The thread's index.
+ @return The number of frames.
+ */
+- (NSUInteger) frameCountInThread:(NSUInteger)thread;
+
+/*!
+ Returns the number of report threads a thread stands for.
+ @param thread The thread's index.
+ @return The number of thread numbers recorded for it, which is 0 if none were
+ recorded.
+ */
+- (NSUInteger) threadNumberCountInThread:(NSUInteger)thread;
+
+/*!
+ Reads a frame.
+ @param frame The frame's index within its thread, innermost first.
+ @param thread The thread's index.
+ @param address Set to the frame's address.
+ @param image Set to the frame's image UUID, or `nil` if it is unknown.
+ @param offset Set to the frame's offset within its image, if known.
+ */
+- (void) getFrame:(NSUInteger)frame inThread:(NSUInteger)thread address:(uint64_t *)address image:(NSString **)image offset:(uint64_t *)offset;
+
+#pragma mark Serialization
+
+/*!
+ Returns the compact binary form, for the journal.
+ @return The binary representation.
+ */
+- (NSData *) dataRepresentation;
+
+/*!
+ Streams the backtrace into a writer in the shape given by
+ SCBacktrace::style.
+ @param writer The writer to append the JSON array to.
+ */
+- (void) writeJSONTo:(SCJSONWriter *)writer;
+
+@end
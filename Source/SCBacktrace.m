@@ -0,0 +1,584 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import "SCBacktrace.h"
+#import "SCBinaryImages.h"
+#import "SCJSONWriter.h"
+
+enum {
+    SCBacktraceThreadFaulted = 1 << 0,
+    SCBacktraceThreadHasRegisters = 1 << 1
+};
+
+// Precedes the arrays in SCBacktrace::dataRepresentation.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t style;
+    uint32_t threadCount;
+    uint32_t frameCount;
+    uint32_t registerCount;
+    uint32_t stringCount;
+    uint32_t threadNumberCount; // version 2 and later
+} SCBacktraceHeader;
+
+#define SCBacktraceHeaderLengthV1 offsetof(SCBacktraceHeader, threadNumberCount)
+
+static void *SCResizeArray(void *array, NSUInteger count, size_t size);
+static BOOL SCReadArray(const uint8_t *bytes, NSUInteger length, NSUInteger *offset, void **array, NSUInteger count, size_t size);
+
+@interface SCBacktrace (Private)
+
+- (void) reserveThreads:(NSUInteger)threads frames:(NSUInteger)frames registers:(NSUInteger)registers;
+- (void) reserveThreadNumbers:(NSUInteger)numbers;
+- (NSRange) framesOfThread:(NSUInteger)thread;
+- (NSRange) registersOfThread:(NSUInteger)thread;
+- (NSRange) threadNumbersOfThread:(NSUInteger)thread;
+- (BOOL) thread:(NSUInteger)thread hasSameFramesAsThread:(NSUInteger)other;
+- (BOOL) isConsistent;
+
+@end
+
+#pragma mark -
+
+@implementation SCBacktrace
+
+#pragma mark Properties
+
+@synthesize style;
+@synthesize threadCount;
+
+#pragma mark Initializers
+
+- (id) initWithStyle:(SCBacktraceStyle)backtraceStyle {
+    if (self = [super init]) {
+        style = backtraceStyle;
+        strings = [[NSMutableArray alloc] init];
+        stringIndexes = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (id) init {
+    return [self initWithStyle:SCBacktraceStyleReturnAddresses];
+}
+
+- (id) initWithBytes:(const void *)bytes length:(NSUInteger)length {
+    SCBacktraceHeader header;
+    memset(&header, 0, sizeof(header));
+    if (length < SCBacktraceHeaderLengthV1) {
+        [self release];
+        return nil;
+    }
+    memcpy(&header, bytes, SCBacktraceHeaderLengthV1);
+    if (header.magic != SCBacktraceMagic || header.version < 1 || header.version > SCBacktraceVersion) {
+        [self release];
+        return nil;
+    }
+    NSUInteger headerLength = SCBacktraceHeaderLengthV1;
+    if (header.version >= 2) {
+        if (length < sizeof(header)) {
+            [self release];
+            return nil;
+        }
+        memcpy(&header, bytes, sizeof(header));
+        headerLength = sizeof(header);
+    }
+    // refuse counts the buffer can't possibly hold before allocating for them
+    unsigned long long minimumLength = headerLength +
+        (unsigned long long)header.frameCount*(2*sizeof(uint64_t) + sizeof(uint32_t)) +
+        (unsigned long long)header.registerCount*(sizeof(uint64_t) + sizeof(uint32_t)) +
+        (unsigned long long)header.threadCount*(3*sizeof(uint32_t) + sizeof(uint8_t)) +
+        (unsigned long long)header.stringCount*sizeof(uint32_t);
+    if (header.version >= 2)
+        minimumLength += (unsigned long long)header.threadCount*sizeof(uint32_t) + (unsigned long long)header.threadNumberCount*sizeof(uint32_t);
+    if (minimumLength > length) {
+        [self release];
+        return nil;
+    }
+
+    if (self = [self initWithStyle:header.style]) {
+        NSUInteger offset = headerLength;
+        [self reserveThreads:header.threadCount frames:header.frameCount registers:header.registerCount];
+        [self reserveThreadNumbers:header.threadNumberCount];
+        threadCount = header.threadCount;
+        frameCount = header.frameCount;
+        registerCount = header.registerCount;
+        threadNumberCount = header.threadNumberCount;
+        if (threadCount) memset(threadNumberStarts, 0, threadCount*sizeof(uint32_t));
+
+        BOOL valid =
+            SCReadArray(bytes, length, &offset, (void **)&frameAddresses, frameCount, sizeof(uint64_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&frameOffsets, frameCount, sizeof(uint64_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&registerValues, registerCount, sizeof(uint64_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&threadNames, threadCount, sizeof(uint32_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&threadFrameStarts, threadCount, sizeof(uint32_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&threadRegisterStarts, threadCount, sizeof(uint32_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&frameImages, frameCount, sizeof(uint32_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&registerNames, registerCount, sizeof(uint32_t)) &&
+            SCReadArray(bytes, length, &offset, (void **)&threadFlags, threadCount, sizeof(uint8_t));
+        if (valid && header.version >= 2)
+            valid = SCReadArray(bytes, length, &offset, (void **)&threadNumberStarts, threadCount, sizeof(uint32_t)) &&
+                    SCReadArray(bytes, length, &offset, (void **)&threadNumbers, threadNumberCount, sizeof(uint32_t));
+
+        for (uint32_t idx = 0; valid && idx < header.stringCount; idx++) {
+            uint32_t stringLength;
+            if (offset + sizeof(stringLength) > length) { valid = NO; break; }
+            memcpy(&stringLength, (const uint8_t *)bytes + offset, sizeof(stringLength));
+            offset += sizeof(stringLength);
+            if (stringLength > length - offset) { valid = NO; break; }
+            NSString *string = [[NSString alloc] initWithBytes:(const uint8_t *)bytes + offset length:stringLength encoding:NSUTF8StringEncoding];
+            offset += stringLength;
+            [stringIndexes setObject:[NSNumber numberWithUnsignedInt:idx] forKey:(string ? string : @"")];
+            [strings addObject:(string ? string : @"")];
+            [string release];
+        }
+
+        if (!valid || ![self isConsistent]) {
+            [self release];
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (id) initWithPropertyList:(NSArray *)threads {
+    id first = [threads count] ? [threads objectAtIndex:0] : nil;
+    SCBacktraceStyle legacyStyle = [first isKindOfClass:[NSDictionary class]] ? SCBacktraceStyleCrashReport : SCBacktraceStyleReturnAddresses;
+
+    if (self = [self initWithStyle:legacyStyle]) {
+        for (id thread in threads) {
+            NSString *name = nil;
+            BOOL faulted = NO;
+            NSArray *frames = nil, *registers = nil;
+            if ([thread isKindOfClass:[NSArray class]] && [thread count] >= 3) {
+                name = [[thread objectAtIndex:0] description];
+                faulted = [[thread objectAtIndex:1] boolValue];
+                frames = [thread objectAtIndex:2];
+            } else if ([thread isKindOfClass:[NSDictionary class]]) {
+                name = [[thread objectForKey:@"name"] description];
+                faulted = [[thread objectForKey:@"faulted"] boolValue];
+                frames = [thread objectForKey:@"backtrace"];
+                registers = [thread objectForKey:@"registers"];
+            } else {
+                continue;
+            }
+            [self beginThreadNamed:(name ? name : @"") faulted:faulted registers:(registers != nil)];
+
+            for (id frame in ([frames isKindOfClass:[NSArray class]] ? frames : nil)) {
+                id address = nil, image = nil, offset = nil;
+                if ([frame isKindOfClass:[NSArray class]] && [frame count] >= 2) {
+                    address = [frame objectAtIndex:1];
+                    if ([frame count] >= 4) {
+                        image = [frame objectAtIndex:2];
+                        offset = [frame objectAtIndex:3];
+                    }
+                } else if ([frame isKindOfClass:[NSDictionary class]]) {
+                    address = [frame objectForKey:@"address"];
+                    image = [frame objectForKey:@"image_uuid"];
+                    offset = [frame objectForKey:@"image_offset"];
+                }
+                if (![address respondsToSelector:@selector(unsignedLongLongValue)]) continue;
+                BOOL resolved = [image isKindOfClass:[NSString class]] && [offset respondsToSelector:@selector(unsignedLongLongValue)];
+                [self addFrameWithAddress:[address unsignedLongLongValue]
+                                    image:(resolved ? [self indexOfString:image] : SCBacktraceNoImage)
+                                   offset:(resolved ? [offset unsignedLongLongValue] : 0)];
+            }
+
+            for (id reg in ([registers isKindOfClass:[NSArray class]] ? registers : nil)) {
+                if (![reg isKindOfClass:[NSArray class]] || [reg count] < 2) continue;
+                [self addRegisterNamed:[[reg objectAtIndex:0] description] value:[[reg objectAtIndex:1] unsignedLongLongValue]];
+            }
+        }
+    }
+    return self;
+}
+
+- (id) initWithCoder:(NSCoder *)coder {
+    NSData *data = [coder decodeObjectForKey:@"SCBacktraceData"];
+    return [self initWithBytes:[data bytes] length:[data length]];
+}
+
+- (void) encodeWithCoder:(NSCoder *)coder {
+    [coder encodeObject:[self dataRepresentation] forKey:@"SCBacktraceData"];
+}
+
+- (void) dealloc {
+    free(threadNames);
+    free(threadFlags);
+    free(threadFrameStarts);
+    free(threadRegisterStarts);
+    free(threadNumberStarts);
+    free(threadNumbers);
+    free(frameAddresses);
+    free(frameOffsets);
+    free(frameImages);
+    free(registerNames);
+    free(registerValues);
+    [strings release];
+    [stringIndexes release];
+    [super dealloc];
+}
+
+#pragma mark Building
+
+- (void) beginThreadNamed:(NSString *)name faulted:(BOOL)faulted registers:(BOOL)registers {
+    [self reserveThreads:threadCount + 1 frames:0 registers:0];
+    threadNames[threadCount] = [self indexOfString:name];
+    threadFlags[threadCount] = (faulted ? SCBacktraceThreadFaulted : 0) | (registers ? SCBacktraceThreadHasRegisters : 0);
+    threadFrameStarts[threadCount] = (uint32_t)frameCount;
+    threadRegisterStarts[threadCount] = (uint32_t)registerCount;
+    threadNumberStarts[threadCount] = (uint32_t)threadNumberCount;
+    threadCount++;
+}
+
+- (void) addFrameWithAddress:(uint64_t)address resolve:(BOOL)resolve {
+    NSString *image = nil;
+    uint64_t offset = 0;
+    if (resolve && SCBinaryImageForAddress(address, &image, &offset))
+        [self addFrameWithAddress:address image:[self indexOfString:image] offset:offset];
+    else
+        [self addFrameWithAddress:address image:SCBacktraceNoImage offset:0];
+}
+
+- (void) addFrameWithAddress:(uint64_t)address image:(uint32_t)image offset:(uint64_t)offset {
+    if (threadCount == 0) return;
+    [self reserveThreads:0 frames:frameCount + 1 registers:0];
+    frameAddresses[frameCount] = address;
+    frameImages[frameCount] = image;
+    frameOffsets[frameCount] = offset;
+    frameCount++;
+}
+
+- (void) addRegisterNamed:(NSString *)name value:(uint64_t)value {
+    if (threadCount == 0) return;
+    [self reserveThreads:0 frames:0 registers:registerCount + 1];
+    registerNames[registerCount] = [self indexOfString:name];
+    registerValues[registerCount] = value;
+    threadFlags[threadCount - 1] |= SCBacktraceThreadHasRegisters;
+    registerCount++;
+}
+
+- (void) addThreadNumber:(uint32_t)number {
+    if (threadCount == 0) return;
+    [self reserveThreadNumbers:threadNumberCount + 1];
+    threadNumbers[threadNumberCount++] = number;
+}
+
+- (NSUInteger) coalesceIdenticalThreads {
+    if (threadCount < 2) return 0;
+
+    // each thread's representative is the first earlier thread it folds into
+    NSUInteger *representatives = malloc(threadCount * sizeof(NSUInteger));
+    NSUInteger folded = 0;
+    for (NSUInteger thread = 0; thread < threadCount; thread++) {
+        representatives[thread] = thread;
+        if ((threadFlags[thread] & SCBacktraceThreadFaulted) || [self registersOfThread:thread].length) continue;
+        for (NSUInteger other = 0; other < thread; other++) {
+            if (representatives[other] != other) continue;
+            if ((threadFlags[other] & SCBacktraceThreadFaulted) || [self registersOfThread:other].length) continue;
+            if (![self thread:thread hasSameFramesAsThread:other]) continue;
+            representatives[thread] = other;
+            folded++;
+            break;
+        }
+    }
+    if (folded == 0) {
+        free(representatives);
+        return 0;
+    }
+
+    // every array only shrinks, so the survivors can be compacted in place;
+    // the thread numbers are regrouped into a new array
+    uint32_t *groupedNumbers = malloc(MAX(threadNumberCount, (NSUInteger)1) * sizeof(uint32_t));
+    NSUInteger keptThreads = 0, keptFrames = 0, keptRegisters = 0, keptNumbers = 0;
+    for (NSUInteger thread = 0; thread < threadCount; thread++) {
+        if (representatives[thread] != thread) continue;
+        NSRange frames = [self framesOfThread:thread];
+        NSRange registers = [self registersOfThread:thread];
+
+        uint32_t numberStart = (uint32_t)keptNumbers;
+        for (NSUInteger member = thread; member < threadCount; member++) {
+            if (representatives[member] != thread) continue;
+            NSRange numbers = [self threadNumbersOfThread:member];
+            memcpy(groupedNumbers + keptNumbers, threadNumbers + numbers.location, numbers.length * sizeof(uint32_t));
+            keptNumbers += numbers.length;
+        }
+
+        memmove(frameAddresses + keptFrames, frameAddresses + frames.location, frames.length * sizeof(uint64_t));
+        memmove(frameOffsets + keptFrames, frameOffsets + frames.location, frames.length * sizeof(uint64_t));
+        memmove(frameImages + keptFrames, frameImages + frames.location, frames.length * sizeof(uint32_t));
+        memmove(registerNames + keptRegisters, registerNames + registers.location, registers.length * sizeof(uint32_t));
+        memmove(registerValues + keptRegisters, registerValues + registers.location, registers.length * sizeof(uint64_t));
+
+        // the starts of a later kept thread are read before being overwritten,
+        // since keptThreads never passes thread
+        threadNames[keptThreads] = threadNames[thread];
+        threadFlags[keptThreads] = threadFlags[thread];
+        threadFrameStarts[keptThreads] = (uint32_t)keptFrames;
+        threadRegisterStarts[keptThreads] = (uint32_t)keptRegisters;
+        threadNumberStarts[keptThreads] = numberStart;
+        representatives[thread] = keptThreads;
+        keptThreads++;
+        keptFrames += frames.length;
+        keptRegisters += registers.length;
+    }
+
+    free(threadNumbers);
+    threadNumbers = groupedNumbers;
+    threadNumberCapacity = MAX(threadNumberCount, (NSUInteger)1);
+    threadNumberCount = keptNumbers;
+    threadCount = keptThreads;
+    frameCount = keptFrames;
+    registerCount = keptRegisters;
+    free(representatives);
+    return folded;
+}
+
+- (uint32_t) indexOfString:(NSString *)string {
+    if (!string) string = @"";
+    NSNumber *index = [stringIndexes objectForKey:string];
+    if (index) return [index unsignedIntValue];
+
+    uint32_t newIndex = (uint32_t)[strings count];
+    [strings addObject:string];
+    [stringIndexes setObject:[NSNumber numberWithUnsignedInt:newIndex] forKey:string];
+    return newIndex;
+}
+
+#pragma mark Reading
+
+- (NSUInteger) faultedThread {
+    for (NSUInteger thread = 0; thread < threadCount; thread++)
+        if (threadFlags[thread] & SCBacktraceThreadFaulted) return thread;
+    return NSNotFound;
+}
+
+- (NSUInteger) frameCountInThread:(NSUInteger)thread {
+    if (thread >= threadCount) return 0;
+    return [self framesOfThread:thread].length;
+}
+
+- (NSUInteger) threadNumberCountInThread:(NSUInteger)thread {
+    if (thread >= threadCount) return 0;
+    return [self threadNumbersOfThread:thread].length;
+}
+
+- (void) getFrame:(NSUInteger)frame inThread:(NSUInteger)thread address:(uint64_t *)address image:(NSString **)image offset:(uint64_t *)offset {
+    NSUInteger idx = [self framesOfThread:thread].location + frame;
+    if (address) *address = frameAddresses[idx];
+    if (image) *image = (frameImages[idx] == SCBacktraceNoImage) ? nil : [strings objectAtIndex:frameImages[idx]];
+    if (offset) *offset = frameOffsets[idx];
+}
+
+#pragma mark Serialization
+
+- (NSData *) dataRepresentation {
+    SCBacktraceHeader header = {
+        SCBacktraceMagic, SCBacktraceVersion, (uint16_t)style,
+        (uint32_t)threadCount, (uint32_t)frameCount, (uint32_t)registerCount, (uint32_t)[strings count],
+        (uint32_t)threadNumberCount
+    };
+    NSMutableData *data = [NSMutableData dataWithCapacity:sizeof(header) + frameCount*20 + registerCount*12 + threadCount*17 + threadNumberCount*4 + [strings count]*40];
+    [data appendBytes:&header length:sizeof(header)];
+    // eight-byte fields first, so that a copy of the buffer could be read in
+    // place without misaligned access
+    [data appendBytes:frameAddresses length:frameCount*sizeof(uint64_t)];
+    [data appendBytes:frameOffsets length:frameCount*sizeof(uint64_t)];
+    [data appendBytes:registerValues length:registerCount*sizeof(uint64_t)];
+    [data appendBytes:threadNames length:threadCount*sizeof(uint32_t)];
+    [data appendBytes:threadFrameStarts length:threadCount*sizeof(uint32_t)];
+    [data appendBytes:threadRegisterStarts length:threadCount*sizeof(uint32_t)];
+    [data appendBytes:frameImages length:frameCount*sizeof(uint32_t)];
+    [data appendBytes:registerNames length:registerCount*sizeof(uint32_t)];
+    [data appendBytes:threadFlags length:threadCount*sizeof(uint8_t)];
+    [data appendBytes:threadNumberStarts length:threadCount*sizeof(uint32_t)];
+    [data appendBytes:threadNumbers length:threadNumberCount*sizeof(uint32_t)];
+    for (NSString *string in strings) {
+        NSData *encoded = [string dataUsingEncoding:NSUTF8StringEncoding];
+        uint32_t stringLength = (uint32_t)[encoded length];
+        [data appendBytes:&stringLength length:sizeof(stringLength)];
+        [data appendData:encoded];
+    }
+    return data;
+}
+
+- (void) writeJSONTo:(SCJSONWriter *)writer {
+    [writer beginArray];
+    for (NSUInteger thread = 0; thread < threadCount; thread++) {
+        NSString *name = [strings objectAtIndex:threadNames[thread]];
+        BOOL faulted = (threadFlags[thread] & SCBacktraceThreadFaulted) != 0;
+        NSRange frames = [self framesOfThread:thread];
+
+        if (style == SCBacktraceStyleCrashReport) {
+            [writer beginObject];
+            [writer writeKey:@"name"]; [writer writeString:name];
+            [writer writeKey:@"faulted"]; [writer writeBool:faulted];
+            [writer writeKey:@"backtrace"];
+            [writer beginArray];
+            for (NSUInteger idx = frames.location; idx < NSMaxRange(frames); idx++) {
+                [writer beginObject];
+                [writer writeKey:@"type"]; [writer writeString:@"address"];
+                [writer writeKey:@"address"]; [writer writeUnsignedInteger:frameAddresses[idx]];
+                if (frameImages[idx] != SCBacktraceNoImage) {
+                    [writer writeKey:@"image_uuid"]; [writer writeString:[strings objectAtIndex:frameImages[idx]]];
+                    [writer writeKey:@"image_offset"]; [writer writeUnsignedInteger:frameOffsets[idx]];
+                }
+                [writer endObject];
+            }
+            [writer endArray];
+            if (threadFlags[thread] & SCBacktraceThreadHasRegisters) {
+                NSRange registers = [self registersOfThread:thread];
+                [writer writeKey:@"registers"];
+                [writer beginArray];
+                for (NSUInteger idx = registers.location; idx < NSMaxRange(registers); idx++) {
+                    [writer beginArray];
+                    [writer writeString:[strings objectAtIndex:registerNames[idx]]];
+                    [writer writeUnsignedInteger:registerValues[idx]];
+                    [writer endArray];
+                }
+                [writer endArray];
+            }
+            NSRange numbers = [self threadNumbersOfThread:thread];
+            if (numbers.length > 1) {
+                [writer writeKey:@"thread_count"]; [writer writeUnsignedInteger:numbers.length];
+                [writer writeKey:@"thread_numbers"];
+                [writer beginArray];
+                for (NSUInteger idx = numbers.location; idx < NSMaxRange(numbers); idx++)
+                    [writer writeUnsignedInteger:threadNumbers[idx]];
+                [writer endArray];
+            }
+            [writer endObject];
+        } else {
+            [writer beginArray];
+            [writer writeString:name];
+            [writer writeBool:faulted];
+            [writer beginArray];
+            for (NSUInteger idx = frames.location; idx < NSMaxRange(frames); idx++) {
+                [writer beginArray];
+                [writer writeString:@"_RETURN_ADDRESS_"];
+                [writer writeUnsignedInteger:frameAddresses[idx]];
+                if (frameImages[idx] != SCBacktraceNoImage) {
+                    [writer writeString:[strings objectAtIndex:frameImages[idx]]];
+                    [writer writeUnsignedInteger:frameOffsets[idx]];
+                }
+                [writer endArray];
+            }
+            [writer endArray];
+            [writer endArray];
+        }
+    }
+    [writer endArray];
+}
+
+- (NSString *) description {
+    return [NSString stringWithFormat:@"<%@ %p: %lu threads, %lu frames>", [self class], self, (unsigned long)threadCount, (unsigned long)frameCount];
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCBacktrace (Private)
+
+- (void) reserveThreads:(NSUInteger)threads frames:(NSUInteger)frames registers:(NSUInteger)registers {
+    if (threads > threadCapacity) {
+        threadCapacity = MAX(threads, MAX(threadCapacity*2, (NSUInteger)4));
+        threadNames = SCResizeArray(threadNames, threadCapacity, sizeof(uint32_t));
+        threadFlags = SCResizeArray(threadFlags, threadCapacity, sizeof(uint8_t));
+        threadFrameStarts = SCResizeArray(threadFrameStarts, threadCapacity, sizeof(uint32_t));
+        threadRegisterStarts = SCResizeArray(threadRegisterStarts, threadCapacity, sizeof(uint32_t));
+        threadNumberStarts = SCResizeArray(threadNumberStarts, threadCapacity, sizeof(uint32_t));
+    }
+    if (frames > frameCapacity) {
+        frameCapacity = MAX(frames, MAX(frameCapacity*2, (NSUInteger)64));
+        frameAddresses = SCResizeArray(frameAddresses, frameCapacity, sizeof(uint64_t));
+        frameOffsets = SCResizeArray(frameOffsets, frameCapacity, sizeof(uint64_t));
+        frameImages = SCResizeArray(frameImages, frameCapacity, sizeof(uint32_t));
+    }
+    if (registers > registerCapacity) {
+        registerCapacity = MAX(registers, MAX(registerCapacity*2, (NSUInteger)32));
+        registerNames = SCResizeArray(registerNames, registerCapacity, sizeof(uint32_t));
+        registerValues = SCResizeArray(registerValues, registerCapacity, sizeof(uint64_t));
+    }
+}
+
+- (void) reserveThreadNumbers:(NSUInteger)numbers {
+    if (numbers > threadNumberCapacity) {
+        threadNumberCapacity = MAX(numbers, MAX(threadNumberCapacity*2, (NSUInteger)16));
+        threadNumbers = SCResizeArray(threadNumbers, threadNumberCapacity, sizeof(uint32_t));
+    }
+}
+
+- (NSRange) framesOfThread:(NSUInteger)thread {
+    NSUInteger end = (thread + 1 < threadCount) ? threadFrameStarts[thread + 1] : frameCount;
+    return NSMakeRange(threadFrameStarts[thread], end - threadFrameStarts[thread]);
+}
+
+- (NSRange) registersOfThread:(NSUInteger)thread {
+    NSUInteger end = (thread + 1 < threadCount) ? threadRegisterStarts[thread + 1] : registerCount;
+    return NSMakeRange(threadRegisterStarts[thread], end - threadRegisterStarts[thread]);
+}
+
+- (NSRange) threadNumbersOfThread:(NSUInteger)thread {
+    NSUInteger end = (thread + 1 < threadCount) ? threadNumberStarts[thread + 1] : threadNumberCount;
+    return NSMakeRange(threadNumberStarts[thread], end - threadNumberStarts[thread]);
+}
+
+- (BOOL) thread:(NSUInteger)thread hasSameFramesAsThread:(NSUInteger)other {
+    NSRange frames = [self framesOfThread:thread];
+    NSRange otherFrames = [self framesOfThread:other];
+    if (frames.length != otherFrames.length) return NO;
+    return memcmp(frameAddresses + frames.location, frameAddresses + otherFrames.location, frames.length * sizeof(uint64_t)) == 0;
+}
+
+// Checks a deserialized backtrace, so that a corrupt journal record can't
+// cause an out-of-bounds read later.
+- (BOOL) isConsistent {
+    NSUInteger stringCount = [strings count];
+    uint32_t previousFrame = 0, previousRegister = 0, previousNumber = 0;
+    for (NSUInteger thread = 0; thread < threadCount; thread++) {
+        if (threadNames[thread] >= stringCount) return NO;
+        if (threadFrameStarts[thread] < previousFrame || threadFrameStarts[thread] > frameCount) return NO;
+        if (threadRegisterStarts[thread] < previousRegister || threadRegisterStarts[thread] > registerCount) return NO;
+        if (threadNumberStarts[thread] < previousNumber || threadNumberStarts[thread] > threadNumberCount) return NO;
+        previousFrame = threadFrameStarts[thread];
+        previousRegister = threadRegisterStarts[thread];
+        previousNumber = threadNumberStarts[thread];
+    }
+    for (NSUInteger idx = 0; idx < frameCount; idx++)
+        if (frameImages[idx] != SCBacktraceNoImage && frameImages[idx] >= stringCount) return NO;
+    for (NSUInteger idx = 0; idx < registerCount; idx++)
+        if (registerNames[idx] >= stringCount) return NO;
+    return YES;
+}
+
+@end
+
+#pragma mark -
+
+static void *SCResizeArray(void *array, NSUInteger count, size_t size) {
+    void *resized = realloc(array, count * size);
+    if (!resized) [NSException raise:NSMallocException format:@"Couldn't grow a backtrace to %lu entries", (unsigned long)count];
+    return resized;
+}
+
+static BOOL SCReadArray(const uint8_t *bytes, NSUInteger length, NSUInteger *offset, void **array, NSUInteger count, size_t size) {
+    NSUInteger byteCount = count * size;
+    if (byteCount > length - *offset) return NO;
+    if (byteCount) memcpy(*array, bytes + *offset, byteCount);
+    *offset += byteCount;
+    return YES;
+}
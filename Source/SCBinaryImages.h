@@ -0,0 +1,59 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*!
+ A binary image (the main executable, a framework, a plugin, or a system
+ library) loaded into the process.
+ */
+typedef struct {
+    /*! The address of the image's Mach-O header. */
+    uint64_t loadAddress;
+    /*! The address just past the end of the image's `__TEXT` segment. */
+    uint64_t endAddress;
+    /*! The difference between the load address and the preferred address. */
+    int64_t slide;
+    /*! The image's `LC_UUID`, which identifies its symbol file. */
+    uint8_t UUID[16];
+    /*! The image's path on disk. Never freed, so it stays valid after unload. */
+    const char *path;
+    /*! SCBinaryImage::UUID formatted as a string. */
+    NSString *UUIDString;
+} SCBinaryImage;
+
+/*!
+ Starts tracking the binary images loaded into the process. dyld reports every
+ image already loaded right away, and later additions and removals as they
+ happen, so the registry is built once and then maintained incrementally.
+ Called by SquashCocoa::hook, and on first use by the lookup functions; calling
+ it again does nothing.
+ */
+void SCBinaryImagesRegister(void);
+
+/*!
+ Finds the image containing an address with a binary search over the loaded
+ images, which are kept sorted by load address.
+ @param address An address in this process, such as a return address.
+ @param UUID On success, set to the image's UUID string.
+ @param offset On success, set to the address's offset from the image's load
+ address.
+ @return Whether the address falls inside a loaded image.
+ */
+BOOL SCBinaryImageForAddress(uint64_t address, NSString **UUID, uint64_t *offset);
+
+/*!
+ Returns a snapshot of every loaded image, sorted by load address.
+ @return An array of dictionaries with `uuid`, `path`, `load_address`, and
+ `slide` keys.
+ */
+NSArray *SCBinaryImagesDescription(void);
@@ -0,0 +1,162 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCBinaryImages.h"
+#import <mach-o/dyld.h>
+#import <mach-o/loader.h>
+#import <dlfcn.h>
+#import <pthread.h>
+
+static SCBinaryImage *SCImages = NULL;
+static NSUInteger SCImageCount = 0;
+static NSUInteger SCImageCapacity = 0;
+static pthread_rwlock_t SCImagesLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static BOOL SCReadImage(const struct mach_header *header, intptr_t slide, SCBinaryImage *image);
+static NSUInteger SCImageIndexForAddress(uint64_t address);
+static void SCImageAdded(const struct mach_header *header, intptr_t slide);
+static void SCImageRemoved(const struct mach_header *header, intptr_t slide);
+
+void SCBinaryImagesRegister(void) {
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        _dyld_register_func_for_add_image(SCImageAdded);
+        _dyld_register_func_for_remove_image(SCImageRemoved);
+    });
+}
+
+BOOL SCBinaryImageForAddress(uint64_t address, NSString **UUID, uint64_t *offset) {
+    SCBinaryImagesRegister();
+
+    BOOL found = NO;
+    pthread_rwlock_rdlock(&SCImagesLock);
+    NSUInteger idx = SCImageIndexForAddress(address);
+    if (idx < SCImageCount && address < SCImages[idx].endAddress) {
+        if (UUID) *UUID = [[SCImages[idx].UUIDString retain] autorelease];
+        if (offset) *offset = address - SCImages[idx].loadAddress;
+        found = YES;
+    }
+    pthread_rwlock_unlock(&SCImagesLock);
+    return found;
+}
+
+NSArray *SCBinaryImagesDescription(void) {
+    SCBinaryImagesRegister();
+
+    NSMutableArray *images = [NSMutableArray array];
+    pthread_rwlock_rdlock(&SCImagesLock);
+    for (NSUInteger idx = 0; idx < SCImageCount; idx++) {
+        SCBinaryImage *image = &SCImages[idx];
+        [images addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                           image->UUIDString, @"uuid",
+                           [NSString stringWithUTF8String:image->path], @"path",
+                           [NSNumber numberWithUnsignedLongLong:image->loadAddress], @"load_address",
+                           [NSNumber numberWithLongLong:image->slide], @"slide",
+                           NULL]];
+    }
+    pthread_rwlock_unlock(&SCImagesLock);
+    return images;
+}
+
+#pragma mark -
+
+// Returns the index of the last image loaded at or below the address, or
+// SCImageCount if there is none. Must be called with the lock held.
+static NSUInteger SCImageIndexForAddress(uint64_t address) {
+    NSUInteger low = 0, high = SCImageCount;
+    while (low < high) {
+        NSUInteger middle = low + (high - low)/2;
+        if (SCImages[middle].loadAddress <= address) low = middle + 1;
+        else high = middle;
+    }
+    return low == 0 ? SCImageCount : low - 1;
+}
+
+static BOOL SCReadImage(const struct mach_header *header, intptr_t slide, SCBinaryImage *image) {
+    memset(image, 0, sizeof(SCBinaryImage));
+    image->loadAddress = (uintptr_t)header;
+    image->slide = slide;
+
+    const uint8_t *command;
+    if (header->magic == MH_MAGIC_64 || header->magic == MH_CIGAM_64)
+        command = (const uint8_t *)header + sizeof(struct mach_header_64);
+    else
+        command = (const uint8_t *)header + sizeof(struct mach_header);
+
+    BOOL hasUUID = NO;
+    for (uint32_t idx = 0; idx < header->ncmds; idx++) {
+        const struct load_command *loadCommand = (const struct load_command *)command;
+        if (loadCommand->cmd == LC_UUID) {
+            memcpy(image->UUID, ((const struct uuid_command *)command)->uuid, 16);
+            hasUUID = YES;
+        }
+        else if (loadCommand->cmd == LC_SEGMENT_64) {
+            const struct segment_command_64 *segment = (const struct segment_command_64 *)command;
+            if (strcmp(segment->segname, SEG_TEXT) == 0) image->endAddress = image->loadAddress + segment->vmsize;
+        }
+        else if (loadCommand->cmd == LC_SEGMENT) {
+            const struct segment_command *segment = (const struct segment_command *)command;
+            if (strcmp(segment->segname, SEG_TEXT) == 0) image->endAddress = image->loadAddress + segment->vmsize;
+        }
+        command += loadCommand->cmdsize;
+    }
+    if (!hasUUID || image->endAddress == 0) return NO;
+
+    Dl_info info;
+    image->path = strdup((dladdr(header, &info) && info.dli_fname) ? info.dli_fname : "");
+
+    const uint8_t *b = image->UUID;
+    image->UUIDString = [[NSString alloc] initWithFormat:@"%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+                         b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+                         b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]];
+    return YES;
+}
+
+static void SCImageAdded(const struct mach_header *header, intptr_t slide) {
+    SCBinaryImage image;
+    if (!SCReadImage(header, slide, &image)) return;
+
+    pthread_rwlock_wrlock(&SCImagesLock);
+    if (SCImageCount == SCImageCapacity) {
+        NSUInteger capacity = SCImageCapacity ? SCImageCapacity*2 : 256;
+        SCBinaryImage *images = realloc(SCImages, capacity * sizeof(SCBinaryImage));
+        if (!images) {
+            pthread_rwlock_unlock(&SCImagesLock);
+            [image.UUIDString release];
+            return;
+        }
+        SCImages = images;
+        SCImageCapacity = capacity;
+    }
+
+    // images mostly arrive in ascending address order, so this usually
+    // appends
+    NSUInteger idx = SCImageCount;
+    while (idx > 0 && SCImages[idx - 1].loadAddress > image.loadAddress) idx--;
+    memmove(&SCImages[idx + 1], &SCImages[idx], (SCImageCount - idx) * sizeof(SCBinaryImage));
+    SCImages[idx] = image;
+    SCImageCount++;
+    pthread_rwlock_unlock(&SCImagesLock);
+}
+
+static void SCImageRemoved(const struct mach_header *header, intptr_t slide) {
+    pthread_rwlock_wrlock(&SCImagesLock);
+    NSUInteger idx = SCImageIndexForAddress((uintptr_t)header);
+    if (idx < SCImageCount && SCImages[idx].loadAddress == (uintptr_t)header) {
+        [SCImages[idx].UUIDString release];
+        memmove(&SCImages[idx], &SCImages[idx + 1], (SCImageCount - idx - 1) * sizeof(SCBinaryImage));
+        SCImageCount--;
+    }
+    pthread_rwlock_unlock(&SCImagesLock);
+}
@@ -0,0 +1,103 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+/*! Identifies a breadcrumb ring file. */
+#define SCBreadcrumbRingMagic 0x53434252
+
+/*! The current version of the SCBreadcrumbRing layout. */
+#define SCBreadcrumbRingVersion 1
+
+/*! The number of breadcrumbs kept. Must be a power of two. */
+#define SCBreadcrumbCapacity 64
+
+/*! The longest category stored, in bytes, including the terminator. */
+#define SCBreadcrumbCategoryLength 16
+
+/*! The longest message stored, in bytes, including the terminator. */
+#define SCBreadcrumbMessageLength 96
+
+/*! One slot of the breadcrumb ring. */
+typedef struct {
+    /*!
+     The breadcrumb's sequence number (starting at 1) once it is completely
+     written; 0 while a writer is filling the slot in.
+     */
+    volatile int64_t sequence;
+    /*! When the breadcrumb was left, in seconds since the epoch. */
+    double timestamp;
+    /*! The NUL-terminated UTF-8 category, such as "navigation" or "network". */
+    char category[SCBreadcrumbCategoryLength];
+    /*! The NUL-terminated UTF-8 message, truncated if necessary. */
+    char message[SCBreadcrumbMessageLength];
+} SCBreadcrumb;
+
+/*!
+ The fixed-size ring of the most recent breadcrumbs. It is memory-mapped from a
+ file, so whatever was written before the process died is on disk for the next
+ launch without the crash handler doing anything.
+ */
+typedef struct {
+    /*! Always SCBreadcrumbRingMagic. */
+    uint32_t magic;
+    /*! The layout version (SCBreadcrumbRingVersion). */
+    uint32_t version;
+    /*! Always SCBreadcrumbCapacity. */
+    uint32_t capacity;
+    /*! Reserved; always zero. */
+    uint32_t flags;
+    /*! The sequence number of the newest breadcrumb claimed by a writer. */
+    volatile int64_t head;
+    /*! The slots; breadcrumb `n` lives in slot `(n - 1) % capacity`. */
+    SCBreadcrumb slots[SCBreadcrumbCapacity];
+} SCBreadcrumbRing;
+
+/*!
+ Records a breadcrumb. Any number of threads may call this at once: each
+ claims a slot with one atomic increment and publishes it by writing its
+ sequence number, so it never locks or allocates and costs a few dozen
+ nanoseconds. The oldest breadcrumb is overwritten once the ring is full.
+
+ Breadcrumbs left before SCBreadcrumbsOpen is called are kept in memory and
+ carried over into the file.
+ @param category A short category, or `NULL`.
+ @param message The message, truncated to fit a slot.
+ */
+void SCLeaveBreadcrumb(const char *category, const char *message);
+
+/*!
+ Moves the previous launch's ring file aside (see
+ SCBreadcrumbsFromPreviousSession) and maps a fresh one at the same path. Called
+ by SquashCocoa::hook and SquashCocoa::reportErrors; calling it again does
+ nothing. Must not be called from a signal handler.
+ @param path The ring file.
+ */
+void SCBreadcrumbsOpen(NSString *path);
+
+/*!
+ Returns the breadcrumbs currently in the ring, oldest first. Slots being
+ written while the snapshot is taken are skipped.
+ @return An array of dictionaries with `timestamp`, `category`, and `message`
+ keys.
+ */
+NSArray *SCBreadcrumbsSnapshot(void);
+
+/*!
+ Returns the breadcrumbs left by the previous launch, as found by
+ SCBreadcrumbsOpen, for attaching to its crash report.
+ @param before Only breadcrumbs left at or before this date are returned.
+ @return An array in the format of SCBreadcrumbsSnapshot, or `nil` if there
+ were none.
+ */
+NSArray *SCBreadcrumbsFromPreviousSession(NSDate *before);
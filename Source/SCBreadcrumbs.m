@@ -0,0 +1,132 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <libkern/OSAtomic.h>
+#import <sys/mman.h>
+#import <sys/time.h>
+#import "SCBreadcrumbs.h"
+#import "SCFunctions.h"
+
+// Breadcrumbs left before the ring file is mapped go here.
+static SCBreadcrumbRing SCInitialRing = { SCBreadcrumbRingMagic, SCBreadcrumbRingVersion, SCBreadcrumbCapacity, 0, 0 };
+static SCBreadcrumbRing * volatile SCCurrentRing = &SCInitialRing;
+static NSData *SCPreviousRing = nil;
+
+static void SCCopyTruncatedUTF8(char *destination, const char *source, size_t size);
+static NSArray *SCBreadcrumbsInRing(const SCBreadcrumbRing *ring, NSDate *before);
+
+void SCLeaveBreadcrumb(const char *category, const char *message) {
+    SCBreadcrumbRing *ring = SCCurrentRing;
+    int64_t sequence = OSAtomicIncrement64Barrier(&ring->head);
+    SCBreadcrumb *slot = &ring->slots[(sequence - 1) & (SCBreadcrumbCapacity - 1)];
+
+    // readers ignore the slot until its sequence number is back
+    slot->sequence = 0;
+    OSMemoryBarrier();
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    slot->timestamp = now.tv_sec + now.tv_usec/1000000.0;
+    SCCopyTruncatedUTF8(slot->category, category ? category : "", SCBreadcrumbCategoryLength);
+    SCCopyTruncatedUTF8(slot->message, message ? message : "", SCBreadcrumbMessageLength);
+    OSMemoryBarrier();
+    slot->sequence = sequence;
+}
+
+void SCBreadcrumbsOpen(NSString *path) {
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSString *previousPath = [path stringByAppendingPathExtension:@"previous"];
+        NSFileManager *manager = [NSFileManager defaultManager];
+        [manager removeItemAtPath:previousPath error:NULL];
+        if ([manager moveItemAtPath:path toPath:previousPath error:NULL]) {
+            NSData *data = [[NSData alloc] initWithContentsOfFile:previousPath];
+            if ([data length] >= sizeof(SCBreadcrumbRing)) {
+                const SCBreadcrumbRing *ring = [data bytes];
+                if (ring->magic == SCBreadcrumbRingMagic && ring->version == SCBreadcrumbRingVersion && ring->capacity == SCBreadcrumbCapacity)
+                    SCPreviousRing = [data retain];
+            }
+            [data release];
+        }
+
+        [manager createDirectoryAtPath:[path stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:NULL];
+        int fd = open([path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return;
+        if (ftruncate(fd, sizeof(SCBreadcrumbRing)) != 0) {
+            close(fd);
+            return;
+        }
+        void *mapping = mmap(NULL, sizeof(SCBreadcrumbRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return;
+
+        // breadcrumbs left while the copy is made may land in either ring
+        memcpy(mapping, &SCInitialRing, sizeof(SCBreadcrumbRing));
+        OSMemoryBarrier();
+        SCCurrentRing = mapping;
+    });
+}
+
+NSArray *SCBreadcrumbsSnapshot(void) {
+    return SCBreadcrumbsInRing(SCCurrentRing, nil);
+}
+
+NSArray *SCBreadcrumbsFromPreviousSession(NSDate *before) {
+    if (!SCPreviousRing) return nil;
+    NSArray *breadcrumbs = SCBreadcrumbsInRing([SCPreviousRing bytes], before);
+    return [breadcrumbs count] ? breadcrumbs : nil;
+}
+
+static void SCCopyTruncatedUTF8(char *destination, const char *source, size_t size) {
+    size_t length = strlcpy(destination, source, size);
+    if (length < size) return;
+
+    // don't leave half a multi-byte character at the end
+    size_t end = size - 1, lead = end;
+    while (lead > 0 && ((unsigned char)destination[lead - 1] & 0xC0) == 0x80) lead--;
+    if (lead == 0) return;
+    lead--;
+    unsigned char byte = (unsigned char)destination[lead];
+    size_t characterLength = (byte < 0x80) ? 1 : (byte >= 0xF0) ? 4 : (byte >= 0xE0) ? 3 : 2;
+    if (lead + characterLength > end) destination[lead] = '\0';
+}
+
+static NSArray *SCBreadcrumbsInRing(const SCBreadcrumbRing *ring, NSDate *before) {
+    int64_t head = ring->head;
+    int64_t first = MAX(head - SCBreadcrumbCapacity + 1, (int64_t)1);
+    NSMutableArray *breadcrumbs = [NSMutableArray arrayWithCapacity:(NSUInteger)MAX(head - first + 1, (int64_t)0)];
+
+    for (int64_t sequence = first; sequence <= head; sequence++) {
+        const SCBreadcrumb *slot = &ring->slots[(sequence - 1) & (SCBreadcrumbCapacity - 1)];
+        if (slot->sequence != sequence) continue;
+        OSMemoryBarrier();
+        SCBreadcrumb copy = *slot;
+        OSMemoryBarrier();
+        // overwritten while it was being copied
+        if (slot->sequence != sequence) continue;
+
+        copy.category[SCBreadcrumbCategoryLength - 1] = '\0';
+        copy.message[SCBreadcrumbMessageLength - 1] = '\0';
+        NSDate *date = [NSDate dateWithTimeIntervalSince1970:copy.timestamp];
+        if (before && [date compare:before] == NSOrderedDescending) continue;
+        NSString *category = [NSString stringWithUTF8String:copy.category];
+        NSString *message = [NSString stringWithUTF8String:copy.message];
+        [breadcrumbs addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                                SCISO8601StringFromDate(date), @"timestamp",
+                                category ? category : @"", @"category",
+                                message ? message : @"", @"message",
+                                NULL]];
+    }
+    return breadcrumbs;
+}
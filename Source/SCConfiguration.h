@@ -0,0 +1,97 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <Foundation/Foundation.h>
+
+/*!
+ An immutable snapshot of the SquashCocoa settings read while an exception is
+ being recorded. SquashCocoa publishes a new snapshot whenever one of these
+ settings changes (SquashCocoa::configuration), so the recording paths can read
+ them from any thread without locking, and never see a set that another thread
+ is in the middle of changing.
+ */
+@interface SCConfiguration : NSObject {
+    NSString *APIKey;
+    NSString *environment;
+    NSString *revision;
+    NSSet *ignoredExceptions;
+    NSSet *handledSignals;
+    NSSet *filterUserInfoKeys;
+}
+
+#pragma mark Properties
+
+/*! The value of SquashCocoa::APIKey when the snapshot was taken. */
+@property (readonly) NSString *APIKey;
+
+/*! The value of SquashCocoa::environment when the snapshot was taken. */
+@property (readonly) NSString *environment;
+
+/*! The value of SquashCocoa::revision when the snapshot was taken. */
+@property (readonly) NSString *revision;
+
+/*! The contents of SquashCocoa::ignoredExceptions. */
+@property (readonly) NSSet *ignoredExceptions;
+
+/*! The contents of SquashCocoa::handledSignals. */
+@property (readonly) NSSet *handledSignals;
+
+/*! The contents of SquashCocoa::filterUserInfoKeys. */
+@property (readonly) NSSet *filterUserInfoKeys;
+
+#pragma mark Initializers
+
+/*!
+ Creates a snapshot. The strings are copied; the sets should already be
+ immutable.
+ @return The initialized instance.
+ */
+- (id) initWithAPIKey:(NSString *)key
+          environment:(NSString *)environmentName
+             revision:(NSString *)revisionID
+    ignoredExceptions:(NSSet *)ignored
+       handledSignals:(NSSet *)signals
+   filterUserInfoKeys:(NSSet *)filterKeys;
+
+@end
+
+#pragma mark -
+
+/*!
+ A mutable set that is safe to change from several threads at once and that
+ reports every change, so that SquashCocoa can keep the SCConfiguration
+ snapshot current. Bulk changes (such as `addObjectsFromArray:` or `unionSet:`)
+ are made in one step and reported once. Enumerating it enumerates a copy.
+ */
+@interface SCObservedSet : NSMutableSet {
+    NSMutableSet *storage;
+    dispatch_block_t changeHandler;
+}
+
+/*!
+ Creates a set with some initial contents.
+ @param objects The initial contents.
+ @param handler Called after each change, on the thread making the change.
+ @return The initialized instance.
+ */
+- (id) initWithObjects:(NSArray *)objects changeHandler:(dispatch_block_t)handler;
+
+/*!
+ Returns an immutable copy of the current contents.
+ @return The copy.
+ */
+- (NSSet *) snapshot;
+
+@end
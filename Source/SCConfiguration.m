@@ -0,0 +1,177 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import "SCConfiguration.h"
+
+@implementation SCConfiguration
+
+#pragma mark Properties
+
+@synthesize APIKey;
+@synthesize environment;
+@synthesize revision;
+@synthesize ignoredExceptions;
+@synthesize handledSignals;
+@synthesize filterUserInfoKeys;
+
+#pragma mark Initializers
+
+- (id) initWithAPIKey:(NSString *)key
+          environment:(NSString *)environmentName
+             revision:(NSString *)revisionID
+    ignoredExceptions:(NSSet *)ignored
+       handledSignals:(NSSet *)signals
+   filterUserInfoKeys:(NSSet *)filterKeys {
+    if (self = [super init]) {
+        APIKey = [key copy];
+        environment = [environmentName copy];
+        revision = [revisionID copy];
+        ignoredExceptions = [ignored retain];
+        handledSignals = [signals retain];
+        filterUserInfoKeys = [filterKeys retain];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [APIKey release];
+    [environment release];
+    [revision release];
+    [ignoredExceptions release];
+    [handledSignals release];
+    [filterUserInfoKeys release];
+    [super dealloc];
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCObservedSet
+
+#pragma mark Initializers
+
+- (id) init {
+    return [self initWithObjects:nil changeHandler:nil];
+}
+
+- (id) initWithCapacity:(NSUInteger)capacity {
+    return [self initWithObjects:nil changeHandler:nil];
+}
+
+- (id) initWithObjects:(NSArray *)objects changeHandler:(dispatch_block_t)handler {
+    if (self = [super init]) {
+        storage = objects ? [[NSMutableSet alloc] initWithArray:objects] : [[NSMutableSet alloc] init];
+        changeHandler = [handler copy];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [storage release];
+    [changeHandler release];
+    [super dealloc];
+}
+
+#pragma mark Snapshots
+
+- (NSSet *) snapshot {
+    @synchronized(storage) {
+        return [[[NSSet alloc] initWithSet:storage] autorelease];
+    }
+}
+
+#pragma mark NSSet primitives
+
+- (NSUInteger) count {
+    @synchronized(storage) {
+        return [storage count];
+    }
+}
+
+- (id) member:(id)object {
+    @synchronized(storage) {
+        return [[[storage member:object] retain] autorelease];
+    }
+}
+
+- (NSEnumerator *) objectEnumerator {
+    return [[self snapshot] objectEnumerator];
+}
+
+#pragma mark NSMutableSet primitives
+
+- (void) addObject:(id)object {
+    @synchronized(storage) {
+        [storage addObject:object];
+    }
+    if (changeHandler) changeHandler();
+}
+
+- (void) removeObject:(id)object {
+    @synchronized(storage) {
+        [storage removeObject:object];
+    }
+    if (changeHandler) changeHandler();
+}
+
+#pragma mark Bulk changes
+
+// NSMutableSet's versions call addObject: or removeObject: once per element,
+// which would publish a configuration snapshot for each
+
+- (void) addObjectsFromArray:(NSArray *)array {
+    @synchronized(storage) {
+        [storage addObjectsFromArray:array];
+    }
+    if (changeHandler) changeHandler();
+}
+
+- (void) unionSet:(NSSet *)otherSet {
+    @synchronized(storage) {
+        [storage unionSet:otherSet];
+    }
+    if (changeHandler) changeHandler();
+}
+
+- (void) minusSet:(NSSet *)otherSet {
+    @synchronized(storage) {
+        [storage minusSet:otherSet];
+    }
+    if (changeHandler) changeHandler();
+}
+
+- (void) intersectSet:(NSSet *)otherSet {
+    @synchronized(storage) {
+        [storage intersectSet:otherSet];
+    }
+    if (changeHandler) changeHandler();
+}
+
+- (void) setSet:(NSSet *)otherSet {
+    @synchronized(storage) {
+        [storage setSet:otherSet];
+    }
+    if (changeHandler) changeHandler();
+}
+
+- (void) removeAllObjects {
+    @synchronized(storage) {
+        [storage removeAllObjects];
+    }
+    if (changeHandler) changeHandler();
+}
+
+@end
@@ -0,0 +1,372 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#include <string.h>
+#include "SCCrashReportConverter.h"
+
+#pragma mark Protocol buffers
+
+// PLCrashReporter's file header: the magic bytes and a version byte
+#define SCCrashReportHeaderLength 8
+#define SCCrashReportFileVersion 1
+
+// wire types
+enum {
+    SCProtobufVarint = 0,
+    SCProtobufFixed64 = 1,
+    SCProtobufLengthDelimited = 2,
+    SCProtobufFixed32 = 5
+};
+
+// field numbers from PLCrashReporter's crash_report.proto
+enum {
+    SCReportSystemInfo = 1,
+    SCReportThreads = 3,
+    SCReportBinaryImages = 4,
+    SCReportException = 5,
+    SCReportSignal = 6,
+    SCReportProcessInfo = 7,
+    SCReportMachineInfo = 8
+};
+
+typedef struct {
+    const uint8_t *cursor;
+    const uint8_t *end;
+    bool failed;
+} SCProtobuf;
+
+typedef struct {
+    uint32_t number;
+    uint32_t wireType;
+    uint64_t value;
+    const uint8_t *data;
+    size_t length;
+} SCProtobufField;
+
+static SCProtobuf SCProtobufMake(const uint8_t *data, size_t length) {
+    SCProtobuf buffer = { data, data + length, false };
+    return buffer;
+}
+
+static bool SCProtobufReadVarint(SCProtobuf *buffer, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (buffer->cursor >= buffer->end) return false;
+        uint8_t byte = *buffer->cursor++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t SCProtobufReadLittleEndian(const uint8_t *bytes, size_t count) {
+    uint64_t value = 0;
+    for (size_t idx = 0; idx < count; idx++) value |= (uint64_t)bytes[idx] << (idx*8);
+    return value;
+}
+
+// Reads the next field of a message. Returns false at the end of the message,
+// or if the field is malformed, in which case the buffer is marked as failed.
+static bool SCProtobufNext(SCProtobuf *buffer, SCProtobufField *field) {
+    if (buffer->failed || buffer->cursor >= buffer->end) return false;
+
+    uint64_t key;
+    if (!SCProtobufReadVarint(buffer, &key)) goto malformed;
+    field->number = (uint32_t)(key >> 3);
+    field->wireType = (uint32_t)(key & 7);
+    field->value = 0;
+    field->data = NULL;
+    field->length = 0;
+
+    switch (field->wireType) {
+        case SCProtobufVarint:
+            if (!SCProtobufReadVarint(buffer, &field->value)) goto malformed;
+            break;
+        case SCProtobufFixed64:
+            if (buffer->end - buffer->cursor < 8) goto malformed;
+            field->value = SCProtobufReadLittleEndian(buffer->cursor, 8);
+            buffer->cursor += 8;
+            break;
+        case SCProtobufFixed32:
+            if (buffer->end - buffer->cursor < 4) goto malformed;
+            field->value = SCProtobufReadLittleEndian(buffer->cursor, 4);
+            buffer->cursor += 4;
+            break;
+        case SCProtobufLengthDelimited: {
+            uint64_t length;
+            if (!SCProtobufReadVarint(buffer, &length)) goto malformed;
+            if (length > (uint64_t)(buffer->end - buffer->cursor)) goto malformed;
+            field->data = buffer->cursor;
+            field->length = (size_t)length;
+            buffer->cursor += length;
+            break;
+        }
+        default:
+            // groups were never used by PLCrashReporter
+            goto malformed;
+    }
+    return true;
+
+malformed:
+    buffer->failed = true;
+    return false;
+}
+
+static SCCrashReportString SCProtobufString(const SCProtobufField *field) {
+    SCCrashReportString string = { NULL, 0 };
+    if (field->wireType == SCProtobufLengthDelimited) {
+        string.bytes = (const char *)field->data;
+        string.length = field->length;
+    }
+    return string;
+}
+
+#pragma mark Reading
+
+static bool SCCrashReportReadSystemInfo(SCCrashReport *report, const SCProtobufField *message) {
+    SCProtobuf buffer = SCProtobufMake(message->data, message->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        switch (field.number) {
+            case 1: report->operatingSystem = (uint32_t)field.value; break;
+            case 2: report->operatingSystemVersion = SCProtobufString(&field); break;
+            case 3: report->architecture = (uint32_t)field.value; break;
+            case 4: report->timestamp = (int64_t)field.value; break;
+            case 5: report->operatingSystemBuild = SCProtobufString(&field); break;
+        }
+    }
+    return !buffer.failed;
+}
+
+static bool SCCrashReportReadMachineInfo(SCCrashReport *report, const SCProtobufField *message) {
+    SCProtobuf buffer = SCProtobufMake(message->data, message->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field))
+        if (field.number == 1) report->modelName = SCProtobufString(&field);
+    report->hasMachineInfo = true;
+    return !buffer.failed;
+}
+
+static bool SCCrashReportReadProcessInfo(SCCrashReport *report, const SCProtobufField *message) {
+    SCProtobuf buffer = SCProtobufMake(message->data, message->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        switch (field.number) {
+            case 2: report->processID = (uint32_t)field.value; break;
+            case 3: report->processPath = SCProtobufString(&field); break;
+            case 4: report->parentProcessName = SCProtobufString(&field); break;
+            case 6: report->native = (field.value != 0); break;
+        }
+    }
+    report->hasProcessInfo = true;
+    return !buffer.failed;
+}
+
+static bool SCCrashReportReadException(SCCrashReport *report, const SCProtobufField *message) {
+    SCProtobuf buffer = SCProtobufMake(message->data, message->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        switch (field.number) {
+            case 1: report->exceptionName = SCProtobufString(&field); break;
+            case 2: report->exceptionReason = SCProtobufString(&field); break;
+        }
+    }
+    report->hasException = true;
+    report->exception = message->data;
+    report->exceptionLength = message->length;
+    return !buffer.failed;
+}
+
+static bool SCCrashReportReadSignal(SCCrashReport *report, const SCProtobufField *message) {
+    SCProtobuf buffer = SCProtobufMake(message->data, message->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        switch (field.number) {
+            case 1: report->signalName = SCProtobufString(&field); break;
+            case 2: report->signalCode = SCProtobufString(&field); break;
+            case 3: report->signalAddress = field.value; break;
+        }
+    }
+    return !buffer.failed;
+}
+
+static bool SCCrashReportReadImage(SCCrashReport *report, const SCProtobufField *message) {
+    SCCrashReportImage image = { 0, 0, NULL };
+    SCProtobuf buffer = SCProtobufMake(message->data, message->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        switch (field.number) {
+            case 1: image.base = field.value; break;
+            case 2: image.size = field.value; break;
+            case 4:
+                if (field.wireType == SCProtobufLengthDelimited && field.length == 16) image.UUID = field.data;
+                break;
+        }
+    }
+    if (buffer.failed) return false;
+    if (report->imageCount < SCCrashReportImageCapacity) report->images[report->imageCount++] = image;
+    return true;
+}
+
+bool SCCrashReportOpen(SCCrashReport *report, const void *bytes, size_t length) {
+    memset(report, 0, sizeof(*report));
+    if (length < SCCrashReportHeaderLength || memcmp(bytes, "plcrash", 7) != 0) return false;
+    if (((const uint8_t *)bytes)[7] != SCCrashReportFileVersion) return false;
+    report->bytes = (const uint8_t *)bytes + SCCrashReportHeaderLength;
+    report->length = length - SCCrashReportHeaderLength;
+
+    // system and signal information are required, as PLCrashReport requires them
+    bool hasSystemInfo = false, hasSignal = false, valid = true;
+    SCProtobuf buffer = SCProtobufMake(report->bytes, report->length);
+    SCProtobufField field;
+    while (valid && SCProtobufNext(&buffer, &field)) {
+        if (field.wireType != SCProtobufLengthDelimited) continue;
+        switch (field.number) {
+            case SCReportSystemInfo: valid = hasSystemInfo = SCCrashReportReadSystemInfo(report, &field); break;
+            case SCReportThreads: report->threadCount++; break;
+            case SCReportBinaryImages: valid = SCCrashReportReadImage(report, &field); break;
+            case SCReportException: valid = SCCrashReportReadException(report, &field); break;
+            case SCReportSignal: valid = hasSignal = SCCrashReportReadSignal(report, &field); break;
+            case SCReportProcessInfo: valid = SCCrashReportReadProcessInfo(report, &field); break;
+            case SCReportMachineInfo: valid = SCCrashReportReadMachineInfo(report, &field); break;
+        }
+    }
+    return valid && !buffer.failed && hasSystemInfo && hasSignal;
+}
+
+#pragma mark Visiting
+
+static uint32_t SCCrashReportFindImage(const SCCrashReport *report, uint64_t address, uint64_t *offset) {
+    for (size_t idx = 0; idx < report->imageCount; idx++) {
+        const SCCrashReportImage *image = &report->images[idx];
+        if (address < image->base || address - image->base >= image->size) continue;
+        *offset = address - image->base;
+        return (uint32_t)idx;
+    }
+    *offset = 0;
+    return SCCrashReportNoImage;
+}
+
+// Calls the frame callback for each StackFrame stored under fieldNumber in a
+// thread or exception message.
+static bool SCCrashReportVisitFrames(const SCCrashReport *report, const uint8_t *data, size_t length, uint32_t fieldNumber, const SCCrashReportVisitor *visitor, void *context) {
+    SCProtobuf buffer = SCProtobufMake(data, length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        if (field.number != fieldNumber || field.wireType != SCProtobufLengthDelimited) continue;
+
+        uint64_t address = 0;
+        SCProtobuf frame = SCProtobufMake(field.data, field.length);
+        SCProtobufField frameField;
+        while (SCProtobufNext(&frame, &frameField))
+            if (frameField.number == 3) address = frameField.value;
+        if (frame.failed) return false;
+
+        uint64_t offset;
+        uint32_t image = SCCrashReportFindImage(report, address, &offset);
+        if (visitor->frame) visitor->frame(context, address, image, offset);
+    }
+    return !buffer.failed;
+}
+
+static bool SCCrashReportVisitRegisters(const uint8_t *data, size_t length, const SCCrashReportVisitor *visitor, void *context) {
+    SCProtobuf buffer = SCProtobufMake(data, length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        if (field.number != 4 || field.wireType != SCProtobufLengthDelimited) continue;
+
+        SCCrashReportString name = { NULL, 0 };
+        uint64_t value = 0;
+        SCProtobuf reg = SCProtobufMake(field.data, field.length);
+        SCProtobufField regField;
+        while (SCProtobufNext(&reg, &regField)) {
+            if (regField.number == 1) name = SCProtobufString(&regField);
+            else if (regField.number == 2) value = regField.value;
+        }
+        if (reg.failed) return false;
+        if (visitor->registerValue) visitor->registerValue(context, name, value);
+    }
+    return !buffer.failed;
+}
+
+static bool SCCrashReportVisitThread(const SCCrashReport *report, const uint8_t *data, size_t length, const SCCrashReportVisitor *visitor, bool allRegisters, void *context) {
+    // the crashed flag is written after the frames, so it's found first
+    uint32_t number = 0;
+    bool crashed = false;
+    SCProtobuf buffer = SCProtobufMake(data, length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        if (field.number == 1) number = (uint32_t)field.value;
+        else if (field.number == 3) crashed = (field.value != 0);
+    }
+    if (buffer.failed) return false;
+
+    bool registers = allRegisters || crashed;
+    if (visitor->beginThread) visitor->beginThread(context, number, crashed, registers);
+    if (!SCCrashReportVisitFrames(report, data, length, 2, visitor, context)) return false;
+    if (registers && !SCCrashReportVisitRegisters(data, length, visitor, context)) return false;
+    return true;
+}
+
+bool SCCrashReportVisitThreads(const SCCrashReport *report, const SCCrashReportVisitor *visitor, bool allRegisters, void *context) {
+    SCProtobuf buffer = SCProtobufMake(report->bytes, report->length);
+    SCProtobufField field;
+    while (SCProtobufNext(&buffer, &field)) {
+        if (field.number != SCReportThreads || field.wireType != SCProtobufLengthDelimited) continue;
+        if (!SCCrashReportVisitThread(report, field.data, field.length, visitor, allRegisters, context)) return false;
+    }
+    return !buffer.failed;
+}
+
+bool SCCrashReportVisitExceptionFrames(const SCCrashReport *report, const SCCrashReportVisitor *visitor, void *context) {
+    if (!report->exception) return true;
+    return SCCrashReportVisitFrames(report, report->exception, report->exceptionLength, 3, visitor, context);
+}
+
+#pragma mark Names
+
+const char *SCCrashReportOperatingSystemName(uint32_t operatingSystem) {
+    switch (operatingSystem) {
+        case 0: return "Mac OS X";
+        case 1: return "iPhone OS";
+        case 2: return "iPhone Simulator";
+        default: return "Unknown";
+    }
+}
+
+const char *SCCrashReportArchitectureName(uint32_t architecture) {
+    switch (architecture) {
+        case 0: return "x86-32";
+        case 1: return "x86-64";
+        case 2: return "ARMv6";
+        case 3: return "PPC";
+        case 4: return "PPC64";
+        case 5: return "ARMv7";
+        default: return "Unknown";
+    }
+}
+
+void SCCrashReportFormatUUID(const uint8_t *UUID, char *string) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (size_t idx = 0; idx < 16; idx++) {
+        if (idx == 4 || idx == 6 || idx == 8 || idx == 10) *string++ = '-';
+        *string++ = digits[UUID[idx] >> 4];
+        *string++ = digits[UUID[idx] & 0xF];
+    }
+    *string = '\0';
+}
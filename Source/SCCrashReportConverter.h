@@ -0,0 +1,199 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ The most binary images an SCCrashReport indexes. Frames in images past this
+ limit are reported without an image.
+ */
+#define SCCrashReportImageCapacity 1024
+
+/*! Passed for a frame that lies in no indexed binary image. */
+#define SCCrashReportNoImage UINT32_MAX
+
+/*!
+ A string field of a crash report. It points into the report's bytes and is
+ not NUL-terminated; `bytes` is `NULL` if the field is absent.
+ */
+typedef struct {
+    /*! The UTF-8 bytes of the string. */
+    const char *bytes;
+    /*! The length of the string, in bytes. */
+    size_t length;
+} SCCrashReportString;
+
+/*! A binary image loaded into the crashed process. */
+typedef struct {
+    /*! The address the image was loaded at. */
+    uint64_t base;
+    /*! The size of the image's text segment, in bytes. */
+    uint64_t size;
+    /*! The image's 16-byte Mach-O UUID, or `NULL` if it wasn't recorded. */
+    const uint8_t *UUID;
+} SCCrashReportImage;
+
+/*!
+ A PLCrashReporter crash report, read in place from its serialized form. The
+ scalar fields and the binary image table are filled in by
+ SCCrashReportOpen; threads and frames are decoded only as they are visited,
+ so the memory used doesn't depend on how many threads or frames the report
+ has. The report's bytes must outlive the structure.
+ */
+typedef struct {
+    /*! The protocol buffer following the file header. */
+    const uint8_t *bytes;
+    /*! The length of SCCrashReport::bytes. */
+    size_t length;
+
+    /*! `PLCrashReportOperatingSystem` value of the crashed device. */
+    uint32_t operatingSystem;
+    /*! The operating system version. */
+    SCCrashReportString operatingSystemVersion;
+    /*! The operating system build. */
+    SCCrashReportString operatingSystemBuild;
+    /*! `PLCrashReportArchitecture` value of the crashed device. */
+    uint32_t architecture;
+    /*! When the crash happened, in seconds since the epoch, or 0 if unknown. */
+    int64_t timestamp;
+
+    /*! Whether the report describes the machine. */
+    bool hasMachineInfo;
+    /*! The hardware model. */
+    SCCrashReportString modelName;
+
+    /*! Whether the report describes the crashed process. */
+    bool hasProcessInfo;
+    /*! The process ID. */
+    uint32_t processID;
+    /*! The path to the executable. */
+    SCCrashReportString processPath;
+    /*! The name of the parent process. */
+    SCCrashReportString parentProcessName;
+    /*! Whether the process ran natively (not under Rosetta). */
+    bool native;
+
+    /*! Whether the crash was an uncaught exception. */
+    bool hasException;
+    /*! The exception's name. */
+    SCCrashReportString exceptionName;
+    /*! The exception's reason. */
+    SCCrashReportString exceptionReason;
+    /*! The encoded exception message, whose call stack is visited lazily. */
+    const uint8_t *exception;
+    /*! The length of SCCrashReport::exception. */
+    size_t exceptionLength;
+
+    /*! The name of the fatal signal. */
+    SCCrashReportString signalName;
+    /*! The signal code. */
+    SCCrashReportString signalCode;
+    /*! The faulting address. */
+    uint64_t signalAddress;
+
+    /*! The number of threads in the report. */
+    size_t threadCount;
+    /*! The number of binary images indexed in SCCrashReport::images. */
+    size_t imageCount;
+    /*! The binary images, in report order. */
+    SCCrashReportImage images[SCCrashReportImageCapacity];
+} SCCrashReport;
+
+/*!
+ Receives the threads, frames and registers of a crash report from
+ SCCrashReportVisitThreads, in report order, as they are decoded.
+ */
+typedef struct {
+    /*!
+     Called at the start of each thread.
+     @param context The context passed to SCCrashReportVisitThreads.
+     @param number The thread's number in the report.
+     @param crashed Whether this thread crashed.
+     @param registers Whether this thread's registers will be visited.
+     */
+    void (*beginThread)(void *context, uint32_t number, bool crashed, bool registers);
+    /*!
+     Called for each stack frame, innermost first.
+     @param context The context passed to SCCrashReportVisitThreads.
+     @param address The frame's instruction pointer.
+     @param image The index into SCCrashReport::images of the image containing
+     the address, or SCCrashReportNoImage.
+     @param offset The address's offset from the image's base, or 0.
+     */
+    void (*frame)(void *context, uint64_t address, uint32_t image, uint64_t offset);
+    /*!
+     Called for each register of a thread whose registers are visited.
+     @param context The context passed to SCCrashReportVisitThreads.
+     @param name The register name.
+     @param value The register's value.
+     */
+    void (*registerValue)(void *context, SCCrashReportString name, uint64_t value);
+} SCCrashReportVisitor;
+
+/*!
+ Checks a serialized PLCrashReporter report (file header and all) and reads its
+ scalar fields and binary images in place. Nothing is allocated.
+ @param report The structure to fill in.
+ @param bytes The serialized report.
+ @param length The length of the serialized report, in bytes.
+ @return `false` if the bytes aren't a well-formed crash report.
+ */
+bool SCCrashReportOpen(SCCrashReport *report, const void *bytes, size_t length);
+
+/*!
+ Decodes every thread of a report and hands it to a visitor.
+ @param report A report opened by SCCrashReportOpen.
+ @param visitor The callbacks to invoke.
+ @param allRegisters If `false`, only the crashed thread's registers are
+ visited.
+ @param context Passed to every callback.
+ @return `false` if a thread couldn't be decoded.
+ */
+bool SCCrashReportVisitThreads(const SCCrashReport *report, const SCCrashReportVisitor *visitor, bool allRegisters, void *context);
+
+/*!
+ Decodes the call stack recorded with an uncaught exception and hands its
+ frames to a visitor. Only SCCrashReportVisitor::frame is called.
+ @param report A report opened by SCCrashReportOpen.
+ @param visitor The callbacks to invoke.
+ @param context Passed to every callback.
+ @return `false` if the call stack couldn't be decoded.
+ */
+bool SCCrashReportVisitExceptionFrames(const SCCrashReport *report, const SCCrashReportVisitor *visitor, void *context);
+
+/*!
+ Returns the name Squash uses for a `PLCrashReportOperatingSystem` value.
+ @param operatingSystem The value of SCCrashReport::operatingSystem.
+ @return A constant string, such as "Mac OS X".
+ */
+const char *SCCrashReportOperatingSystemName(uint32_t operatingSystem);
+
+/*!
+ Returns the name Squash uses for a `PLCrashReportArchitecture` value.
+ @param architecture The value of SCCrashReport::architecture.
+ @return A constant string, such as "x86-64".
+ */
+const char *SCCrashReportArchitectureName(uint32_t architecture);
+
+/*!
+ Formats an image UUID the way SCBinaryImages does: uppercase hexadecimal in
+ 8-4-4-4-12 groups.
+ @param UUID The 16 bytes of the UUID.
+ @param string A buffer of at least 37 bytes to receive the NUL-terminated
+ result.
+ */
+void SCCrashReportFormatUUID(const uint8_t *UUID, char *string);
@@ -0,0 +1,104 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+@class Reachability;
+
+/*!
+ Decides when SquashCocoa flushes its queue of occurrences, so that uploads
+ happen when they can succeed and back off when the host is struggling.
+
+ The scheduler watches the Squash host with a `Reachability` notifier and
+ requests a flush whenever the host becomes reachable again, instead of
+ probing it synchronously before each flush.
+
+ When a flush fails because of a server error (5xx), rate limiting (429), or a
+ timeout (no response, or 408), the scheduler waits before the next one. Any
+ other failure means Squash rejected the occurrence itself, and it is not
+ retried. The delay doubles with each
+ consecutive failure, from SCFlushScheduler::minimumRetryInterval up to
+ SCFlushScheduler::maximumRetryInterval, and each device waits a random 50 to
+ 100% of it so that a fleet does not retry in lockstep. A `Retry-After` from
+ the server is honored if it asks for longer. The backoff state is saved to
+ disk, so relaunching the app does not reset it.
+ */
+@interface SCFlushScheduler : NSObject {
+    NSString *statePath;
+    void (^flushHandler)(void);
+    NSTimeInterval minimumRetryInterval;
+    NSTimeInterval maximumRetryInterval;
+    Reachability *reachability;
+    BOOL reachable;
+    NSUInteger failures;
+    NSDate *nextAttemptDate;
+    BOOL failedDuringFlush;
+    NSTimeInterval retryAfter;
+    NSUInteger timerGeneration;
+}
+
+#pragma mark Properties
+
+/*! The delay after the first failed flush. */
+@property (assign) NSTimeInterval minimumRetryInterval;
+
+/*! The longest delay between failed flushes. */
+@property (assign) NSTimeInterval maximumRetryInterval;
+
+/*! The earliest time the next flush may start, or `nil` if it may start now. */
+@property (readonly) NSDate *nextAttemptDate;
+
+#pragma mark Initializers
+
+/*!
+ Creates a scheduler.
+ @param path The file the backoff state is persisted in.
+ @param handler Called on a background thread whenever a flush should start.
+ @return The initialized instance.
+ */
+- (id) initWithStatePath:(NSString *)path flushHandler:(void (^)(void))handler;
+
+#pragma mark Monitoring
+
+/*!
+ Starts watching a host, replacing any host watched before. Change
+ notifications are delivered on the main run loop.
+ @param hostName The host to watch.
+ */
+- (void) startMonitoringHost:(NSString *)hostName;
+
+#pragma mark Scheduling
+
+/*!
+ Returns whether a flush may start now: the host is not known to be
+ unreachable, and no backoff is in effect.
+ @return Whether to flush.
+ */
+- (BOOL) shouldFlush;
+
+/*!
+ Records the outcome of one upload in the current flush.
+ @param statusCode The HTTP status code, or 0 if no response was received.
+ @param retryAfterInterval The server's `Retry-After`, in seconds, or 0.
+ @return Whether the failure means the rest of the flush should be abandoned.
+ If `NO` for a failed upload, Squash rejected the occurrence itself, and it
+ should be removed from the queue rather than retried.
+ */
+- (BOOL) recordUploadWithStatusCode:(NSInteger)statusCode retryAfter:(NSTimeInterval)retryAfterInterval;
+
+/*!
+ Finishes a flush: resets the backoff if it went well, or extends it and
+ schedules the next attempt if it didn't.
+ */
+- (void) flushDidFinish;
+
+@end
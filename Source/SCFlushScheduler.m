@@ -0,0 +1,171 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCFlushScheduler.h"
+#import "Reachability.h"
+
+@interface SCFlushScheduler (Private)
+
+- (void) reachabilityChanged:(NSNotification *)notification;
+- (void) scheduleFlushAfter:(NSTimeInterval)delay;
+- (void) saveState;
+
+@end
+
+#pragma mark -
+
+@implementation SCFlushScheduler
+
+#pragma mark Properties
+
+@synthesize minimumRetryInterval;
+@synthesize maximumRetryInterval;
+
+- (NSDate *) nextAttemptDate {
+    @synchronized(self) {
+        return [[nextAttemptDate retain] autorelease];
+    }
+}
+
+#pragma mark Initializers
+
+- (id) initWithStatePath:(NSString *)path flushHandler:(void (^)(void))handler {
+    if (self = [super init]) {
+        statePath = [path copy];
+        flushHandler = [handler copy];
+        minimumRetryInterval = 30;
+        maximumRetryInterval = 60*60;
+        reachable = YES;
+
+        NSDictionary *state = [NSDictionary dictionaryWithContentsOfFile:statePath];
+        failures = [[state objectForKey:@"failures"] unsignedIntegerValue];
+        nextAttemptDate = [[state objectForKey:@"nextAttemptDate"] retain];
+        if ([nextAttemptDate timeIntervalSinceNow] > 0)
+            [self scheduleFlushAfter:[nextAttemptDate timeIntervalSinceNow]];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [reachability stopNotifier];
+    [reachability release];
+    [statePath release];
+    [flushHandler release];
+    [nextAttemptDate release];
+    [super dealloc];
+}
+
+#pragma mark Monitoring
+
+- (void) startMonitoringHost:(NSString *)hostName {
+    // Reachability delivers its callbacks on the run loop it was scheduled
+    // on, so it lives on the main one
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (reachability) {
+            [[NSNotificationCenter defaultCenter] removeObserver:self name:kReachabilityChangedNotification object:reachability];
+            [reachability stopNotifier];
+            [reachability release];
+        }
+        reachability = [[Reachability reachabilityWithHostName:hostName] retain];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(reachabilityChanged:) name:kReachabilityChangedNotification object:reachability];
+        [reachability startNotifier];
+    });
+}
+
+#pragma mark Scheduling
+
+- (BOOL) shouldFlush {
+    @synchronized(self) {
+        if (!reachable) return NO;
+        return !nextAttemptDate || [nextAttemptDate timeIntervalSinceNow] <= 0;
+    }
+}
+
+- (BOOL) recordUploadWithStatusCode:(NSInteger)statusCode retryAfter:(NSTimeInterval)retryAfterInterval {
+    // other 4xx responses mean the occurrence itself was rejected; retrying
+    // sooner or later won't change that
+    if (statusCode != 0 && statusCode != 408 && statusCode != 429 && statusCode/100 != 5) return NO;
+
+    @synchronized(self) {
+        failedDuringFlush = YES;
+        retryAfter = MAX(retryAfter, retryAfterInterval);
+    }
+    return YES;
+}
+
+- (void) flushDidFinish {
+    NSTimeInterval delay = 0;
+    @synchronized(self) {
+        if (!failedDuringFlush) {
+            failures = 0;
+            [nextAttemptDate release];
+            nextAttemptDate = nil;
+        } else {
+            failures++;
+            double backoff = minimumRetryInterval * pow(2, MIN(failures - 1, (NSUInteger)30));
+            backoff = MIN(backoff, maximumRetryInterval);
+            delay = backoff * (0.5 + 0.5 * ((double)arc4random() / UINT32_MAX));
+            delay = MAX(delay, retryAfter);
+
+            [nextAttemptDate release];
+            nextAttemptDate = [[NSDate alloc] initWithTimeIntervalSinceNow:delay];
+        }
+        failedDuringFlush = NO;
+        retryAfter = 0;
+        [self saveState];
+    }
+    if (delay > 0) [self scheduleFlushAfter:delay];
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCFlushScheduler (Private)
+
+- (void) reachabilityChanged:(NSNotification *)notification {
+    BOOL nowReachable = ([[notification object] currentReachabilityStatus] != NotReachable);
+    BOOL becameReachable;
+    @synchronized(self) {
+        becameReachable = (nowReachable && !reachable);
+        reachable = nowReachable;
+    }
+    if (becameReachable && [self shouldFlush])
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), flushHandler);
+}
+
+- (void) scheduleFlushAfter:(NSTimeInterval)delay {
+    // only the most recently scheduled attempt fires
+    NSUInteger generation;
+    @synchronized(self) {
+        generation = ++timerGeneration;
+    }
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        BOOL current;
+        @synchronized(self) {
+            current = (generation == timerGeneration);
+        }
+        if (current) flushHandler();
+    });
+}
+
+// must be called while synchronized
+- (void) saveState {
+    NSMutableDictionary *state = [NSMutableDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInteger:failures] forKey:@"failures"];
+    if (nextAttemptDate) [state setObject:nextAttemptDate forKey:@"nextAttemptDate"];
+    [state writeToFile:statePath atomically:YES];
+}
+
+@end
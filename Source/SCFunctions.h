@@ -12,28 +12,94 @@
 //    See the License for the specific language governing permissions and
 //    limitations under the License.
 
+#import "SquashCocoa.h"
+
 /*!
  Squash's exception handler. When hooked, this function becomes the uncaught
- exception handler. Sends the exception to SquashCocoa::recordException:.
+ exception handler. Sends the exception to
+ SquashCocoa::recordUncaughtException:, which records it as fatal without
+ sampling, rate limiting, or coalescing it.
  */
 void SCHandleException(NSException *exception);
 
+/*! Identifies a file written by SCHandleSignal. */
+#define SCSignalRecordMagic 0x53435347
+
+/*! The current version of the SCSignalRecord layout. */
+#define SCSignalRecordVersion 1
+
+/*! The maximum number of return addresses captured by SCHandleSignal. */
+#define SCSignalRecordMaximumFrames 128
+
+/*!
+ The raw record SCHandleSignal writes when a signal is trapped. It is a fixed
+ size so that it can live in preallocated storage and be written with a single
+ `write(2)`; SquashCocoa::reportErrors turns it into an SCOccurrence on the next
+ launch.
+ */
+typedef struct {
+    /*! Always SCSignalRecordMagic. */
+    uint32_t magic;
+    /*! The layout version (SCSignalRecordVersion). */
+    uint32_t version;
+    /*! The trapped signal number. */
+    int32_t signal;
+    /*! The number of valid entries in `frames`. */
+    uint32_t frameCount;
+    /*! The time of the trap, in seconds since the epoch. */
+    int64_t timestamp;
+    /*! The call stack return addresses, innermost first. */
+    uint64_t frames[SCSignalRecordMaximumFrames];
+} SCSignalRecord;
+
+/*!
+ Squash's signal handler. SCInstallSignalHandlers installs it for each of
+ SquashCocoa::handledSignals. It is async-signal-safe: it never allocates or
+ calls into Objective-C, but unwinds the stack into preallocated storage and
+ writes a raw SCSignalRecord to the path given to SCPrepareSignalCapture. Only
+ the first thread to fault writes a record. Then it calls the handler it
+ replaced (PLCrashReporter's), restores the default disposition, and re-raises
+ the signal.
+ @param signal The trapped signal.
+ @param info Details of the signal, passed on to the replaced handler.
+ @param context The interrupted thread's context, passed on to the replaced
+ handler.
+ */
+void SCHandleSignal(int signal, siginfo_t *info, void *context);
+
+/*!
+ Prepares SCHandleSignal for use by choosing, ahead of time, the file it will
+ write its record to, and by calling `backtrace(3)` once so that it is already
+ bound when the handler runs. Called by SquashCocoa::hook. Must not be called
+ from a signal handler.
+ @param path The file SCHandleSignal will create if a signal is trapped.
+ */
+void SCPrepareSignalCapture(NSString *path);
+
 /*!
- Squash's signal handler. When hooked, this function becomes the default signal
- handler. Sends the signal to SquashCocoa::recordSignal:backtraces:.
+ Installs SCHandleSignal for each of the given signals, saving the handlers it
+ replaces so that SCHandleSignal can chain to them. Called by SquashCocoa::hook
+ after PLCrashReporter installs its own handlers.
+ @param signals The signals to trap (`NSNumber`s).
  */
-void SCHandleSignal(int signal);
+void SCInstallSignalHandlers(NSSet *signals);
 
 /*!
  Serializes any `NSObject` subclass into an `NSDictionary` appropriate for
  transmitting to the Squash host. The dictionary includes various serialized
  representations of the object, including `description`, `NSKeyedArchiver`, and
- JSON (if able).
+ JSON (if able), as selected by SquashCocoa::userDataRepresentations.
  
  Some objects can already be transmitted to Squash without further serialization
  (for example, `NSString` or `NSNumber`. These objects are returned unmodified
  by this function.
  
+ The work is bounded by SquashCocoa::maximumUserDataBytes,
+ SquashCocoa::maximumUserDataDepth, SquashCocoa::maximumUserDataCount, and
+ SquashCocoa::userDataTimeBudget. Whatever doesn't fit is truncated or replaced
+ with a marker (a `truncated` key, or a string beginning "(truncated:"), as are
+ reference cycles. An object reached more than once is only serialized once.
+ 
  This function can serialize `nil`, but no other primitives.
  
  @param object The object to prepare for transmission.
@@ -44,7 +110,39 @@ id SCValueify(id object);
 
 /*!
  Returns the Mach-O executable UUID, which is equal to the UUID used to identify
- the symbolication data for this build.
+ the symbolication data for this build. The load commands are only walked on
+ the first call.
  @return The UUID for this build.
  */
 NSString *SCExecutableUUID(void);
+
+/*!
+ Compresses data using an HTTP content coding.
+ @param data The data to compress.
+ @param compression The content coding to apply.
+ @return The compressed data, or `data` itself if `compression` is
+ `SCCompressionNone` or the data could not be compressed.
+ */
+NSData *SCCompressData(NSData *data, SCCompression compression);
+
+/*!
+ Returns the `Content-Encoding` header value for a content coding.
+ @param compression The content coding.
+ @return The header value, or `nil` for `SCCompressionNone`.
+ */
+NSString *SCContentEncoding(SCCompression compression);
+
+/*!
+ Formats a date as an ISO 8601 timestamp, using a formatter that is created
+ once and shared between threads.
+ @param date The date to format.
+ @return The formatted date and time.
+ */
+NSString *SCISO8601StringFromDate(NSDate *date);
+
+/*!
+ Returns whether a debugger is attached to the process, in which case stalls
+ and abrupt terminations are expected and not worth reporting.
+ @return Whether the process is being traced.
+ */
+BOOL SCDebuggerAttached(void);
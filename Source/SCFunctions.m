@@ -14,116 +14,428 @@
 
 #import "SCFunctions.h"
 #import "SquashCocoa.h"
+#import "ISO8601DateFormatter.h"
+#import "SCJSONWriter.h"
+#import "SCSessionState.h"
+#import "SCConfiguration.h"
 #import <mach-o/ldsyms.h>
+#import <libkern/OSAtomic.h>
+#import <zlib.h>
+#import <execinfo.h>
+#import <fcntl.h>
+#import <sys/sysctl.h>
 
-static id SCValueifyNested(id object);
+// Preallocated so that SCHandleSignal never has to allocate.
+static char SCSignalRecordPath[PATH_MAX];
+static SCSignalRecord SCSignalRecordArena;
+static void *SCSignalFrameArena[SCSignalRecordMaximumFrames];
+// Claimed by the first thread to fault, so that a second one can't overwrite
+// the arenas while the record is being written.
+static volatile int32_t SCSignalRecordClaimed = 0;
+// The handlers SCInstallSignalHandlers replaced (usually PLCrashReporter's),
+// chained to once the record is written.
+static struct sigaction SCPreviousSignalActions[NSIG];
+
+// Limits shared by everything serialized during one SCValueify call.
+typedef struct {
+    NSUInteger bytesRemaining;
+    NSUInteger maximumDepth;
+    NSUInteger maximumCount;
+    CFAbsoluteTime deadline;
+    SCValueRepresentation representations;
+    CFMutableDictionaryRef memo;
+    CFMutableSetRef visiting;
+    NSSet *filterKeys;
+} SCValueifyBudget;
+
+static id SCValueifyWithBudget(id object, NSUInteger depth, SCValueifyBudget *budget);
 static BOOL SCDictionaryKeysAllStrings(NSDictionary *dictionary);
-static NSDictionary *SCCreateValueRepresentation(id object);
+static NSDictionary *SCCreateValueRepresentation(id object, NSUInteger depth, SCValueifyBudget *budget);
+static id SCBoundedJSONObject(id object, NSUInteger depth, BOOL root, SCValueifyBudget *budget, BOOL *valid);
+static NSString *SCValueifyBudgetExhausted(SCValueifyBudget *budget);
+static void SCChargeBudget(SCValueifyBudget *budget, NSUInteger bytes);
+static NSString *SCTruncateString(NSString *string, SCValueifyBudget *budget);
+static NSDictionary *SCValueifyMarker(id object, NSString *reason);
 
 void SCHandleException(NSException *exception) {
     //[[SquashCocoa sharedClient] unhook];
-    [[SquashCocoa sharedClient] recordException:exception];
+    SCSessionStateSetFlags(SCSessionCrashed, YES);
+    [[SquashCocoa sharedClient] recordUncaughtException:exception];
 }
 
-void SCHandleSignal(int signal) {
-    //[[SquashCocoa sharedClient] unhook];
-    NSArray *addresses = [NSThread callStackReturnAddresses];
-    [[SquashCocoa sharedClient] recordSignal:signal addresses:addresses];
-    
+void SCHandleSignal(int signal, siginfo_t *info, void *context) {
+    SCSessionStateSetFlags(SCSessionCrashed, YES);
+    if (SCSignalRecordPath[0] != '\0' && OSAtomicCompareAndSwap32Barrier(0, 1, &SCSignalRecordClaimed)) {
+        // backtrace() walks frame pointers into the caller's buffer without
+        // allocating, unlike +[NSThread callStackReturnAddresses]
+        int count = backtrace(SCSignalFrameArena, SCSignalRecordMaximumFrames);
+        SCSignalRecordArena.magic = SCSignalRecordMagic;
+        SCSignalRecordArena.version = SCSignalRecordVersion;
+        SCSignalRecordArena.signal = signal;
+        SCSignalRecordArena.timestamp = time(NULL);
+        SCSignalRecordArena.frameCount = (count > 0) ? (uint32_t)count : 0;
+        for (int idx = 0; idx < count; idx++)
+            SCSignalRecordArena.frames[idx] = (uint64_t)(uintptr_t)SCSignalFrameArena[idx];
+
+        int fd = open(SCSignalRecordPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            write(fd, &SCSignalRecordArena, sizeof(SCSignalRecordArena));
+            close(fd);
+        }
+    }
+
+    // let the handler installed before this one (PLCrashReporter's) record
+    // the signal too
+    const struct sigaction *previous = &SCPreviousSignalActions[signal];
+    if (previous->sa_flags & SA_SIGINFO) {
+        if (previous->sa_sigaction) previous->sa_sigaction(signal, info, context);
+    } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+        previous->sa_handler(signal);
+    }
+
+    // fall through to the default action (usually terminating with a core)
+    // instead of re-entering this handler
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
     raise(signal);
 }
 
+void SCPrepareSignalCapture(NSString *path) {
+    if (![path getFileSystemRepresentation:SCSignalRecordPath maxLength:sizeof(SCSignalRecordPath)])
+        SCSignalRecordPath[0] = '\0';
+    // the first call binds backtrace() and loads what it needs to unwind, so
+    // that none of that happens inside the handler
+    backtrace(SCSignalFrameArena, 1);
+}
+
+void SCInstallSignalHandlers(NSSet *signals) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = SCHandleSignal;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    for (NSNumber *number in signals) {
+        int signal = [number intValue];
+        if (signal <= 0 || signal >= NSIG) continue;
+        struct sigaction previous;
+        if (sigaction(signal, &action, &previous) != 0) continue;
+        // hooking twice must not chain this handler to itself
+        if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction == SCHandleSignal) continue;
+        SCPreviousSignalActions[signal] = previous;
+    }
+}
+
 id SCValueify(id object) {
+    SquashCocoa *client = [SquashCocoa sharedClient];
+    SCValueifyBudget budget;
+    budget.bytesRemaining = client.maximumUserDataBytes;
+    budget.maximumDepth = client.maximumUserDataDepth;
+    budget.maximumCount = client.maximumUserDataCount;
+    budget.deadline = CFAbsoluteTimeGetCurrent() + client.userDataTimeBudget;
+    budget.representations = client.userDataRepresentations;
+    // one snapshot for the whole graph, kept alive by the autorelease pool
+    budget.filterKeys = client.configuration.filterUserInfoKeys;
+    // both tables compare objects by identity and don't retain their keys; the
+    // objects are kept alive by the graph being serialized
+    budget.memo = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+    budget.visiting = CFSetCreateMutable(NULL, 0, NULL);
+
+    id value = [SCValueifyWithBudget(object, 0, &budget) retain];
+
+    CFRelease(budget.memo);
+    CFRelease(budget.visiting);
+    return [value autorelease];
+}
+
+static id SCValueifyWithBudget(id object, NSUInteger depth, SCValueifyBudget *budget) {
     if (object == NULL)
         return [NSDictionary dictionaryWithObjectsAndKeys:
                 @"objc", @"language",
                 @"NULL", @"description",
                 NULL];
-    // we need to wrap the object in an array because isValidJSONObject: only
-    // returns true for valid TOP-LEVEL JSON objects (i.e., hashes and arrays)
-    else if (![object isKindOfClass:[NSArray class]] &&
-             ![object isKindOfClass:[NSDictionary class]] &&
-             [NSJSONSerialization isValidJSONObject:[NSArray arrayWithObject:object]])
+
+    NSString *reason = SCValueifyBudgetExhausted(budget);
+    if (reason) return SCValueifyMarker(object, reason);
+
+    if ([object isKindOfClass:[NSString class]])
+        return SCTruncateString(object, budget);
+    if ([object isKindOfClass:[NSNull class]] ||
+        ([object isKindOfClass:[NSNumber class]] && (!CFNumberIsFloatType((CFNumberRef)object) || isfinite([object doubleValue])))) {
+        SCChargeBudget(budget, sizeof(double));
         return object;
-    else if ([object isKindOfClass:[NSDictionary class]] && SCDictionaryKeysAllStrings(object)) {
-        NSMutableDictionary *valueifiedDictionary = [[NSMutableDictionary alloc] initWithCapacity:[object count]];
+    }
+
+    id memoized = (id)CFDictionaryGetValue(budget->memo, object);
+    if (memoized) return memoized;
+    if (CFSetContainsValue(budget->visiting, object)) return SCValueifyMarker(object, @"cycle");
+
+    id result;
+    CFSetAddValue(budget->visiting, object);
+    if (depth == 0 && [object isKindOfClass:[NSDictionary class]] && SCDictionaryKeysAllStrings(object)) {
+        NSMutableDictionary *valueifiedDictionary = [[NSMutableDictionary alloc] initWithCapacity:MIN([object count], budget->maximumCount)];
+        NSUInteger count = 0;
         for (NSString *key in object) {
-            if ([[SquashCocoa sharedClient].filterUserInfoKeys containsObject:key]) continue;
-            [valueifiedDictionary setObject:SCValueifyNested([object objectForKey:key]) forKey:key];
+            if ([budget->filterKeys containsObject:key]) continue;
+            if (count++ >= budget->maximumCount) {
+                [valueifiedDictionary setObject:[NSString stringWithFormat:@"(truncated: %lu more entries)", (unsigned long)([object count] - budget->maximumCount)]
+                                         forKey:@"_TRUNCATED_"];
+                break;
+            }
+            SCChargeBudget(budget, [key length]);
+            [valueifiedDictionary setObject:SCValueifyWithBudget([object objectForKey:key], depth + 1, budget) forKey:key];
         }
-        return [valueifiedDictionary autorelease];
+        result = [valueifiedDictionary autorelease];
+    } else {
+        result = SCCreateValueRepresentation(object, depth, budget);
     }
-    else
-        return SCCreateValueRepresentation(object);
-}
+    CFSetRemoveValue(budget->visiting, object);
 
-id SCValueifyNested(id object) {
-    if (object == NULL)
-        return [NSDictionary dictionaryWithObjectsAndKeys:
-                @"objc", @"language",
-                @"NULL", @"description",
-                NULL];
-    // we need to wrap the object in an array because isValidJSONObject: only
-    // returns true for valid TOP-LEVEL JSON objects (i.e., hashes and arrays)
-    else if (![object isKindOfClass:[NSArray class]] &&
-             ![object isKindOfClass:[NSDictionary class]] &&
-             [NSJSONSerialization isValidJSONObject:[NSArray arrayWithObject:object]])
-        return object;
-    else
-        return SCCreateValueRepresentation(object);
+    CFDictionarySetValue(budget->memo, object, result);
+    return result;
 }
 
-BOOL SCDictionaryKeysAllStrings(NSDictionary *dictionary) {
+static BOOL SCDictionaryKeysAllStrings(NSDictionary *dictionary) {
     for (id key in dictionary)
-        if ([key isKindOfClass:[NSString class]]) return YES;
-    return NO;
+        if (![key isKindOfClass:[NSString class]]) return NO;
+    return YES;
 }
 
-static NSDictionary *SCCreateValueRepresentation(id object) {
-    NSMutableDictionary *representation = [[NSMutableDictionary alloc] initWithCapacity:3];
+static NSDictionary *SCCreateValueRepresentation(id object, NSUInteger depth, SCValueifyBudget *budget) {
+    NSMutableDictionary *representation = [[NSMutableDictionary alloc] initWithCapacity:4];
     [representation setObject:@"objc" forKey:@"language"];
-    [representation setObject:[object description] forKey:@"description"];
     if ([object respondsToSelector:@selector(class)])
         [representation setObject:NSStringFromClass([object class]) forKey:@"class_name"];
     else
         [representation setObject:@"(native C type)" forKey:@"class_name"];
-        
-    if ([object conformsToProtocol:@protocol(NSCoding)]) {
-        NSMutableData *encoded = [[NSMutableData alloc] init];
-        NSKeyedArchiver *archiver = [[NSKeyedArchiver alloc] initForWritingWithMutableData:encoded];
-        [archiver setOutputFormat:NSPropertyListXMLFormat_v1_0];
-        [archiver encodeRootObject:object];
-        [archiver finishEncoding];
-        [archiver release];
-        NSString *string = [[NSString alloc] initWithData:encoded encoding:NSUTF8StringEncoding];
-        [encoded release];
-        [representation setObject:string forKey:@"keyed_archiver"];
-        [string release];
+
+    // describing or archiving a huge collection costs as much as the
+    // collection is big, so those representations are skipped outright
+    BOOL oversized = ([object respondsToSelector:@selector(count)] && [object count] > budget->maximumCount);
+
+    if (budget->representations & SCValueRepresentationDescription) {
+        NSString *description;
+        if (oversized)
+            description = [NSString stringWithFormat:@"<%@: %lu elements>", NSStringFromClass([object class]), (unsigned long)[object count]];
+        else
+            description = [object description];
+        [representation setObject:SCTruncateString(description, budget) forKey:@"description"];
+    }
+
+    if ((budget->representations & SCValueRepresentationKeyedArchiver) &&
+        [object conformsToProtocol:@protocol(NSCoding)] &&
+        !SCValueifyBudgetExhausted(budget)) {
+        if (oversized) {
+            [representation setObject:@"(omitted: too many elements)" forKey:@"keyed_archiver"];
+        } else {
+            NSMutableData *encoded = [[NSMutableData alloc] init];
+            NSKeyedArchiver *archiver = [[NSKeyedArchiver alloc] initForWritingWithMutableData:encoded];
+            [archiver setOutputFormat:NSPropertyListXMLFormat_v1_0];
+            [archiver encodeRootObject:object];
+            [archiver finishEncoding];
+            [archiver release];
+            // a truncated archive can't be decoded, so it's all or nothing
+            if ([encoded length] > budget->bytesRemaining) {
+                [representation setObject:[NSString stringWithFormat:@"(omitted: %lu bytes over budget)", (unsigned long)([encoded length] - budget->bytesRemaining)]
+                                   forKey:@"keyed_archiver"];
+            } else {
+                NSString *string = [[NSString alloc] initWithData:encoded encoding:NSUTF8StringEncoding];
+                if (string) [representation setObject:string forKey:@"keyed_archiver"];
+                [string release];
+                SCChargeBudget(budget, [encoded length]);
+            }
+            [encoded release];
+        }
     }
-    if ([NSJSONSerialization isValidJSONObject:object]) {
-        NSData *data = [NSJSONSerialization dataWithJSONObject:object options:0 error:NULL];
-        NSString *string = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-        if (data) [representation setObject:string forKey:@"json"];
-        [string release];
+
+    if ((budget->representations & SCValueRepresentationJSON) &&
+        ([object isKindOfClass:[NSArray class]] || [object isKindOfClass:[NSDictionary class]])) {
+        BOOL valid = YES;
+        id bounded = SCBoundedJSONObject(object, depth, YES, budget, &valid);
+        if (valid) {
+            SCJSONWriter *writer = [[SCJSONWriter alloc] init];
+            [writer writeObject:bounded];
+            NSString *string = [[NSString alloc] initWithData:[writer data] encoding:NSUTF8StringEncoding];
+            if (string) [representation setObject:string forKey:@"json"];
+            [string release];
+            [writer release];
+        }
     }
     return [representation autorelease];
 }
 
+static id SCBoundedJSONObject(id object, NSUInteger depth, BOOL root, SCValueifyBudget *budget, BOOL *valid) {
+    NSString *reason = SCValueifyBudgetExhausted(budget);
+    if (reason) return [NSString stringWithFormat:@"(truncated: %@)", reason];
+
+    if ([object isKindOfClass:[NSString class]])
+        return SCTruncateString(object, budget);
+    if ([object isKindOfClass:[NSNull class]]) {
+        SCChargeBudget(budget, 4);
+        return object;
+    }
+    if ([object isKindOfClass:[NSNumber class]]) {
+        if (CFNumberIsFloatType((CFNumberRef)object) && !isfinite([object doubleValue])) *valid = NO;
+        SCChargeBudget(budget, sizeof(double));
+        return object;
+    }
+
+    BOOL isArray = [object isKindOfClass:[NSArray class]];
+    if (!isArray && ![object isKindOfClass:[NSDictionary class]]) {
+        *valid = NO;
+        return nil;
+    }
+    if (depth >= budget->maximumDepth) return @"(truncated: depth)";
+    // the root is already being visited by SCValueifyWithBudget
+    if (!root && CFSetContainsValue(budget->visiting, object)) return @"(truncated: cycle)";
+
+    if (!root) CFSetAddValue(budget->visiting, object);
+    id result;
+    NSUInteger count = 0;
+    if (isArray) {
+        NSMutableArray *array = [NSMutableArray arrayWithCapacity:MIN([object count], budget->maximumCount)];
+        for (id element in object) {
+            if (count++ >= budget->maximumCount) {
+                [array addObject:[NSString stringWithFormat:@"(truncated: %lu more elements)", (unsigned long)([object count] - budget->maximumCount)]];
+                break;
+            }
+            id value = SCBoundedJSONObject(element, depth + 1, NO, budget, valid);
+            if (!*valid) break;
+            [array addObject:value];
+        }
+        result = array;
+    } else {
+        NSMutableDictionary *dictionary = [NSMutableDictionary dictionaryWithCapacity:MIN([object count], budget->maximumCount)];
+        for (id key in object) {
+            if (![key isKindOfClass:[NSString class]]) {
+                *valid = NO;
+                break;
+            }
+            if (count++ >= budget->maximumCount) {
+                [dictionary setObject:[NSString stringWithFormat:@"(truncated: %lu more entries)", (unsigned long)([object count] - budget->maximumCount)]
+                               forKey:@"_TRUNCATED_"];
+                break;
+            }
+            SCChargeBudget(budget, [key length]);
+            id value = SCBoundedJSONObject([object objectForKey:key], depth + 1, NO, budget, valid);
+            if (!*valid) break;
+            [dictionary setObject:value forKey:key];
+        }
+        result = dictionary;
+    }
+    if (!root) CFSetRemoveValue(budget->visiting, object);
+    return result;
+}
+
+static NSString *SCValueifyBudgetExhausted(SCValueifyBudget *budget) {
+    if (budget->bytesRemaining == 0) return @"size";
+    if (CFAbsoluteTimeGetCurrent() > budget->deadline) return @"time";
+    return nil;
+}
+
+static void SCChargeBudget(SCValueifyBudget *budget, NSUInteger bytes) {
+    budget->bytesRemaining = (bytes < budget->bytesRemaining) ? budget->bytesRemaining - bytes : 0;
+}
+
+static NSString *SCTruncateString(NSString *string, SCValueifyBudget *budget) {
+    // strings are measured in UTF-16 units, which is close enough to their
+    // UTF-8 size for budgeting and doesn't require transcoding
+    NSUInteger length = [string length];
+    if (length <= budget->bytesRemaining) {
+        SCChargeBudget(budget, length);
+        return string;
+    }
+    NSUInteger keep = budget->bytesRemaining;
+    if (keep > 0) keep = [string rangeOfComposedCharacterSequenceAtIndex:keep].location;
+    budget->bytesRemaining = 0;
+    return [NSString stringWithFormat:@"%@... (truncated: %lu more characters)", [string substringToIndex:keep], (unsigned long)(length - keep)];
+}
+
+static NSDictionary *SCValueifyMarker(id object, NSString *reason) {
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            @"objc", @"language",
+            NSStringFromClass([object class]), @"class_name",
+            reason, @"truncated",
+            NULL];
+}
+
 // http://stackoverflow.com/questions/10119700/how-to-get-mach-o-uuid-of-a-running-process
 NSString *SCExecutableUUID(void) {
-    const uint8_t *command = (const uint8_t *)(&_mh_execute_header + 1);
-    for (uint32_t idx = 0; idx < _mh_execute_header.ncmds; ++idx) {
-        if (((const struct load_command *)command)->cmd == LC_UUID) {
-            command += sizeof(struct load_command);
-            return [NSString stringWithFormat:@"%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
-                    command[0], command[1], command[2], command[3],
-                    command[4], command[5],
-                    command[6], command[7],
-                    command[8], command[9],
-                    command[10], command[11], command[12], command[13], command[14], command[15]];
-        } else {
-            command += ((const struct load_command *)command)->cmdsize;
+    static NSString *executableUUID = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        const uint8_t *command = (const uint8_t *)(&_mh_execute_header + 1);
+        for (uint32_t idx = 0; idx < _mh_execute_header.ncmds; ++idx) {
+            if (((const struct load_command *)command)->cmd == LC_UUID) {
+                command += sizeof(struct load_command);
+                executableUUID = [[NSString alloc] initWithFormat:@"%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+                                  command[0], command[1], command[2], command[3],
+                                  command[4], command[5],
+                                  command[6], command[7],
+                                  command[8], command[9],
+                                  command[10], command[11], command[12], command[13], command[14], command[15]];
+                break;
+            } else {
+                command += ((const struct load_command *)command)->cmdsize;
+            }
         }
+    });
+    return executableUUID;
+}
+
+NSData *SCCompressData(NSData *data, SCCompression compression) {
+    if (compression == SCCompressionNone || [data length] == 0) return data;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits of 15 produces a zlib stream (HTTP "deflate"); adding 16
+    // produces a gzip stream instead
+    int windowBits = (compression == SCCompressionGzip) ? 15 + 16 : 15;
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return data;
+
+    NSMutableData *compressed = [NSMutableData dataWithLength:deflateBound(&stream, [data length])];
+    stream.next_in = (Bytef *)[data bytes];
+    stream.avail_in = (uInt)[data length];
+    stream.next_out = [compressed mutableBytes];
+    stream.avail_out = (uInt)[compressed length];
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) return data;
+
+    [compressed setLength:stream.total_out];
+    return compressed;
+}
+
+NSString *SCContentEncoding(SCCompression compression) {
+    switch (compression) {
+        case SCCompressionGzip: return @"gzip";
+        case SCCompressionDeflate: return @"deflate";
+        default: return nil;
     }
-    return nil;
+}
+
+NSString *SCISO8601StringFromDate(NSDate *date) {
+    static ISO8601DateFormatter *formatter = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        formatter = [[ISO8601DateFormatter alloc] init];
+        formatter.includeTime = YES;
+    });
+    // ISO8601DateFormatter keeps mutable state while formatting
+    @synchronized(formatter) {
+        return [formatter stringFromDate:date];
+    }
+}
+
+BOOL SCDebuggerAttached(void) {
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    int name[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid() };
+    memset(&info, 0, sizeof(info));
+    if (sysctl(name, 4, &info, &size, NULL, 0) != 0) return NO;
+    return (info.kp_proc.p_flag & P_TRACED) != 0;
 }
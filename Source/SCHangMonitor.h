@@ -0,0 +1,99 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <mach/mach.h>
+
+@class SCOccurrence;
+
+/*! The SCOccurrence::exceptionClassName of a main-thread stall. */
+#define SCHangClassName @"Hang"
+
+/*! The most samples of the main thread recorded in one hang occurrence. */
+#define SCHangMaximumSamples 8
+
+/*!
+ Watches for stalls of the main thread, which show up to users as frozen UI and
+ often end with the system killing the app.
+
+ A watchdog timer on a background queue posts a trivial block to the main queue
+ every SCHangMonitor::pingInterval. If the block has not run after
+ SCHangMonitor::threshold seconds, the main thread is sampled (see
+ SCThreadSnapshotAppendThread) and an SCOccurrence with the class name
+ SCHangClassName is handed to the hang handler, which should journal it right
+ away so that it survives the app being killed mid-hang. While the stall goes
+ on, the main thread is sampled again every SCHangMonitor::threshold seconds
+ (up to SCHangMaximumSamples times), and the samples and the growing duration
+ are journaled as updates to the same occurrence. Until the stall ends, the
+ occurrence must not be uploaded (see SCHangMonitor::performWithHangInProgress:),
+ or the updates journaled after it would be lost.
+
+ Stalls are not reported while a debugger is attached. If the watchdog itself
+ wakes up much later than scheduled, the whole process was suspended (for
+ instance in the background), and the pending ping is discarded.
+ */
+@interface SCHangMonitor : NSObject {
+    NSTimeInterval threshold;
+    NSTimeInterval pingInterval;
+    void (^hangHandler)(SCOccurrence *hang);
+    dispatch_queue_t queue;
+    dispatch_source_t timer;
+    thread_t mainThread;
+    uint64_t lastTick;
+    uint64_t pingSentAt;
+    SCOccurrence *currentHang;
+    NSString *hangUUID;
+    NSUInteger sampleCount;
+    uint64_t lastSampleAt;
+}
+
+#pragma mark Properties
+
+/*! How long the main thread must be unresponsive to count as a hang. */
+@property (assign) NSTimeInterval threshold;
+
+/*!
+ How often the main thread is pinged. Changes take effect the next time the
+ monitor is started.
+ */
+@property (assign) NSTimeInterval pingInterval;
+
+/*! Whether the monitor is running. */
+@property (readonly, getter = isRunning) BOOL running;
+
+#pragma mark Initializers
+
+/*!
+ Creates a monitor, which does nothing until started.
+ @param handler Called on the watchdog queue with each new hang occurrence.
+ @return The initialized instance.
+ */
+- (id) initWithHangHandler:(void (^)(SCOccurrence *hang))handler;
+
+#pragma mark Monitoring
+
+/*! Starts pinging the main thread. Does nothing if already running. */
+- (void) start;
+
+/*! Stops pinging the main thread. */
+- (void) stop;
+
+/*!
+ Runs a block while no hang can begin or end.
+ @param block Called with the SCOccurrence::UUID of the hang that is still
+ being updated, or `nil` if there is none.
+ */
+- (void) performWithHangInProgress:(void (^)(NSString *hangUUID))block;
+
+@end
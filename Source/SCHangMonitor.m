@@ -0,0 +1,218 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import "SCHangMonitor.h"
+#import "SCOccurrence.h"
+#import "SCBacktrace.h"
+#import "SCThreadSnapshot.h"
+#import "SCFunctions.h"
+#import "SCSessionState.h"
+#import "SCJournal.h"
+#import <pthread.h>
+
+static uint64_t SCSecondsToAbsolute(NSTimeInterval seconds);
+static NSTimeInterval SCAbsoluteToSeconds(uint64_t absolute);
+
+@interface SCHangMonitor (Private)
+
+- (void) tick;
+- (void) mainThreadRespondedToPingSentAt:(uint64_t)sentAt;
+- (void) beginHangAt:(uint64_t)now;
+- (void) sampleHangAt:(uint64_t)now;
+- (void) endHangAt:(uint64_t)now;
+
+@end
+
+#pragma mark -
+
+@implementation SCHangMonitor
+
+#pragma mark Properties
+
+@synthesize threshold;
+@synthesize pingInterval;
+
+- (BOOL) isRunning {
+    __block BOOL running;
+    dispatch_sync(queue, ^{ running = (timer != NULL); });
+    return running;
+}
+
+#pragma mark Initializers
+
+- (id) initWithHangHandler:(void (^)(SCOccurrence *hang))handler {
+    if (self = [super init]) {
+        threshold = 2;
+        pingInterval = 0.5;
+        hangHandler = [handler copy];
+        queue = dispatch_queue_create("com.squareup.squash.hang-monitor", DISPATCH_QUEUE_SERIAL);
+        mainThread = MACH_PORT_NULL;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [self stop];
+    [hangHandler release];
+    [currentHang release];
+    [hangUUID release];
+    dispatch_release(queue);
+    [super dealloc];
+}
+
+#pragma mark Monitoring
+
+- (void) start {
+    dispatch_sync(queue, ^{
+        if (timer) return;
+        lastTick = 0;
+        pingSentAt = 0;
+        uint64_t interval = (uint64_t)(self.pingInterval * NSEC_PER_SEC);
+        timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+        dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+        dispatch_source_set_event_handler(timer, ^{ [self tick]; });
+        dispatch_resume(timer);
+    });
+}
+
+- (void) stop {
+    dispatch_sync(queue, ^{
+        if (!timer) return;
+        dispatch_source_cancel(timer);
+        dispatch_release(timer);
+        timer = NULL;
+        if (currentHang) [self endHangAt:mach_absolute_time()];
+        pingSentAt = 0;
+    });
+}
+
+- (void) performWithHangInProgress:(void (^)(NSString *hangUUID))block {
+    @synchronized(self) {
+        block(hangUUID);
+    }
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCHangMonitor (Private)
+
+- (void) tick {
+    uint64_t now = mach_absolute_time();
+
+    // a watchdog that ran far behind schedule was suspended along with the
+    // rest of the process, so the main thread never had a chance to respond
+    if (lastTick && SCAbsoluteToSeconds(now - lastTick) > 3 * self.pingInterval) {
+        lastTick = now;
+        pingSentAt = 0;
+        if (currentHang) [self endHangAt:now];
+        return;
+    }
+    lastTick = now;
+
+    if (!pingSentAt) {
+        uint64_t sentAt = now;
+        pingSentAt = sentAt;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            // pthread_mach_thread_np does not add a port reference
+            thread_t thread = pthread_mach_thread_np(pthread_self());
+            dispatch_async(queue, ^{
+                mainThread = thread;
+                [self mainThreadRespondedToPingSentAt:sentAt];
+            });
+        });
+        return;
+    }
+
+    if (now - pingSentAt < SCSecondsToAbsolute(self.threshold)) return;
+    if (!currentHang) {
+        if (SCDebuggerAttached()) return;
+        [self beginHangAt:now];
+    } else if (sampleCount < SCHangMaximumSamples && now - lastSampleAt >= SCSecondsToAbsolute(self.threshold)) {
+        [self sampleHangAt:now];
+    }
+}
+
+- (void) mainThreadRespondedToPingSentAt:(uint64_t)sentAt {
+    // a late response to a ping that was discarded is ignored
+    if (sentAt != pingSentAt) return;
+    if (currentHang) [self endHangAt:mach_absolute_time()];
+    pingSentAt = 0;
+}
+
+- (void) beginHangAt:(uint64_t)now {
+    // the main thread's port is learned from the first ping it answers
+    if (mainThread == MACH_PORT_NULL) return;
+
+    SCBacktrace *backtrace = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleReturnAddresses];
+    if (!SCThreadSnapshotAppendThread(backtrace, mainThread, @"Main Thread", YES)) {
+        [backtrace release];
+        return;
+    }
+    currentHang = [[SCOccurrence alloc] initWithHangBacktrace:backtrace duration:SCAbsoluteToSeconds(now - pingSentAt)];
+    [backtrace release];
+    sampleCount = 1;
+    lastSampleAt = now;
+    // a termination while this is set is blamed on the watchdog
+    SCSessionStateSetFlags(SCSessionHanging, YES);
+    @synchronized(self) {
+        hangUUID = [currentHang.UUID copy];
+    }
+    hangHandler(currentHang);
+}
+
+- (void) sampleHangAt:(uint64_t)now {
+    NSTimeInterval duration = SCAbsoluteToSeconds(now - pingSentAt);
+    NSString *name = [NSString stringWithFormat:@"Main Thread (after %.1f seconds)", duration];
+    if (!SCThreadSnapshotAppendThread(currentHang.backtraces, mainThread, name, NO)) return;
+    sampleCount++;
+    lastSampleAt = now;
+    currentHang.message = [NSString stringWithFormat:@"Main thread unresponsive for %.1f seconds", duration];
+    [[SCJournal sharedJournal] appendUpdateOfKeys:[NSArray arrayWithObjects:@"backtraces", @"message", NULL] forOccurrence:currentHang];
+}
+
+- (void) endHangAt:(uint64_t)now {
+    currentHang.message = [NSString stringWithFormat:@"Main thread unresponsive for %.1f seconds", SCAbsoluteToSeconds(now - pingSentAt)];
+    // the final update and the release go together, so an upload sees either
+    // the hang in progress or its complete record
+    @synchronized(self) {
+        [[SCJournal sharedJournal] appendUpdateOfKeys:[NSArray arrayWithObject:@"message"] forOccurrence:currentHang];
+        [hangUUID release];
+        hangUUID = nil;
+    }
+    [currentHang release];
+    currentHang = nil;
+    sampleCount = 0;
+    SCSessionStateSetFlags(SCSessionHanging, NO);
+}
+
+@end
+
+#pragma mark -
+
+static uint64_t SCSecondsToAbsolute(NSTimeInterval seconds) {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{ mach_timebase_info(&timebase); });
+    return (uint64_t)(seconds * NSEC_PER_SEC) * timebase.denom / timebase.numer;
+}
+
+static NSTimeInterval SCAbsoluteToSeconds(uint64_t absolute) {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{ mach_timebase_info(&timebase); });
+    return (double)absolute * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
@@ -0,0 +1,131 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*! The maximum nesting depth of arrays and objects an SCJSONWriter accepts. */
+#define SCJSONWriterMaximumDepth 64
+
+/*!
+ A streaming JSON encoder. Values are appended directly to the output as UTF-8
+ text, without first building a Foundation object graph for
+ `NSJSONSerialization`.
+
+ The output is either a growable `NSMutableData` (SCJSONWriter::init) or a
+ fixed, caller-supplied buffer (SCJSONWriter::initWithBuffer:capacity:). A
+ fixed buffer is never written past its capacity; instead the writer sets
+ SCJSONWriter::overflowed and keeps counting SCJSONWriter::length, so the caller
+ can learn how large a buffer it needs.
+
+ Commas and colons are inserted automatically. Inside an object, every value
+ must be preceded by a call to SCJSONWriter::writeKey:.
+ */
+@interface SCJSONWriter : NSObject {
+    NSMutableData *data;
+    char *buffer;
+    NSUInteger capacity;
+    NSUInteger length;
+    BOOL overflowed;
+
+    NSUInteger depth;
+    BOOL hasElements[SCJSONWriterMaximumDepth];
+    BOOL afterKey;
+}
+
+#pragma mark Properties
+
+/*!
+ The number of bytes written so far (for a fixed buffer that has overflowed,
+ the number of bytes that would have been written).
+ */
+@property (readonly) NSUInteger length;
+
+/*! `YES` if a fixed buffer was too small to hold the output. */
+@property (readonly) BOOL overflowed;
+
+#pragma mark Initializers
+
+/*!
+ Creates a writer that appends to a growable buffer.
+ @return The initialized instance.
+ */
+- (id) init;
+
+/*!
+ Creates a writer that fills a caller-supplied buffer. The buffer is not
+ copied and must outlive the writer.
+ @param buffer The buffer to write into.
+ @param capacity The size of `buffer`, in bytes.
+ @return The initialized instance.
+ */
+- (id) initWithBuffer:(void *)buffer capacity:(NSUInteger)capacity;
+
+#pragma mark Output
+
+/*!
+ Returns the output written so far. For a fixed buffer the data references the
+ caller's buffer without copying it.
+ @return The UTF-8 encoded JSON.
+ */
+- (NSData *) data;
+
+#pragma mark Structure
+
+/*! Opens a JSON object (`{`). */
+- (void) beginObject;
+
+/*! Closes the innermost JSON object (`}`). */
+- (void) endObject;
+
+/*! Opens a JSON array (`[`). */
+- (void) beginArray;
+
+/*! Closes the innermost JSON array (`]`). */
+- (void) endArray;
+
+/*!
+ Writes an object key. The next value written becomes its value.
+ @param key The key.
+ */
+- (void) writeKey:(NSString *)key;
+
+#pragma mark Values
+
+/*! Writes a string, escaping it as necessary (control characters, including
+ U+0000, as `\u00XX`). `nil` is written as `null`. */
+- (void) writeString:(NSString *)string;
+
+/*! Writes a signed integer. */
+- (void) writeInteger:(long long)value;
+
+/*! Writes an unsigned integer, such as a return address. */
+- (void) writeUnsignedInteger:(unsigned long long)value;
+
+/*! Writes a floating-point number. Non-finite values are written as `null`. */
+- (void) writeDouble:(double)value;
+
+/*! Writes `true` or `false`. */
+- (void) writeBool:(BOOL)value;
+
+/*! Writes `null`. */
+- (void) writeNull;
+
+/*!
+ Writes any JSON-compatible Foundation object (`NSString`, `NSNumber`,
+ `NSNull`, `NSArray`, `NSDictionary`), recursing into collections. `NSDate`s
+ are written as ISO 8601 strings; any other object is written as its
+ `description`.
+ @param object The object to write.
+ */
+- (void) writeObject:(id)object;
+
+@end
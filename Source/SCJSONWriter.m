@@ -0,0 +1,257 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCJSONWriter.h"
+#import "SCFunctions.h"
+
+static const char SCHexDigits[] = "0123456789abcdef";
+
+@interface SCJSONWriter (Private)
+
+- (void) appendBytes:(const void *)bytes length:(NSUInteger)count;
+- (void) beginValue;
+- (void) appendDigits:(unsigned long long)value;
+- (void) writeUTF8:(const char *)string length:(NSUInteger)count;
+
+@end
+
+#pragma mark -
+
+@implementation SCJSONWriter
+
+#pragma mark Properties
+
+@synthesize length;
+@synthesize overflowed;
+
+#pragma mark Initializers
+
+- (id) init {
+    if (self = [super init]) {
+        data = [[NSMutableData alloc] initWithCapacity:4096];
+    }
+    return self;
+}
+
+- (id) initWithBuffer:(void *)bytes capacity:(NSUInteger)size {
+    if (self = [super init]) {
+        buffer = bytes;
+        capacity = size;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [data release];
+    [super dealloc];
+}
+
+#pragma mark Output
+
+- (NSData *) data {
+    if (data) return data;
+    return [NSData dataWithBytesNoCopy:buffer length:MIN(length, capacity) freeWhenDone:NO];
+}
+
+#pragma mark Structure
+
+- (void) beginObject {
+    [self beginValue];
+    [self appendBytes:"{" length:1];
+    if (depth < SCJSONWriterMaximumDepth) hasElements[depth] = NO;
+    depth++;
+}
+
+- (void) endObject {
+    depth--;
+    [self appendBytes:"}" length:1];
+}
+
+- (void) beginArray {
+    [self beginValue];
+    [self appendBytes:"[" length:1];
+    if (depth < SCJSONWriterMaximumDepth) hasElements[depth] = NO;
+    depth++;
+}
+
+- (void) endArray {
+    depth--;
+    [self appendBytes:"]" length:1];
+}
+
+- (void) writeKey:(NSString *)key {
+    [self writeString:key];
+    [self appendBytes:":" length:1];
+    afterKey = YES;
+}
+
+#pragma mark Values
+
+- (void) writeString:(NSString *)string {
+    if (!string) {
+        [self writeNull];
+        return;
+    }
+    [self beginValue];
+
+    // most strings are plain ASCII or UTF-8 backed, so try to read the bytes
+    // in place before falling back to a transcoded copy
+    const char *bytes = CFStringGetCStringPtr((CFStringRef)string, kCFStringEncodingUTF8);
+    if (!bytes) bytes = [string UTF8String];
+    // not strlen, which would stop at the first U+0000; writeUTF8:length:
+    // escapes it instead
+    NSUInteger count = bytes ? [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding] : 0;
+    [self writeUTF8:bytes length:count];
+}
+
+- (void) writeInteger:(long long)value {
+    [self beginValue];
+    if (value < 0) {
+        [self appendBytes:"-" length:1];
+        [self appendDigits:(unsigned long long)(-(value + 1)) + 1];
+    } else {
+        [self appendDigits:(unsigned long long)value];
+    }
+}
+
+- (void) writeUnsignedInteger:(unsigned long long)value {
+    [self beginValue];
+    [self appendDigits:value];
+}
+
+- (void) writeDouble:(double)value {
+    if (!isfinite(value)) {
+        [self writeNull];
+        return;
+    }
+    [self beginValue];
+    char digits[32];
+    int count = snprintf(digits, sizeof(digits), "%.17g", value);
+    [self appendBytes:digits length:count];
+}
+
+- (void) writeBool:(BOOL)value {
+    [self beginValue];
+    if (value) [self appendBytes:"true" length:4];
+    else [self appendBytes:"false" length:5];
+}
+
+- (void) writeNull {
+    [self beginValue];
+    [self appendBytes:"null" length:4];
+}
+
+- (void) writeObject:(id)object {
+    if (!object || object == [NSNull null]) {
+        [self writeNull];
+    }
+    else if ([object isKindOfClass:[NSString class]]) {
+        [self writeString:object];
+    }
+    else if ([object isKindOfClass:[NSNumber class]]) {
+        if ((CFBooleanRef)object == kCFBooleanTrue || (CFBooleanRef)object == kCFBooleanFalse)
+            [self writeBool:[object boolValue]];
+        else if (CFNumberIsFloatType((CFNumberRef)object))
+            [self writeDouble:[object doubleValue]];
+        else if (strchr("CISLQ", *[object objCType]))
+            [self writeUnsignedInteger:[object unsignedLongLongValue]];
+        else
+            [self writeInteger:[object longLongValue]];
+    }
+    else if ([object isKindOfClass:[NSArray class]]) {
+        [self beginArray];
+        for (id element in object) [self writeObject:element];
+        [self endArray];
+    }
+    else if ([object isKindOfClass:[NSDictionary class]]) {
+        [self beginObject];
+        for (id key in object) {
+            [self writeKey:([key isKindOfClass:[NSString class]] ? key : [key description])];
+            [self writeObject:[object objectForKey:key]];
+        }
+        [self endObject];
+    }
+    else if ([object isKindOfClass:[NSDate class]]) {
+        [self writeString:SCISO8601StringFromDate(object)];
+    }
+    else {
+        [self writeString:[object description]];
+    }
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCJSONWriter (Private)
+
+- (void) appendBytes:(const void *)bytes length:(NSUInteger)count {
+    if (data) {
+        [data appendBytes:bytes length:count];
+    } else if (!overflowed && length + count <= capacity) {
+        memcpy(buffer + length, bytes, count);
+    } else {
+        overflowed = YES;
+    }
+    length += count;
+}
+
+- (void) beginValue {
+    if (afterKey) {
+        afterKey = NO;
+        return;
+    }
+    if (depth == 0) return;
+    NSUInteger level = MIN(depth - 1, (NSUInteger)SCJSONWriterMaximumDepth - 1);
+    if (hasElements[level]) [self appendBytes:"," length:1];
+    hasElements[level] = YES;
+}
+
+- (void) appendDigits:(unsigned long long)value {
+    char digits[20];
+    NSUInteger count = 0;
+    do {
+        digits[sizeof(digits) - ++count] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    [self appendBytes:digits + sizeof(digits) - count length:count];
+}
+
+- (void) writeUTF8:(const char *)bytes length:(NSUInteger)count {
+    [self appendBytes:"\"" length:1];
+    NSUInteger runStart = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        unsigned char c = bytes[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        // flush the run of characters that need no escaping in one copy
+        if (i > runStart) [self appendBytes:bytes + runStart length:i - runStart];
+        runStart = i + 1;
+        switch (c) {
+            case '"': [self appendBytes:"\\\"" length:2]; break;
+            case '\\': [self appendBytes:"\\\\" length:2]; break;
+            case '\n': [self appendBytes:"\\n" length:2]; break;
+            case '\r': [self appendBytes:"\\r" length:2]; break;
+            case '\t': [self appendBytes:"\\t" length:2]; break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', SCHexDigits[c >> 4], SCHexDigits[c & 0xF]};
+                [self appendBytes:escape length:6];
+            }
+        }
+    }
+    if (count > runStart) [self appendBytes:bytes + runStart length:count - runStart];
+    [self appendBytes:"\"" length:1];
+}
+
+@end
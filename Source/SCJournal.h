@@ -0,0 +1,186 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+@class SCOccurrence;
+
+/*! Identifies the start of an occurrence journal file. */
+#define SCJournalFileMagic 0x53434A46
+
+/*! The current version of the journal file layout. */
+#define SCJournalFileVersion 1
+
+/*! Marks the start of every record, so a torn tail can be detected. */
+#define SCJournalRecordMagic 0x53434A52
+
+/*! The kinds of record stored in the journal. */
+typedef enum {
+    /*! A complete occurrence (SCOccurrence::journalRepresentation). */
+    SCJournalRecordOccurrence = 1,
+    /*! Fields that changed after the occurrence was recorded. */
+    SCJournalRecordUpdate = 2,
+    /*! The occurrence was delivered and can be forgotten. */
+    SCJournalRecordRemoval = 3
+} SCJournalRecordType;
+
+/*!
+ The fixed-size header preceding every journal record. The payload follows
+ immediately and is `length` bytes long.
+ */
+typedef struct {
+    /*! Always SCJournalRecordMagic. */
+    uint32_t magic;
+    /*! An SCJournalRecordType. */
+    uint16_t type;
+    /*! Reserved; always zero. */
+    uint16_t flags;
+    /*! The payload length, in bytes. */
+    uint32_t length;
+    /*! The CRC-32 of the payload. */
+    uint32_t checksum;
+    /*! The UUID of the occurrence the record belongs to. */
+    uint8_t UUID[16];
+} SCJournalRecordHeader;
+
+/*!
+ A single append-only file holding every occurrence that has not yet been
+ delivered to Squash. Recording an occurrence, updating it with late-arriving
+ data (such as a location fix), and acknowledging its delivery each append one
+ small binary record; nothing is ever rewritten in place.
+
+ When the queue is read back (SCJournal::occurrences), the file is memory-mapped
+ and the records are replayed without copying their payloads. The file is
+ compacted (SCJournal::compact) at startup, which drops delivered occurrences,
+ folds updates into their occurrence, and discards any torn record left by a
+ crash during an append.
+
+ Compaction also keeps the queue within SCJournal::maximumAge,
+ SCJournal::maximumCount, and SCJournal::maximumBytes, so that a device that
+ stays offline for weeks does not pay for an ever-growing backlog. Besides at
+ startup, it runs in the background whenever appends take the file or the
+ number of pending occurrences a quarter past its limit. Occurrences past the
+ maximum age go first. If the queue is still too big, duplicates (occurrences
+ with the same SCOccurrence::fingerprint) are merged, and then the non-fatal
+ occurrences seen longest ago are dropped, followed by the fatal ones. Both
+ age and size go by SCOccurrence::lastSeenAt (or SCOccurrence::occurredAt for
+ an occurrence seen once). The number evicted for each reason is kept in a small file
+ beside the journal until it has been reported to Squash.
+ */
+@interface SCJournal : NSObject {
+    NSString *path;
+    int fd;
+    NSUInteger maximumBytes;
+    NSUInteger maximumCount;
+    NSTimeInterval maximumAge;
+    BOOL compacting;
+    BOOL compactionScheduled;
+    unsigned long long fileBytes;
+    NSInteger pendingCount;
+    void (^compactionHandler)(NSSet *unchangedUUIDs);
+}
+
+#pragma mark Properties
+
+/*! The path to the journal file. */
+@property (readonly) NSString *path;
+
+/*! The most bytes of occurrences kept after compaction, or 0 for no limit. */
+@property (assign) NSUInteger maximumBytes;
+
+/*! The most occurrences kept after compaction, or 0 for no limit. */
+@property (assign) NSUInteger maximumCount;
+
+/*! The age, in seconds, past which occurrences are evicted, or 0 for no limit. */
+@property (assign) NSTimeInterval maximumAge;
+
+/*!
+ Called after each compaction with the UUIDs of the occurrences it kept
+ unchanged. Any other occurrence was evicted, or had duplicates merged into it,
+ so copies of it held in memory are out of date.
+ */
+@property (copy) void (^compactionHandler)(NSSet *unchangedUUIDs);
+
+#pragma mark Singleton
+
+/*!
+ Returns the journal stored in SquashCocoa::occurrencesDirectory.
+ @return The shared instance.
+ */
++ (SCJournal *) sharedJournal;
+
+#pragma mark Initializers
+
+/*!
+ Creates a journal backed by a file, which is created if necessary.
+ @param path The path to the journal file.
+ @return The initialized instance.
+ */
+- (id) initWithPath:(NSString *)path;
+
+#pragma mark Writing
+
+/*!
+ Appends a complete occurrence.
+ @param occurrence The occurrence to store.
+ */
+- (void) appendOccurrence:(SCOccurrence *)occurrence;
+
+/*!
+ Appends new values for some of an occurrence's properties.
+ @param keys The names of the properties that changed.
+ @param occurrence The occurrence that changed.
+ */
+- (void) appendUpdateOfKeys:(NSArray *)keys forOccurrence:(SCOccurrence *)occurrence;
+
+/*!
+ Records that an occurrence was delivered and no longer needs to be kept.
+ @param occurrence The delivered occurrence.
+ */
+- (void) appendRemovalOfOccurrence:(SCOccurrence *)occurrence;
+
+#pragma mark Reading
+
+/*!
+ Replays the journal.
+ @return Every occurrence that has not been removed, in the order they were
+ recorded, with all updates applied.
+ */
+- (NSArray *) occurrences;
+
+#pragma mark Maintenance
+
+/*!
+ Rewrites the journal so that it contains exactly one record per pending
+ occurrence. Occurrences left behind as individual `NSKeyedArchiver` files by
+ older versions of this library are imported at the same time. Records can
+ still be appended while the journal is being compacted.
+ */
+- (void) compact;
+
+/*!
+ Returns the number of occurrences evicted by compaction that have not yet
+ been reported.
+ @return A dictionary mapping the reason (`age`, `duplicate`, or `size`) to the
+ number evicted, or `nil` if there are none.
+ */
+- (NSDictionary *) evictionCounts;
+
+/*!
+ Forgets eviction counts once they have been reported to Squash. Evictions
+ that happened after the counts were read are kept.
+ @param counts The counts that were reported, as returned by
+ SCJournal::evictionCounts.
+ */
+- (void) acknowledgeEvictionCounts:(NSDictionary *)counts;
+
+@end
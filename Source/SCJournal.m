@@ -0,0 +1,537 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCJournal.h"
+#import "SCOccurrence.h"
+#import "SquashCocoa.h"
+#import <fcntl.h>
+#import <sys/uio.h>
+#import <zlib.h>
+
+static NSString *SCJournalFileName = @"Occurrences.journal";
+static NSString *SCLegacyOccurrenceExtension = @"occurrence";
+static NSString *SCEvictionsFileName = @"Evictions.plist";
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} SCJournalFileHeader;
+
+static NSDate *SCJournalLastSeen(SCOccurrence *occurrence);
+static NSUInteger SCJournalReplay(const uint8_t *bytes, NSUInteger length, void (^block)(const SCJournalRecordHeader *header, const void *payload));
+static BOOL SCJournalUUIDBytes(NSString *string, uint8_t bytes[16]);
+static NSString *SCJournalUUIDString(const uint8_t bytes[16]);
+
+@interface SCJournal (Private)
+
+- (void) openFile;
+- (void) recoverFile;
+- (BOOL) appendRecordOfType:(SCJournalRecordType)type UUID:(NSString *)UUID payload:(NSData *)payload;
+- (BOOL) appendRecordOfType:(SCJournalRecordType)type UUID:(NSString *)UUID payload:(NSData *)payload toDescriptor:(int)descriptor;
+- (NSData *) snapshot;
+- (NSArray *) occurrencesInSnapshot:(NSData *)snapshot;
+- (BOOL) copyJournalFromOffset:(off_t)offset toDescriptor:(int)descriptor;
+- (NSArray *) evictFromOccurrences:(NSArray *)occurrences representations:(NSMutableArray *)representations evictions:(NSMutableDictionary *)evicted merged:(NSMutableSet *)mergedUUIDs;
+- (void) noteAppendOfType:(SCJournalRecordType)type bytes:(size_t)bytes;
+- (NSString *) evictionsPath;
+- (void) addEvictionCounts:(NSDictionary *)counts sign:(NSInteger)sign;
+
+@end
+
+#pragma mark -
+
+@implementation SCJournal
+
+#pragma mark Properties
+
+@synthesize path;
+@synthesize maximumBytes;
+@synthesize maximumCount;
+@synthesize maximumAge;
+@synthesize compactionHandler;
+
+#pragma mark Singleton
+
++ (SCJournal *) sharedJournal {
+    static SCJournal *sharedJournal = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSString *directory = [[SquashCocoa sharedClient] occurrencesDirectory];
+        [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:NULL error:NULL];
+        sharedJournal = [[SCJournal alloc] initWithPath:[directory stringByAppendingPathComponent:SCJournalFileName]];
+    });
+    return sharedJournal;
+}
+
+#pragma mark Initializers
+
+- (id) initWithPath:(NSString *)journalPath {
+    if (self = [super init]) {
+        path = [journalPath copy];
+        fd = -1;
+        [self openFile];
+        [self recoverFile];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (fd >= 0) close(fd);
+    [path release];
+    [compactionHandler release];
+    [super dealloc];
+}
+
+#pragma mark Writing
+
+- (void) appendOccurrence:(SCOccurrence *)occurrence {
+    [self appendRecordOfType:SCJournalRecordOccurrence UUID:occurrence.UUID payload:[occurrence journalRepresentation]];
+}
+
+- (void) appendUpdateOfKeys:(NSArray *)keys forOccurrence:(SCOccurrence *)occurrence {
+    [self appendRecordOfType:SCJournalRecordUpdate UUID:occurrence.UUID payload:[occurrence journalRepresentationOfKeys:keys]];
+}
+
+- (void) appendRemovalOfOccurrence:(SCOccurrence *)occurrence {
+    [self appendRecordOfType:SCJournalRecordRemoval UUID:occurrence.UUID payload:nil];
+}
+
+#pragma mark Reading
+
+- (NSArray *) occurrences {
+    NSData *snapshot = [self snapshot];
+    NSArray *occurrences = [self occurrencesInSnapshot:snapshot];
+    [snapshot release];
+    return occurrences;
+}
+
+#pragma mark Maintenance
+
+- (void) compact {
+    NSInteger pendingAtSnapshot;
+    @synchronized(self) {
+        compactionScheduled = NO;
+        if (compacting) return;
+        compacting = YES;
+        pendingAtSnapshot = pendingCount;
+    }
+
+    // The snapshot is compacted without holding the lock, so recording isn't
+    // held up by the replay, the legacy import, or the rewrite. Whatever is
+    // appended meanwhile is copied over verbatim just before the swap.
+    NSData *snapshot = [self snapshot];
+    NSMutableArray *occurrences = [[self occurrencesInSnapshot:snapshot] mutableCopy];
+    NSMutableSet *UUIDs = [[NSMutableSet alloc] initWithArray:[occurrences valueForKey:@"UUID"]];
+
+    // import the one-file-per-occurrence queue used by earlier versions
+    NSString *directory = [path stringByDeletingLastPathComponent];
+    NSMutableArray *legacyFiles = [[NSMutableArray alloc] init];
+    for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directory error:NULL]) {
+        if (![[file pathExtension] isEqualToString:SCLegacyOccurrenceExtension]) continue;
+        NSString *legacyPath = [directory stringByAppendingPathComponent:file];
+        [legacyFiles addObject:legacyPath];
+
+        SCOccurrence *occurrence = nil;
+        @try {
+            occurrence = [NSKeyedUnarchiver unarchiveObjectWithFile:legacyPath];
+        }
+        @catch (NSException *exception) {
+            NSLog(@"Error while unarchiving pending occurrence %@: %@", file, exception);
+        }
+        if (occurrence.UUID && ![UUIDs containsObject:occurrence.UUID]) {
+            [occurrences addObject:occurrence];
+            [UUIDs addObject:occurrence.UUID];
+        }
+    }
+
+    NSMutableArray *representations = [[NSMutableArray alloc] initWithCapacity:[occurrences count]];
+    NSMutableDictionary *evicted = [[NSMutableDictionary alloc] init];
+    NSMutableSet *merged = [[NSMutableSet alloc] init];
+    NSArray *kept = [self evictFromOccurrences:occurrences representations:representations evictions:evicted merged:merged];
+
+    NSString *temporaryPath = [path stringByAppendingPathExtension:@"compacting"];
+    int descriptor = open([temporaryPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (descriptor >= 0) {
+        SCJournalFileHeader fileHeader = { SCJournalFileMagic, SCJournalFileVersion };
+        __block BOOL written = (write(descriptor, &fileHeader, sizeof(fileHeader)) == sizeof(fileHeader));
+        // a partial copy must never replace the journal, or everything
+        // after the failed record would be lost
+        [kept enumerateObjectsUsingBlock:^(SCOccurrence *occurrence, NSUInteger idx, BOOL *stop) {
+            if (!written) {
+                *stop = YES;
+                return;
+            }
+            written = [self appendRecordOfType:SCJournalRecordOccurrence UUID:occurrence.UUID payload:[representations objectAtIndex:idx] toDescriptor:descriptor];
+        }];
+        written = written && (fsync(descriptor) == 0);
+
+        BOOL installed = NO;
+        if (written) {
+            @synchronized(self) {
+                written = [self copyJournalFromOffset:[snapshot length] toDescriptor:descriptor] && (fsync(descriptor) == 0);
+                if (written && rename([temporaryPath fileSystemRepresentation], [path fileSystemRepresentation]) == 0) {
+                    // what was appended meanwhile still counts, on top of
+                    // what was kept
+                    NSInteger appendedMeanwhile = pendingCount - pendingAtSnapshot;
+                    if (fd >= 0) close(fd);
+                    [self openFile];
+                    pendingCount = MAX((NSInteger)[kept count] + appendedMeanwhile, 0);
+                    installed = YES;
+                }
+            }
+        }
+        close(descriptor);
+
+        if (installed) {
+            for (NSString *legacyPath in legacyFiles)
+                [[NSFileManager defaultManager] removeItemAtPath:legacyPath error:NULL];
+            if ([evicted count]) [self addEvictionCounts:evicted sign:1];
+            void (^handler)(NSSet *) = self.compactionHandler;
+            if (handler) {
+                NSMutableSet *unchanged = [NSMutableSet setWithArray:[kept valueForKey:@"UUID"]];
+                [unchanged minusSet:merged];
+                handler(unchanged);
+            }
+        } else {
+            unlink([temporaryPath fileSystemRepresentation]);
+        }
+    }
+
+    [evicted release];
+    [merged release];
+    [representations release];
+    [legacyFiles release];
+    [UUIDs release];
+    [occurrences release];
+    [snapshot release];
+
+    @synchronized(self) {
+        compacting = NO;
+    }
+}
+
+- (NSDictionary *) evictionCounts {
+    @synchronized(self) {
+        NSDictionary *counts = [NSDictionary dictionaryWithContentsOfFile:[self evictionsPath]];
+        return [counts count] ? counts : nil;
+    }
+}
+
+- (void) acknowledgeEvictionCounts:(NSDictionary *)counts {
+    [self addEvictionCounts:counts sign:-1];
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCJournal (Private)
+
+// Applies the age, count, and size limits. Returns the occurrences to keep, in
+// their original order, fills in their journal representations, and counts
+// the evicted occurrences by reason, noting which kept occurrences absorbed
+// duplicates.
+- (NSArray *) evictFromOccurrences:(NSArray *)occurrences representations:(NSMutableArray *)representations evictions:(NSMutableDictionary *)evicted merged:(NSMutableSet *)mergedUUIDs {
+    NSMutableArray *kept = [NSMutableArray arrayWithCapacity:[occurrences count]];
+    NSUInteger ageEvictions = 0, duplicateEvictions = 0, sizeEvictions = 0;
+
+    NSDate *cutoff = (self.maximumAge > 0) ? [NSDate dateWithTimeIntervalSinceNow:-self.maximumAge] : nil;
+    for (SCOccurrence *occurrence in occurrences) {
+        if (cutoff && [SCJournalLastSeen(occurrence) compare:cutoff] == NSOrderedAscending) ageEvictions++;
+        else [kept addObject:occurrence];
+    }
+
+    NSUInteger bytes = 0;
+    for (SCOccurrence *occurrence in kept) {
+        NSData *representation = [occurrence journalRepresentation];
+        [representations addObject:representation];
+        bytes += [representation length];
+    }
+    BOOL (^overLimit)(void) = ^BOOL {
+        return (self.maximumCount > 0 && [kept count] > self.maximumCount) ||
+               (self.maximumBytes > 0 && bytes > self.maximumBytes);
+    };
+
+    // duplicates are merged into their earliest copy, so only detail is lost
+    if (overLimit()) {
+        NSMutableDictionary *originals = [NSMutableDictionary dictionary];
+        for (NSUInteger idx = 0; idx < [kept count];) {
+            SCOccurrence *occurrence = [kept objectAtIndex:idx];
+            SCOccurrence *original = occurrence.fingerprint ? [originals objectForKey:occurrence.fingerprint] : nil;
+            if (!original) {
+                if (occurrence.fingerprint) [originals setObject:occurrence forKey:occurrence.fingerprint];
+                idx++;
+                continue;
+            }
+
+            [original mergeOccurrence:occurrence];
+            [mergedUUIDs addObject:original.UUID];
+            NSUInteger originalIndex = [kept indexOfObjectIdenticalTo:original];
+            bytes -= [[representations objectAtIndex:originalIndex] length] + [[representations objectAtIndex:idx] length];
+            NSData *representation = [original journalRepresentation];
+            [representations replaceObjectAtIndex:originalIndex withObject:representation];
+            bytes += [representation length];
+            [kept removeObjectAtIndex:idx];
+            [representations removeObjectAtIndex:idx];
+            duplicateEvictions++;
+        }
+    }
+
+    // then the non-fatal occurrences seen longest ago, and only then fatal ones
+    while (overLimit() && [kept count] > 0) {
+        NSUInteger victim = NSNotFound;
+        for (NSUInteger idx = 0; idx < [kept count]; idx++) {
+            SCOccurrence *occurrence = [kept objectAtIndex:idx];
+            if (victim == NSNotFound) {
+                victim = idx;
+                continue;
+            }
+            SCOccurrence *candidate = [kept objectAtIndex:victim];
+            BOOL occurrenceFatal = [occurrence.fatal boolValue], candidateFatal = [candidate.fatal boolValue];
+            if ((candidateFatal && !occurrenceFatal) ||
+                (candidateFatal == occurrenceFatal && [SCJournalLastSeen(occurrence) compare:SCJournalLastSeen(candidate)] == NSOrderedAscending))
+                victim = idx;
+        }
+        bytes -= [[representations objectAtIndex:victim] length];
+        [kept removeObjectAtIndex:victim];
+        [representations removeObjectAtIndex:victim];
+        sizeEvictions++;
+    }
+
+    if (ageEvictions) [evicted setObject:[NSNumber numberWithUnsignedInteger:ageEvictions] forKey:@"age"];
+    if (duplicateEvictions) [evicted setObject:[NSNumber numberWithUnsignedInteger:duplicateEvictions] forKey:@"duplicate"];
+    if (sizeEvictions) [evicted setObject:[NSNumber numberWithUnsignedInteger:sizeEvictions] forKey:@"size"];
+    return kept;
+}
+
+- (NSString *) evictionsPath {
+    return [[path stringByDeletingLastPathComponent] stringByAppendingPathComponent:SCEvictionsFileName];
+}
+
+- (void) addEvictionCounts:(NSDictionary *)counts sign:(NSInteger)sign {
+    @synchronized(self) {
+        NSMutableDictionary *totals = [NSMutableDictionary dictionaryWithContentsOfFile:[self evictionsPath]];
+        if (!totals) totals = [NSMutableDictionary dictionary];
+        for (NSString *reason in counts) {
+            NSInteger total = [[totals objectForKey:reason] integerValue] + sign * [[counts objectForKey:reason] integerValue];
+            if (total > 0) [totals setObject:[NSNumber numberWithInteger:total] forKey:reason];
+            else [totals removeObjectForKey:reason];
+        }
+        if ([totals count]) [totals writeToFile:[self evictionsPath] atomically:YES];
+        else [[NSFileManager defaultManager] removeItemAtPath:[self evictionsPath] error:NULL];
+    }
+}
+
+- (void) openFile {
+    fd = open([path fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        NSLog(@"Couldn't open occurrence journal %@: %s", path, strerror(errno));
+        return;
+    }
+    off_t length = lseek(fd, 0, SEEK_END);
+    if (length == 0) {
+        SCJournalFileHeader fileHeader = { SCJournalFileMagic, SCJournalFileVersion };
+        write(fd, &fileHeader, sizeof(fileHeader));
+        length = sizeof(fileHeader);
+    }
+    fileBytes = length;
+}
+
+// Cuts off a record torn by a crash, so that what is appended from now on
+// isn't hidden behind it, and counts the pending occurrences.
+- (void) recoverFile {
+    if (fd < 0) return;
+    off_t length = lseek(fd, 0, SEEK_END);
+    NSData *mapped = [[NSData alloc] initWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    __block NSInteger pending = 0;
+    NSUInteger validLength = SCJournalReplay([mapped bytes], [mapped length], ^(const SCJournalRecordHeader *header, const void *payload) {
+        if (header->type == SCJournalRecordOccurrence) pending++;
+        else if (header->type == SCJournalRecordRemoval) pending--;
+    });
+    if (validLength > 0 && validLength < (NSUInteger)length) {
+        ftruncate(fd, validLength);
+        length = validLength;
+    }
+    [mapped release];
+    fileBytes = length;
+    pendingCount = MAX(pending, 0);
+}
+
+- (BOOL) appendRecordOfType:(SCJournalRecordType)type UUID:(NSString *)UUID payload:(NSData *)payload {
+    @synchronized(self) {
+        if (![self appendRecordOfType:type UUID:UUID payload:payload toDescriptor:fd]) return NO;
+        [self noteAppendOfType:type bytes:sizeof(SCJournalRecordHeader) + [payload length]];
+        return YES;
+    }
+}
+
+// Keeps count of the file size and pending occurrences, and schedules a
+// compaction once either is a quarter over its limit (so that a full queue
+// isn't rewritten on every append). Must be called while synchronized.
+- (void) noteAppendOfType:(SCJournalRecordType)type bytes:(size_t)bytes {
+    fileBytes += bytes;
+    if (type == SCJournalRecordOccurrence) pendingCount++;
+    else if (type == SCJournalRecordRemoval && pendingCount > 0) pendingCount--;
+
+    if (compacting || compactionScheduled) return;
+    NSUInteger countLimit = self.maximumCount, bytesLimit = self.maximumBytes;
+    BOOL overCount = (countLimit > 0 && pendingCount > (NSInteger)(countLimit + MAX(countLimit/4, (NSUInteger)1)));
+    BOOL overBytes = (bytesLimit > 0 && fileBytes > bytesLimit + bytesLimit/4);
+    if (!overCount && !overBytes) return;
+
+    compactionScheduled = YES;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        [self compact];
+    });
+}
+
+- (BOOL) appendRecordOfType:(SCJournalRecordType)type UUID:(NSString *)UUID payload:(NSData *)payload toDescriptor:(int)descriptor {
+    if (descriptor < 0) return NO;
+
+    SCJournalRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SCJournalRecordMagic;
+    header.type = type;
+    header.length = (uint32_t)[payload length];
+    header.checksum = (uint32_t)crc32(0, [payload bytes], (uInt)[payload length]);
+    if (!SCJournalUUIDBytes(UUID, header.UUID)) return NO;
+
+    // header and payload go out in one system call, so a crash can tear at
+    // most the final record, which replay detects and ignores (and openFile
+    // trims). A write that comes up short without a crash (a full disk, say)
+    // is undone here, since a torn record in the middle of the file would hide
+    // every record after it.
+    off_t start = lseek(descriptor, 0, SEEK_END);
+    struct iovec vectors[2] = {
+        { &header, sizeof(header) },
+        { (void *)[payload bytes], [payload length] }
+    };
+    ssize_t expected = (ssize_t)(sizeof(header) + [payload length]);
+    if (writev(descriptor, vectors, payload ? 2 : 1) == expected) return YES;
+    if (start >= 0) ftruncate(descriptor, start);
+    return NO;
+}
+
+// Maps the journal as it stands. Records are only ever appended under the
+// lock, so the snapshot ends on a record boundary. The caller releases it.
+- (NSData *) snapshot {
+    @synchronized(self) {
+        return [[NSData alloc] initWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    }
+}
+
+- (NSArray *) occurrencesInSnapshot:(NSData *)snapshot {
+    NSMutableArray *order = [[NSMutableArray alloc] init];
+    NSMutableDictionary *occurrences = [[NSMutableDictionary alloc] init];
+
+    SCJournalReplay([snapshot bytes], [snapshot length], ^(const SCJournalRecordHeader *header, const void *payload) {
+        NSString *UUID = SCJournalUUIDString(header->UUID);
+        switch (header->type) {
+            case SCJournalRecordOccurrence: {
+                SCOccurrence *occurrence = [[SCOccurrence alloc] initWithJournalRepresentation:payload length:header->length];
+                if (occurrence && ![occurrences objectForKey:UUID]) {
+                    [occurrences setObject:occurrence forKey:UUID];
+                    [order addObject:UUID];
+                }
+                [occurrence release];
+                break;
+            }
+            case SCJournalRecordUpdate:
+                [[occurrences objectForKey:UUID] applyJournalRepresentation:payload length:header->length];
+                break;
+            case SCJournalRecordRemoval:
+                if ([occurrences objectForKey:UUID]) {
+                    [occurrences removeObjectForKey:UUID];
+                    [order removeObject:UUID];
+                }
+                break;
+        }
+    });
+
+    NSArray *result = [occurrences objectsForKeys:order notFoundMarker:[NSNull null]];
+    [order release];
+    [occurrences release];
+    return result;
+}
+
+// Copies whatever was appended to the journal past an offset. Must be called
+// while synchronized.
+- (BOOL) copyJournalFromOffset:(off_t)offset toDescriptor:(int)descriptor {
+    if (fd < 0) return YES;
+    char buffer[16384];
+    for (;;) {
+        ssize_t count = pread(fd, buffer, sizeof(buffer), offset);
+        if (count < 0) return NO;
+        if (count == 0) return YES;
+        if (write(descriptor, buffer, count) != count) return NO;
+        offset += count;
+    }
+}
+
+@end
+
+#pragma mark -
+
+// The one timestamp both age and size eviction go by.
+static NSDate *SCJournalLastSeen(SCOccurrence *occurrence) {
+    return occurrence.lastSeenAt ? occurrence.lastSeenAt : occurrence.occurredAt;
+}
+
+// Calls the block (if any) for each intact record, stopping at the first one
+// that isn't. Returns the offset just past the last intact record, or 0 if the
+// file header isn't one this version understands.
+static NSUInteger SCJournalReplay(const uint8_t *bytes, NSUInteger length, void (^block)(const SCJournalRecordHeader *header, const void *payload)) {
+    const SCJournalFileHeader *fileHeader = (const SCJournalFileHeader *)bytes;
+    if (length < sizeof(SCJournalFileHeader) ||
+        fileHeader->magic != SCJournalFileMagic ||
+        fileHeader->version != SCJournalFileVersion) return 0;
+
+    NSUInteger offset = sizeof(SCJournalFileHeader);
+    while (offset + sizeof(SCJournalRecordHeader) <= length) {
+        SCJournalRecordHeader header;
+        memcpy(&header, bytes + offset, sizeof(header));
+        if (header.magic != SCJournalRecordMagic) break;
+        if (header.length > length - offset - sizeof(header)) break;
+
+        const void *payload = bytes + offset + sizeof(header);
+        if (crc32(0, payload, header.length) != header.checksum) break;
+
+        if (block) {
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            block(&header, payload);
+            [pool drain];
+        }
+        offset += sizeof(header) + header.length;
+    }
+    return offset;
+}
+
+static BOOL SCJournalUUIDBytes(NSString *string, uint8_t bytes[16]) {
+    if (!string) return NO;
+    CFUUIDRef UUID = CFUUIDCreateFromString(NULL, (CFStringRef)string);
+    if (!UUID) return NO;
+    CFUUIDBytes UUIDBytes = CFUUIDGetUUIDBytes(UUID);
+    memcpy(bytes, &UUIDBytes, 16);
+    CFRelease(UUID);
+    return YES;
+}
+
+static NSString *SCJournalUUIDString(const uint8_t bytes[16]) {
+    CFUUIDBytes UUIDBytes;
+    memcpy(&UUIDBytes, bytes, 16);
+    CFUUIDRef UUID = CFUUIDCreateFromUUIDBytes(NULL, UUIDBytes);
+    NSString *string = (NSString *)CFUUIDCreateString(NULL, UUID);
+    CFRelease(UUID);
+    return [string autorelease];
+}
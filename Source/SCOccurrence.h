@@ -13,6 +13,11 @@
 //    limitations under the License.
 
 #import "PLCrashReport.h"
+#import "SCFunctions.h"
+#import "SCBacktrace.h"
+#import "SCSessionState.h"
+
+@class SCJSONWriter;
 
 /*!
  An occurrence of an `NSException` being raised or a signal being trapped. This
@@ -35,7 +40,7 @@
     NSString *client;
     NSString *exceptionClassName;
     NSString *message;
-    NSArray *backtraces;
+    SCBacktrace *backtraces;
     NSDictionary *userData;
     NSArray *parentExceptions;
     NSDictionary *envVars;
@@ -65,6 +70,18 @@
     NSString *networkOperator;
     NSString *networkType;
     NSString *connectivity;
+    NSString *fingerprint;
+    NSNumber *occurrenceCount;
+    NSDate *firstSeenAt;
+    NSDate *lastSeenAt;
+    NSArray *variants;
+    NSDictionary *droppedOccurrences;
+    NSNumber *sampleRate;
+    NSNumber *fatal;
+    NSArray *breadcrumbs;
+    NSDictionary *performanceMetrics;
+    NSDictionary *evictedOccurrences;
+    NSDictionary *clientStats;
 }
 
 #pragma mark Properties
@@ -93,8 +110,14 @@
 /*! For `NSException`s, the description. For signals, a constant string. */
 @property (retain) NSString *message;
 
-/*! The call stack return addresses (as `NSNumber`s) at the time of occurrence. */
-@property (retain) NSArray *backtraces;
+/*!
+ The call stacks at the time of occurrence. Frames that fall inside a loaded
+ binary image also carry that image's UUID and the frame's offset within it
+ (see SCBinaryImageForAddress), so they can be symbolicated without knowing
+ where the image was loaded. Kept as flat address arrays until the occurrence
+ is serialized (see SCBacktrace).
+ */
+@property (retain) SCBacktrace *backtraces;
 
 /*! The `NSException`'s `userInfo` dictionary. */
 @property (retain) NSDictionary *userData;
@@ -183,6 +206,79 @@
 /*! Unused. */
 @property (retain) NSString *connectivity;
 
+/*!
+ A stable identifier for the bug behind this occurrence, computed when it is
+ recorded from SCOccurrence::exceptionClassName and the top
+ SquashCocoa::fingerprintFrameCount frames of the faulting thread. Frames are
+ hashed relative to their binary image, so the fingerprint survives address
+ space randomization across launches.
+ */
+@property (retain) NSString *fingerprint;
+
+/*!
+ The number of occurrences folded into this one by
+ SCOccurrence::coalesceOccurrence:, including itself. `nil` means 1.
+ */
+@property (retain) NSNumber *occurrenceCount;
+
+/*! The earliest time at which a coalesced occurrence happened. */
+@property (retain) NSDate *firstSeenAt;
+
+/*! The latest time at which a coalesced occurrence happened. */
+@property (retain) NSDate *lastSeenAt;
+
+/*!
+ A few coalesced occurrences whose message differed from this one's, as
+ dictionaries with `message` and `occurred_at` keys. At most
+ SquashCocoa::maximumVariants are kept.
+ */
+@property (retain) NSArray *variants;
+
+/*!
+ The number of exceptions, by class name, that were dropped by sampling or rate
+ limiting since the previous occurrence was recorded (see
+ SquashCocoa::rateLimit).
+ */
+@property (retain) NSDictionary *droppedOccurrences;
+
+/*! The SquashCocoa::sampleRate in effect, if less than 1. */
+@property (retain) NSNumber *sampleRate;
+
+/*!
+ `YES` if the occurrence terminated the process (a crash report or a trapped
+ signal), as opposed to an exception passed to
+ SquashCocoa::recordException:. Fatal occurrences are evicted from a full
+ queue last.
+ */
+@property (retain) NSNumber *fatal;
+
+/*!
+ The most recent breadcrumbs left with SquashCocoa::leaveBreadcrumb:category:
+ before the occurrence, oldest first, as dictionaries with `timestamp`,
+ `category`, and `message` keys. Crash reports get the breadcrumbs the crashed
+ launch left behind (see SCBreadcrumbsFromPreviousSession).
+ */
+@property (retain) NSArray *breadcrumbs;
+
+/*!
+ For performance summaries (see SCPerformanceRecorder), the latency histograms
+ of each operation recorded during the period, keyed by operation name.
+ */
+@property (retain) NSDictionary *performanceMetrics;
+
+/*!
+ The number of occurrences, by reason, that were evicted from the queue to
+ keep it within its limits (see SquashCocoa::maximumQueueBytes). Set on one
+ occurrence of an upload only; it is not stored in the journal.
+ */
+@property (retain) NSDictionary *evictedOccurrences;
+
+/*!
+ A snapshot of SquashCocoa::telemetry, sent with one occurrence per upload if
+ SquashCocoa::uploadsClientStats is set. Not stored in the journal.
+ */
+@property (retain) NSDictionary *clientStats;
+
 #pragma mark Initializers
 
 /*!
@@ -203,6 +299,45 @@
  */
 - (id) initWithSignal:(int)signal addresses:(NSArray *)backtraces;
 
+/*!
+ Creates a new Occurrence from the raw record SCHandleSignal wrote in an
+ earlier process. Its addresses are not resolved against this process's
+ images.
+ @param record The signal record.
+ @return The initialized instance.
+ */
+- (id) initWithSignalRecord:(const SCSignalRecord *)record;
+
+/*!
+ Creates a new Occurrence recording a stall of the main thread, as detected by
+ SCHangMonitor. Its class name is SCHangClassName.
+ @param backtrace The main thread's stack (and any later samples of it).
+ @param duration How long the main thread has been unresponsive, in seconds.
+ @return The initialized instance.
+ */
+- (id) initWithHangBacktrace:(SCBacktrace *)backtrace duration:(NSTimeInterval)duration;
+
+/*!
+ Creates a new Occurrence recording that an earlier launch was terminated
+ without a crash report (see SCSessionStateEndedAbnormally). The class name
+ tells whether it was in the foreground (SCOutOfMemoryClassName), hung
+ (SCWatchdogTerminationClassName), or in the background
+ (SCBackgroundTerminationClassName); the user data carries its last and peak
+ memory footprint, memory warnings, and footprint timeline.
+ @param state The earlier launch's session state.
+ @return The initialized instance.
+ */
+- (id) initWithSessionState:(const SCSessionState *)state;
+
+/*!
+ Creates a new Occurrence carrying a period's performance summary, as built by
+ SCPerformanceRecorder. Its class name is SCPerformanceClassName.
+ @param metrics The SCOccurrence::performanceMetrics.
+ @param backtrace The stacks of each operation's slowest sample.
+ @return The initialized instance.
+ */
+- (id) initWithPerformanceMetrics:(NSDictionary *)metrics backtrace:(SCBacktrace *)backtrace;
+
 /*!
  Creates a new Occurrence from a `PLCrashReport` object.
  @param report The crash report.
@@ -210,15 +345,157 @@
  */
 - (id) initWithCrashReport:(PLCrashReport *)report;
 
+/*!
+ Creates a new Occurrence straight from a serialized PLCrashReporter report,
+ decoding it in place (see SCCrashReportOpen) rather than building a
+ `PLCrashReport` object graph first. The result is the same as
+ SCOccurrence::initWithCrashReport: would produce.
+ @param data The serialized crash report.
+ @return The initialized instance, or `nil` if the report can't be read.
+ */
+- (id) initWithCrashReportData:(NSData *)data;
+
+#pragma mark Coalescing
+
+/*!
+ Folds a repeat of this occurrence (one with the same
+ SCOccurrence::fingerprint) into it: the count and first- and last-seen times
+ are updated, the repeat's message is kept as a variant if it is new, and the
+ change is appended to the journal. The repeat itself is not stored.
+ @param repeat The occurrence to fold in.
+ */
+- (void) coalesceOccurrence:(SCOccurrence *)repeat;
+
+/*!
+ Folds a repeat of this occurrence into it like
+ SCOccurrence::coalesceOccurrence:, but without touching the journal. Used
+ when the journal is rewritten anyway.
+ @param repeat The occurrence to fold in.
+ @return The names of the properties that changed.
+ */
+- (NSArray *) mergeOccurrence:(SCOccurrence *)repeat;
+
 #pragma mark Serialization
 
 /*!
- Writes this occurrence to a file for later uploading.
+ Creates an occurrence from the binary representation stored in the journal.
+ @param bytes The start of the representation. The bytes are not retained.
+ @param length The length of the representation, in bytes.
+ @return The initialized instance, or `nil` if the representation is invalid.
+ */
+- (id) initWithJournalRepresentation:(const void *)bytes length:(NSUInteger)length;
+
+/*!
+ Appends this occurrence to the journal (SCJournal::sharedJournal) for later
+ uploading.
  */
 - (void) writeToFile;
 
+/*!
+ If location services are authorized and this occurrence is still missing its
+ location or heading, arranges for them to be filled in and journaled as a
+ single update once the shared location cache is refreshed. Call it only once
+ the occurrence is in the journal, since an update journaled first would be
+ lost.
+ */
+- (void) requestLateLocation;
+
+/*!
+ Records in the journal that this occurrence no longer needs to be kept,
+ typically once Squash has received it.
+ */
+- (void) removeFromQueue;
+
+/*!
+ Returns a compact, versioned binary representation of every property, for
+ storage in the journal. Each property is encoded as a tagged, typed field;
+ nested collections (such as SCOccurrence::userData) are encoded as JSON, and
+ SCOccurrence::backtraces in its own compact form.
+ @return The binary representation.
+ */
+- (NSData *) journalRepresentation;
+
+/*!
+ Returns the binary representation of just some properties, for recording
+ late-arriving data as a small delta.
+ @param keys The names of the properties to encode.
+ @return The binary representation.
+ */
+- (NSData *) journalRepresentationOfKeys:(NSArray *)keys;
+
+/*!
+ Overwrites properties with the values in a binary representation produced by
+ SCOccurrence::journalRepresentationOfKeys:.
+ @param bytes The start of the representation. The bytes are not retained.
+ @param length The length of the representation, in bytes.
+ */
+- (void) applyJournalRepresentation:(const void *)bytes length:(NSUInteger)length;
+
+/*!
+ Serializes this occurrence into the JSON body expected by the Squash notify
+ API.
+ @return The UTF-8 encoded JSON representation.
+ */
+- (NSData *) asJSON;
+
+/*!
+ Streams the JSON body expected by the Squash notify API into a writer, which
+ may target a growable or a caller-supplied buffer.
+ @param writer The writer to append the JSON object to.
+ */
+- (void) writeJSONTo:(SCJSONWriter *)writer;
+
+/*!
+ Returns a content hash of the fields that describe the process and device
+ rather than the occurrence itself: SCOccurrence::symbolicationID,
+ SCOccurrence::envVars, SCOccurrence::arguments, SCOccurrence::hostname,
+ SCOccurrence::version, SCOccurrence::build, SCOccurrence::deviceType, the
+ operating system fields, SCOccurrence::architecture and
+ SCOccurrence::physicalMemory. Occurrences from the same process share a
+ context ID, so Squash only needs to receive that context once.
+ @return The lowercase hexadecimal SHA-256 digest of the context fields.
+ */
+- (NSString *) contextID;
+
+/*!
+ Serializes this occurrence into the JSON body expected by the Squash notify
+ API, tagged with a context ID (see SCOccurrence::contextID).
+ @param contextID The context ID to send as `context_id`, or `nil` to send
+ none.
+ @param includeContext If `NO`, the context fields are left out, and Squash
+ is expected to look them up by `context_id`.
+ @return The UTF-8 encoded JSON representation.
+ */
+- (NSData *) asJSONWithContextID:(NSString *)contextID includingContext:(BOOL)includeContext;
+
+/*!
+ Streams the JSON body into a writer, tagged with a context ID (see
+ SCOccurrence::asJSONWithContextID:includingContext:).
+ @param writer The writer to append the JSON object to.
+ @param contextID The context ID to send as `context_id`, or `nil` to send
+ none.
+ @param includeContext Whether to write the context fields.
+ */
+- (void) writeJSONTo:(SCJSONWriter *)writer contextID:(NSString *)contextID includingContext:(BOOL)includeContext;
+
 #pragma mark Reporting
 
+/*!
+ Builds the HTTP request that transmits this occurrence to
+ SquashCocoa::notifyURL.
+ @return A `POST` request whose body is the occurrence's JSON representation.
+ */
+- (NSURLRequest *) notifyRequest;
+
+/*!
+ Builds the HTTP request that transmits a previously serialized body to
+ SquashCocoa::notifyURL.
+ @param body The JSON body, such as one returned by
+ SCOccurrence::asJSONWithContextID:includingContext:.
+ @return A `POST` request with the given body.
+ */
+- (NSURLRequest *) notifyRequestWithBody:(NSData *)body;
+
 /*!
  Sends the occurrence data synchronously to the Squash host over HTTP(S).
  @return Whether or not the data was received successfully.
@@ -16,26 +16,122 @@
 #import "SCFunctions.h"
 #import "SquashCocoa.h"
 #import "Reachability.h"
-#import "ISO8601DateFormatter.h"
+#import "SCJSONWriter.h"
+#import "SCJournal.h"
+#import "SCProcessContext.h"
+#import "SCTelemetry.h"
+#import "SCBreadcrumbs.h"
+#import "SCHangMonitor.h"
+#import "SCPerformance.h"
+#import "SCCrashReportConverter.h"
 #import <CoreLocation/CoreLocation.h>
+#import <CommonCrypto/CommonDigest.h>
 #if TARGET_OS_MAC && !TARGET_OS_IPHONE && !TARGET_IPHONE_SIMULATOR
 #import <ExceptionHandling/ExceptionHandling.h>
 #endif
 
-#if TARGET_OS_MAC && !TARGET_OS_IPHONE && !TARGET_IPHONE_SIMULATOR
-	#import <sys/sysctl.h>
-#endif
-
 #if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
 	static NSDictionary *batteryStates;
 	static NSDictionary *orientations;
 #endif
 
+// Journal field tags are indexes into this table (plus one). Only ever append
+// to it; reordering would change the meaning of stored records.
+static NSString * const SCJournalKeys[] = {
+    @"UUID", @"symbolicationID", @"revision", @"occurredAt", @"client",
+    @"exceptionClassName", @"message", @"backtraces", @"userData",
+    @"parentExceptions", @"envVars", @"arguments", @"hostname", @"PID",
+    @"processPath", @"parentProcessName", @"processRunningNatively", @"version",
+    @"build", @"deviceID", @"deviceType", @"operatingSystem",
+    @"operatingSystemVersion", @"operatingSystemBuild", @"architecture",
+    @"physicalMemory", @"powerState", @"orientation", @"lat", @"lon",
+    @"altitude", @"locationPrecision", @"heading", @"speed", @"networkOperator",
+    @"networkType", @"connectivity", @"fingerprint", @"occurrenceCount",
+    @"firstSeenAt", @"lastSeenAt", @"variants", @"droppedOccurrences",
+    @"sampleRate", @"fatal", @"breadcrumbs", @"performanceMetrics"
+};
+static const NSUInteger SCJournalKeyCount = sizeof(SCJournalKeys)/sizeof(SCJournalKeys[0]);
+
+// A cached fix younger than this is copied into new occurrences as-is.
+static const NSTimeInterval SCLocationMaximumAge = 300.0;
+// The shared location manager is started at most this often.
+static const NSTimeInterval SCLocationRefreshInterval = 60.0;
+// A refresh that hasn't produced everything by now is stopped. Must be shorter
+// than SCLocationRefreshInterval.
+static const NSTimeInterval SCLocationRefreshTimeout = 30.0;
+// Late data is held this long so that location and heading arriving together
+// are written as one update per occurrence.
+static const NSTimeInterval SCLocationCoalescingDelay = 1.0;
+// At most this many occurrences wait for a refresh; the rest go without.
+static const NSUInteger SCLocationMaximumPending = 64;
+
+typedef enum {
+    SCJournalFieldString = 1,
+    SCJournalFieldDouble,
+    SCJournalFieldInteger,
+    SCJournalFieldUnsignedInteger,
+    SCJournalFieldBool,
+    SCJournalFieldDate,
+    SCJournalFieldJSON,
+    SCJournalFieldBacktrace
+} SCJournalFieldKind;
+
+typedef struct {
+    uint16_t tag;
+    uint8_t kind;
+    uint8_t reserved;
+    uint32_t length;
+} SCJournalFieldHeader;
+
+static void SCJournalAppendField(NSMutableData *data, uint16_t tag, id value);
+static id SCJournalCreateValue(uint8_t kind, const uint8_t *bytes, uint32_t length);
+static void SCAddCrashReportFrames(SCBacktrace *backtrace, NSArray *frames, const uint64_t *imageBases, const uint64_t *imageSizes, const uint32_t *imageUUIDs, NSUInteger imageCount);
+static NSString *SCCreateFingerprint(NSString *className, SCBacktrace *backtraces, NSUInteger frameCount);
+static SCBacktrace *SCBacktraceFromStoredValue(id value);
+static NSString *SCStringFromCrashReportString(SCCrashReportString string);
+
+// state shared by the SCCrashReportVisitor callbacks that fill a backtrace
+typedef struct {
+    SCBacktrace *backtrace;
+    const uint32_t *imageUUIDs;
+} SCCrashReportBacktraceBuilder;
+
+static void SCCrashReportBeginThread(void *context, uint32_t number, bool crashed, bool registers);
+static void SCCrashReportAddFrame(void *context, uint64_t address, uint32_t image, uint64_t offset);
+static void SCCrashReportAddRegister(void *context, SCCrashReportString name, uint64_t value);
+
+// Process-wide location cache. One location manager serves every occurrence;
+// new occurrences copy a fresh cached fix synchronously, and stored occurrences
+// still missing one receive the next refresh as a single journal update.
 @interface SCOccurrenceLocationDelegate : NSObject <CLLocationManagerDelegate> {
-    SCOccurrence *occurrence;
+    CLLocationManager *locationManager;
+    CLLocation *location;
+    NSNumber *heading;
+    NSDate *headingDate;
+    NSDate *lastRefresh;
+    BOOL updating;
+    BOOL locationReceived;
+    BOOL headingReceived;
+    BOOL flushScheduled;
+    NSMutableArray *pendingOccurrences;
+    NSMutableSet *pendingKeys;
 }
 
-@property (retain) SCOccurrence *occurrence;
++ (SCOccurrenceLocationDelegate *) sharedDelegate;
+
+- (void) applyToOccurrence:(SCOccurrence *)occurrence;
+- (void) enrollOccurrence:(SCOccurrence *)occurrence;
+
+@end
+
+@interface SCOccurrenceLocationDelegate (Private)
+
+- (BOOL) wantsHeading;
+- (void) copyLocation:(BOOL)copyLocation heading:(BOOL)copyHeading toOccurrence:(SCOccurrence *)occurrence;
+- (void) startUpdating;
+- (void) finishUpdating;
+- (void) scheduleFlush;
+- (void) flush;
 
 @end
 
@@ -43,14 +139,18 @@
 
 @interface SCOccurrence (Private)
 
+#pragma mark Coalescing
+
+- (void) computeFingerprint;
+
 #pragma mark Updates
 
-- (void) didReceiveNewData;
+- (void) didReceiveNewDataForKeys:(NSArray *)keys;
 
 #pragma mark Serialization
 
-- (NSString *) filePath;
-- (NSData *) asJSON;
+- (void) writeContextTo:(SCJSONWriter *)writer;
+
 - (NSString *) description;
 
 @end
@@ -106,6 +206,19 @@
 @synthesize networkType;
 @synthesize connectivity;
 
+@synthesize fingerprint;
+@synthesize occurrenceCount;
+@synthesize firstSeenAt;
+@synthesize lastSeenAt;
+@synthesize variants;
+@synthesize droppedOccurrences;
+@synthesize sampleRate;
+@synthesize fatal;
+@synthesize breadcrumbs;
+@synthesize performanceMetrics;
+@synthesize evictedOccurrences;
+@synthesize clientStats;
+
 #pragma mark Initializers
 
 + (void) initialize {
@@ -134,26 +247,33 @@
         self.message = [exception reason];
         self.userData = SCValueify([exception userInfo]);
 
-        NSMutableArray *bt;
+        SCBacktrace *bt = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleReturnAddresses];
+        [bt beginThreadNamed:@"Crashed Thread" faulted:YES registers:NO];
         if ([[exception callStackReturnAddresses] count] > 0) {
-            bt = [[NSMutableArray alloc] initWithCapacity:[[exception callStackReturnAddresses] count]];
-            for (NSString *line in [exception callStackReturnAddresses])
-                [bt addObject:[NSArray arrayWithObjects:@"_RETURN_ADDRESS_", line, NULL]];
+            for (NSNumber *address in [exception callStackReturnAddresses])
+                [bt addFrameWithAddress:[address unsignedLongLongValue] resolve:YES];
 #if TARGET_OS_MAC && !TARGET_OS_IPHONE && !TARGET_IPHONE_SIMULATOR
         } else if ([[exception userInfo] objectForKey:NSStackTraceKey]) {
-            NSArray *frames = [[[exception userInfo] objectForKey:NSStackTraceKey] componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-            bt = [[NSMutableArray alloc] initWithCapacity:[frames count]];
-            for (NSString *frame in frames) {
-                long address = strtol([frame cStringUsingEncoding:NSASCIIStringEncoding], NULL, 16);
-                [bt addObject:[NSArray arrayWithObjects:@"_RETURN_ADDRESS_", [NSNumber numberWithLong:address], NULL]];
+            // a whitespace-separated list of hex addresses, scanned in place
+            const char *cursor = [[[exception userInfo] objectForKey:NSStackTraceKey] UTF8String];
+            char *end = NULL;
+            while (cursor && *cursor) {
+                uint64_t address = strtoull(cursor, &end, 16);
+                if (end == cursor) break;
+                [bt addFrameWithAddress:address resolve:YES];
+                cursor = end;
             }
 #endif
         } else {
+            [bt release];
+            [self release];
             return nil;
         }
 
-        self.backtraces = [NSArray arrayWithObject:[NSArray arrayWithObjects:@"Crashed Thread", [NSNumber numberWithBool:YES], bt, NULL]];
+        self.backtraces = bt;
         [bt release];
+        [self computeFingerprint];
+        self.breadcrumbs = SCBreadcrumbsSnapshot();
     }
     return self;
 }
@@ -162,13 +282,106 @@
     if (self = [self init]) {
         self.exceptionClassName = [NSString stringWithUTF8String:strsignal(signal)];
         self.message = @"Signal trapped";
+        self.fatal = [NSNumber numberWithBool:YES];
 
-        NSMutableArray *bt = [[NSMutableArray alloc] initWithCapacity:[backtrace count]];
-        for (NSString *line in backtrace)
-            [bt addObject:[NSArray arrayWithObjects:@"_RETURN_ADDRESS_", line, NULL]];
-        
-        self.backtraces = [NSArray arrayWithObject:[NSArray arrayWithObjects:@"Crashed Thread", [NSNumber numberWithBool:YES], bt, NULL]];
+        SCBacktrace *bt = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleReturnAddresses];
+        [bt beginThreadNamed:@"Crashed Thread" faulted:YES registers:NO];
+        for (NSNumber *address in backtrace)
+            [bt addFrameWithAddress:[address unsignedLongLongValue] resolve:YES];
+
+        self.backtraces = bt;
+        [bt release];
+        [self computeFingerprint];
+        self.breadcrumbs = SCBreadcrumbsSnapshot();
+    }
+    return self;
+}
+
+- (id) initWithSignalRecord:(const SCSignalRecord *)record {
+    if (self = [self init]) {
+        self.exceptionClassName = [NSString stringWithUTF8String:strsignal(record->signal)];
+        self.message = @"Signal trapped";
+        self.fatal = [NSNumber numberWithBool:YES];
+        self.occurredAt = [NSDate dateWithTimeIntervalSince1970:record->timestamp];
+
+        // the addresses belong to the process that wrote the record, whose
+        // images were loaded elsewhere, so they are left unresolved
+        uint32_t frameCount = MIN(record->frameCount, (uint32_t)SCSignalRecordMaximumFrames);
+        SCBacktrace *bt = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleReturnAddresses];
+        [bt beginThreadNamed:@"Crashed Thread" faulted:YES registers:NO];
+        for (uint32_t idx = 0; idx < frameCount; idx++)
+            [bt addFrameWithAddress:record->frames[idx] resolve:NO];
+
+        self.backtraces = bt;
+        [bt release];
+        [self computeFingerprint];
+    }
+    return self;
+}
+
+- (id) initWithHangBacktrace:(SCBacktrace *)backtrace duration:(NSTimeInterval)duration {
+    if (self = [self init]) {
+        self.exceptionClassName = SCHangClassName;
+        self.message = [NSString stringWithFormat:@"Main thread unresponsive for %.1f seconds", duration];
+        self.fatal = [NSNumber numberWithBool:NO];
+        self.backtraces = backtrace;
+        [self computeFingerprint];
+        self.breadcrumbs = SCBreadcrumbsSnapshot();
+    }
+    return self;
+}
+
+- (id) initWithSessionState:(const SCSessionState *)state {
+    if (self = [self init]) {
+        double megabytes = state->footprint / (1024.0*1024.0);
+        if (state->flags & SCSessionHanging) {
+            self.exceptionClassName = SCWatchdogTerminationClassName;
+            self.message = [NSString stringWithFormat:@"Terminated while the main thread was unresponsive (footprint %.1f MB)", megabytes];
+        } else if (state->flags & SCSessionForeground) {
+            self.exceptionClassName = SCOutOfMemoryClassName;
+            self.message = [NSString stringWithFormat:@"Terminated in the foreground without a crash report (footprint %.1f MB)", megabytes];
+        } else {
+            self.exceptionClassName = SCBackgroundTerminationClassName;
+            self.message = [NSString stringWithFormat:@"Terminated in the background (footprint %.1f MB)", megabytes];
+        }
+        self.fatal = [NSNumber numberWithBool:YES];
+        self.occurredAt = [NSDate dateWithTimeIntervalSince1970:state->updatedAt];
+
+        // oldest sample first
+        NSMutableArray *timeline = [NSMutableArray arrayWithCapacity:SCSessionTimelineLength];
+        uint64_t first = state->sampleCount > SCSessionTimelineLength ? state->sampleCount - SCSessionTimelineLength : 0;
+        for (uint64_t idx = first; idx < state->sampleCount; idx++) {
+            const SCFootprintSample *sample = &state->timeline[idx % SCSessionTimelineLength];
+            [timeline addObject:[NSArray arrayWithObjects:
+                                 SCISO8601StringFromDate([NSDate dateWithTimeIntervalSince1970:sample->timestamp]),
+                                 [NSNumber numberWithUnsignedLongLong:sample->footprint],
+                                 NULL]];
+        }
+        self.userData = [NSDictionary dictionaryWithObjectsAndKeys:
+                         [NSNumber numberWithUnsignedLongLong:state->footprint], @"footprint",
+                         [NSNumber numberWithUnsignedLongLong:state->peakFootprint], @"peak_footprint",
+                         [NSNumber numberWithUnsignedInt:state->memoryWarnings], @"memory_warnings",
+                         [NSNumber numberWithBool:(state->flags & SCSessionForeground) != 0], @"foreground",
+                         [NSNumber numberWithDouble:state->updatedAt - state->launchedAt], @"session_duration",
+                         timeline, @"footprint_timeline",
+                         NULL];
+
+        SCBacktrace *bt = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleReturnAddresses];
+        self.backtraces = bt;
         [bt release];
+        [self computeFingerprint];
+    }
+    return self;
+}
+
+- (id) initWithPerformanceMetrics:(NSDictionary *)metrics backtrace:(SCBacktrace *)backtrace {
+    if (self = [self init]) {
+        self.exceptionClassName = SCPerformanceClassName;
+        self.message = [NSString stringWithFormat:@"Latency of %lu operations", (unsigned long)[metrics count]];
+        self.fatal = [NSNumber numberWithBool:NO];
+        self.performanceMetrics = metrics;
+        self.backtraces = backtrace;
+        [self computeFingerprint];
     }
     return self;
 }
@@ -195,6 +408,7 @@
         }
 
         self.occurredAt = report.systemInfo.timestamp;
+        self.fatal = [NSNumber numberWithBool:YES];
 
         if (report.hasMachineInfo) {
             self.deviceType = report.machineInfo.modelName;
@@ -215,53 +429,134 @@
             self.message = [NSString stringWithFormat:@"Signal trapped: %@", report.signalInfo.code];
         }
 
+        SCBacktrace *bt = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleCrashReport];
+
+        // look each image's bounds and UUID up once, rather than once per frame
+        NSUInteger imageCount = [report.images count];
+        uint64_t *imageBases = malloc(imageCount * sizeof(uint64_t));
+        uint64_t *imageSizes = malloc(imageCount * sizeof(uint64_t));
+        uint32_t *imageUUIDs = malloc(imageCount * sizeof(uint32_t));
+        NSUInteger idx = 0;
+        for (PLCrashReportBinaryImageInfo *image in report.images) {
+            imageBases[idx] = image.imageBaseAddress;
+            imageSizes[idx] = image.imageSize;
+            imageUUIDs[idx] = SCBacktraceNoImage;
+            if (image.hasImageUUID) {
+                // PLCrashReporter formats UUIDs as bare hex; match SCBinaryImages
+                NSMutableString *UUIDString = [[image.imageUUID uppercaseString] mutableCopy];
+                if ([UUIDString length] == 32) {
+                    [UUIDString insertString:@"-" atIndex:20];
+                    [UUIDString insertString:@"-" atIndex:16];
+                    [UUIDString insertString:@"-" atIndex:12];
+                    [UUIDString insertString:@"-" atIndex:8];
+                }
+                imageUUIDs[idx] = [bt indexOfString:UUIDString];
+                [UUIDString release];
+            }
+            idx++;
+        }
+
         if ([report.threads count] > 0) {
-            NSMutableArray *_backtraces = [[NSMutableArray alloc] initWithCapacity:[report.threads count]];
-            self.backtraces = _backtraces;
-            [_backtraces release];
+            // only the crashed thread's registers are usually worth sending
+            BOOL allRegisters = [SquashCocoa sharedClient].includesAllThreadRegisters;
             for (PLCrashReportThreadInfo *thread in report.threads) {
-                NSMutableArray *trace = [[NSMutableArray alloc] initWithCapacity:[thread.stackFrames count]];
-                for (PLCrashReportStackFrameInfo *frame in thread.stackFrames)
-                    [trace addObject:@{
-                     @"type": @"address",
-                     @"address": [NSNumber numberWithUnsignedInteger:frame.instructionPointer]
-                    }];
-
-                NSMutableArray *registers = [[NSMutableArray alloc] initWithCapacity:[thread.registers count]];
-                for (PLCrashReportRegisterInfo *reg in thread.registers)
-                    [registers addObject:@[reg.registerName, [NSNumber numberWithUnsignedInteger:reg.registerValue]]];
-
-                [(NSMutableArray *)self.backtraces addObject:@{
-                 @"name": [NSString stringWithFormat:@"Thread %ld", (long)thread.threadNumber],
-                 @"faulted": [NSNumber numberWithBool:thread.crashed],
-                 @"backtrace":trace,
-                 @"registers":registers
-                }];
-                [trace release];
-                [registers release];
+                BOOL registers = allRegisters || thread.crashed;
+                [bt beginThreadNamed:[NSString stringWithFormat:@"Thread %ld", (long)thread.threadNumber] faulted:thread.crashed registers:registers];
+                [bt addThreadNumber:(uint32_t)thread.threadNumber];
+                SCAddCrashReportFrames(bt, thread.stackFrames, imageBases, imageSizes, imageUUIDs, imageCount);
+                if (registers)
+                    for (PLCrashReportRegisterInfo *reg in thread.registers)
+                        [bt addRegisterNamed:reg.registerName value:reg.registerValue];
             }
+            // idle workers parked in the same stack are sent once
+            [bt coalesceIdenticalThreads];
         } else {
-            NSMutableArray *trace = [[NSMutableArray alloc] initWithCapacity:[report.exceptionInfo.stackFrames count]];
-            for (PLCrashReportStackFrameInfo *frame in report.exceptionInfo.stackFrames)
-                [trace addObject:@{
-                 @"type": @"address",
-                 @"address": [NSNumber numberWithUnsignedInteger:frame.instructionPointer]
-                }];
-
-            NSMutableArray *_backtraces = [[NSMutableArray alloc] initWithCapacity:1];
-            self.backtraces = _backtraces;
-            [_backtraces release];
-            [(NSMutableArray *)self.backtraces addObject:@{
-             @"name": @"Current Thread",
-             @"faulted": [NSNumber numberWithBool:YES],
-             @"backtrace": trace
-            }];
-            [trace release];
+            [bt beginThreadNamed:@"Current Thread" faulted:YES registers:NO];
+            SCAddCrashReportFrames(bt, report.exceptionInfo.stackFrames, imageBases, imageSizes, imageUUIDs, imageCount);
         }
+
+        free(imageBases);
+        free(imageSizes);
+        free(imageUUIDs);
+        self.backtraces = bt;
+        [bt release];
+
+        [self computeFingerprint];
     }
     return self;
 }
 
+- (id) initWithCrashReportData:(NSData *)data {
+    SCCrashReport *report = malloc(sizeof(SCCrashReport));
+    if (!SCCrashReportOpen(report, [data bytes], [data length])) {
+        free(report);
+        [self release];
+        return nil;
+    }
+
+    if (self = [self init]) {
+        self.operatingSystem = [NSString stringWithUTF8String:SCCrashReportOperatingSystemName(report->operatingSystem)];
+        self.operatingSystemVersion = SCStringFromCrashReportString(report->operatingSystemVersion);
+        self.operatingSystemBuild = SCStringFromCrashReportString(report->operatingSystemBuild);
+        self.architecture = [NSString stringWithUTF8String:SCCrashReportArchitectureName(report->architecture)];
+        if (report->timestamp != 0) self.occurredAt = [NSDate dateWithTimeIntervalSince1970:report->timestamp];
+        self.fatal = [NSNumber numberWithBool:YES];
+
+        if (report->hasMachineInfo) {
+            self.deviceType = SCStringFromCrashReportString(report->modelName);
+        }
+
+        if (report->hasProcessInfo) {
+            self.PID = [NSNumber numberWithUnsignedInteger:report->processID];
+            self.processPath = SCStringFromCrashReportString(report->processPath);
+            self.parentProcessName = SCStringFromCrashReportString(report->parentProcessName);
+            self.processRunningNatively = [NSNumber numberWithBool:report->native];
+        }
+
+        if (report->hasException) {
+            self.exceptionClassName = SCStringFromCrashReportString(report->exceptionName);
+            self.message = SCStringFromCrashReportString(report->exceptionReason);
+        } else {
+            self.exceptionClassName = SCStringFromCrashReportString(report->signalName);
+            self.message = [NSString stringWithFormat:@"Signal trapped: %@", SCStringFromCrashReportString(report->signalCode)];
+        }
+
+        SCBacktrace *bt = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleCrashReport];
+        uint32_t *imageUUIDs = malloc(MAX(report->imageCount, (size_t)1) * sizeof(uint32_t));
+        for (size_t idx = 0; idx < report->imageCount; idx++) {
+            imageUUIDs[idx] = SCBacktraceNoImage;
+            if (report->images[idx].UUID) {
+                char UUIDString[37];
+                SCCrashReportFormatUUID(report->images[idx].UUID, UUIDString);
+                imageUUIDs[idx] = [bt indexOfString:[NSString stringWithUTF8String:UUIDString]];
+            }
+        }
+
+        SCCrashReportBacktraceBuilder builder = { bt, imageUUIDs };
+        SCCrashReportVisitor visitor = { SCCrashReportBeginThread, SCCrashReportAddFrame, SCCrashReportAddRegister };
+        BOOL decoded;
+        if (report->threadCount > 0) {
+            decoded = SCCrashReportVisitThreads(report, &visitor, [SquashCocoa sharedClient].includesAllThreadRegisters, &builder);
+            [bt coalesceIdenticalThreads];
+        } else {
+            [bt beginThreadNamed:@"Current Thread" faulted:YES registers:NO];
+            decoded = SCCrashReportVisitExceptionFrames(report, &visitor, &builder);
+        }
+        free(imageUUIDs);
+        self.backtraces = bt;
+        [bt release];
+
+        if (!decoded) {
+            free(report);
+            [self release];
+            return nil;
+        }
+        [self computeFingerprint];
+    }
+    free(report);
+    return self;
+}
+
 - (id) initWithCoder:(NSCoder *)coder {
     if (self = [super init]) {
         UUID = [[coder decodeObjectForKey:@"SCUUID"] retain];
@@ -273,19 +568,26 @@
         
         self.exceptionClassName = [coder decodeObjectForKey:@"SCClassName"];
         self.message = [coder decodeObjectForKey:@"SCMessage"];
-        self.backtraces = [coder decodeObjectForKey:@"SCBacktraces"];
+        self.backtraces = SCBacktraceFromStoredValue([coder decodeObjectForKey:@"SCBacktraces"]);
         self.userData = [coder decodeObjectForKey:@"SCUserData"];
         self.parentExceptions = [coder decodeObjectForKey:@"SCParentExceptions"];
         self.envVars = [coder decodeObjectForKey:@"SCEnvVars"];
         self.arguments = [coder decodeObjectForKey:@"SCArguments"];
         
         self.hostname = [coder decodeObjectForKey:@"SCHostname"];
+        self.PID = [coder decodeObjectForKey:@"SCPID"];
+        self.processPath = [coder decodeObjectForKey:@"SCProcessPath"];
+        self.parentProcessName = [coder decodeObjectForKey:@"SCParentProcessName"];
+        self.processRunningNatively = [coder decodeObjectForKey:@"SCProcessRunningNatively"];
+        self.architecture = [coder decodeObjectForKey:@"SCArchitecture"];
         
         self.version = [coder decodeObjectForKey:@"SCVersion"];
         self.build = [coder decodeObjectForKey:@"SCBuild"];
         self.deviceID = [coder decodeObjectForKey:@"SCDeviceID"];
         self.deviceType = [coder decodeObjectForKey:@"SCDeviceType"];
         self.operatingSystem = [coder decodeObjectForKey:@"SCOperatingSystem"];
+        self.operatingSystemVersion = [coder decodeObjectForKey:@"SCOperatingSystemVersion"];
+        self.operatingSystemBuild = [coder decodeObjectForKey:@"SCOperatingSystemBuild"];
         
         self.physicalMemory = [coder decodeObjectForKey:@"SCPhysicalMemory"];
         self.powerState = [coder decodeObjectForKey:@"SCPowerState"];
@@ -301,15 +603,185 @@
         self.networkOperator = [coder decodeObjectForKey:@"SCNetworkOperator"];
         self.networkType = [coder decodeObjectForKey:@"SCNetworkType"];
         self.connectivity = [coder decodeObjectForKey:@"SCConnectivity"];
+
+        self.fingerprint = [coder decodeObjectForKey:@"SCFingerprint"];
+        self.occurrenceCount = [coder decodeObjectForKey:@"SCOccurrenceCount"];
+        self.firstSeenAt = [coder decodeObjectForKey:@"SCFirstSeenAt"];
+        self.lastSeenAt = [coder decodeObjectForKey:@"SCLastSeenAt"];
+        self.variants = [coder decodeObjectForKey:@"SCVariants"];
+        self.droppedOccurrences = [coder decodeObjectForKey:@"SCDroppedOccurrences"];
+        self.sampleRate = [coder decodeObjectForKey:@"SCSampleRate"];
+        self.fatal = [coder decodeObjectForKey:@"SCFatal"];
+        self.breadcrumbs = [coder decodeObjectForKey:@"SCBreadcrumbs"];
+        self.performanceMetrics = [coder decodeObjectForKey:@"SCPerformanceMetrics"];
     }
     return self;
 }
 
+- (id) initWithJournalRepresentation:(const void *)bytes length:(NSUInteger)length {
+    if (self = [super init]) {
+        [self applyJournalRepresentation:bytes length:length];
+        if (!self.UUID) {
+            [self release];
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [UUID release];
+    [symbolicationID release];
+    [revision release];
+    [occurredAt release];
+    [client release];
+    [exceptionClassName release];
+    [message release];
+    [backtraces release];
+    [userData release];
+    [parentExceptions release];
+    [envVars release];
+    [arguments release];
+    [hostname release];
+    [PID release];
+    [processPath release];
+    [parentProcessName release];
+    [processRunningNatively release];
+    [version release];
+    [build release];
+    [deviceID release];
+    [deviceType release];
+    [operatingSystem release];
+    [operatingSystemVersion release];
+    [operatingSystemBuild release];
+    [architecture release];
+    [physicalMemory release];
+    [powerState release];
+    [orientation release];
+    [lat release];
+    [lon release];
+    [altitude release];
+    [locationPrecision release];
+    [heading release];
+    [speed release];
+    [networkOperator release];
+    [networkType release];
+    [connectivity release];
+    [fingerprint release];
+    [occurrenceCount release];
+    [firstSeenAt release];
+    [lastSeenAt release];
+    [variants release];
+    [droppedOccurrences release];
+    [sampleRate release];
+    [fatal release];
+    [breadcrumbs release];
+    [performanceMetrics release];
+    [evictedOccurrences release];
+    [clientStats release];
+    [super dealloc];
+}
+
+#pragma mark Coalescing
+
+- (void) coalesceOccurrence:(SCOccurrence *)repeat {
+    [self didReceiveNewDataForKeys:[self mergeOccurrence:repeat]];
+}
+
+- (NSArray *) mergeOccurrence:(SCOccurrence *)repeat {
+    NSDate *first = self.firstSeenAt ? self.firstSeenAt : self.occurredAt;
+    NSDate *last = self.lastSeenAt ? self.lastSeenAt : self.occurredAt;
+    // the repeat may itself stand for several coalesced occurrences
+    self.firstSeenAt = [first earlierDate:(repeat.firstSeenAt ? repeat.firstSeenAt : repeat.occurredAt)];
+    self.lastSeenAt = [last laterDate:(repeat.lastSeenAt ? repeat.lastSeenAt : repeat.occurredAt)];
+    NSUInteger repeatCount = repeat.occurrenceCount ? [repeat.occurrenceCount unsignedIntegerValue] : 1;
+    self.occurrenceCount = [NSNumber numberWithUnsignedInteger:(self.occurrenceCount ? [self.occurrenceCount unsignedIntegerValue] : 1) + repeatCount];
+    NSMutableArray *keys = [NSMutableArray arrayWithObjects:@"occurrenceCount", @"firstSeenAt", @"lastSeenAt", NULL];
+
+    NSMutableArray *candidates = [NSMutableArray array];
+    if (repeat.message)
+        [candidates addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                               repeat.message, @"message",
+                               SCISO8601StringFromDate(repeat.occurredAt), @"occurred_at",
+                               NULL]];
+    if (repeat.variants) [candidates addObjectsFromArray:repeat.variants];
+
+    NSMutableArray *known = [NSMutableArray arrayWithArray:self.variants];
+    NSUInteger maximumVariants = [SquashCocoa sharedClient].maximumVariants;
+    for (NSDictionary *variant in candidates) {
+        if ([known count] >= maximumVariants) break;
+        NSString *variantMessage = [variant objectForKey:@"message"];
+        if ([variantMessage isEqualToString:self.message] || [[known valueForKey:@"message"] containsObject:variantMessage]) continue;
+        [known addObject:variant];
+    }
+    if ([known count] > [self.variants count]) {
+        self.variants = known;
+        [keys addObject:@"variants"];
+    }
+
+    // the repeat may carry drop counts of its own, which must not be lost
+    if (repeat.droppedOccurrences) {
+        NSMutableDictionary *dropped = [NSMutableDictionary dictionaryWithDictionary:self.droppedOccurrences];
+        for (NSString *className in repeat.droppedOccurrences) {
+            NSUInteger count = [[dropped objectForKey:className] unsignedIntegerValue] + [[repeat.droppedOccurrences objectForKey:className] unsignedIntegerValue];
+            [dropped setObject:[NSNumber numberWithUnsignedInteger:count] forKey:className];
+        }
+        self.droppedOccurrences = dropped;
+        [keys addObject:@"droppedOccurrences"];
+    }
+
+    return keys;
+}
+
 #pragma mark Serialization
 
 - (void) writeToFile {
-    [[NSFileManager defaultManager] createDirectoryAtPath:[[SquashCocoa sharedClient] occurrencesDirectory] withIntermediateDirectories:YES attributes:NULL error:NULL];
-    [NSKeyedArchiver archiveRootObject:self toFile:[self filePath]];
+    [[SCJournal sharedJournal] appendOccurrence:self];
+}
+
+- (void) requestLateLocation {
+    if ([CLLocationManager authorizationStatus] != kCLAuthorizationStatusAuthorized) return;
+    [[SCOccurrenceLocationDelegate sharedDelegate] enrollOccurrence:self];
+}
+
+- (void) removeFromQueue {
+    [[SCJournal sharedJournal] appendRemovalOfOccurrence:self];
+}
+
+- (NSData *) journalRepresentation {
+    NSMutableData *data = [NSMutableData dataWithCapacity:4096];
+    for (NSUInteger idx = 0; idx < SCJournalKeyCount; idx++)
+        SCJournalAppendField(data, (uint16_t)(idx + 1), [self valueForKey:SCJournalKeys[idx]]);
+    return data;
+}
+
+- (NSData *) journalRepresentationOfKeys:(NSArray *)keys {
+    NSMutableData *data = [NSMutableData dataWithCapacity:256];
+    for (NSUInteger idx = 0; idx < SCJournalKeyCount; idx++)
+        if ([keys containsObject:SCJournalKeys[idx]])
+            SCJournalAppendField(data, (uint16_t)(idx + 1), [self valueForKey:SCJournalKeys[idx]]);
+    return data;
+}
+
+- (void) applyJournalRepresentation:(const void *)bytes length:(NSUInteger)length {
+    NSUInteger offset = 0;
+    while (offset + sizeof(SCJournalFieldHeader) <= length) {
+        SCJournalFieldHeader field;
+        memcpy(&field, (const uint8_t *)bytes + offset, sizeof(field));
+        offset += sizeof(field);
+        if (field.length > length - offset) break;
+
+        // tags from newer versions of the library are skipped
+        if (field.tag >= 1 && field.tag <= SCJournalKeyCount) {
+            id value = SCJournalCreateValue(field.kind, (const uint8_t *)bytes + offset, field.length);
+            if (value && field.kind == SCJournalFieldJSON && [SCJournalKeys[field.tag - 1] isEqualToString:@"backtraces"])
+                [self setValue:SCBacktraceFromStoredValue(value) forKey:@"backtraces"];
+            else if (value)
+                [self setValue:value forKey:SCJournalKeys[field.tag - 1]];
+            [value release];
+        }
+        offset += field.length;
+    }
 }
 
 - (void) encodeWithCoder:(NSCoder *)coder {
@@ -329,12 +801,19 @@
     [coder encodeObject:self.arguments forKey:@"SCArguments"];
     
     [coder encodeObject:self.hostname forKey:@"SCHostname"];
+    [coder encodeObject:self.PID forKey:@"SCPID"];
+    [coder encodeObject:self.processPath forKey:@"SCProcessPath"];
+    [coder encodeObject:self.parentProcessName forKey:@"SCParentProcessName"];
+    [coder encodeObject:self.processRunningNatively forKey:@"SCProcessRunningNatively"];
+    [coder encodeObject:self.architecture forKey:@"SCArchitecture"];
     
     [coder encodeObject:self.version forKey:@"SCVersion"];
     [coder encodeObject:self.build forKey:@"SCBuild"];
     [coder encodeObject:self.deviceID forKey:@"SCDeviceID"];
     [coder encodeObject:self.deviceType forKey:@"SCDeviceType"];
     [coder encodeObject:self.operatingSystem forKey:@"SCOperatingSystem"];
+    [coder encodeObject:self.operatingSystemVersion forKey:@"SCOperatingSystemVersion"];
+    [coder encodeObject:self.operatingSystemBuild forKey:@"SCOperatingSystemBuild"];
     
     [coder encodeObject:self.physicalMemory forKey:@"SCPhysicalMemory"];
     [coder encodeObject:self.powerState forKey:@"SCPowerState"];
@@ -350,24 +829,48 @@
     [coder encodeObject:self.networkOperator forKey:@"SCNetworkOperator"];
     [coder encodeObject:self.networkType forKey:@"SCNetworkType"];
     [coder encodeObject:self.connectivity forKey:@"SCConnectivity"];
+
+    [coder encodeObject:self.fingerprint forKey:@"SCFingerprint"];
+    [coder encodeObject:self.occurrenceCount forKey:@"SCOccurrenceCount"];
+    [coder encodeObject:self.firstSeenAt forKey:@"SCFirstSeenAt"];
+    [coder encodeObject:self.lastSeenAt forKey:@"SCLastSeenAt"];
+    [coder encodeObject:self.variants forKey:@"SCVariants"];
+    [coder encodeObject:self.droppedOccurrences forKey:@"SCDroppedOccurrences"];
+    [coder encodeObject:self.sampleRate forKey:@"SCSampleRate"];
+    [coder encodeObject:self.fatal forKey:@"SCFatal"];
+    [coder encodeObject:self.breadcrumbs forKey:@"SCBreadcrumbs"];
+    [coder encodeObject:self.performanceMetrics forKey:@"SCPerformanceMetrics"];
 }
 
 #pragma mark Reporting
 
-- (BOOL) report {
+- (NSURLRequest *) notifyRequest {
+    return [self notifyRequestWithBody:[self asJSON]];
+}
+
+- (NSURLRequest *) notifyRequestWithBody:(NSData *)body {
     NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[[SquashCocoa sharedClient] notifyURL] cachePolicy:NSURLRequestUseProtocolCachePolicy timeoutInterval:60.0];
     [request setHTTPMethod:@"POST"];
     [request setValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
     [request setValue:@"application/json" forHTTPHeaderField:@"Accept"];
-    [request setValue:@"utf-8" forHTTPHeaderField:@"Accept-Encoding"];
-    [request setHTTPBody:[self asJSON]];
+    [request setValue:@"gzip, deflate" forHTTPHeaderField:@"Accept-Encoding"];
+    [request setHTTPBody:body];
     [request setTimeoutInterval:[SquashCocoa sharedClient].timeout];
-    
+    return [request autorelease];
+}
+
+- (BOOL) report {
     NSHTTPURLResponse *response = NULL;
+    NSURLRequest *request = [self notifyRequest];
+    uint64_t start = SCTelemetryTimestamp();
     [NSURLConnection sendSynchronousRequest:request returningResponse:&response error:NULL];
-    [request release];
-    
-    return response && [response statusCode]/100 == 2;
+    BOOL success = response && [response statusCode]/100 == 2;
+
+    SCTelemetry *telemetry = [SCTelemetry sharedTelemetry];
+    [telemetry recordValue:SCTelemetryMicrosecondsSince(start)/1000 inHistogram:SCTelemetryUploadLatency];
+    [telemetry incrementCounter:SCTelemetryBytesUploaded by:[[request HTTPBody] length]];
+    [telemetry recordUploadWithStatusCode:[response statusCode] success:success];
+    return success;
 }
 
 @end
@@ -384,57 +887,38 @@
         UUID = (NSString *)CFUUIDCreateString(NULL, UUIDObject);
         CFRelease(UUIDObject);
         
-        symbolicationID = SCExecutableUUID();
-        
         self.revision = [[SquashCocoa sharedClient] revision];
         self.occurredAt = [NSDate date];
         self.client = [[SquashCocoa sharedClient] clientName];
-        
-        NSProcessInfo *info = [NSProcessInfo processInfo];
-        self.arguments = [info arguments];
-        self.envVars = [info environment];
-        self.hostname = [info hostName];
-        self.operatingSystem = [info operatingSystemVersionString];
-        self.physicalMemory = [NSNumber numberWithLongLong:[info physicalMemory]];
-        
+
+        // facts that can't change while the process runs are collected once
+        // and shared by every occurrence
+        SCProcessContext *context = [SCProcessContext currentContext];
+        symbolicationID = [context.symbolicationID retain];
+        self.arguments = context.arguments;
+        self.envVars = context.environment;
+        self.hostname = context.hostname;
+        self.operatingSystem = context.operatingSystem;
+        self.physicalMemory = context.physicalMemory;
+        self.deviceType = context.deviceType;
+        self.version = context.version;
+        self.build = context.build;
+
 #if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
         UIDevice *device = [UIDevice currentDevice];
         self.powerState = [batteryStates objectForKey:[NSNumber numberWithInt:device.batteryState]];
-        self.deviceType = device.model;
         self.orientation = [orientations objectForKey:[NSNumber numberWithInt:device.orientation]];
-#elif TARGET_OS_MAC
-		size_t len = 0;
-		sysctlbyname("hw.model", NULL, &len, NULL, 0);
-		if (len) {
-			char *model = malloc(len * sizeof(char));
-			sysctlbyname("hw.model", model, &len, NULL, 0);
-			self.deviceType = [NSString stringWithUTF8String:model];
-			free(model);
-		} else {
-			self.deviceType = nil;
-		}
 #endif
-        
-        self.version = [[[NSBundle mainBundle] infoDictionary] objectForKey:@"CFBundleShortVersionString"];
-        self.build = [[[NSBundle mainBundle] infoDictionary] objectForKey:@"CFBundleVersion"];
-
-        if ([CLLocationManager authorizationStatus] == kCLAuthorizationStatusAuthorized) {
-            CLLocationManager *locationManager = [[CLLocationManager alloc] init];
-            SCOccurrenceLocationDelegate *delegate = [[SCOccurrenceLocationDelegate alloc] init];
-            delegate.occurrence = self;
-            locationManager.delegate = [delegate autorelease];
-            locationManager.desiredAccuracy = kCLLocationAccuracyHundredMeters;
-#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
-            [locationManager startUpdatingHeading];
-#endif
-            [locationManager startUpdatingLocation];
-            [locationManager autorelease];
-        }
 
-        Reachability *currentReachability = [[Reachability reachabilityForInternetConnection] retain];
-        NetworkStatus status = [currentReachability currentReachabilityStatus];
-        [currentReachability release];
-        switch (status) {
+        if ([CLLocationManager authorizationStatus] == kCLAuthorizationStatusAuthorized)
+            [[SCOccurrenceLocationDelegate sharedDelegate] applyToOccurrence:self];
+
+        static Reachability *internetReachability = nil;
+        static dispatch_once_t once;
+        dispatch_once(&once, ^{
+            internetReachability = [[Reachability reachabilityForInternetConnection] retain];
+        });
+        switch ([internetReachability currentReachabilityStatus]) {
             case NotReachable: self.connectivity = @"none"; break;
             case ReachableViaWWAN: self.connectivity = @"wwan"; break;
             case ReachableViaWiFi: self.connectivity = @"wifi"; break;
@@ -443,70 +927,127 @@
     return self;
 }
 
+#pragma mark Coalescing
+
+- (void) computeFingerprint {
+    NSString *value = SCCreateFingerprint(self.exceptionClassName, self.backtraces, [SquashCocoa sharedClient].fingerprintFrameCount);
+    self.fingerprint = value;
+    [value release];
+}
+
 #pragma mark Updates
 
-- (void) didReceiveNewData {
-    [self writeToFile];
+- (void) didReceiveNewDataForKeys:(NSArray *)keys {
+    [[SCJournal sharedJournal] appendUpdateOfKeys:keys forOccurrence:self];
 }
 
 #pragma mark Serialization
 
-- (NSString *) filePath {
-    NSString *path = [[SquashCocoa sharedClient] occurrencesDirectory];
-    path = [path stringByAppendingPathComponent:[self.UUID stringByAppendingString:@".occurrence"]];
-    return path;
+- (NSData *) asJSON {
+    return [self asJSONWithContextID:nil includingContext:YES];
 }
 
-- (NSData *) asJSON {
-    ISO8601DateFormatter *formatter = [[ISO8601DateFormatter alloc] init];
-    formatter.includeTime = YES;
-
-    NSMutableDictionary *dictionary = [[NSMutableDictionary alloc] initWithCapacity:31];
-    [dictionary setObject:[SquashCocoa sharedClient].APIKey forKey:@"api_key"];
-    [dictionary setObject:[SquashCocoa sharedClient].environment forKey:@"environment"];
-    [dictionary setObject:self.symbolicationID forKey:@"symbolication_id"];
-    [dictionary setObject:self.revision forKey:@"revision"];
-    [dictionary setObject:[formatter stringFromDate:self.occurredAt] forKey:@"occurred_at"];
-    [dictionary setObject:self.client forKey:@"client"];
-    [dictionary setObject:self.exceptionClassName forKey:@"class_name"];
-    [dictionary setObject:self.message forKey:@"message"];
-    [dictionary setObject:self.backtraces forKey:@"backtraces"];
-    if (self.userData) [dictionary setObject:userData forKey:@"user_data"];
-    if (self.parentExceptions) [dictionary setObject:parentExceptions forKey:@"parent_exceptions"];
-    if (self.envVars) [dictionary setObject:envVars forKey:@"env_vars"];
-    if (self.arguments) [dictionary setObject:[arguments componentsJoinedByString:@" "] forKey:@"arguments"];
-    if (self.hostname) [dictionary setObject:hostname forKey:@"hostname"];
-    if (self.PID) [dictionary setObject:PID forKey:@"pid"];
-    if (self.processPath) [dictionary setObject:processPath forKey:@"process_path"];
-    if (self.parentProcessName) [dictionary setObject:parentProcessName forKey:@"parent_process"];
-    if (self.processRunningNatively) [dictionary setObject:processRunningNatively forKey:@"process_native"];
-    if (self.version) [dictionary setObject:version forKey:@"version"];
-    if (self.build) [dictionary setObject:build forKey:@"build"];
-    if (self.deviceID) [dictionary setObject:deviceID forKey:@"device_id"];
-    if (self.deviceType) [dictionary setObject:deviceType forKey:@"device_type"];
-    if (self.operatingSystem) [dictionary setObject:operatingSystem forKey:@"operating_system"];
-    if (self.operatingSystemVersion) [dictionary setObject:operatingSystemVersion forKey:@"os_version"];
-    if (self.operatingSystemBuild) [dictionary setObject:operatingSystemBuild forKey:@"os_build"];
-    if (self.architecture) [dictionary setObject:architecture forKey:@"architecture"];
-    if (self.physicalMemory) [dictionary setObject:physicalMemory forKey:@"physical_memory"];
-    if (self.powerState) [dictionary setObject:powerState forKey:@"power_state"];
-    if (self.orientation) [dictionary setObject:orientation forKey:@"orientation"];
-    if (self.lat) [dictionary setObject:lat forKey:@"lat"];
-    if (self.lon) [dictionary setObject:lon forKey:@"lon"];
-    if (self.altitude) [dictionary setObject:altitude forKey:@"altitude"];
-    if (self.locationPrecision) [dictionary setObject:locationPrecision forKey:@"location_precision"];
-    if (self.heading) [dictionary setObject:heading forKey:@"heading"];
-    if (self.speed) [dictionary setObject:speed forKey:@"speed"];
-    if (self.networkOperator) [dictionary setObject:networkOperator forKey:@"network_operator"];
-    if (self.networkType) [dictionary setObject:networkType forKey:@"network_type"];
-    if (self.connectivity) [dictionary setObject:connectivity forKey:@"connectivity"];
-    
-    NSData *data = [NSJSONSerialization dataWithJSONObject:dictionary options:0 error:NULL];
-    [dictionary release];
-    [formatter release];
+- (NSData *) asJSONWithContextID:(NSString *)contextID includingContext:(BOOL)includeContext {
+    SCJSONWriter *writer = [[SCJSONWriter alloc] init];
+    [self writeJSONTo:writer contextID:contextID includingContext:includeContext];
+    NSData *data = [[[writer data] retain] autorelease];
+    [writer release];
+    [[SCTelemetry sharedTelemetry] recordValue:[data length] inHistogram:SCTelemetryPayloadBytes];
     return data;
 }
 
+- (void) writeJSONTo:(SCJSONWriter *)writer {
+    [self writeJSONTo:writer contextID:nil includingContext:YES];
+}
+
+- (void) writeJSONTo:(SCJSONWriter *)writer contextID:(NSString *)contextID includingContext:(BOOL)includeContext {
+    [writer beginObject];
+    [writer writeKey:@"api_key"]; [writer writeString:[SquashCocoa sharedClient].APIKey];
+    [writer writeKey:@"environment"]; [writer writeString:[SquashCocoa sharedClient].environment];
+    if (contextID) { [writer writeKey:@"context_id"]; [writer writeString:contextID]; }
+    if (includeContext) [self writeContextTo:writer];
+    [writer writeKey:@"revision"]; [writer writeString:self.revision];
+    [writer writeKey:@"occurred_at"]; [writer writeString:SCISO8601StringFromDate(self.occurredAt)];
+    [writer writeKey:@"client"]; [writer writeString:self.client];
+    [writer writeKey:@"class_name"]; [writer writeString:self.exceptionClassName];
+    [writer writeKey:@"message"]; [writer writeString:self.message];
+    [writer writeKey:@"backtraces"]; [self.backtraces writeJSONTo:writer];
+    if (self.userData) { [writer writeKey:@"user_data"]; [writer writeObject:userData]; }
+    if (self.parentExceptions) { [writer writeKey:@"parent_exceptions"]; [writer writeObject:parentExceptions]; }
+    if (self.PID) { [writer writeKey:@"pid"]; [writer writeObject:PID]; }
+    if (self.processPath) { [writer writeKey:@"process_path"]; [writer writeString:processPath]; }
+    if (self.parentProcessName) { [writer writeKey:@"parent_process"]; [writer writeString:parentProcessName]; }
+    if (self.processRunningNatively) { [writer writeKey:@"process_native"]; [writer writeObject:processRunningNatively]; }
+    if (self.deviceID) { [writer writeKey:@"device_id"]; [writer writeString:deviceID]; }
+    if (self.powerState) { [writer writeKey:@"power_state"]; [writer writeString:powerState]; }
+    if (self.orientation) { [writer writeKey:@"orientation"]; [writer writeString:orientation]; }
+    if (self.lat) { [writer writeKey:@"lat"]; [writer writeObject:lat]; }
+    if (self.lon) { [writer writeKey:@"lon"]; [writer writeObject:lon]; }
+    if (self.altitude) { [writer writeKey:@"altitude"]; [writer writeObject:altitude]; }
+    if (self.locationPrecision) { [writer writeKey:@"location_precision"]; [writer writeObject:locationPrecision]; }
+    if (self.heading) { [writer writeKey:@"heading"]; [writer writeObject:heading]; }
+    if (self.speed) { [writer writeKey:@"speed"]; [writer writeObject:speed]; }
+    if (self.networkOperator) { [writer writeKey:@"network_operator"]; [writer writeString:networkOperator]; }
+    if (self.networkType) { [writer writeKey:@"network_type"]; [writer writeString:networkType]; }
+    if (self.connectivity) { [writer writeKey:@"connectivity"]; [writer writeString:connectivity]; }
+    if (self.fingerprint) { [writer writeKey:@"fingerprint"]; [writer writeString:fingerprint]; }
+    if ([self.occurrenceCount unsignedIntegerValue] > 1) {
+        [writer writeKey:@"occurrence_count"]; [writer writeObject:occurrenceCount];
+        [writer writeKey:@"first_seen_at"]; [writer writeString:SCISO8601StringFromDate(firstSeenAt)];
+        [writer writeKey:@"last_seen_at"]; [writer writeString:SCISO8601StringFromDate(lastSeenAt)];
+        if (self.variants) { [writer writeKey:@"variants"]; [writer writeObject:variants]; }
+    }
+    if ([self.breadcrumbs count]) { [writer writeKey:@"breadcrumbs"]; [writer writeObject:breadcrumbs]; }
+    if (self.performanceMetrics) { [writer writeKey:@"performance"]; [writer writeObject:performanceMetrics]; }
+    if (self.droppedOccurrences) { [writer writeKey:@"dropped_occurrences"]; [writer writeObject:droppedOccurrences]; }
+    if (self.sampleRate) { [writer writeKey:@"sample_rate"]; [writer writeObject:sampleRate]; }
+    if (self.evictedOccurrences) { [writer writeKey:@"evicted_occurrences"]; [writer writeObject:evictedOccurrences]; }
+    if (self.clientStats) { [writer writeKey:@"client_stats"]; [writer writeObject:clientStats]; }
+    [writer endObject];
+}
+
+- (NSString *) contextID {
+    SCJSONWriter *writer = [[SCJSONWriter alloc] init];
+    [writer beginObject];
+    [self writeContextTo:writer];
+    [writer endObject];
+    NSData *data = [writer data];
+
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256([data bytes], (CC_LONG)[data length], digest);
+    [writer release];
+
+    char hex[CC_SHA256_DIGEST_LENGTH*2 + 1];
+    for (NSUInteger idx = 0; idx < CC_SHA256_DIGEST_LENGTH; idx++)
+        snprintf(hex + idx*2, 3, "%02x", digest[idx]);
+    return [NSString stringWithUTF8String:hex];
+}
+
+// the fields covered by contextID, in a fixed order (environment variables
+// sorted by name) so that equal contexts hash equally
+- (void) writeContextTo:(SCJSONWriter *)writer {
+    [writer writeKey:@"symbolication_id"]; [writer writeString:self.symbolicationID];
+    if (self.envVars) {
+        [writer writeKey:@"env_vars"];
+        [writer beginObject];
+        for (NSString *name in [[envVars allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+            [writer writeKey:name];
+            [writer writeObject:[envVars objectForKey:name]];
+        }
+        [writer endObject];
+    }
+    if (self.arguments) { [writer writeKey:@"arguments"]; [writer writeString:[arguments componentsJoinedByString:@" "]]; }
+    if (self.hostname) { [writer writeKey:@"hostname"]; [writer writeString:hostname]; }
+    if (self.version) { [writer writeKey:@"version"]; [writer writeString:version]; }
+    if (self.build) { [writer writeKey:@"build"]; [writer writeString:build]; }
+    if (self.deviceType) { [writer writeKey:@"device_type"]; [writer writeString:deviceType]; }
+    if (self.operatingSystem) { [writer writeKey:@"operating_system"]; [writer writeString:operatingSystem]; }
+    if (self.operatingSystemVersion) { [writer writeKey:@"os_version"]; [writer writeString:operatingSystemVersion]; }
+    if (self.operatingSystemBuild) { [writer writeKey:@"os_build"]; [writer writeString:operatingSystemBuild]; }
+    if (self.architecture) { [writer writeKey:@"architecture"]; [writer writeString:architecture]; }
+    if (self.physicalMemory) { [writer writeKey:@"physical_memory"]; [writer writeObject:physicalMemory]; }
+}
+
 - (NSString *) description {
     return [NSString stringWithFormat:@"<SCOccurrence: className = %@, message = %@>", self.exceptionClassName, self.message];
 }
@@ -517,28 +1058,106 @@
 
 @implementation SCOccurrenceLocationDelegate
 
-#pragma mark Properties
+#pragma mark Singleton
+
++ (SCOccurrenceLocationDelegate *) sharedDelegate {
+    static SCOccurrenceLocationDelegate *sharedDelegate = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sharedDelegate = [[SCOccurrenceLocationDelegate alloc] init];
+    });
+    return sharedDelegate;
+}
 
-@synthesize occurrence;
+#pragma mark Initializers
+
+- (id) init {
+    if (self = [super init]) {
+        pendingOccurrences = [[NSMutableArray alloc] init];
+        pendingKeys = [[NSMutableSet alloc] init];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    locationManager.delegate = nil;
+    [locationManager release];
+    [location release];
+    [heading release];
+    [headingDate release];
+    [lastRefresh release];
+    [pendingOccurrences release];
+    [pendingKeys release];
+    [super dealloc];
+}
+
+#pragma mark Occurrences
+
+- (void) applyToOccurrence:(SCOccurrence *)occurrence {
+    @synchronized(self) {
+        BOOL locationFresh = location && -[location.timestamp timeIntervalSinceNow] < SCLocationMaximumAge;
+        BOOL headingFresh = heading && -[headingDate timeIntervalSinceNow] < SCLocationMaximumAge;
+        [self copyLocation:locationFresh heading:headingFresh toOccurrence:occurrence];
+    }
+}
+
+- (void) enrollOccurrence:(SCOccurrence *)occurrence {
+    BOOL refresh = NO;
+    @synchronized(self) {
+        if (occurrence.lat && (occurrence.heading || ![self wantsHeading])) return;
+        if ([pendingOccurrences indexOfObjectIdenticalTo:occurrence] != NSNotFound) return;
+
+        if (!updating) {
+            if (lastRefresh && -[lastRefresh timeIntervalSinceNow] < SCLocationRefreshInterval) return;
+            [lastRefresh release];
+            lastRefresh = [[NSDate alloc] init];
+            updating = YES;
+            locationReceived = NO;
+            headingReceived = NO;
+            refresh = YES;
+        }
+        if ([pendingOccurrences count] < SCLocationMaximumPending)
+            [pendingOccurrences addObject:occurrence];
+    }
+
+    // location managers deliver to the run loop they were created on
+    if (refresh) dispatch_async(dispatch_get_main_queue(), ^{ [self startUpdating]; });
+}
 
 #pragma mark SCLocationDelegate (implemented)
 
 #if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
 - (void) locationManager:(CLLocationManager *)manager didUpdateHeading:(CLHeading *)newHeading {
     [manager stopUpdatingHeading];
-    occurrence.heading = [NSNumber numberWithDouble:[newHeading trueHeading]];
-    [occurrence didReceiveNewData];
+    @synchronized(self) {
+        [heading release];
+        heading = [[NSNumber alloc] initWithDouble:[newHeading trueHeading]];
+        [headingDate release];
+        headingDate = [[NSDate alloc] init];
+        [pendingKeys addObject:@"heading"];
+        headingReceived = YES;
+        if (!locationReceived) {
+            [self scheduleFlush];
+            return;
+        }
+    }
+    [self finishUpdating];
 }
 #endif
 
 - (void) locationManager:(CLLocationManager *)manager didUpdateToLocation:(CLLocation *)newLocation fromLocation:(CLLocation *)oldLocation {
 	[manager stopUpdatingLocation];
-    occurrence.lat = [NSNumber numberWithDouble:newLocation.coordinate.latitude];
-    occurrence.lon = [NSNumber numberWithDouble:newLocation.coordinate.longitude];
-    occurrence.altitude = [NSNumber numberWithDouble:newLocation.altitude];
-    occurrence.locationPrecision = [NSNumber numberWithDouble:newLocation.horizontalAccuracy];
-    occurrence.speed = [NSNumber numberWithDouble:newLocation.speed];
-    [occurrence didReceiveNewData];
+    @synchronized(self) {
+        [location release];
+        location = [newLocation retain];
+        [pendingKeys addObjectsFromArray:[NSArray arrayWithObjects:@"lat", @"lon", @"altitude", @"locationPrecision", @"speed", NULL]];
+        locationReceived = YES;
+        if ([self wantsHeading] && !headingReceived) {
+            [self scheduleFlush];
+            return;
+        }
+    }
+    [self finishUpdating];
 }
 
 #pragma mark SCLocationDelegate (ignored)
@@ -556,7 +1175,7 @@
 }
 
 - (void) locationManager:(CLLocationManager *)manager didFailWithError:(NSError *)error {
-    
+    [self finishUpdating];
 }
 
 - (void) locationManager:(CLLocationManager *)manager didStartMonitoringForRegion:(CLRegion *)region {
@@ -568,3 +1187,253 @@
 }
 
 @end
+
+@implementation SCOccurrenceLocationDelegate (Private)
+
+- (BOOL) wantsHeading {
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+    return [CLLocationManager headingAvailable];
+#else
+    return NO;
+#endif
+}
+
+// call while synchronized on self
+- (void) copyLocation:(BOOL)copyLocation heading:(BOOL)copyHeading toOccurrence:(SCOccurrence *)occurrence {
+    if (copyLocation && location) {
+        occurrence.lat = [NSNumber numberWithDouble:location.coordinate.latitude];
+        occurrence.lon = [NSNumber numberWithDouble:location.coordinate.longitude];
+        occurrence.altitude = [NSNumber numberWithDouble:location.altitude];
+        occurrence.locationPrecision = [NSNumber numberWithDouble:location.horizontalAccuracy];
+        occurrence.speed = [NSNumber numberWithDouble:location.speed];
+    }
+    if (copyHeading && heading) occurrence.heading = heading;
+}
+
+// main thread only
+- (void) startUpdating {
+    if (!locationManager) {
+        locationManager = [[CLLocationManager alloc] init];
+        locationManager.delegate = self;
+        locationManager.desiredAccuracy = kCLLocationAccuracyHundredMeters;
+    }
+    if ([self wantsHeading]) [locationManager startUpdatingHeading];
+    [locationManager startUpdatingLocation];
+
+    // the timeout fires before another refresh can start, so it can't stop the
+    // wrong one
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(SCLocationRefreshTimeout * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        BOOL stillUpdating;
+        @synchronized(self) { stillUpdating = updating; }
+        if (stillUpdating) [self finishUpdating];
+    });
+}
+
+// main thread only
+- (void) finishUpdating {
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+    [locationManager stopUpdatingHeading];
+#endif
+    [locationManager stopUpdatingLocation];
+    @synchronized(self) {
+        updating = NO;
+        [self scheduleFlush];
+    }
+}
+
+// call while synchronized on self
+- (void) scheduleFlush {
+    if (flushScheduled) return;
+    flushScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(SCLocationCoalescingDelay * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+        [self flush];
+    });
+}
+
+// Writes everything that arrived since the last flush to each waiting
+// occurrence as one journal update. Occurrences stop waiting once the refresh
+// is over.
+- (void) flush {
+    NSArray *occurrences;
+    NSArray *keys;
+    @synchronized(self) {
+        flushScheduled = NO;
+        occurrences = [NSArray arrayWithArray:pendingOccurrences];
+        keys = [pendingKeys allObjects];
+        [pendingKeys removeAllObjects];
+        if (!updating) [pendingOccurrences removeAllObjects];
+        if ([keys count] == 0) return;
+        for (SCOccurrence *occurrence in occurrences) [self copyLocation:YES heading:YES toOccurrence:occurrence];
+    }
+    for (SCOccurrence *occurrence in occurrences) [occurrence didReceiveNewDataForKeys:keys];
+}
+
+@end
+
+#pragma mark -
+
+static void SCJournalAppendField(NSMutableData *data, uint16_t tag, id value) {
+    if (!value || value == [NSNull null]) return;
+
+    SCJournalFieldHeader field = { tag, 0, 0, 0 };
+    NSData *encoded = nil;
+    union { double d; int64_t i; uint64_t u; uint8_t b; } scalar;
+
+    if ([value isKindOfClass:[NSString class]]) {
+        field.kind = SCJournalFieldString;
+        encoded = [value dataUsingEncoding:NSUTF8StringEncoding];
+    }
+    else if ([value isKindOfClass:[NSDate class]]) {
+        field.kind = SCJournalFieldDate;
+        scalar.d = [value timeIntervalSince1970];
+        encoded = [NSData dataWithBytes:&scalar.d length:sizeof(double)];
+    }
+    else if ([value isKindOfClass:[NSNumber class]]) {
+        if ((CFBooleanRef)value == kCFBooleanTrue || (CFBooleanRef)value == kCFBooleanFalse) {
+            field.kind = SCJournalFieldBool;
+            scalar.b = [value boolValue];
+            encoded = [NSData dataWithBytes:&scalar.b length:1];
+        } else if (CFNumberIsFloatType((CFNumberRef)value)) {
+            field.kind = SCJournalFieldDouble;
+            scalar.d = [value doubleValue];
+            encoded = [NSData dataWithBytes:&scalar.d length:sizeof(double)];
+        } else if (*[value objCType] == 'Q') {
+            field.kind = SCJournalFieldUnsignedInteger;
+            scalar.u = [value unsignedLongLongValue];
+            encoded = [NSData dataWithBytes:&scalar.u length:sizeof(uint64_t)];
+        } else {
+            field.kind = SCJournalFieldInteger;
+            scalar.i = [value longLongValue];
+            encoded = [NSData dataWithBytes:&scalar.i length:sizeof(int64_t)];
+        }
+    }
+    else if ([value isKindOfClass:[SCBacktrace class]]) {
+        field.kind = SCJournalFieldBacktrace;
+        encoded = [value dataRepresentation];
+    }
+    else if ([NSJSONSerialization isValidJSONObject:value]) {
+        field.kind = SCJournalFieldJSON;
+        encoded = [NSJSONSerialization dataWithJSONObject:value options:0 error:NULL];
+    }
+    if (!encoded) return;
+
+    field.length = (uint32_t)[encoded length];
+    [data appendBytes:&field length:sizeof(field)];
+    [data appendData:encoded];
+}
+
+static id SCJournalCreateValue(uint8_t kind, const uint8_t *bytes, uint32_t length) {
+    double d; int64_t i; uint64_t u;
+    switch (kind) {
+        case SCJournalFieldString:
+            return [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+        case SCJournalFieldDate:
+            if (length != sizeof(double)) return nil;
+            memcpy(&d, bytes, sizeof(double));
+            return [[NSDate alloc] initWithTimeIntervalSince1970:d];
+        case SCJournalFieldDouble:
+            if (length != sizeof(double)) return nil;
+            memcpy(&d, bytes, sizeof(double));
+            return [[NSNumber alloc] initWithDouble:d];
+        case SCJournalFieldInteger:
+            if (length != sizeof(int64_t)) return nil;
+            memcpy(&i, bytes, sizeof(int64_t));
+            return [[NSNumber alloc] initWithLongLong:i];
+        case SCJournalFieldUnsignedInteger:
+            if (length != sizeof(uint64_t)) return nil;
+            memcpy(&u, bytes, sizeof(uint64_t));
+            return [[NSNumber alloc] initWithUnsignedLongLong:u];
+        case SCJournalFieldBool:
+            if (length != 1) return nil;
+            return [[NSNumber alloc] initWithBool:bytes[0] != 0];
+        case SCJournalFieldJSON: {
+            NSData *data = [[NSData alloc] initWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
+            id value = [NSJSONSerialization JSONObjectWithData:data options:0 error:NULL];
+            [data release];
+            return [value retain];
+        }
+        case SCJournalFieldBacktrace:
+            return [[SCBacktrace alloc] initWithBytes:bytes length:length];
+        default:
+            return nil;
+    }
+}
+
+static uint64_t SCFingerprintAppend(uint64_t hash, const void *bytes, size_t length) {
+    // 64-bit FNV-1a
+    for (size_t idx = 0; idx < length; idx++) {
+        hash ^= ((const uint8_t *)bytes)[idx];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void SCAddCrashReportFrames(SCBacktrace *backtrace, NSArray *frames, const uint64_t *imageBases, const uint64_t *imageSizes, const uint32_t *imageUUIDs, NSUInteger imageCount) {
+    for (PLCrashReportStackFrameInfo *frame in frames) {
+        uint64_t address = frame.instructionPointer;
+        uint32_t image = SCBacktraceNoImage;
+        uint64_t offset = 0;
+        for (NSUInteger idx = 0; idx < imageCount; idx++) {
+            if (address < imageBases[idx] || address - imageBases[idx] >= imageSizes[idx]) continue;
+            image = imageUUIDs[idx];
+            if (image != SCBacktraceNoImage) offset = address - imageBases[idx];
+            break;
+        }
+        [backtrace addFrameWithAddress:address image:image offset:offset];
+    }
+}
+
+static NSString *SCStringFromCrashReportString(SCCrashReportString string) {
+    if (!string.bytes) return nil;
+    return [[[NSString alloc] initWithBytes:string.bytes length:string.length encoding:NSUTF8StringEncoding] autorelease];
+}
+
+static void SCCrashReportBeginThread(void *context, uint32_t number, bool crashed, bool registers) {
+    SCCrashReportBacktraceBuilder *builder = context;
+    [builder->backtrace beginThreadNamed:[NSString stringWithFormat:@"Thread %ld", (long)number] faulted:crashed registers:registers];
+    [builder->backtrace addThreadNumber:number];
+}
+
+// matches SCAddCrashReportFrames: offsets are only kept for images with a UUID
+static void SCCrashReportAddFrame(void *context, uint64_t address, uint32_t image, uint64_t offset) {
+    SCCrashReportBacktraceBuilder *builder = context;
+    uint32_t UUID = (image == SCCrashReportNoImage) ? SCBacktraceNoImage : builder->imageUUIDs[image];
+    [builder->backtrace addFrameWithAddress:address image:UUID offset:(UUID == SCBacktraceNoImage ? 0 : offset)];
+}
+
+static void SCCrashReportAddRegister(void *context, SCCrashReportString name, uint64_t value) {
+    SCCrashReportBacktraceBuilder *builder = context;
+    [builder->backtrace addRegisterNamed:SCStringFromCrashReportString(name) value:value];
+}
+
+static NSString *SCCreateFingerprint(NSString *className, SCBacktrace *backtraces, NSUInteger frameCount) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const char *name = [className UTF8String];
+    if (name) hash = SCFingerprintAppend(hash, name, strlen(name) + 1);
+
+    NSUInteger thread = [backtraces faultedThread];
+    NSUInteger count = (thread == NSNotFound) ? 0 : MIN(frameCount, [backtraces frameCountInThread:thread]);
+    for (NSUInteger idx = 0; idx < count; idx++) {
+        uint64_t address, offset;
+        NSString *image;
+        [backtraces getFrame:idx inThread:thread address:&address image:&image offset:&offset];
+
+        // resolved frames hash the image UUID and offset rather than the
+        // absolute address, which changes from launch to launch
+        const char *imageName = [image UTF8String];
+        if (imageName) hash = SCFingerprintAppend(hash, imageName, strlen(imageName) + 1);
+        uint64_t position = image ? offset : address;
+        hash = SCFingerprintAppend(hash, &position, sizeof(position));
+    }
+
+    return [[NSString alloc] initWithFormat:@"%016llx", hash];
+}
+
+static SCBacktrace *SCBacktraceFromStoredValue(id value) {
+    // journals and archives written before SCBacktrace hold nested arrays
+    if ([value isKindOfClass:[NSArray class]])
+        return [[[SCBacktrace alloc] initWithPropertyList:value] autorelease];
+    if ([value isKindOfClass:[SCBacktrace class]]) return value;
+    return nil;
+}
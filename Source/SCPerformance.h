@@ -0,0 +1,109 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <pthread.h>
+
+@class SCOccurrence;
+
+/*! The SCOccurrence::exceptionClassName of a performance summary. */
+#define SCPerformanceClassName @"Performance"
+
+/*! The most distinct operations tracked in one period; others are dropped. */
+#define SCPerformanceMaximumOperations 64
+
+/*!
+ The number of linear sub-buckets per power of two in a latency histogram.
+ Sixteen keeps every recorded value within about 6% of its true value.
+ */
+#define SCPerformanceSubBuckets 16
+
+/*!
+ The number of buckets in a latency histogram: exact buckets below 32 µs, then
+ SCPerformanceSubBuckets per power of two up to 2^41 µs (about 25 days).
+ */
+#define SCPerformanceHistogramBuckets 608
+
+/*! The most return addresses kept for an operation's slowest sample. */
+#define SCPerformanceSlowestFrames 32
+
+/*!
+ Aggregates operation timings on the device so that a period's worth of them
+ can be uploaded as one small summary rather than as individual events.
+
+ Each operation gets a fixed-size, log-bucketed histogram in the style of
+ HdrHistogram, along with its count, total, minimum, and maximum, and the
+ call stack of its slowest sample. Memory use is bounded by
+ SCPerformanceMaximumOperations regardless of how many timings are recorded;
+ recording takes a lock and increments a few counters, and only captures a
+ stack when a sample is the slowest of its operation so far.
+
+ Every SCPerformanceRecorder::flushInterval the histograms are handed to the
+ flush handler as an SCOccurrence with the class name SCPerformanceClassName
+ (see SCOccurrence::performanceMetrics), and a new period begins.
+ */
+@interface SCPerformanceRecorder : NSObject {
+    NSTimeInterval flushInterval;
+    void (^flushHandler)(SCOccurrence *summary);
+    pthread_mutex_t lock;
+    NSMutableDictionary *operationIndexes;
+    void *histograms;
+    NSUInteger operationCount;
+    NSDate *periodStart;
+    dispatch_queue_t queue;
+    dispatch_source_t timer;
+}
+
+#pragma mark Properties
+
+/*!
+ How often the histograms are flushed. Changes take effect the next time the
+ recorder is started.
+ */
+@property (assign) NSTimeInterval flushInterval;
+
+#pragma mark Initializers
+
+/*!
+ Creates a recorder, which records timings right away but flushes them only
+ once started.
+ @param handler Called on a background queue with each period's summary.
+ @return The initialized instance.
+ */
+- (id) initWithFlushHandler:(void (^)(SCOccurrence *summary))handler;
+
+#pragma mark Recording
+
+/*!
+ Adds a timing to an operation's histogram.
+ @param duration How long the operation took, in seconds.
+ @param operation The operation's name, such as `@"launch"`.
+ */
+- (void) recordDuration:(NSTimeInterval)duration ofOperation:(NSString *)operation;
+
+#pragma mark Flushing
+
+/*! Starts flushing every SCPerformanceRecorder::flushInterval. */
+- (void) start;
+
+/*! Stops the periodic flushes. */
+- (void) stop;
+
+/*!
+ Hands the current period's histograms to the flush handler now, if anything
+ was recorded, and starts a new period.
+ */
+- (void) flush;
+
+@end
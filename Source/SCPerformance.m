@@ -0,0 +1,227 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import "SCPerformance.h"
+#import "SCOccurrence.h"
+#import "SCBacktrace.h"
+#import "SCFunctions.h"
+#import <execinfo.h>
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t minimum;
+    uint64_t maximum;
+    uint32_t slowestFrameCount;
+    uint64_t slowestFrames[SCPerformanceSlowestFrames];
+    uint32_t buckets[SCPerformanceHistogramBuckets];
+} SCLatencyHistogram;
+
+static NSUInteger SCLatencyBucket(uint64_t value);
+static uint64_t SCLatencyBucketLowerBound(NSUInteger bucket);
+static uint64_t SCLatencyPercentile(const SCLatencyHistogram *histogram, double percentile);
+static NSDictionary *SCLatencyHistogramDescription(const SCLatencyHistogram *histogram);
+
+@implementation SCPerformanceRecorder
+
+#pragma mark Properties
+
+@synthesize flushInterval;
+
+#pragma mark Initializers
+
+- (id) initWithFlushHandler:(void (^)(SCOccurrence *summary))handler {
+    if (self = [super init]) {
+        flushInterval = 15*60;
+        flushHandler = [handler copy];
+        pthread_mutex_init(&lock, NULL);
+        operationIndexes = [[NSMutableDictionary alloc] initWithCapacity:SCPerformanceMaximumOperations];
+        histograms = calloc(SCPerformanceMaximumOperations, sizeof(SCLatencyHistogram));
+        periodStart = [[NSDate alloc] init];
+        queue = dispatch_queue_create("com.squareup.squash.performance", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [self stop];
+    [flushHandler release];
+    pthread_mutex_destroy(&lock);
+    [operationIndexes release];
+    free(histograms);
+    [periodStart release];
+    dispatch_release(queue);
+    [super dealloc];
+}
+
+#pragma mark Recording
+
+- (void) recordDuration:(NSTimeInterval)duration ofOperation:(NSString *)operation {
+    if (!operation || duration < 0) return;
+    uint64_t value = (uint64_t)(duration * 1000000);
+
+    pthread_mutex_lock(&lock);
+    NSNumber *index = [operationIndexes objectForKey:operation];
+    if (!index) {
+        if (operationCount == SCPerformanceMaximumOperations) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        index = [NSNumber numberWithUnsignedInteger:operationCount++];
+        NSString *name = [operation copy];
+        [operationIndexes setObject:index forKey:name];
+        [name release];
+    }
+    SCLatencyHistogram *histogram = (SCLatencyHistogram *)histograms + [index unsignedIntegerValue];
+
+    if (histogram->count == 0 || value < histogram->minimum) histogram->minimum = value;
+    if (histogram->count == 0 || value > histogram->maximum) {
+        histogram->maximum = value;
+        // a stack is only walked for a new slowest sample; this method's and
+        // SquashCocoa's frames are skipped
+        void *addresses[SCPerformanceSlowestFrames + 2];
+        int frameCount = backtrace(addresses, SCPerformanceSlowestFrames + 2);
+        int skipped = MIN(frameCount, 2);
+        histogram->slowestFrameCount = frameCount - skipped;
+        for (int idx = skipped; idx < frameCount; idx++)
+            histogram->slowestFrames[idx - skipped] = (uint64_t)(uintptr_t)addresses[idx];
+    }
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[SCLatencyBucket(value)]++;
+    pthread_mutex_unlock(&lock);
+}
+
+#pragma mark Flushing
+
+- (void) start {
+    dispatch_sync(queue, ^{
+        if (timer) return;
+        uint64_t interval = (uint64_t)(self.flushInterval * NSEC_PER_SEC);
+        timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+        dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+        dispatch_source_set_event_handler(timer, ^{ [self flush]; });
+        dispatch_resume(timer);
+    });
+}
+
+- (void) stop {
+    dispatch_sync(queue, ^{
+        if (!timer) return;
+        dispatch_source_cancel(timer);
+        dispatch_release(timer);
+        timer = NULL;
+    });
+}
+
+- (void) flush {
+    // the period's histograms are copied out and reset under the lock, and
+    // described after it is released
+    pthread_mutex_lock(&lock);
+    NSUInteger count = operationCount;
+    SCLatencyHistogram *period = count ? malloc(count * sizeof(SCLatencyHistogram)) : NULL;
+    if (period) memcpy(period, histograms, count * sizeof(SCLatencyHistogram));
+    memset(histograms, 0, count * sizeof(SCLatencyHistogram));
+    NSDictionary *indexes = [operationIndexes copy];
+    [operationIndexes removeAllObjects];
+    operationCount = 0;
+    NSDate *start = periodStart;
+    periodStart = [[NSDate alloc] init];
+    pthread_mutex_unlock(&lock);
+
+    if (count) {
+        NSMutableDictionary *metrics = [[NSMutableDictionary alloc] initWithCapacity:count];
+        SCBacktrace *backtrace = [[SCBacktrace alloc] initWithStyle:SCBacktraceStyleReturnAddresses];
+        for (NSString *operation in [[indexes allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+            const SCLatencyHistogram *histogram = period + [[indexes objectForKey:operation] unsignedIntegerValue];
+            NSMutableDictionary *description = [SCLatencyHistogramDescription(histogram) mutableCopy];
+            [description setObject:SCISO8601StringFromDate(start) forKey:@"period_start"];
+            [metrics setObject:description forKey:operation];
+            [description release];
+
+            [backtrace beginThreadNamed:[NSString stringWithFormat:@"%@ (slowest: %llu us)", operation, histogram->maximum] faulted:NO registers:NO];
+            for (uint32_t idx = 0; idx < histogram->slowestFrameCount; idx++)
+                [backtrace addFrameWithAddress:histogram->slowestFrames[idx] resolve:YES];
+        }
+
+        SCOccurrence *summary = [[SCOccurrence alloc] initWithPerformanceMetrics:metrics backtrace:backtrace];
+        summary.occurredAt = [NSDate date];
+        flushHandler(summary);
+        [summary release];
+        [backtrace release];
+        [metrics release];
+    }
+
+    free(period);
+    [indexes release];
+    [start release];
+}
+
+@end
+
+#pragma mark -
+
+static NSUInteger SCLatencyBucket(uint64_t value) {
+    // values below 2*SCPerformanceSubBuckets get a bucket each; above that,
+    // each power of two is split into SCPerformanceSubBuckets linear buckets
+    if (value < 2*SCPerformanceSubBuckets) return (NSUInteger)value;
+    NSUInteger exponent = 63 - __builtin_clzll(value);
+    NSUInteger shift = exponent - 4;
+    NSUInteger bucket = shift*SCPerformanceSubBuckets + (NSUInteger)(value >> shift);
+    return MIN(bucket, (NSUInteger)SCPerformanceHistogramBuckets - 1);
+}
+
+static uint64_t SCLatencyBucketLowerBound(NSUInteger bucket) {
+    if (bucket < 2*SCPerformanceSubBuckets) return bucket;
+    NSUInteger shift = bucket/SCPerformanceSubBuckets - 1;
+    return (uint64_t)(bucket%SCPerformanceSubBuckets + SCPerformanceSubBuckets) << shift;
+}
+
+static uint64_t SCLatencyPercentile(const SCLatencyHistogram *histogram, double percentile) {
+    uint64_t target = (uint64_t)ceil(histogram->count * percentile);
+    uint64_t seen = 0;
+    for (NSUInteger bucket = 0; bucket < SCPerformanceHistogramBuckets; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen >= target && histogram->buckets[bucket]) {
+            // the highest value the bucket could hold, but never past the maximum
+            uint64_t upper = (bucket + 1 < SCPerformanceHistogramBuckets) ? SCLatencyBucketLowerBound(bucket + 1) - 1 : histogram->maximum;
+            return MAX(MIN(upper, histogram->maximum), histogram->minimum);
+        }
+    }
+    return histogram->maximum;
+}
+
+static NSDictionary *SCLatencyHistogramDescription(const SCLatencyHistogram *histogram) {
+    // buckets are sent sparsely, as [lower bound in µs, count] pairs
+    NSMutableArray *buckets = [NSMutableArray array];
+    for (NSUInteger bucket = 0; bucket < SCPerformanceHistogramBuckets; bucket++) {
+        if (!histogram->buckets[bucket]) continue;
+        [buckets addObject:[NSArray arrayWithObjects:
+                            [NSNumber numberWithUnsignedLongLong:SCLatencyBucketLowerBound(bucket)],
+                            [NSNumber numberWithUnsignedInt:histogram->buckets[bucket]],
+                            NULL]];
+    }
+
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedLongLong:histogram->count], @"count",
+            [NSNumber numberWithUnsignedLongLong:histogram->sum], @"sum_us",
+            [NSNumber numberWithUnsignedLongLong:histogram->minimum], @"min_us",
+            [NSNumber numberWithUnsignedLongLong:histogram->maximum], @"max_us",
+            [NSNumber numberWithUnsignedLongLong:SCLatencyPercentile(histogram, 0.5)], @"p50_us",
+            [NSNumber numberWithUnsignedLongLong:SCLatencyPercentile(histogram, 0.9)], @"p90_us",
+            [NSNumber numberWithUnsignedLongLong:SCLatencyPercentile(histogram, 0.99)], @"p99_us",
+            buckets, @"buckets",
+            NULL];
+}
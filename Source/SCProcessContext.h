@@ -0,0 +1,75 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*!
+ An immutable snapshot of the facts about the running process and device that
+ cannot change while it runs: launch arguments, environment, host name,
+ operating system, hardware model, bundle version, and the executable UUID.
+
+ Collecting these is comparatively expensive (SCProcessContext::hostname can
+ block on DNS, and the hardware model takes two `sysctl` calls), so it is done
+ once, by SquashCocoa::hook or on first use, and every SCOccurrence then
+ shares the same objects by reference.
+ */
+@interface SCProcessContext : NSObject {
+    NSArray *arguments;
+    NSDictionary *environment;
+    NSString *hostname;
+    NSString *operatingSystem;
+    NSNumber *physicalMemory;
+    NSString *deviceType;
+    NSString *version;
+    NSString *build;
+    NSString *symbolicationID;
+}
+
+#pragma mark Properties
+
+/*! The program's launch arguments. */
+@property (readonly) NSArray *arguments;
+
+/*! The environment variables. */
+@property (readonly) NSDictionary *environment;
+
+/*! The hostname of the device running the program. */
+@property (readonly) NSString *hostname;
+
+/*! The operating system version string. */
+@property (readonly) NSString *operatingSystem;
+
+/*! The amount of physical memory on the device, in bytes. */
+@property (readonly) NSNumber *physicalMemory;
+
+/*! A string identifying the device's make and model. */
+@property (readonly) NSString *deviceType;
+
+/*! The human-readable version of the build (`CFBundleShortVersionString`). */
+@property (readonly) NSString *version;
+
+/*! The internal build number (`CFBundleVersion`). */
+@property (readonly) NSString *build;
+
+/*! The Mach-O UUID of the executable (see SCExecutableUUID). */
+@property (readonly) NSString *symbolicationID;
+
+#pragma mark Singleton
+
+/*!
+ Returns the snapshot for this process, collecting it on the first call.
+ Concurrent first callers wait for the one collection to finish.
+ @return The shared instance.
+ */
++ (SCProcessContext *) currentContext;
+
+@end
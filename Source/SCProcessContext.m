@@ -0,0 +1,103 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCProcessContext.h"
+#import "SCFunctions.h"
+#if TARGET_OS_MAC && !TARGET_OS_IPHONE && !TARGET_IPHONE_SIMULATOR
+	#import <sys/sysctl.h>
+#endif
+
+@interface SCProcessContext (Private)
+
+- (id) initWithCurrentProcess;
+
+@end
+
+#pragma mark -
+
+@implementation SCProcessContext
+
+#pragma mark Properties
+
+@synthesize arguments;
+@synthesize environment;
+@synthesize hostname;
+@synthesize operatingSystem;
+@synthesize physicalMemory;
+@synthesize deviceType;
+@synthesize version;
+@synthesize build;
+@synthesize symbolicationID;
+
+#pragma mark Singleton
+
++ (SCProcessContext *) currentContext {
+    static SCProcessContext *currentContext = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        currentContext = [[SCProcessContext alloc] initWithCurrentProcess];
+    });
+    return currentContext;
+}
+
+- (void) dealloc {
+    [arguments release];
+    [environment release];
+    [hostname release];
+    [operatingSystem release];
+    [physicalMemory release];
+    [deviceType release];
+    [version release];
+    [build release];
+    [symbolicationID release];
+    [super dealloc];
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCProcessContext (Private)
+
+- (id) initWithCurrentProcess {
+    if (self = [super init]) {
+        NSProcessInfo *info = [NSProcessInfo processInfo];
+        arguments = [[info arguments] copy];
+        environment = [[info environment] copy];
+        hostname = [[info hostName] copy];
+        operatingSystem = [[info operatingSystemVersionString] copy];
+        physicalMemory = [[NSNumber alloc] initWithLongLong:[info physicalMemory]];
+
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+        deviceType = [[[UIDevice currentDevice] model] copy];
+#elif TARGET_OS_MAC
+		size_t len = 0;
+		sysctlbyname("hw.model", NULL, &len, NULL, 0);
+		if (len) {
+			char *model = malloc(len * sizeof(char));
+			sysctlbyname("hw.model", model, &len, NULL, 0);
+			deviceType = [[NSString alloc] initWithUTF8String:model];
+			free(model);
+		}
+#endif
+
+        NSDictionary *infoDictionary = [[NSBundle mainBundle] infoDictionary];
+        version = [[infoDictionary objectForKey:@"CFBundleShortVersionString"] copy];
+        build = [[infoDictionary objectForKey:@"CFBundleVersion"] copy];
+        symbolicationID = [SCExecutableUUID() copy];
+    }
+    return self;
+}
+
+@end
@@ -0,0 +1,69 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/*!
+ Decides which recorded exceptions are worth keeping, so that an exception
+ thrown and caught in a tight loop cannot make crash reporting the app's main
+ CPU and I/O cost. Admission happens before an occurrence is built, and costs
+ one dictionary lookup.
+
+ Each exception class has its own token bucket, holding up to
+ SCRateLimiter::burst tokens and refilling at SCRateLimiter::rate tokens per
+ second; an occurrence is admitted only if a token is available. Before that,
+ occurrences are sampled uniformly at SCRateLimiter::sampleRate.
+
+ Every rejected occurrence is counted by class. The counts are handed out
+ (SCRateLimiter::takeDroppedCounts) with the next admitted occurrence, so the
+ server can extrapolate the true rate.
+ */
+@interface SCRateLimiter : NSObject {
+    double rate;
+    double burst;
+    double sampleRate;
+    NSMutableDictionary *buckets;
+    NSMutableDictionary *droppedCounts;
+}
+
+#pragma mark Properties
+
+/*!
+ The sustained number of occurrences admitted per second, per exception class.
+ Set to 0 to disable rate limiting.
+ */
+@property (assign) double rate;
+
+/*! The number of occurrences of one class that can be admitted at once. */
+@property (assign) double burst;
+
+/*! The fraction of occurrences (0 to 1) that are considered for admission. */
+@property (assign) double sampleRate;
+
+#pragma mark Admission
+
+/*!
+ Decides whether to record an occurrence, consuming a token if so, and counts
+ it as dropped if not.
+ @param className The exception class (`NSException` name).
+ @return Whether the occurrence should be recorded.
+ */
+- (BOOL) admitOccurrenceOfClass:(NSString *)className;
+
+/*!
+ Returns and resets the number of occurrences dropped since the last call.
+ @return A dictionary mapping exception class names to the number dropped (as
+ `NSNumber`s), or `nil` if none were.
+ */
+- (NSDictionary *) takeDroppedCounts;
+
+@end
@@ -0,0 +1,118 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCRateLimiter.h"
+
+// Buckets for classes that have not been seen for a while are full, which is
+// also the state of a new bucket, so the table is simply cleared when it grows
+// past this size.
+static const NSUInteger SCRateLimiterMaximumBuckets = 256;
+
+typedef struct {
+    double tokens;
+    CFAbsoluteTime updatedAt;
+} SCTokenBucket;
+
+@interface SCRateLimiter (Private)
+
+- (void) countDroppedOccurrenceOfClass:(NSString *)className;
+
+@end
+
+#pragma mark -
+
+@implementation SCRateLimiter
+
+#pragma mark Properties
+
+@synthesize rate;
+@synthesize burst;
+@synthesize sampleRate;
+
+#pragma mark Initializers
+
+- (id) init {
+    if (self = [super init]) {
+        rate = 1;
+        burst = 10;
+        sampleRate = 1;
+        buckets = [[NSMutableDictionary alloc] init];
+        droppedCounts = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [buckets release];
+    [droppedCounts release];
+    [super dealloc];
+}
+
+#pragma mark Admission
+
+- (BOOL) admitOccurrenceOfClass:(NSString *)className {
+    if (!className) className = @"";
+
+    @synchronized(self) {
+        if (sampleRate < 1 && (double)arc4random() / UINT32_MAX >= sampleRate) {
+            [self countDroppedOccurrenceOfClass:className];
+            return NO;
+        }
+        if (rate <= 0) return YES;
+
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        NSMutableData *storage = [buckets objectForKey:className];
+        if (!storage) {
+            if ([buckets count] >= SCRateLimiterMaximumBuckets) [buckets removeAllObjects];
+            storage = [[NSMutableData alloc] initWithLength:sizeof(SCTokenBucket)];
+            SCTokenBucket *bucket = [storage mutableBytes];
+            bucket->tokens = burst;
+            bucket->updatedAt = now;
+            [buckets setObject:storage forKey:className];
+            [storage release];
+        }
+
+        SCTokenBucket *bucket = [storage mutableBytes];
+        bucket->tokens = MIN(burst, bucket->tokens + (now - bucket->updatedAt) * rate);
+        bucket->updatedAt = now;
+        if (bucket->tokens < 1) {
+            [self countDroppedOccurrenceOfClass:className];
+            return NO;
+        }
+        bucket->tokens -= 1;
+        return YES;
+    }
+}
+
+- (NSDictionary *) takeDroppedCounts {
+    @synchronized(self) {
+        if ([droppedCounts count] == 0) return nil;
+        NSDictionary *counts = [[droppedCounts copy] autorelease];
+        [droppedCounts removeAllObjects];
+        return counts;
+    }
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCRateLimiter (Private)
+
+- (void) countDroppedOccurrenceOfClass:(NSString *)className {
+    NSNumber *count = [droppedCounts objectForKey:className];
+    [droppedCounts setObject:[NSNumber numberWithUnsignedInteger:[count unsignedIntegerValue] + 1] forKey:className];
+}
+
+@end
@@ -0,0 +1,138 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+/*! Identifies a session state file. */
+#define SCSessionStateMagic 0x53435353
+
+/*! The current version of the SCSessionState layout. */
+#define SCSessionStateVersion 1
+
+/*! The number of footprint samples kept in the timeline. */
+#define SCSessionTimelineLength 32
+
+/*! The longest version string stored, in bytes, including the terminator. */
+#define SCSessionVersionLength 32
+
+/*! The SCOccurrence::exceptionClassName of a foreground termination. */
+#define SCOutOfMemoryClassName @"Out of Memory"
+
+/*! The SCOccurrence::exceptionClassName of a termination during a hang. */
+#define SCWatchdogTerminationClassName @"Watchdog Termination"
+
+/*! The SCOccurrence::exceptionClassName of a background termination. */
+#define SCBackgroundTerminationClassName @"Background Termination"
+
+/*! Flags describing a session, kept in SCSessionState::flags. */
+enum {
+    /*! The app exited normally (`exit` or termination notification). */
+    SCSessionCleanExit = 1 << 0,
+    /*! The app was in the foreground at last report. */
+    SCSessionForeground = 1 << 1,
+    /*! SCHandleSignal or SCHandleException ran. */
+    SCSessionCrashed = 1 << 2,
+    /*! The main thread was stalled (see SCHangMonitor). */
+    SCSessionHanging = 1 << 3,
+    /*! A debugger was attached. */
+    SCSessionDebugged = 1 << 4
+};
+
+/*! One sample of the footprint timeline. */
+typedef struct {
+    /*! When the sample was taken, in seconds since the epoch. */
+    double timestamp;
+    /*! The process's memory footprint, in bytes. */
+    uint64_t footprint;
+} SCFootprintSample;
+
+/*!
+ What a launch knows about itself, kept in a small memory-mapped file so that
+ the next launch can tell how it ended even if it was killed without warning.
+ Every field is a plain value written in place, so updating it costs a store to
+ memory and is safe from a signal handler.
+ */
+typedef struct {
+    /*! Always SCSessionStateMagic. */
+    uint32_t magic;
+    /*! The layout version (SCSessionStateVersion). */
+    uint32_t version;
+    /*! SCSessionCleanExit and the other session flags. */
+    volatile uint32_t flags;
+    /*! The number of memory warnings received. */
+    volatile uint32_t memoryWarnings;
+    /*! When the session started, in seconds since the epoch. */
+    double launchedAt;
+    /*! When the state was last updated, in seconds since the epoch. */
+    double updatedAt;
+    /*! The memory footprint at the last sample, in bytes. */
+    uint64_t footprint;
+    /*! The largest footprint sampled, in bytes. */
+    uint64_t peakFootprint;
+    /*! The number of samples ever written to `timeline`. */
+    uint64_t sampleCount;
+    /*! The app's `CFBundleShortVersionString`. */
+    char appVersion[SCSessionVersionLength];
+    /*! The app's `CFBundleVersion`. */
+    char appBuild[SCSessionVersionLength];
+    /*! The operating system version. */
+    char systemVersion[SCSessionVersionLength];
+    /*! The most recent footprint samples, as a ring indexed by `sampleCount`. */
+    SCFootprintSample timeline[SCSessionTimelineLength];
+} SCSessionState;
+
+/*!
+ Maps the session state file, setting the previous launch's state aside first
+ (see SCSessionStateTakePrevious), and starts tracking foreground and
+ background transitions, memory warnings, and normal exit. Called by
+ SquashCocoa::hook and SquashCocoa::reportErrors; calling it again does nothing.
+ It may be called from any thread, but reads the application state on the main
+ thread, so the main thread must not be waiting on the caller.
+ @param path The state file.
+ */
+void SCSessionStateOpen(NSString *path);
+
+/*!
+ Samples the memory footprint into the state file every `interval` seconds.
+ Calling it again does nothing.
+ @param interval The time between samples.
+ */
+void SCSessionStateStartSampling(NSTimeInterval interval);
+
+/*!
+ Takes one footprint sample now.
+ */
+void SCSessionStateSampleFootprint(void);
+
+/*!
+ Sets or clears session flags. Async-signal-safe.
+ @param flags The flags to change.
+ @param set Whether to set (`YES`) or clear them.
+ */
+void SCSessionStateSetFlags(uint32_t flags, BOOL set);
+
+/*!
+ Returns the previous launch's state, once per launch.
+ @param state Set to the previous state.
+ @return Whether a readable previous state was found and not already taken.
+ */
+BOOL SCSessionStateTakePrevious(SCSessionState *state);
+
+/*!
+ Returns whether the previous launch ended in a way nothing else explains: no
+ clean exit, no crash, no debugger, and no app or operating system update in
+ between.
+ @param state A previous state (see SCSessionStateTakePrevious).
+ @return Whether the session was terminated abnormally.
+ */
+BOOL SCSessionStateEndedAbnormally(const SCSessionState *state);
@@ -0,0 +1,224 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import "SCSessionState.h"
+#import "SCFunctions.h"
+#import <libkern/OSAtomic.h>
+#import <mach/mach.h>
+#import <sys/mman.h>
+#import <sys/time.h>
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+#import <UIKit/UIKit.h>
+#else
+#import <AppKit/AppKit.h>
+#endif
+
+// Updates made before the state file is mapped go here.
+static SCSessionState SCInitialState = { SCSessionStateMagic, SCSessionStateVersion, 0, 0 };
+static SCSessionState * volatile SCCurrentState = &SCInitialState;
+static SCSessionState SCPreviousState;
+static BOOL SCPreviousStateAvailable = NO;
+static volatile BOOL SCStateOpened = NO;
+
+static double SCNow(void);
+static uint64_t SCCurrentFootprint(void);
+static void SCCopyString(char *destination, NSString *source);
+static uint32_t SCApplicationFlags(void);
+static void SCObserveApplication(void);
+static void SCMarkCleanExit(void);
+
+void SCSessionStateOpen(NSString *path) {
+    // The application state is read before the once rather than inside it:
+    // a background caller waiting there on the main thread would deadlock
+    // against SquashCocoa::hook waiting on the once on the main thread.
+    if (SCStateOpened) return;
+    uint32_t applicationFlags = SCApplicationFlags();
+
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSData *data = [[NSData alloc] initWithContentsOfFile:path];
+        if ([data length] >= sizeof(SCSessionState)) {
+            memcpy(&SCPreviousState, [data bytes], sizeof(SCSessionState));
+            SCPreviousStateAvailable = (SCPreviousState.magic == SCSessionStateMagic && SCPreviousState.version == SCSessionStateVersion);
+        }
+        [data release];
+
+        SCSessionState initial;
+        memcpy(&initial, SCCurrentState, sizeof(initial));
+        initial.launchedAt = SCNow();
+        initial.updatedAt = initial.launchedAt;
+        NSDictionary *info = [[NSBundle mainBundle] infoDictionary];
+        SCCopyString(initial.appVersion, [info objectForKey:@"CFBundleShortVersionString"]);
+        SCCopyString(initial.appBuild, [info objectForKey:@"CFBundleVersion"]);
+        SCCopyString(initial.systemVersion, [[NSProcessInfo processInfo] operatingSystemVersionString]);
+        uint32_t flags = applicationFlags;
+        if (SCDebuggerAttached()) flags |= SCSessionDebugged;
+        initial.flags |= flags;
+
+        [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:NULL];
+        int fd = open([path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            void *mapping = MAP_FAILED;
+            if (ftruncate(fd, sizeof(SCSessionState)) == 0)
+                mapping = mmap(NULL, sizeof(SCSessionState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping != MAP_FAILED) {
+                memcpy(mapping, &initial, sizeof(initial));
+                OSMemoryBarrier();
+                SCCurrentState = mapping;
+            }
+        }
+
+        SCObserveApplication();
+        atexit(SCMarkCleanExit);
+        SCSessionStateSampleFootprint();
+        SCStateOpened = YES;
+    });
+}
+
+void SCSessionStateStartSampling(NSTimeInterval interval) {
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        uint64_t nanoseconds = (uint64_t)(interval * NSEC_PER_SEC);
+        // generous leeway, since the exact moment doesn't matter
+        dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, nanoseconds), nanoseconds, nanoseconds / 2);
+        dispatch_source_set_event_handler(timer, ^{ SCSessionStateSampleFootprint(); });
+        dispatch_resume(timer);
+    });
+}
+
+void SCSessionStateSampleFootprint(void) {
+    static OSSpinLock lock = OS_SPINLOCK_INIT;
+    uint64_t footprint = SCCurrentFootprint();
+    double now = SCNow();
+
+    OSSpinLockLock(&lock);
+    SCSessionState *state = SCCurrentState;
+    state->timeline[state->sampleCount % SCSessionTimelineLength].timestamp = now;
+    state->timeline[state->sampleCount % SCSessionTimelineLength].footprint = footprint;
+    state->sampleCount++;
+    state->footprint = footprint;
+    if (footprint > state->peakFootprint) state->peakFootprint = footprint;
+    state->updatedAt = now;
+    OSSpinLockUnlock(&lock);
+}
+
+void SCSessionStateSetFlags(uint32_t flags, BOOL set) {
+    SCSessionState *state = SCCurrentState;
+    if (set) OSAtomicOr32Barrier(flags, &state->flags);
+    else OSAtomicAnd32Barrier(~flags, &state->flags);
+}
+
+BOOL SCSessionStateTakePrevious(SCSessionState *state) {
+    static OSSpinLock lock = OS_SPINLOCK_INIT;
+    OSSpinLockLock(&lock);
+    BOOL available = SCPreviousStateAvailable;
+    if (available) memcpy(state, &SCPreviousState, sizeof(SCSessionState));
+    SCPreviousStateAvailable = NO;
+    OSSpinLockUnlock(&lock);
+    return available;
+}
+
+BOOL SCSessionStateEndedAbnormally(const SCSessionState *state) {
+    if (state->flags & (SCSessionCleanExit | SCSessionCrashed | SCSessionDebugged)) return NO;
+
+    // updating the app or the OS also kills it without warning
+    const SCSessionState *current = SCCurrentState;
+    if (strncmp(state->appVersion, current->appVersion, SCSessionVersionLength) != 0) return NO;
+    if (strncmp(state->appBuild, current->appBuild, SCSessionVersionLength) != 0) return NO;
+    if (strncmp(state->systemVersion, current->systemVersion, SCSessionVersionLength) != 0) return NO;
+    return YES;
+}
+
+#pragma mark -
+
+static double SCNow(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec/1000000.0;
+}
+
+static uint64_t SCCurrentFootprint(void) {
+#ifdef TASK_VM_INFO_REV1_COUNT
+    // the footprint the system's memory limits are enforced against
+    task_vm_info_data_t vmInfo;
+    mach_msg_type_number_t vmCount = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&vmInfo, &vmCount) == KERN_SUCCESS && vmCount >= TASK_VM_INFO_REV1_COUNT)
+        return vmInfo.phys_footprint;
+#endif
+    struct task_basic_info info;
+    mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return info.resident_size;
+}
+
+static void SCCopyString(char *destination, NSString *source) {
+    memset(destination, 0, SCSessionVersionLength);
+    if ([source isKindOfClass:[NSString class]])
+        strlcpy(destination, [source UTF8String], SCSessionVersionLength);
+}
+
+static uint32_t SCApplicationFlags(void) {
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+    // UIKit may only be used on the main thread
+    __block UIApplicationState state = UIApplicationStateActive;
+    void (^readState)(void) = ^{ state = [[UIApplication sharedApplication] applicationState]; };
+    if ([NSThread isMainThread]) readState();
+    else dispatch_sync(dispatch_get_main_queue(), readState);
+    if (state == UIApplicationStateBackground) return 0;
+#endif
+    return SCSessionForeground;
+}
+
+static void SCObserveApplication(void) {
+    NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+    NSOperationQueue *queue = [NSOperationQueue mainQueue];
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+    [center addObserverForName:UIApplicationWillEnterForegroundNotification object:nil queue:queue usingBlock:^(NSNotification *note) {
+        SCSessionStateSetFlags(SCSessionForeground, YES);
+    }];
+    [center addObserverForName:UIApplicationDidBecomeActiveNotification object:nil queue:queue usingBlock:^(NSNotification *note) {
+        SCSessionStateSetFlags(SCSessionForeground, YES);
+    }];
+    [center addObserverForName:UIApplicationDidEnterBackgroundNotification object:nil queue:queue usingBlock:^(NSNotification *note) {
+        SCSessionStateSetFlags(SCSessionForeground, NO);
+        SCSessionStateSampleFootprint();
+    }];
+    [center addObserverForName:UIApplicationDidReceiveMemoryWarningNotification object:nil queue:queue usingBlock:^(NSNotification *note) {
+        OSAtomicIncrement32Barrier((volatile int32_t *)&SCCurrentState->memoryWarnings);
+        SCSessionStateSampleFootprint();
+    }];
+    [center addObserverForName:UIApplicationWillTerminateNotification object:nil queue:queue usingBlock:^(NSNotification *note) {
+        SCMarkCleanExit();
+    }];
+#else
+    [center addObserverForName:NSApplicationWillTerminateNotification object:nil queue:queue usingBlock:^(NSNotification *note) {
+        SCMarkCleanExit();
+    }];
+#ifdef DISPATCH_SOURCE_TYPE_MEMORYPRESSURE
+    dispatch_source_t pressure = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0, DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    dispatch_source_set_event_handler(pressure, ^{
+        OSAtomicIncrement32Barrier((volatile int32_t *)&SCCurrentState->memoryWarnings);
+        SCSessionStateSampleFootprint();
+    });
+    dispatch_resume(pressure);
+#endif
+#endif
+}
+
+static void SCMarkCleanExit(void) {
+    SCSessionStateSetFlags(SCSessionCleanExit, YES);
+}
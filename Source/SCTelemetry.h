@@ -0,0 +1,152 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+/*! The number of power-of-two buckets in each SCTelemetry histogram. */
+#define SCTelemetryHistogramBuckets 40
+
+/*! Counters kept by SCTelemetry. */
+typedef enum {
+    /*! Occurrences written to the journal. */
+    SCTelemetryOccurrencesRecorded = 0,
+    /*! Occurrences folded into an earlier one. */
+    SCTelemetryOccurrencesCoalesced,
+    /*! Exceptions dropped by sampling or rate limiting. */
+    SCTelemetryOccurrencesDropped,
+    /*! Occurrences removed from the queue because Squash rejected them. */
+    SCTelemetryOccurrencesRejected,
+    /*! Upload attempts, one per occurrence. */
+    SCTelemetryUploadsAttempted,
+    /*! Occurrences Squash acknowledged. */
+    SCTelemetryUploadsSucceeded,
+    /*! Occurrences Squash rejected or that got no response. */
+    SCTelemetryUploadsFailed,
+    /*! Bytes of request bodies sent, after compression. */
+    SCTelemetryBytesUploaded,
+    /*! Upload attempts that got a 2xx status. In a batch, each occurrence's own status counts. */
+    SCTelemetryStatus2xx,
+    /*! Upload attempts that got a 4xx response. */
+    SCTelemetryStatus4xx,
+    /*! Upload attempts that got a 5xx response. */
+    SCTelemetryStatus5xx,
+    /*! Upload attempts that got no response or any other status. */
+    SCTelemetryStatusOther,
+    SCTelemetryCounterCount
+} SCTelemetryCounter;
+
+/*! Gauges (last-written values) kept by SCTelemetry. */
+typedef enum {
+    /*! Occurrences waiting in the journal at the start of the last flush. */
+    SCTelemetryQueueDepth = 0,
+    /*! The status code of the most recent upload attempt, or 0. */
+    SCTelemetryLastStatusCode,
+    SCTelemetryGaugeCount
+} SCTelemetryGauge;
+
+/*! Histograms kept by SCTelemetry. */
+typedef enum {
+    /*! Microseconds SquashCocoa::recordException: blocked the calling thread. */
+    SCTelemetryCaptureLatency = 0,
+    /*! Bytes of each occurrence's JSON (SCOccurrence::asJSON). */
+    SCTelemetryPayloadBytes,
+    /*! Milliseconds from sending an upload request to its response. */
+    SCTelemetryUploadLatency,
+    SCTelemetryHistogramCount
+} SCTelemetryHistogram;
+
+/*!
+ Counters, gauges, and histograms describing what SquashCocoa itself costs and
+ how its uploads are faring. Every update is a handful of atomic additions on
+ preallocated storage: nothing locks or allocates, so it is safe to record from
+ any thread, including the one that threw. Snapshots read each value
+ atomically too, so no value is torn, even on 32-bit devices.
+
+ Histograms use power-of-two buckets, so percentiles in a snapshot are upper
+ bounds accurate to within a factor of two.
+ */
+@interface SCTelemetry : NSObject {
+    int64_t counters[SCTelemetryCounterCount];
+    int64_t gauges[SCTelemetryGaugeCount];
+    int64_t buckets[SCTelemetryHistogramCount][SCTelemetryHistogramBuckets];
+    int64_t sums[SCTelemetryHistogramCount];
+    int64_t maximums[SCTelemetryHistogramCount];
+}
+
+#pragma mark Singleton
+
+/*!
+ Returns the telemetry shared by every part of the library.
+ @return The shared instance.
+ */
++ (SCTelemetry *) sharedTelemetry;
+
+#pragma mark Recording
+
+/*!
+ Adds to a counter.
+ @param counter The counter to increment.
+ @param amount The amount to add.
+ */
+- (void) incrementCounter:(SCTelemetryCounter)counter by:(int64_t)amount;
+
+/*!
+ Sets a gauge.
+ @param gauge The gauge to set.
+ @param value Its new value.
+ */
+- (void) setGauge:(SCTelemetryGauge)gauge value:(int64_t)value;
+
+/*!
+ Adds a sample to a histogram.
+ @param value The sample, in the histogram's units. Negative samples count as 0.
+ @param histogram The histogram to add to.
+ */
+- (void) recordValue:(int64_t)value inHistogram:(SCTelemetryHistogram)histogram;
+
+/*!
+ Records the outcome of one occurrence's upload attempt. Request latency and
+ size are recorded separately, since a batch carries many occurrences.
+ @param statusCode The HTTP status code, or 0 if there was no response.
+ @param success Whether Squash acknowledged the occurrence.
+ */
+- (void) recordUploadWithStatusCode:(NSInteger)statusCode success:(BOOL)success;
+
+#pragma mark Reading
+
+/*!
+ Returns a snapshot of every counter, gauge and histogram. Values recorded
+ while the snapshot is taken may or may not be included.
+ @return A dictionary of JSON-compatible values, with `counters`, `gauges`, and
+ `histograms` keys. Each histogram has `count`, `sum`, `mean`, `max`, `p50`,
+ `p90`, and `p99` keys.
+ */
+- (NSDictionary *) snapshot;
+
+@end
+
+#pragma mark -
+
+/*!
+ Returns a monotonic timestamp for measuring short intervals with
+ SCTelemetryMicrosecondsSince.
+ @return The current time, in platform units.
+ */
+uint64_t SCTelemetryTimestamp(void);
+
+/*!
+ Converts the time elapsed since a timestamp to microseconds.
+ @param start A value returned by SCTelemetryTimestamp.
+ @return The microseconds elapsed.
+ */
+int64_t SCTelemetryMicrosecondsSince(uint64_t start);
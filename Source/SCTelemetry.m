@@ -0,0 +1,180 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <libkern/OSAtomic.h>
+#import <mach/mach_time.h>
+#import "SCTelemetry.h"
+
+static NSString *SCTelemetryCounterNames[SCTelemetryCounterCount] = {
+    @"occurrences_recorded", @"occurrences_coalesced", @"occurrences_dropped",
+    @"occurrences_rejected", @"uploads_attempted", @"uploads_succeeded",
+    @"uploads_failed", @"bytes_uploaded",
+    @"status_2xx", @"status_4xx", @"status_5xx", @"status_other"
+};
+
+static NSString *SCTelemetryGaugeNames[SCTelemetryGaugeCount] = {
+    @"queue_depth", @"last_status_code"
+};
+
+static NSString *SCTelemetryHistogramNames[SCTelemetryHistogramCount] = {
+    @"capture_latency_us", @"payload_bytes", @"upload_latency_ms"
+};
+
+// A plain 64-bit load can tear on 32-bit ARM, so reads go through the same
+// atomics as the writes.
+static inline int64_t SCAtomicLoad64(volatile int64_t *value) {
+    return OSAtomicAdd64Barrier(0, value);
+}
+
+@interface SCTelemetry (Private)
+
+- (NSDictionary *) snapshotOfHistogram:(SCTelemetryHistogram)histogram;
+
+@end
+
+#pragma mark -
+
+@implementation SCTelemetry
+
+#pragma mark Singleton
+
++ (SCTelemetry *) sharedTelemetry {
+    static SCTelemetry *sharedTelemetry = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sharedTelemetry = [[SCTelemetry alloc] init];
+    });
+    return sharedTelemetry;
+}
+
+#pragma mark Recording
+
+- (void) incrementCounter:(SCTelemetryCounter)counter by:(int64_t)amount {
+    OSAtomicAdd64Barrier(amount, &counters[counter]);
+}
+
+- (void) setGauge:(SCTelemetryGauge)gauge value:(int64_t)value {
+    int64_t old;
+    do {
+        old = SCAtomicLoad64(&gauges[gauge]);
+    } while (!OSAtomicCompareAndSwap64Barrier(old, value, &gauges[gauge]));
+}
+
+- (void) recordValue:(int64_t)value inHistogram:(SCTelemetryHistogram)histogram {
+    if (value < 0) value = 0;
+
+    // bucket n holds values below 2^n
+    int bucket = 0;
+    for (uint64_t remaining = (uint64_t)value; remaining > 0 && bucket < SCTelemetryHistogramBuckets - 1; remaining >>= 1)
+        bucket++;
+    OSAtomicIncrement64Barrier(&buckets[histogram][bucket]);
+    OSAtomicAdd64Barrier(value, &sums[histogram]);
+
+    int64_t maximum;
+    do {
+        maximum = SCAtomicLoad64(&maximums[histogram]);
+        if (value <= maximum) break;
+    } while (!OSAtomicCompareAndSwap64Barrier(maximum, value, &maximums[histogram]));
+}
+
+- (void) recordUploadWithStatusCode:(NSInteger)statusCode success:(BOOL)success {
+    [self incrementCounter:SCTelemetryUploadsAttempted by:1];
+    [self incrementCounter:(success ? SCTelemetryUploadsSucceeded : SCTelemetryUploadsFailed) by:1];
+    switch (statusCode/100) {
+        case 2: [self incrementCounter:SCTelemetryStatus2xx by:1]; break;
+        case 4: [self incrementCounter:SCTelemetryStatus4xx by:1]; break;
+        case 5: [self incrementCounter:SCTelemetryStatus5xx by:1]; break;
+        default: [self incrementCounter:SCTelemetryStatusOther by:1]; break;
+    }
+    [self setGauge:SCTelemetryLastStatusCode value:statusCode];
+}
+
+#pragma mark Reading
+
+- (NSDictionary *) snapshot {
+    NSMutableDictionary *counterValues = [NSMutableDictionary dictionaryWithCapacity:SCTelemetryCounterCount];
+    for (int counter = 0; counter < SCTelemetryCounterCount; counter++)
+        [counterValues setObject:[NSNumber numberWithLongLong:SCAtomicLoad64(&counters[counter])] forKey:SCTelemetryCounterNames[counter]];
+
+    NSMutableDictionary *gaugeValues = [NSMutableDictionary dictionaryWithCapacity:SCTelemetryGaugeCount];
+    for (int gauge = 0; gauge < SCTelemetryGaugeCount; gauge++)
+        [gaugeValues setObject:[NSNumber numberWithLongLong:SCAtomicLoad64(&gauges[gauge])] forKey:SCTelemetryGaugeNames[gauge]];
+
+    NSMutableDictionary *histogramValues = [NSMutableDictionary dictionaryWithCapacity:SCTelemetryHistogramCount];
+    for (int histogram = 0; histogram < SCTelemetryHistogramCount; histogram++)
+        [histogramValues setObject:[self snapshotOfHistogram:histogram] forKey:SCTelemetryHistogramNames[histogram]];
+
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            counterValues, @"counters",
+            gaugeValues, @"gauges",
+            histogramValues, @"histograms",
+            nil];
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCTelemetry (Private)
+
+- (NSDictionary *) snapshotOfHistogram:(SCTelemetryHistogram)histogram {
+    int64_t counts[SCTelemetryHistogramBuckets];
+    int64_t count = 0;
+    for (int bucket = 0; bucket < SCTelemetryHistogramBuckets; bucket++) {
+        counts[bucket] = SCAtomicLoad64(&buckets[histogram][bucket]);
+        count += counts[bucket];
+    }
+    int64_t sum = SCAtomicLoad64(&sums[histogram]);
+    int64_t maximum = SCAtomicLoad64(&maximums[histogram]);
+
+    double quantiles[3] = { 0.5, 0.9, 0.99 };
+    int64_t percentiles[3] = { 0, 0, 0 };
+    for (int idx = 0; idx < 3; idx++) {
+        int64_t rank = (int64_t)ceil(quantiles[idx] * count), seen = 0;
+        for (int bucket = 0; bucket < SCTelemetryHistogramBuckets && count > 0; bucket++) {
+            seen += counts[bucket];
+            if (seen >= rank) {
+                percentiles[idx] = (bucket == 0) ? 0 : ((int64_t)1 << bucket) - 1;
+                break;
+            }
+        }
+        percentiles[idx] = MIN(percentiles[idx], maximum);
+    }
+
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithLongLong:count], @"count",
+            [NSNumber numberWithLongLong:sum], @"sum",
+            [NSNumber numberWithDouble:(count ? (double)sum/count : 0)], @"mean",
+            [NSNumber numberWithLongLong:maximum], @"max",
+            [NSNumber numberWithLongLong:percentiles[0]], @"p50",
+            [NSNumber numberWithLongLong:percentiles[1]], @"p90",
+            [NSNumber numberWithLongLong:percentiles[2]], @"p99",
+            nil];
+}
+
+@end
+
+#pragma mark -
+
+uint64_t SCTelemetryTimestamp(void) {
+    return mach_absolute_time();
+}
+
+int64_t SCTelemetryMicrosecondsSince(uint64_t start) {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{ mach_timebase_info(&timebase); });
+    return (int64_t)((mach_absolute_time() - start) * timebase.numer / timebase.denom / 1000);
+}
@@ -0,0 +1,49 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <mach/mach.h>
+
+@class SCBacktrace;
+
+/*! The most threads SCThreadSnapshotAppend records. */
+#define SCThreadSnapshotMaximumThreads 128
+
+/*! The most frames SCThreadSnapshotAppend records per thread. */
+#define SCThreadSnapshotMaximumFrames 128
+
+/*!
+ Records the stack of every thread but the calling one, without stopping the
+ process. The other threads are suspended only while their stacks are walked
+ (by following frame pointers) into a static buffer; nothing is allocated and
+ no locks that another thread might hold are taken until they are resumed.
+ The addresses are resolved and added to the backtrace afterwards, as
+ non-faulted threads.
+
+ Only one snapshot is taken at a time; concurrent callers wait.
+ @param backtrace The backtrace to add the threads to.
+ @return The number of threads added.
+ */
+NSUInteger SCThreadSnapshotAppend(SCBacktrace *backtrace);
+
+/*!
+ Records the stack of a single other thread, suspending only that thread while
+ it is walked. Used to sample a thread that has stopped responding.
+ @param backtrace The backtrace to add the thread to.
+ @param thread The thread to sample. Must not be the calling thread.
+ @param name The name to record the thread under.
+ @param faulted Whether to mark the thread as faulted.
+ @return Whether the thread could be sampled.
+ */
+BOOL SCThreadSnapshotAppendThread(SCBacktrace *backtrace, thread_t thread, NSString *name, BOOL faulted);
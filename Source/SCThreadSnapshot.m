@@ -0,0 +1,151 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import "SCThreadSnapshot.h"
+#import "SCBacktrace.h"
+#import <mach/mach.h>
+#import <pthread.h>
+
+// One frame record, as laid down by the function prologue on every
+// architecture we support.
+typedef struct {
+    uintptr_t previous;
+    uintptr_t returnAddress;
+} SCFrameRecord;
+
+typedef struct {
+    uint32_t threadCount;
+    uint32_t frameCounts[SCThreadSnapshotMaximumThreads];
+    uint64_t frames[SCThreadSnapshotMaximumThreads][SCThreadSnapshotMaximumFrames];
+} SCThreadSnapshot;
+
+// preallocated so nothing is allocated while threads (one of which may hold the
+// malloc lock) are suspended
+static SCThreadSnapshot SCSnapshot;
+static pthread_mutex_t SCSnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+static BOOL SCGetThreadPosition(thread_t thread, uintptr_t *pc, uintptr_t *fp);
+static uint32_t SCWalkThread(thread_t thread, uint64_t *frames, uint32_t capacity);
+
+NSUInteger SCThreadSnapshotAppend(SCBacktrace *backtrace) {
+    thread_act_array_t threads = NULL;
+    mach_msg_type_number_t count = 0;
+    if (task_threads(mach_task_self(), &threads, &count) != KERN_SUCCESS) return 0;
+
+    thread_t current = mach_thread_self();
+    pthread_mutex_lock(&SCSnapshotLock);
+
+    uint32_t recorded = MIN(count, (mach_msg_type_number_t)SCThreadSnapshotMaximumThreads);
+    BOOL *suspended = alloca(count * sizeof(BOOL));
+    for (mach_msg_type_number_t idx = 0; idx < count; idx++)
+        suspended[idx] = idx < recorded && threads[idx] != current && thread_suspend(threads[idx]) == KERN_SUCCESS;
+
+    for (uint32_t idx = 0; idx < recorded; idx++)
+        SCSnapshot.frameCounts[idx] = suspended[idx] ? SCWalkThread(threads[idx], SCSnapshot.frames[idx], SCThreadSnapshotMaximumFrames) : 0;
+    SCSnapshot.threadCount = recorded;
+
+    for (mach_msg_type_number_t idx = 0; idx < count; idx++)
+        if (suspended[idx]) thread_resume(threads[idx]);
+
+    NSUInteger added = 0;
+    for (uint32_t idx = 0; idx < SCSnapshot.threadCount; idx++) {
+        if (!suspended[idx]) continue;
+        [backtrace beginThreadNamed:[NSString stringWithFormat:@"Thread %u", idx] faulted:NO registers:NO];
+        [backtrace addThreadNumber:idx];
+        for (uint32_t frame = 0; frame < SCSnapshot.frameCounts[idx]; frame++)
+            [backtrace addFrameWithAddress:SCSnapshot.frames[idx][frame] resolve:YES];
+        added++;
+    }
+    pthread_mutex_unlock(&SCSnapshotLock);
+
+    for (mach_msg_type_number_t idx = 0; idx < count; idx++)
+        mach_port_deallocate(mach_task_self(), threads[idx]);
+    mach_port_deallocate(mach_task_self(), current);
+    vm_deallocate(mach_task_self(), (vm_address_t)threads, count * sizeof(thread_t));
+    return added;
+}
+
+BOOL SCThreadSnapshotAppendThread(SCBacktrace *backtrace, thread_t thread, NSString *name, BOOL faulted) {
+    if (thread == MACH_PORT_NULL) return NO;
+    thread_t current = mach_thread_self();
+    mach_port_deallocate(mach_task_self(), current);
+    if (thread == current) return NO;
+
+    pthread_mutex_lock(&SCSnapshotLock);
+    if (thread_suspend(thread) != KERN_SUCCESS) {
+        pthread_mutex_unlock(&SCSnapshotLock);
+        return NO;
+    }
+    SCSnapshot.frameCounts[0] = SCWalkThread(thread, SCSnapshot.frames[0], SCThreadSnapshotMaximumFrames);
+    thread_resume(thread);
+
+    [backtrace beginThreadNamed:name faulted:faulted registers:NO];
+    for (uint32_t frame = 0; frame < SCSnapshot.frameCounts[0]; frame++)
+        [backtrace addFrameWithAddress:SCSnapshot.frames[0][frame] resolve:YES];
+    pthread_mutex_unlock(&SCSnapshotLock);
+    return YES;
+}
+
+static BOOL SCGetThreadPosition(thread_t thread, uintptr_t *pc, uintptr_t *fp) {
+#if defined(__x86_64__)
+    x86_thread_state64_t state;
+    mach_msg_type_number_t stateCount = x86_THREAD_STATE64_COUNT;
+    if (thread_get_state(thread, x86_THREAD_STATE64, (thread_state_t)&state, &stateCount) != KERN_SUCCESS) return NO;
+    *pc = state.__rip;
+    *fp = state.__rbp;
+#elif defined(__i386__)
+    x86_thread_state32_t state;
+    mach_msg_type_number_t stateCount = x86_THREAD_STATE32_COUNT;
+    if (thread_get_state(thread, x86_THREAD_STATE32, (thread_state_t)&state, &stateCount) != KERN_SUCCESS) return NO;
+    *pc = state.__eip;
+    *fp = state.__ebp;
+#elif defined(__arm64__)
+    arm_thread_state64_t state;
+    mach_msg_type_number_t stateCount = ARM_THREAD_STATE64_COUNT;
+    if (thread_get_state(thread, ARM_THREAD_STATE64, (thread_state_t)&state, &stateCount) != KERN_SUCCESS) return NO;
+    *pc = state.__pc;
+    *fp = state.__fp;
+#elif defined(__arm__)
+    arm_thread_state_t state;
+    mach_msg_type_number_t stateCount = ARM_THREAD_STATE_COUNT;
+    if (thread_get_state(thread, ARM_THREAD_STATE, (thread_state_t)&state, &stateCount) != KERN_SUCCESS) return NO;
+    *pc = state.__pc;
+    *fp = state.__r[7];
+#else
+    return NO;
+#endif
+    return YES;
+}
+
+static uint32_t SCWalkThread(thread_t thread, uint64_t *frames, uint32_t capacity) {
+    uintptr_t pc, fp;
+    if (!SCGetThreadPosition(thread, &pc, &fp)) return 0;
+
+    uint32_t count = 0;
+    frames[count++] = pc;
+    while (fp && count < capacity) {
+        // vm_read_overwrite fails cleanly on a bad frame pointer instead of
+        // faulting
+        SCFrameRecord record;
+        vm_size_t read = 0;
+        if (vm_read_overwrite(mach_task_self(), fp, sizeof(record), (vm_address_t)&record, &read) != KERN_SUCCESS || read != sizeof(record)) break;
+        if (!record.returnAddress) break;
+        frames[count++] = record.returnAddress;
+        // stacks grow down, so each caller's frame is above its callee's
+        if (record.previous <= fp) break;
+        fp = record.previous;
+    }
+    return count;
+}
@@ -0,0 +1,124 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SquashCocoa.h"
+
+@class SCOccurrence;
+
+/*!
+ Called once for each occurrence handed to an SCUploader, on a background
+ thread, when its upload attempt finishes.
+ @param occurrence The occurrence that was uploaded.
+ @param success Whether Squash acknowledged the occurrence (2xx response).
+ @param statusCode The HTTP status code, or 0 if no response was received
+ (including when the upload was cancelled).
+ @param retryAfter The number of seconds the server asked clients to wait
+ before retrying (the `Retry-After` header), or 0 if it didn't say.
+ */
+typedef void (^SCUploadCompletionHandler)(SCOccurrence *occurrence, BOOL success, NSInteger statusCode, NSTimeInterval retryAfter);
+
+/*!
+ Transmits occurrences to Squash off the caller's thread. Requests to
+ SquashCocoa::notifyURL are issued asynchronously, with at most
+ SCUploader::maximumConcurrentUploads requests in flight at once. Additional
+ occurrences wait in a FIFO queue until a slot in the window frees up.
+
+ Because the system's URL loading keeps connections to the Squash host open
+ and reuses them for later requests, draining a backlog costs roughly one
+ round trip per occurrence spread across the window, rather than one
+ connection setup (or one timeout) per occurrence in turn.
+
+ Occurrences can also be sent in batches (SCUploader::uploadOccurrences:completion:).
+ A batch is a single compressed `POST` to SCUploader::batchURL whose body is
+ `{"occurrences": [...]}`. The server acknowledges each item separately by
+ responding with `{"statuses": [...]}`, one HTTP-style status code per
+ occurrence in request order; a 2xx response without a `statuses` array
+ acknowledges the whole batch.
+
+ When SCUploader::deduplicatesContext is set, every occurrence carries a
+ `context_id` (SCOccurrence::contextID), and the process and device fields it
+ stands for are sent only until Squash has acknowledged one occurrence with
+ that context; later occurrences send just the ID. If Squash answers an
+ occurrence that referenced a context with 412 (Precondition Failed), meaning
+ it no longer knows the context, the uploader forgets that the context was
+ registered and immediately resends the occurrence with its context inline.
+ */
+@interface SCUploader : NSObject {
+    NSUInteger maximumConcurrentUploads;
+    NSURL *batchURL;
+    NSUInteger maximumBatchBytes;
+    NSUInteger maximumBatchCount;
+    SCCompression compression;
+    BOOL deduplicatesContext;
+    NSMutableSet *registeredContexts;
+    NSMutableArray *pending;
+    NSUInteger inFlight;
+    NSOperationQueue *callbackQueue;
+    dispatch_queue_t stateQueue;
+}
+
+#pragma mark Properties
+
+/*!
+ The maximum number of requests that may be outstanding at once. By default
+ it's 4.
+ */
+@property (assign) NSUInteger maximumConcurrentUploads;
+
+/*! The URL batches are posted to. */
+@property (retain) NSURL *batchURL;
+
+/*! The maximum uncompressed size of one batch body, in bytes. */
+@property (assign) NSUInteger maximumBatchBytes;
+
+/*! The maximum number of occurrences in one batch. */
+@property (assign) NSUInteger maximumBatchCount;
+
+/*! The content coding applied to batch bodies. */
+@property (assign) SCCompression compression;
+
+/*!
+ If `YES`, the process and device context of each occurrence is sent once
+ and referenced by its hash afterwards. The set of contexts Squash has
+ acknowledged lives only as long as the uploader. By default it's `NO`.
+ */
+@property (assign) BOOL deduplicatesContext;
+
+#pragma mark Uploading
+
+/*!
+ Queues an occurrence for transmission and returns immediately.
+ @param occurrence The occurrence to transmit.
+ @param completion Called on a background thread once the upload finishes.
+ */
+- (void) uploadOccurrence:(SCOccurrence *)occurrence completion:(SCUploadCompletionHandler)completion;
+
+/*!
+ Groups occurrences into batches bounded by SCUploader::maximumBatchBytes and
+ SCUploader::maximumBatchCount, queues each batch for transmission to
+ SCUploader::batchURL, and returns immediately.
+ @param occurrences The occurrences to transmit.
+ @param completion Called on a background thread once for every occurrence,
+ reporting whether that particular occurrence was acknowledged.
+ */
+- (void) uploadOccurrences:(NSArray *)occurrences completion:(SCUploadCompletionHandler)completion;
+
+/*!
+ Abandons every upload that has not started yet, calling its completion
+ handler with a status code of 0. Requests already in flight are unaffected.
+ Used to stop hammering a host that has started failing.
+ */
+- (void) cancelPendingUploads;
+
+@end
@@ -0,0 +1,357 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#import "SCUploader.h"
+#import "SCOccurrence.h"
+#import "SCFunctions.h"
+#import "SCTelemetry.h"
+
+static NSTimeInterval SCRetryAfterInterval(NSURLResponse *response);
+static void SCRecordRequest(NSURLRequest *request, uint64_t start);
+
+// the status Squash answers an occurrence with when it references a context
+// that Squash doesn't know
+static const NSInteger SCUnknownContextStatusCode = 412;
+
+@interface SCUploader (Private)
+
+- (void) startPendingUploads;
+- (void) startUpload:(SCOccurrence *)occurrence body:(NSData *)body completion:(SCUploadCompletionHandler)completion;
+- (void) startBatch:(NSArray *)occurrences JSON:(NSArray *)payloads references:(NSIndexSet *)references completion:(SCUploadCompletionHandler)completion;
+- (void) registerContextsOfOccurrences:(NSArray *)occurrences;
+- (void) retryOccurrencesWithContext:(NSArray *)occurrences completion:(SCUploadCompletionHandler)completion;
+- (void) finishUpload;
+
+@end
+
+#pragma mark -
+
+@implementation SCUploader
+
+#pragma mark Properties
+
+@synthesize maximumConcurrentUploads;
+@synthesize batchURL;
+@synthesize maximumBatchBytes;
+@synthesize maximumBatchCount;
+@synthesize compression;
+@synthesize deduplicatesContext;
+
+#pragma mark Initializers
+
+- (id) init {
+    if (self = [super init]) {
+        maximumConcurrentUploads = 4;
+        maximumBatchBytes = 512*1024;
+        maximumBatchCount = 50;
+        compression = SCCompressionGzip;
+        deduplicatesContext = NO;
+        registeredContexts = [[NSMutableSet alloc] init];
+        pending = [[NSMutableArray alloc] init];
+        inFlight = 0;
+        callbackQueue = [[NSOperationQueue alloc] init];
+        stateQueue = dispatch_queue_create("com.squareup.squash.uploader", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [batchURL release];
+    [registeredContexts release];
+    [pending release];
+    [callbackQueue release];
+    dispatch_release(stateQueue);
+    [super dealloc];
+}
+
+#pragma mark Uploading
+
+- (void) uploadOccurrence:(SCOccurrence *)occurrence completion:(SCUploadCompletionHandler)completion {
+    SCUploadCompletionHandler handler = [[completion copy] autorelease];
+    [occurrence retain];
+    dispatch_async(stateQueue, ^{
+        [pending addObject:[NSArray arrayWithObjects:occurrence, handler, NULL]];
+        [occurrence release];
+        [self startPendingUploads];
+    });
+}
+
+- (void) uploadOccurrences:(NSArray *)occurrences completion:(SCUploadCompletionHandler)completion {
+    SCUploadCompletionHandler handler = [[completion copy] autorelease];
+    [occurrences retain];
+    dispatch_async(stateQueue, ^{
+        NSUInteger byteBudget = self.maximumBatchBytes;
+        NSUInteger countBudget = MAX(self.maximumBatchCount, (NSUInteger)1);
+        BOOL deduplicate = self.deduplicatesContext;
+
+        NSMutableArray *batch = [[NSMutableArray alloc] init];
+        NSMutableArray *payloads = [[NSMutableArray alloc] init];
+        // contexts sent inline earlier in the batch, which later items can
+        // already reference
+        NSMutableSet *inlined = [[NSMutableSet alloc] init];
+        NSMutableIndexSet *references = deduplicate ? [[NSMutableIndexSet alloc] init] : nil;
+        NSUInteger batchBytes = 0;
+        for (SCOccurrence *occurrence in occurrences) {
+            NSString *contextID = deduplicate ? [occurrence contextID] : nil;
+            BOOL reference = contextID && ([registeredContexts containsObject:contextID] || [inlined containsObject:contextID]);
+            NSData *JSON = [occurrence asJSONWithContextID:contextID includingContext:!reference];
+            if (!JSON) {
+                handler(occurrence, NO, 0, 0);
+                continue;
+            }
+            if ([batch count] > 0 && ([batch count] >= countBudget || batchBytes + [JSON length] > byteBudget)) {
+                [pending addObject:[NSArray arrayWithObjects:[[batch copy] autorelease], handler, [[payloads copy] autorelease], [[references copy] autorelease], NULL]];
+                [batch removeAllObjects];
+                [payloads removeAllObjects];
+                [references removeAllIndexes];
+                batchBytes = 0;
+                // the next batch may be delivered first, so it can't rely on
+                // this one's inline contexts
+                if (reference && ![registeredContexts containsObject:contextID]) {
+                    reference = NO;
+                    JSON = [occurrence asJSONWithContextID:contextID includingContext:YES];
+                }
+                [inlined removeAllObjects];
+            }
+            if (reference) [references addIndex:[batch count]];
+            else if (contextID) [inlined addObject:contextID];
+            [batch addObject:occurrence];
+            [payloads addObject:JSON];
+            batchBytes += [JSON length] + 1;
+        }
+        if ([batch count] > 0)
+            [pending addObject:[NSArray arrayWithObjects:[[batch copy] autorelease], handler, [[payloads copy] autorelease], [[references copy] autorelease], NULL]];
+        [batch release];
+        [payloads release];
+        [inlined release];
+        [references release];
+        [occurrences release];
+
+        [self startPendingUploads];
+    });
+}
+
+- (void) cancelPendingUploads {
+    dispatch_async(stateQueue, ^{
+        NSArray *cancelled = [pending copy];
+        [pending removeAllObjects];
+        for (NSArray *job in cancelled) {
+            SCUploadCompletionHandler handler = [job objectAtIndex:1];
+            if ([[job objectAtIndex:0] isKindOfClass:[NSArray class]]) {
+                for (SCOccurrence *occurrence in [job objectAtIndex:0]) handler(occurrence, NO, 0, 0);
+            } else {
+                handler([job objectAtIndex:0], NO, 0, 0);
+            }
+        }
+        [cancelled release];
+    });
+}
+
+@end
+
+#pragma mark -
+
+@implementation SCUploader (Private)
+
+// Jobs are arrays: [occurrence, handler] for a single upload (plus the body,
+// when it was built in advance), or [occurrences, handler, payloads] for a
+// batch (plus the indexes of the items that reference their context, when
+// deduplicating). Must be called on stateQueue.
+- (void) startPendingUploads {
+    NSUInteger window = MAX(self.maximumConcurrentUploads, (NSUInteger)1);
+    while (inFlight < window && [pending count] > 0) {
+        NSArray *job = [[pending objectAtIndex:0] retain];
+        [pending removeObjectAtIndex:0];
+        inFlight++;
+        if ([[job objectAtIndex:0] isKindOfClass:[NSArray class]])
+            [self startBatch:[job objectAtIndex:0]
+                        JSON:[job objectAtIndex:2]
+                  references:([job count] > 3 ? [job objectAtIndex:3] : nil)
+                  completion:[job objectAtIndex:1]];
+        else
+            [self startUpload:[job objectAtIndex:0]
+                         body:([job count] > 2 ? [job objectAtIndex:2] : nil)
+                   completion:[job objectAtIndex:1]];
+        [job release];
+    }
+}
+
+- (void) startUpload:(SCOccurrence *)occurrence body:(NSData *)body completion:(SCUploadCompletionHandler)completion {
+    NSString *contextID = self.deduplicatesContext ? [occurrence contextID] : nil;
+    // a body built in advance is a retry, which always carries its context
+    BOOL reference = (!body && contextID && [registeredContexts containsObject:contextID]);
+    if (!body) body = [occurrence asJSONWithContextID:contextID includingContext:!reference];
+    NSURLRequest *request = [[occurrence notifyRequestWithBody:body] retain];
+
+    [occurrence retain];
+    SCUploadCompletionHandler handler = [completion copy];
+    uint64_t start = SCTelemetryTimestamp();
+    [NSURLConnection sendAsynchronousRequest:request queue:callbackQueue completionHandler:^(NSURLResponse *response, NSData *data, NSError *error) {
+        NSInteger statusCode = 0;
+        if ([response isKindOfClass:[NSHTTPURLResponse class]])
+            statusCode = [(NSHTTPURLResponse *)response statusCode];
+        BOOL success = (!error && statusCode/100 == 2);
+        SCRecordRequest(request, start);
+        [[SCTelemetry sharedTelemetry] recordUploadWithStatusCode:statusCode success:success];
+        if (reference && statusCode == SCUnknownContextStatusCode) {
+            [self retryOccurrencesWithContext:[NSArray arrayWithObject:occurrence] completion:handler];
+        } else {
+            if (success && contextID && !reference)
+                [self registerContextsOfOccurrences:[NSArray arrayWithObject:occurrence]];
+            handler(occurrence, success, statusCode, SCRetryAfterInterval(response));
+        }
+        [handler release];
+        [occurrence release];
+        [self finishUpload];
+    }];
+    [request release];
+}
+
+- (void) startBatch:(NSArray *)occurrences JSON:(NSArray *)payloads references:(NSIndexSet *)references completion:(SCUploadCompletionHandler)completion {
+    NSMutableData *body = [[NSMutableData alloc] init];
+    [body appendBytes:"{\"occurrences\":[" length:16];
+    [payloads enumerateObjectsUsingBlock:^(NSData *JSON, NSUInteger idx, BOOL *stop) {
+        if (idx > 0) [body appendBytes:"," length:1];
+        [body appendData:JSON];
+    }];
+    [body appendBytes:"]}" length:2];
+
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:self.batchURL cachePolicy:NSURLRequestUseProtocolCachePolicy timeoutInterval:60.0];
+    [request setHTTPMethod:@"POST"];
+    [request setValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
+    [request setValue:@"application/json" forHTTPHeaderField:@"Accept"];
+    [request setValue:@"gzip, deflate" forHTTPHeaderField:@"Accept-Encoding"];
+    [request setValue:SCContentEncoding(self.compression) forHTTPHeaderField:@"Content-Encoding"];
+    [request setHTTPBody:SCCompressData(body, self.compression)];
+    [request setTimeoutInterval:[SquashCocoa sharedClient].timeout];
+    [body release];
+
+    [occurrences retain];
+    SCUploadCompletionHandler handler = [completion copy];
+    uint64_t start = SCTelemetryTimestamp();
+    [NSURLConnection sendAsynchronousRequest:request queue:callbackQueue completionHandler:^(NSURLResponse *response, NSData *data, NSError *error) {
+        NSInteger statusCode = 0;
+        if ([response isKindOfClass:[NSHTTPURLResponse class]])
+            statusCode = [(NSHTTPURLResponse *)response statusCode];
+        BOOL batchAccepted = (!error && statusCode/100 == 2);
+        NSTimeInterval retryAfter = SCRetryAfterInterval(response);
+        SCRecordRequest(request, start);
+
+        NSArray *statuses = nil;
+        if (batchAccepted && [data length] > 0) {
+            id result = [NSJSONSerialization JSONObjectWithData:data options:0 error:NULL];
+            if ([result isKindOfClass:[NSDictionary class]]) statuses = [result objectForKey:@"statuses"];
+            if (![statuses isKindOfClass:[NSArray class]]) statuses = nil;
+        }
+
+        NSMutableArray *registered = references ? [NSMutableArray array] : nil;
+        NSMutableArray *unknown = references ? [NSMutableArray array] : nil;
+        [occurrences enumerateObjectsUsingBlock:^(SCOccurrence *occurrence, NSUInteger idx, BOOL *stop) {
+            // items the server did not explicitly acknowledge stay queued
+            NSInteger itemStatus = statusCode;
+            if (statuses) {
+                id status = (idx < [statuses count]) ? [statuses objectAtIndex:idx] : nil;
+                itemStatus = [status respondsToSelector:@selector(integerValue)] ? [status integerValue] : 0;
+            }
+            BOOL success = (batchAccepted && itemStatus/100 == 2);
+            [[SCTelemetry sharedTelemetry] recordUploadWithStatusCode:itemStatus success:success];
+            if ([references containsIndex:idx] && itemStatus == SCUnknownContextStatusCode) {
+                [unknown addObject:occurrence];
+                return;
+            }
+            if (success && references && ![references containsIndex:idx]) [registered addObject:occurrence];
+            handler(occurrence, success, itemStatus, retryAfter);
+        }];
+        if ([registered count] > 0) [self registerContextsOfOccurrences:registered];
+        if ([unknown count] > 0) [self retryOccurrencesWithContext:unknown completion:handler];
+        [handler release];
+        [occurrences release];
+        [self finishUpload];
+    }];
+    [request release];
+}
+
+// called on callbackQueue
+- (void) registerContextsOfOccurrences:(NSArray *)occurrences {
+    NSMutableSet *contextIDs = [NSMutableSet set];
+    for (SCOccurrence *occurrence in occurrences) [contextIDs addObject:[occurrence contextID]];
+    dispatch_async(stateQueue, ^{
+        [registeredContexts unionSet:contextIDs];
+    });
+}
+
+// Squash has forgotten these occurrences' contexts (it restarted, say), so
+// they go back to the front of the queue with their contexts inline. Called on
+// callbackQueue.
+- (void) retryOccurrencesWithContext:(NSArray *)occurrences completion:(SCUploadCompletionHandler)completion {
+    NSMutableSet *contextIDs = [NSMutableSet set];
+    NSMutableArray *payloads = [NSMutableArray arrayWithCapacity:[occurrences count]];
+    for (SCOccurrence *occurrence in occurrences) {
+        NSString *contextID = [occurrence contextID];
+        [contextIDs addObject:contextID];
+        [payloads addObject:[occurrence asJSONWithContextID:contextID includingContext:YES]];
+    }
+    NSArray *job;
+    if ([occurrences count] == 1)
+        job = [NSArray arrayWithObjects:[occurrences objectAtIndex:0], completion, [payloads objectAtIndex:0], NULL];
+    else
+        job = [NSArray arrayWithObjects:occurrences, completion, payloads, [NSIndexSet indexSet], NULL];
+
+    dispatch_async(stateQueue, ^{
+        [registeredContexts minusSet:contextIDs];
+        [pending insertObject:job atIndex:0];
+    });
+}
+
+- (void) finishUpload {
+    dispatch_async(stateQueue, ^{
+        inFlight--;
+        [self startPendingUploads];
+    });
+}
+
+@end
+
+#pragma mark -
+
+static void SCRecordRequest(NSURLRequest *request, uint64_t start) {
+    SCTelemetry *telemetry = [SCTelemetry sharedTelemetry];
+    [telemetry recordValue:SCTelemetryMicrosecondsSince(start)/1000 inHistogram:SCTelemetryUploadLatency];
+    [telemetry incrementCounter:SCTelemetryBytesUploaded by:[[request HTTPBody] length]];
+}
+
+static NSTimeInterval SCRetryAfterInterval(NSURLResponse *response) {
+    if (![response isKindOfClass:[NSHTTPURLResponse class]]) return 0;
+    NSString *value = [[(NSHTTPURLResponse *)response allHeaderFields] objectForKey:@"Retry-After"];
+    if ([value length] == 0) return 0;
+
+    // either a number of seconds or an HTTP date
+    NSScanner *scanner = [NSScanner scannerWithString:value];
+    double seconds;
+    if ([scanner scanDouble:&seconds] && [scanner isAtEnd]) return MAX(seconds, 0);
+
+    static NSDateFormatter *formatter = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        formatter = [[NSDateFormatter alloc] init];
+        [formatter setLocale:[[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"] autorelease]];
+        [formatter setTimeZone:[NSTimeZone timeZoneWithAbbreviation:@"GMT"]];
+        [formatter setDateFormat:@"EEE',' dd MMM yyyy HH':'mm':'ss 'GMT'"];
+    });
+    NSDate *date;
+    @synchronized(formatter) {
+        date = [formatter dateFromString:value];
+    }
+    return date ? MAX([date timeIntervalSinceNow], 0) : 0;
+}
@@ -12,6 +12,58 @@
 //    See the License for the specific language governing permissions and
 //    limitations under the License.
 
+@class SCUploader;
+@class SCRateLimiter;
+@class SCFlushScheduler;
+@class SCHangMonitor;
+@class SCPerformanceRecorder;
+@class SCConfiguration;
+@class SquashCocoa;
+
+/*!
+ HTTP content codings that SquashCocoa can apply to request bodies.
+ */
+typedef enum {
+    /*! The body is sent uncompressed. */
+    SCCompressionNone = 0,
+    /*! The body is gzip-compressed (`Content-Encoding: gzip`). */
+    SCCompressionGzip,
+    /*! The body is zlib-wrapped deflate (`Content-Encoding: deflate`). */
+    SCCompressionDeflate
+} SCCompression;
+
+/*!
+ The representations SCValueify can produce for a `userInfo` value that isn't
+ already JSON-compatible. Combine them with `|`.
+ */
+typedef enum {
+    /*! The value's `description`. */
+    SCValueRepresentationDescription = 1 << 0,
+    /*! An XML `NSKeyedArchiver` archive, for values that conform to `NSCoding`. */
+    SCValueRepresentationKeyedArchiver = 1 << 1,
+    /*! A JSON rendering, for collections of JSON-compatible values. */
+    SCValueRepresentationJSON = 1 << 2,
+    /*! Every representation. */
+    SCValueRepresentationAll = SCValueRepresentationDescription | SCValueRepresentationKeyedArchiver | SCValueRepresentationJSON
+} SCValueRepresentation;
+
+/*!
+ Optional callbacks from SquashCocoa. All methods are called on the main
+ thread.
+ */
+@protocol SquashCocoaDelegate <NSObject>
+@optional
+
+/*!
+ Called when a flush of the occurrence queue finishes, with the same snapshot
+ SquashCocoa::telemetry would return.
+ @param client The SquashCocoa instance.
+ @param telemetry The telemetry snapshot.
+ */
+- (void) squashCocoa:(SquashCocoa *)client didUpdateTelemetry:(NSDictionary *)telemetry;
+
+@end
+
 /*!
  Singleton class managing the interface to Squash. This class is used to
  configure exception reporting, hook the exception handlers, and report and
@@ -38,7 +90,44 @@
     NSMutableSet *ignoredExceptions;
     NSMutableSet *handledSignals;
     NSMutableSet *filterUserInfoKeys;
+    SCConfiguration * volatile configuration;
+    NSMutableArray *retiredConfigurations;
+    volatile int32_t configurationReaders;
+    volatile BOOL hasRetiredConfigurations;
     NSString *revision;
+    NSUInteger maximumConcurrentUploads;
+    BOOL batchingEnabled;
+    NSString *batchNotifyPath;
+    NSUInteger maximumBatchBytes;
+    NSUInteger maximumBatchCount;
+    SCCompression compression;
+    BOOL deduplicatesContext;
+    NSTimeInterval coalescingWindow;
+    NSUInteger fingerprintFrameCount;
+    NSUInteger maximumVariants;
+    BOOL includesAllThreadRegisters;
+    BOOL capturesAllThreads;
+    BOOL monitorsHangs;
+    SCHangMonitor *hangMonitor;
+    SCPerformanceRecorder *performanceRecorder;
+    NSTimeInterval memorySampleInterval;
+    BOOL reportsBackgroundTerminations;
+    NSMutableDictionary *coalescedOccurrences;
+    SCRateLimiter *rateLimiter;
+    NSUInteger maximumUserDataBytes;
+    NSUInteger maximumUserDataDepth;
+    NSUInteger maximumUserDataCount;
+    NSTimeInterval userDataTimeBudget;
+    SCValueRepresentation userDataRepresentations;
+    id<SquashCocoaDelegate> delegate;
+    BOOL uploadsClientStats;
+    NSUInteger maximumQueueBytes;
+    NSUInteger maximumQueueCount;
+    NSTimeInterval maximumQueueAge;
+    SCUploader *uploader;
+    SCFlushScheduler *flushScheduler;
+    NSString *monitoredHost;
+    BOOL reporting;
 }
 
 #pragma mark Properties
@@ -84,21 +173,266 @@
 @property (assign) NSUInteger timeout;
 
 /*!
- A set of `NSException` names that will not be reported to Squash.
+ The maximum number of occurrences that are uploaded to Squash concurrently.
+ By default it's 4.
+ */
+@property (assign) NSUInteger maximumConcurrentUploads;
+
+/*!
+ How long to wait before flushing again after a flush fails with a server
+ error or timeout. The wait doubles with each consecutive failure, up to
+ SquashCocoa::maximumRetryInterval, and is randomized per device. By default
+ it's 30 seconds.
+ */
+@property (assign) NSTimeInterval minimumRetryInterval;
+
+/*!
+ The longest wait between failed flushes. A longer `Retry-After` from the
+ server still takes precedence. By default it's one hour.
+ */
+@property (assign) NSTimeInterval maximumRetryInterval;
+
+/*!
+ The most disk space, in bytes, that queued occurrences may take up. When the
+ queue is compacted (at startup, or once it grows a quarter past this limit)
+ and is over this limit, duplicates are merged and then the occurrences seen
+ longest ago are evicted, non-fatal ones first. The number
+ evicted is reported with the next upload
+ (SCOccurrence::evictedOccurrences). Set to 0 for no limit. By default it's
+ 5 MiB.
+ */
+@property (assign) NSUInteger maximumQueueBytes;
+
+/*!
+ The most occurrences kept in the queue, enforced like
+ SquashCocoa::maximumQueueBytes. Set to 0 for no limit. By default it's 200.
+ */
+@property (assign) NSUInteger maximumQueueCount;
+
+/*!
+ Queued occurrences last seen longer ago than this many seconds are evicted
+ when the queue is compacted. Set to 0 to keep them indefinitely. By default
+ it's 30 days.
+ */
+@property (assign) NSTimeInterval maximumQueueAge;
+
+/*!
+ If `YES`, pending occurrences are grouped and sent to
+ SquashCocoa::batchNotifyPath as one compressed request per batch, rather than
+ one request each to SquashCocoa::notifyPath. Your Squash host must support the
+ batch endpoint. By default it's `NO`.
+ */
+@property (assign) BOOL batchingEnabled;
+
+/*!
+ The path to the batch notify action, with leading slash. By default it's
+ `/api/1.0/notify/batch`. Only used if SquashCocoa::batchingEnabled is set.
+ */
+@property (retain) NSString *batchNotifyPath;
+
+/*!
+ The maximum uncompressed size of a batch, in bytes. A single occurrence larger
+ than this is sent in a batch of its own. By default it's 512 KiB.
+ */
+@property (assign) NSUInteger maximumBatchBytes;
+
+/*!
+ The maximum number of occurrences in a batch. By default it's 50.
+ */
+@property (assign) NSUInteger maximumBatchCount;
+
+/*!
+ The content coding applied to batch request bodies. By default it's
+ `SCCompressionGzip`.
+ */
+@property (assign) SCCompression compression;
+
+/*!
+ If `YES`, the process and device fields of an occurrence (environment
+ variables, launch arguments, host name, device and operating system, bundle
+ version, and symbolication ID) are sent only until Squash has acknowledged
+ them once under their content hash (SCOccurrence::contextID); later
+ occurrences send just the hash as `context_id`. Your Squash host must support
+ context references. By default it's `NO`.
+ */
+@property (assign) BOOL deduplicatesContext;
+
+/*!
+ Occurrences with the same SCOccurrence::fingerprint that happen within this
+ many seconds of the first one are folded into it (SCOccurrence::coalesceOccurrence:)
+ instead of being stored and uploaded separately. Set to 0 to store every
+ occurrence. By default it's 60 seconds.
+ */
+@property (assign) NSTimeInterval coalescingWindow;
+
+/*!
+ The number of frames at the top of the faulting thread that contribute to an
+ occurrence's SCOccurrence::fingerprint. By default it's 5.
+ */
+@property (assign) NSUInteger fingerprintFrameCount;
+
+/*!
+ The maximum number of differing messages kept as SCOccurrence::variants when
+ occurrences are coalesced. By default it's 3.
+ */
+@property (assign) NSUInteger maximumVariants;
+
+/*!
+ If `YES`, crash reports include the registers of every thread. Otherwise only
+ the crashed thread's registers are sent. Threads with identical stacks are
+ sent once either way, unless their registers are included. By default it's
+ `NO`.
+ */
+@property (assign) BOOL includesAllThreadRegisters;
+
+/*!
+ If `YES`, exceptions passed to SquashCocoa::recordException: also carry a
+ snapshot of every other thread's stack (see SCThreadSnapshotAppend). The
+ other threads are paused while their stacks are walked, typically for well
+ under a millisecond. By default it's `NO`.
+ */
+@property (assign) BOOL capturesAllThreads;
+
+/*!
+ If `YES`, SquashCocoa::hook starts a watchdog that records stalls of the main
+ thread as occurrences (see SCHangMonitor). Must be set before calling
+ SquashCocoa::hook. By default it's `NO`.
+ */
+@property (assign) BOOL monitorsHangs;
+
+/*!
+ How long the main thread must be unresponsive before a hang is recorded. By
+ default it's 2 seconds.
+ */
+@property (assign) NSTimeInterval hangThreshold;
+
+/*!
+ How often the hang watchdog pings the main thread. Must be set before calling
+ SquashCocoa::hook. By default it's 0.5 seconds.
+ */
+@property (assign) NSTimeInterval hangPingInterval;
+
+/*!
+ How often the timings given to SquashCocoa::recordDuration:ofOperation: are
+ summarized into an occurrence and queued for upload. Must be set before
+ calling SquashCocoa::hook. By default it's 15 minutes.
+ */
+@property (assign) NSTimeInterval performanceFlushInterval;
+
+/*!
+ How often the app's memory footprint is sampled into the session state file
+ (see SCSessionState). When a launch ends without a crash report, clean exit,
+ or app or OS update, the next launch records it as an occurrence carrying
+ the footprint timeline. Must be set before calling SquashCocoa::hook. By
+ default it's 10 seconds.
+ */
+@property (assign) NSTimeInterval memorySampleInterval;
+
+/*!
+ If `YES`, unexplained terminations while the app was in the background are
+ recorded too (as SCBackgroundTerminationClassName). The system routinely
+ reclaims suspended apps, so by default it's `NO` and only foreground
+ terminations and terminations during a hang are recorded.
+ */
+@property (assign) BOOL reportsBackgroundTerminations;
+
+/*!
+ The sustained number of exceptions of any one class that
+ SquashCocoa::recordException: records per second; the rest are dropped before
+ an occurrence is built. Set to 0 to disable rate limiting. By default it's 1.
+ */
+@property (assign) double rateLimit;
+
+/*!
+ The number of exceptions of one class that can be recorded in a burst before
+ SquashCocoa::rateLimit applies. By default it's 10.
+ */
+@property (assign) double rateLimitBurst;
+
+/*!
+ The fraction of exceptions (0 to 1) that SquashCocoa::recordException:
+ considers recording. The number of exceptions dropped by sampling or rate
+ limiting is sent with the next recorded occurrence
+ (SCOccurrence::droppedOccurrences). By default it's 1.
+ */
+@property (assign) double sampleRate;
+
+/*!
+ The approximate total size, in bytes, of the `userInfo` serialized for one
+ exception. Strings that would exceed it are truncated, and values reached
+ after it is spent are replaced with markers. By default it's 64 KiB.
+ */
+@property (assign) NSUInteger maximumUserDataBytes;
+
+/*!
+ The deepest level of nested collections serialized within a `userInfo` value.
+ By default it's 8.
+ */
+@property (assign) NSUInteger maximumUserDataDepth;
+
+/*!
+ The maximum number of elements serialized from any one collection in
+ `userInfo`. By default it's 100.
+ */
+@property (assign) NSUInteger maximumUserDataCount;
+
+/*!
+ The maximum time, in seconds, spent serializing the `userInfo` for one
+ exception; values reached after it runs out are replaced with markers. By
+ default it's 0.05.
+ */
+@property (assign) NSTimeInterval userDataTimeBudget;
+
+/*!
+ The representations produced for `userInfo` values that aren't already
+ JSON-compatible. Dropping `SCValueRepresentationKeyedArchiver` avoids the most
+ expensive one. By default it's `SCValueRepresentationAll`.
+ */
+@property (assign) SCValueRepresentation userDataRepresentations;
+
+/*!
+ Receives telemetry after each flush (see SquashCocoa::telemetry). Not
+ retained.
+ */
+@property (assign) id<SquashCocoaDelegate> delegate;
+
+/*!
+ If `YES`, a snapshot of SquashCocoa::telemetry is sent as `client_stats` with
+ the first occurrence of each upload, so the cost of crash reporting can be
+ monitored across devices. By default it's `NO`.
+ */
+@property (assign) BOOL uploadsClientStats;
+
+/*!
+ A set of `NSException` names that will not be reported to Squash. It can be
+ changed from any thread; exceptions recorded afterwards see the change.
  */
 @property (readonly) NSMutableSet *ignoredExceptions;
 
 /*!
  A set of signals (represented as `NSNumber`s) that will be trapped by Squash.
+ It can be changed from any thread, but is only read by SquashCocoa::hook,
+ which installs SCHandleSignal for these signals.
  */
 @property (readonly) NSMutableSet *handledSignals;
 
 /*!
  A set of `NSDictionary` keys that will be removed from an `NSException`'s
- `userInfo` before being transmitted to Squash.
+ `userInfo` before being transmitted to Squash. It can be changed from any
+ thread; exceptions recorded afterwards see the change.
  */
 @property (readonly) NSMutableSet *filterUserInfoKeys;
 
+/*!
+ An immutable snapshot of SquashCocoa::APIKey, SquashCocoa::environment,
+ SquashCocoa::revision and the sets above, replaced whenever one of them
+ changes. Reading it takes no lock, so it is what the recording paths use.
+ Each read returns its own reference (retained and autoreleased), so a snapshot
+ stays valid for as long as the reader keeps it. Replaced snapshots are freed
+ once no thread is in the middle of reading the property.
+ */
+@property (readonly) SCConfiguration *configuration;
+
 /*!
  The full SHA1 identification of the Git revision of the project repository at
  the time of the current build.
@@ -118,9 +452,13 @@
 #pragma mark Configuration
 
 /*!
- Installs the Squash uncaught-exception handler and default signal handler. This
- method should be called when your application launches, after Squash is
- configured.
+ Enables PLCrashReporter, which reports uncaught exceptions and crashes, and
+ installs SCHandleSignal for each of SquashCocoa::handledSignals, chaining to
+ PLCrashReporter's handlers. A signal record is only turned into an occurrence
+ if PLCrashReporter didn't report the same crash.
+ This method should be called when your application launches, after Squash is
+ configured. It also preallocates everything SCHandleSignal needs, so that
+ capturing a signal never allocates memory.
  */
 - (oneway void) hook;
 
@@ -145,6 +483,13 @@
  */
 - (NSURL *) notifyURL;
 
+/*!
+ Returns the SquashCocoa::host and SquashCocoa::batchNotifyPath combined into an
+ `NSURL`.
+ @return The URL to `POST` batches of occurrences to.
+ */
+- (NSURL *) batchNotifyURL;
+
 #pragma mark Recording
 
 /*!
@@ -154,24 +499,80 @@
 - (oneway void) recordException:(NSException *)exception;
 
 /*!
- Records a signal to the file queue for later transmission to Squash.
+ Records an uncaught `NSException` as a fatal occurrence. Unlike
+ SquashCocoa::recordException:, the exception bypasses
+ SquashCocoa::sampleRate, SquashCocoa::rateLimit, and
+ SquashCocoa::coalescingWindow, since the process won't live to record it
+ again. Called by SCHandleException; apps should use
+ SquashCocoa::recordException: instead.
+ @param exception The exception that is terminating the process.
+ */
+- (oneway void) recordUncaughtException:(NSException *)exception;
+
+/*!
+ Records a signal to the file queue for later transmission to Squash. This
+ method allocates and archives, so it must not be called from a signal handler;
+ SCHandleSignal writes its own raw record instead, which is converted on the
+ next launch.
  @param signal The signal that was trapped.
  @param addresses The call stack at the time of the trap (array of `NSNumber`s).
  */
 - (oneway void) recordSignal:(int)signal addresses:(NSArray *)addresses;
 
+/*!
+ Records an app event, such as a screen transition, network call, or user
+ action. The most recent breadcrumbs are attached to every occurrence
+ (SCOccurrence::breadcrumbs), including crashes. This method takes no locks and
+ doesn't allocate, so it can be called freely from any thread.
+ @param message What happened. Long messages are truncated to about 90 bytes.
+ @param category A short category, such as "navigation", or `nil`.
+ */
+- (void) leaveBreadcrumb:(NSString *)message category:(NSString *)category;
+
+/*!
+ Records how long an operation, such as app launch, a screen load, or a
+ network call, took. Timings are aggregated on the device into a histogram per
+ operation (see SCPerformanceRecorder), and the histograms are uploaded as one
+ occurrence every SquashCocoa::performanceFlushInterval.
+ @param duration How long the operation took, in seconds.
+ @param operation The operation's name. At most 64 distinct names are tracked
+ per period.
+ */
+- (void) recordDuration:(NSTimeInterval)duration ofOperation:(NSString *)operation;
+
 #pragma mark Reporting
 
 /*!
- Returns the directory where occurrences are serialized to for later
- transmission to Squash.
+ Returns a snapshot of what SquashCocoa itself has been doing since launch:
+ how long SquashCocoa::recordException: blocked its caller, how big occurrence
+ payloads are, how many occurrences are queued, and how long uploads took and
+ with which status codes. Recording these costs a few atomic additions (see
+ SCTelemetry); only taking a snapshot allocates.
+ @return A dictionary of JSON-compatible values, with `counters`, `gauges`, and
+ `histograms` keys.
+ */
+- (NSDictionary *) telemetry;
+
+/*!
+ Returns the directory holding the journal that occurrences are serialized to
+ for later transmission to Squash (see SCJournal).
  @return The directory storing pending occurrences.
  */
 - (NSString *) occurrencesDirectory;
 
 /*!
- Loads all occurrences in SquashCocoa::occurrencesDirectory and transmits them,
- one at a time, to the Squash API host.
+ Compacts the occurrence journal in SquashCocoa::occurrencesDirectory and
+ moves any pending PLCrashReporter reports into it, then transmits every
+ occurrence in the journal to the Squash API host. This method returns
+ immediately; the work happens on a background thread, with up to
+ SquashCocoa::maximumConcurrentUploads requests in flight. Each occurrence is
+ removed from the queue once Squash acknowledges it.
+
+ The first call also starts watching the host's reachability: after that, the
+ queue is flushed again whenever the host becomes reachable, and after a
+ backoff delay if a flush fails (see SquashCocoa::minimumRetryInterval). While
+ the host is known to be unreachable or a backoff is in effect, only the local
+ work is done.
  */
 - (oneway void) reportErrors;
 
@@ -15,9 +15,22 @@
 #import "SquashCocoa.h"
 #import "SCOccurrence.h"
 #import "SCFunctions.h"
+#import "SCUploader.h"
+#import "SCJournal.h"
+#import "SCRateLimiter.h"
+#import "SCProcessContext.h"
+#import "SCBinaryImages.h"
+#import "SCFlushScheduler.h"
+#import "SCTelemetry.h"
+#import "SCBreadcrumbs.h"
+#import "SCThreadSnapshot.h"
+#import "SCHangMonitor.h"
+#import "SCPerformance.h"
+#import "SCSessionState.h"
+#import "SCConfiguration.h"
 #import "PLCrashReporter.h"
 #import "PLCrashReport.h"
-#import "Reachability.h"
+#import <libkern/OSAtomic.h>
 #if TARGET_OS_MAC && !TARGET_OS_IPHONE && !TARGET_IPHONE_SIMULATOR
 #import <ExceptionHandling/ExceptionHandling.h>
 #endif
@@ -25,12 +38,39 @@
 #pragma mark Constants
 
 static NSString *SCDirectory = @"Squash Occurrences";
+static NSString *SCSignalRecordExtension = @"signal";
+static NSString *SCFlushScheduleFileName = @"FlushSchedule.plist";
+static NSString *SCBreadcrumbsFileName = @"Breadcrumbs.ring";
+static NSString *SCSessionStateFileName = @"Session.state";
 static SquashCocoa *sharedClient = NULL;
+// How far apart a signal record and a crash report can be and still describe
+// the same crash, in seconds.
+static const NSTimeInterval SCSignalRecordCrashReportTolerance = 5;
 
 #pragma mark -
 
 @interface SquashCocoa (Private)
 
+#pragma mark Recording
+
+- (void) storeOccurrence:(SCOccurrence *)occurrence;
+- (void) forgetOccurrence:(SCOccurrence *)occurrence;
+- (void) rememberQueuedOccurrences;
+- (void) forgetOccurrencesExcept:(NSSet *)UUIDs;
+
+#pragma mark Configuration
+
+- (void) publishConfiguration;
+- (void) reclaimConfigurations;
+
+#pragma mark Reporting
+
+- (void) monitorHost;
+- (void) moveAbnormalTerminationToQueue;
+- (NSArray *) moveCrashReportsToQueue;
+- (void) moveSignalRecordsToQueueExcept:(NSArray *)crashDates;
+- (void) uploadQueuedOccurrences;
+
 @end
 
 #pragma mark -
@@ -38,15 +78,37 @@ static SquashCocoa *sharedClient = NULL;
 @implementation SquashCocoa
 
 @synthesize disabled;
-@synthesize APIKey;
-@synthesize environment;
 @synthesize host;
 @synthesize notifyPath;
 @synthesize timeout;
+@synthesize maximumConcurrentUploads;
+@synthesize batchingEnabled;
+@synthesize batchNotifyPath;
+@synthesize maximumBatchBytes;
+@synthesize maximumBatchCount;
+@synthesize compression;
+@synthesize deduplicatesContext;
+@synthesize maximumQueueBytes;
+@synthesize maximumQueueCount;
+@synthesize maximumQueueAge;
+@synthesize coalescingWindow;
+@synthesize fingerprintFrameCount;
+@synthesize maximumVariants;
+@synthesize includesAllThreadRegisters;
+@synthesize capturesAllThreads;
+@synthesize monitorsHangs;
+@synthesize memorySampleInterval;
+@synthesize reportsBackgroundTerminations;
+@synthesize maximumUserDataBytes;
+@synthesize maximumUserDataDepth;
+@synthesize maximumUserDataCount;
+@synthesize userDataTimeBudget;
+@synthesize userDataRepresentations;
+@synthesize delegate;
+@synthesize uploadsClientStats;
 @synthesize ignoredExceptions;
 @synthesize handledSignals;
 @synthesize filterUserInfoKeys;
-@synthesize revision;
 
 #pragma mark Singleton
 
@@ -84,29 +146,208 @@ static SquashCocoa *sharedClient = NULL;
         disabled = NO;
         notifyPath = @"/api/1.0/notify";
         timeout = 15;
-        ignoredExceptions = [[NSMutableSet alloc] init];
-        handledSignals = [[NSMutableSet alloc] initWithObjects:
-                          [NSNumber numberWithInteger:SIGABRT],
-                          [NSNumber numberWithInteger:SIGBUS],
-                          [NSNumber numberWithInteger:SIGFPE],
-                          [NSNumber numberWithInteger:SIGILL],
-                          [NSNumber numberWithInteger:SIGSEGV],
-                          [NSNumber numberWithInteger:SIGTRAP],
-                          nil];
-        filterUserInfoKeys = [[NSMutableSet alloc] init];
-        
+        maximumConcurrentUploads = 4;
+        batchingEnabled = NO;
+        batchNotifyPath = @"/api/1.0/notify/batch";
+        maximumBatchBytes = 512*1024;
+        maximumBatchCount = 50;
+        compression = SCCompressionGzip;
+        deduplicatesContext = NO;
+        maximumQueueBytes = 5*1024*1024;
+        maximumQueueCount = 200;
+        maximumQueueAge = 30*24*60*60;
+        coalescingWindow = 60;
+        fingerprintFrameCount = 5;
+        maximumVariants = 3;
+        includesAllThreadRegisters = NO;
+        capturesAllThreads = NO;
+        monitorsHangs = NO;
+        memorySampleInterval = 10;
+        reportsBackgroundTerminations = NO;
+        hangMonitor = [[SCHangMonitor alloc] initWithHangHandler:^(SCOccurrence *hang) {
+            if (self.disabled) return;
+            // journaled at once and never coalesced, so that a hang the app
+            // is killed during is still there at the next launch
+            [hang writeToFile];
+            [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesRecorded by:1];
+        }];
+        performanceRecorder = [[SCPerformanceRecorder alloc] initWithFlushHandler:^(SCOccurrence *summary) {
+            if (self.disabled) return;
+            [summary writeToFile];
+            [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesRecorded by:1];
+        }];
+        coalescedOccurrences = [[NSMutableDictionary alloc] init];
+        rateLimiter = [[SCRateLimiter alloc] init];
+        maximumUserDataBytes = 64*1024;
+        maximumUserDataDepth = 8;
+        maximumUserDataCount = 100;
+        userDataTimeBudget = 0.05;
+        userDataRepresentations = SCValueRepresentationAll;
+        flushScheduler = [[SCFlushScheduler alloc] initWithStatePath:[[self occurrencesDirectory] stringByAppendingPathComponent:SCFlushScheduleFileName]
+                                                        flushHandler:^{ if ([self isConfigured]) [self reportErrors]; }];
+        reporting = NO;
+        retiredConfigurations = [[NSMutableArray alloc] init];
+        dispatch_block_t publish = ^{ [self publishConfiguration]; };
+        ignoredExceptions = [[SCObservedSet alloc] initWithObjects:nil changeHandler:publish];
+        handledSignals = [[SCObservedSet alloc] initWithObjects:[NSArray arrayWithObjects:
+                                                                 [NSNumber numberWithInteger:SIGABRT],
+                                                                 [NSNumber numberWithInteger:SIGBUS],
+                                                                 [NSNumber numberWithInteger:SIGFPE],
+                                                                 [NSNumber numberWithInteger:SIGILL],
+                                                                 [NSNumber numberWithInteger:SIGSEGV],
+                                                                 [NSNumber numberWithInteger:SIGTRAP],
+                                                                 nil]
+                                                  changeHandler:publish];
+        filterUserInfoKeys = [[SCObservedSet alloc] initWithObjects:nil changeHandler:publish];
+        [self publishConfiguration];
     }
     return self;
 }
 
+#pragma mark Properties
+
+- (SCConfiguration *) configuration {
+    // while the count is nonzero no replaced snapshot is freed, so the one
+    // loaded here can't go away before it is retained
+    OSAtomicIncrement32Barrier(&configurationReaders);
+    SCConfiguration *current = [configuration retain];
+    if (OSAtomicDecrement32Barrier(&configurationReaders) == 0 && hasRetiredConfigurations)
+        [self reclaimConfigurations];
+    return [current autorelease];
+}
+
+- (NSString *) APIKey {
+    return self.configuration.APIKey;
+}
+
+- (void) setAPIKey:(NSString *)key {
+    @synchronized(retiredConfigurations) {
+        [APIKey autorelease];
+        APIKey = [key copy];
+        [self publishConfiguration];
+    }
+}
+
+- (NSString *) environment {
+    return self.configuration.environment;
+}
+
+- (void) setEnvironment:(NSString *)environmentName {
+    @synchronized(retiredConfigurations) {
+        [environment autorelease];
+        environment = [environmentName copy];
+        [self publishConfiguration];
+    }
+}
+
+- (NSString *) revision {
+    return self.configuration.revision;
+}
+
+- (void) setRevision:(NSString *)revisionID {
+    @synchronized(retiredConfigurations) {
+        [revision autorelease];
+        revision = [revisionID copy];
+        [self publishConfiguration];
+    }
+}
+
+- (double) rateLimit {
+    return rateLimiter.rate;
+}
+
+- (void) setRateLimit:(double)rate {
+    rateLimiter.rate = rate;
+}
+
+- (double) rateLimitBurst {
+    return rateLimiter.burst;
+}
+
+- (void) setRateLimitBurst:(double)burst {
+    rateLimiter.burst = burst;
+}
+
+- (double) sampleRate {
+    return rateLimiter.sampleRate;
+}
+
+- (void) setSampleRate:(double)rate {
+    rateLimiter.sampleRate = rate;
+}
+
+- (NSTimeInterval) minimumRetryInterval {
+    return flushScheduler.minimumRetryInterval;
+}
+
+- (void) setMinimumRetryInterval:(NSTimeInterval)interval {
+    flushScheduler.minimumRetryInterval = interval;
+}
+
+- (NSTimeInterval) maximumRetryInterval {
+    return flushScheduler.maximumRetryInterval;
+}
+
+- (void) setMaximumRetryInterval:(NSTimeInterval)interval {
+    flushScheduler.maximumRetryInterval = interval;
+}
+
+- (NSTimeInterval) hangThreshold {
+    return hangMonitor.threshold;
+}
+
+- (void) setHangThreshold:(NSTimeInterval)threshold {
+    hangMonitor.threshold = threshold;
+}
+
+- (NSTimeInterval) hangPingInterval {
+    return hangMonitor.pingInterval;
+}
+
+- (void) setHangPingInterval:(NSTimeInterval)interval {
+    hangMonitor.pingInterval = interval;
+}
+
+- (NSTimeInterval) performanceFlushInterval {
+    return performanceRecorder.flushInterval;
+}
+
+- (void) setPerformanceFlushInterval:(NSTimeInterval)interval {
+    performanceRecorder.flushInterval = interval;
+}
+
 #pragma mark Configuration
 
 - (oneway void) hook {
+    // everything SCHandleSignal needs is set up now, outside of any signal
+    // handler, so that capturing a signal never allocates
+    NSString *directory = [self occurrencesDirectory];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:NULL error:NULL];
+    CFUUIDRef UUIDObject = CFUUIDCreate(NULL);
+    NSString *recordName = (NSString *)CFUUIDCreateString(NULL, UUIDObject);
+    CFRelease(UUIDObject);
+    SCPrepareSignalCapture([directory stringByAppendingPathComponent:[recordName stringByAppendingPathExtension:SCSignalRecordExtension]]);
+    [recordName release];
+
+    SCBinaryImagesRegister();
+    SCBreadcrumbsOpen([directory stringByAppendingPathComponent:SCBreadcrumbsFileName]);
+    SCSessionStateOpen([directory stringByAppendingPathComponent:SCSessionStateFileName]);
+    SCSessionStateStartSampling(self.memorySampleInterval);
+    if (self.monitorsHangs) [hangMonitor start];
+    [performanceRecorder start];
+
+    // the process context includes the host name, which can block on DNS, so
+    // it is collected off the main thread ahead of the first occurrence
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        [SCProcessContext currentContext];
+    });
+
 #if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
     [[PLCrashReporter sharedReporter] enableCrashReporterWithExceptionHandling:PLExceptionHandlingUncaughtOnly];
 #elif TARGET_OS_MAC
     [[PLCrashReporter sharedReporter] enableCrashReporterWithExceptionHandling:PLExceptionHandlingAll];
 #endif
+    SCInstallSignalHandlers(self.configuration.handledSignals);
 }
 
 - (BOOL) isConfigured {
@@ -126,27 +367,89 @@ static SquashCocoa *sharedClient = NULL;
     return [URL autorelease];
 }
 
+- (NSURL *) batchNotifyURL {
+    NSURL *baseURL = [[NSURL alloc] initWithString:self.host];
+    NSURL *URL = [[NSURL alloc] initWithString:self.batchNotifyPath relativeToURL:baseURL];
+    [baseURL release];
+    return [URL autorelease];
+}
+
 #pragma mark Recording
 
 - (oneway void) recordException:(NSException *)exception {
     if (self.disabled) return;
     
-    if ([self.ignoredExceptions containsObject:[exception name]]) return;
+    if ([self.configuration.ignoredExceptions containsObject:[exception name]]) return;
+    uint64_t start = SCTelemetryTimestamp();
+    if (![rateLimiter admitOccurrenceOfClass:[exception name]]) {
+        [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesDropped by:1];
+        return;
+    }
+
     SCOccurrence *occurrence = [[SCOccurrence alloc] initWithException:exception];
+    if (occurrence && self.capturesAllThreads) SCThreadSnapshotAppend(occurrence.backtraces);
+    if (occurrence) occurrence.droppedOccurrences = [rateLimiter takeDroppedCounts];
+    occurrence.fatal = [NSNumber numberWithBool:NO];
+    if (self.sampleRate < 1) occurrence.sampleRate = [NSNumber numberWithDouble:self.sampleRate];
+    [self storeOccurrence:occurrence];
+    [occurrence release];
+    [[SCTelemetry sharedTelemetry] recordValue:SCTelemetryMicrosecondsSince(start) inHistogram:SCTelemetryCaptureLatency];
+}
+
+- (oneway void) recordUncaughtException:(NSException *)exception {
+    if (self.disabled) return;
+
+    if ([self.configuration.ignoredExceptions containsObject:[exception name]]) return;
+    uint64_t start = SCTelemetryTimestamp();
+
+    // The process is about to die, so this is the only chance to record the
+    // crash: it is neither sampled nor rate limited, and it is journaled on
+    // its own instead of being coalesced into an earlier handled exception.
+    SCOccurrence *occurrence = [[SCOccurrence alloc] initWithException:exception];
+    if (!occurrence) return;
+    if (self.capturesAllThreads) SCThreadSnapshotAppend(occurrence.backtraces);
+    occurrence.droppedOccurrences = [rateLimiter takeDroppedCounts];
+    occurrence.fatal = [NSNumber numberWithBool:YES];
     [occurrence writeToFile];
+    [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesRecorded by:1];
     [occurrence release];
+    [[SCTelemetry sharedTelemetry] recordValue:SCTelemetryMicrosecondsSince(start) inHistogram:SCTelemetryCaptureLatency];
+}
+
+- (void) leaveBreadcrumb:(NSString *)message category:(NSString *)category {
+    if (self.disabled) return;
+
+    // converted into stack buffers so that nothing is allocated
+    char categoryBytes[SCBreadcrumbCategoryLength];
+    char messageBytes[SCBreadcrumbMessageLength];
+    CFIndex length = 0;
+    if (category) CFStringGetBytes((CFStringRef)category, CFRangeMake(0, CFStringGetLength((CFStringRef)category)), kCFStringEncodingUTF8, '?', false, (UInt8 *)categoryBytes, sizeof(categoryBytes) - 1, &length);
+    categoryBytes[length] = '\0';
+    length = 0;
+    if (message) CFStringGetBytes((CFStringRef)message, CFRangeMake(0, CFStringGetLength((CFStringRef)message)), kCFStringEncodingUTF8, '?', false, (UInt8 *)messageBytes, sizeof(messageBytes) - 1, &length);
+    messageBytes[length] = '\0';
+    SCLeaveBreadcrumb(categoryBytes, messageBytes);
+}
+
+- (void) recordDuration:(NSTimeInterval)duration ofOperation:(NSString *)operation {
+    if (self.disabled) return;
+    [performanceRecorder recordDuration:duration ofOperation:operation];
 }
 
 - (oneway void) recordSignal:(int)signal addresses:(NSArray *)addresses {
     if (self.disabled) return;
     
     SCOccurrence *occurrence = [[SCOccurrence alloc] initWithSignal:signal addresses:addresses];
-    [occurrence writeToFile];
+    [self storeOccurrence:occurrence];
     [occurrence release];
 }
 
 #pragma mark Reporting
 
+- (NSDictionary *) telemetry {
+    return [[SCTelemetry sharedTelemetry] snapshot];
+}
+
 - (NSString *) occurrencesDirectory {
 #if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
     NSArray *folders = NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES);
@@ -166,37 +469,320 @@ static SquashCocoa *sharedClient = NULL;
 }
 
 - (oneway void) reportErrors {
-    Reachability *reachability = [Reachability reachabilityWithHostName:[[self notifyURL] host]];
-    if ([reachability currentReachabilityStatus] == NotReachable) return;
-    
-    if ([[PLCrashReporter sharedReporter] hasPendingCrashReports]) {
-        NSError *error = nil;
-        [[PLCrashReporter sharedReporter] loadPendingCrashReportData:^(NSData *crashData, BOOL *purge) {
+    @synchronized(self) {
+        if (reporting) return;
+        reporting = YES;
+    }
+    [self monitorHost];
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        SCJournal *journal = [SCJournal sharedJournal];
+        journal.maximumBytes = self.maximumQueueBytes;
+        journal.maximumCount = self.maximumQueueCount;
+        journal.maximumAge = self.maximumQueueAge;
+        journal.compactionHandler = ^(NSSet *unchangedUUIDs) {
+            [self forgetOccurrencesExcept:unchangedUUIDs];
+        };
+        // the previous launch's breadcrumbs are set aside before its crash
+        // reports are converted
+        SCBreadcrumbsOpen([[self occurrencesDirectory] stringByAppendingPathComponent:SCBreadcrumbsFileName]);
+        SCSessionStateOpen([[self occurrencesDirectory] stringByAppendingPathComponent:SCSessionStateFileName]);
+        [journal compact];
+        [self rememberQueuedOccurrences];
+        // checked before crash reports are purged, since a pending report
+        // already explains the previous launch's end
+        [self moveAbnormalTerminationToQueue];
+        NSArray *crashDates = [self moveCrashReportsToQueue];
+        [self moveSignalRecordsToQueueExcept:crashDates];
+
+        // when the host comes back or the backoff expires, the scheduler
+        // calls reportErrors again
+        if (![flushScheduler shouldFlush]) {
+            @synchronized(self) { reporting = NO; }
+            return;
+        }
+        [self uploadQueuedOccurrences];
+    });
+}
+
+@end
+
+#pragma mark -
+
+@implementation SquashCocoa (Private)
+
+#pragma mark Configuration
+
+// A thread reading SquashCocoa::configuration may have loaded the previous
+// snapshot without having retained it yet, so a replaced snapshot is retired,
+// and released only once no reader is in that window.
+- (void) publishConfiguration {
+    @synchronized(retiredConfigurations) {
+        SCConfiguration *next = [[SCConfiguration alloc] initWithAPIKey:APIKey
+                                                            environment:environment
+                                                               revision:revision
+                                                      ignoredExceptions:[(SCObservedSet *)ignoredExceptions snapshot]
+                                                         handledSignals:[(SCObservedSet *)handledSignals snapshot]
+                                                     filterUserInfoKeys:[(SCObservedSet *)filterUserInfoKeys snapshot]];
+        SCConfiguration *previous = configuration;
+        OSAtomicCompareAndSwapPtrBarrier(previous, next, (void * volatile *)&configuration);
+        if (previous) {
+            [retiredConfigurations addObject:previous];
+            [previous release];
+            hasRetiredConfigurations = YES;
+        }
+        [self reclaimConfigurations];
+    }
+}
+
+// Readers that start after a snapshot was replaced can only load its
+// successor, so once none are in progress every retired snapshot can go.
+- (void) reclaimConfigurations {
+    @synchronized(retiredConfigurations) {
+        OSMemoryBarrier();
+        if (configurationReaders != 0) return;
+        [retiredConfigurations removeAllObjects];
+        hasRetiredConfigurations = NO;
+    }
+}
+
+#pragma mark Recording
+
+- (void) storeOccurrence:(SCOccurrence *)occurrence {
+    if (!occurrence) return;
+
+    @synchronized(coalescedOccurrences) {
+        SCOccurrence *original = occurrence.fingerprint ? [coalescedOccurrences objectForKey:occurrence.fingerprint] : nil;
+        NSDate *start = original.firstSeenAt ? original.firstSeenAt : original.occurredAt;
+        if (original && self.coalescingWindow > 0 && fabs([occurrence.occurredAt timeIntervalSinceDate:start]) <= self.coalescingWindow) {
+            [original coalesceOccurrence:occurrence];
+            [original requestLateLocation];
+            [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesCoalesced by:1];
+            return;
+        }
+
+        [occurrence writeToFile];
+        [occurrence requestLateLocation];
+        [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesRecorded by:1];
+        if (occurrence.fingerprint) [coalescedOccurrences setObject:occurrence forKey:occurrence.fingerprint];
+    }
+}
+
+- (void) forgetOccurrence:(SCOccurrence *)occurrence {
+    // once an occurrence is being uploaded its count can no longer change, so
+    // later repeats start a new occurrence instead
+    if (!occurrence.fingerprint) return;
+    @synchronized(coalescedOccurrences) {
+        SCOccurrence *original = [coalescedOccurrences objectForKey:occurrence.fingerprint];
+        if ([original.UUID isEqualToString:occurrence.UUID])
+            [coalescedOccurrences removeObjectForKey:occurrence.fingerprint];
+    }
+}
+
+- (void) rememberQueuedOccurrences {
+    // repeats of occurrences still queued from an earlier launch (a crash
+    // loop, for instance) fold into them rather than queueing a new copy
+    for (SCOccurrence *occurrence in [[SCJournal sharedJournal] occurrences]) {
+        if (!occurrence.fingerprint) continue;
+        @synchronized(coalescedOccurrences) {
+            if (![coalescedOccurrences objectForKey:occurrence.fingerprint])
+                [coalescedOccurrences setObject:occurrence forKey:occurrence.fingerprint];
+        }
+    }
+}
+
+// Compaction evicts occurrences and merges duplicates into others. Repeats
+// coalesced into those copies would be journaled as updates that are lost
+// (evicted) or that overwrite the merged counts, so they start new occurrences
+// instead.
+- (void) forgetOccurrencesExcept:(NSSet *)UUIDs {
+    @synchronized(coalescedOccurrences) {
+        for (NSString *fingerprint in [coalescedOccurrences allKeys]) {
+            SCOccurrence *original = [coalescedOccurrences objectForKey:fingerprint];
+            if (![UUIDs containsObject:original.UUID])
+                [coalescedOccurrences removeObjectForKey:fingerprint];
+        }
+    }
+}
+
+#pragma mark Reporting
+
+- (void) monitorHost {
+    NSString *hostName = [[self notifyURL] host];
+    @synchronized(self) {
+        if (!hostName || [hostName isEqualToString:monitoredHost]) return;
+        [monitoredHost release];
+        monitoredHost = [hostName copy];
+    }
+    [flushScheduler startMonitoringHost:hostName];
+}
+
+- (void) moveAbnormalTerminationToQueue {
+    SCSessionState previous;
+    if (!SCSessionStateTakePrevious(&previous)) return;
+    if (!SCSessionStateEndedAbnormally(&previous)) return;
+    if (!(previous.flags & (SCSessionForeground | SCSessionHanging)) && !self.reportsBackgroundTerminations) return;
+
+    if ([[PLCrashReporter sharedReporter] hasPendingCrashReports]) return;
+    for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[self occurrencesDirectory] error:NULL])
+        if ([[file pathExtension] isEqualToString:SCSignalRecordExtension]) return;
+
+    SCOccurrence *occurrence = [[SCOccurrence alloc] initWithSessionState:&previous];
+    occurrence.breadcrumbs = SCBreadcrumbsFromPreviousSession(nil);
+    [self storeOccurrence:occurrence];
+    [occurrence release];
+}
+
+- (NSArray *) moveCrashReportsToQueue {
+    NSMutableArray *crashDates = [NSMutableArray array];
+    if (![[PLCrashReporter sharedReporter] hasPendingCrashReports]) return crashDates;
+
+    // crash reports are converted into occurrences and written to the file
+    // queue before being purged, so they survive until Squash receives them
+    // even though the upload itself completes asynchronously
+    NSError *error = nil;
+    [[PLCrashReporter sharedReporter] loadPendingCrashReportData:^(NSData *crashData, BOOL *purge) {
+        // decoding the report in place avoids holding it in memory a second
+        // time as PLCrashReport objects; those are only built for reports the
+        // in-place reader doesn't understand
+        SCOccurrence *occurrence = [[SCOccurrence alloc] initWithCrashReportData:crashData];
+        if (!occurrence) {
             NSError *err = nil;
             PLCrashReport *report = [[[PLCrashReport alloc] initWithData:crashData error:&err] autorelease];
             if (err) {
                 NSLog(@"Error while unarchiving pending crash report: %@", err);
                 return;
             }
+            occurrence = [[SCOccurrence alloc] initWithCrashReport:report];
+        }
 
-            SCOccurrence *occurrence = [[SCOccurrence alloc] initWithCrashReport:report];
-            [occurrence report];
-            NSLog(@"Squash reported exception %@", occurrence);
-            [occurrence release];
-            *purge = YES;
-        } andReturnError:&error];
-        if (error) {
-            NSLog(@"Error while loading pending crash report: %@", error);
-            return;
+        occurrence.breadcrumbs = SCBreadcrumbsFromPreviousSession(occurrence.occurredAt);
+        if (occurrence.occurredAt) [crashDates addObject:occurrence.occurredAt];
+        [self storeOccurrence:occurrence];
+        [occurrence release];
+        *purge = YES;
+    } andReturnError:&error];
+    if (error) NSLog(@"Error while loading pending crash report: %@", error);
+    return crashDates;
+}
+
+- (void) moveSignalRecordsToQueueExcept:(NSArray *)crashDates {
+    NSString *directory = [self occurrencesDirectory];
+    for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directory error:NULL]) {
+        if (![[file pathExtension] isEqualToString:SCSignalRecordExtension]) continue;
+        NSString *path = [directory stringByAppendingPathComponent:file];
+
+        NSData *data = [[NSData alloc] initWithContentsOfFile:path];
+        const SCSignalRecord *record = [data bytes];
+        if ([data length] >= sizeof(SCSignalRecord) &&
+            record->magic == SCSignalRecordMagic &&
+            record->version == SCSignalRecordVersion) {
+            // SCHandleSignal chains to PLCrashReporter, so a crash usually
+            // leaves both; its report is the richer one, and the record only
+            // stands in when no report was written
+            NSDate *trappedAt = [NSDate dateWithTimeIntervalSince1970:record->timestamp];
+            BOOL reported = NO;
+            for (NSDate *crashDate in crashDates)
+                if (fabs([crashDate timeIntervalSinceDate:trappedAt]) <= SCSignalRecordCrashReportTolerance) reported = YES;
+            if (!reported) {
+                SCOccurrence *occurrence = [[SCOccurrence alloc] initWithSignalRecord:record];
+                occurrence.breadcrumbs = SCBreadcrumbsFromPreviousSession(occurrence.occurredAt);
+                [self storeOccurrence:occurrence];
+                [occurrence release];
+            }
+        } else {
+            NSLog(@"Discarding unreadable signal record %@", file);
         }
+        [data release];
+        [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
     }
 }
 
-@end
-
-#pragma mark -
+- (void) uploadQueuedOccurrences {
+    @synchronized(self) {
+        if (!uploader) uploader = [[SCUploader alloc] init];
+    }
+    uploader.maximumConcurrentUploads = self.maximumConcurrentUploads;
+    uploader.batchURL = [self batchNotifyURL];
+    uploader.maximumBatchBytes = self.maximumBatchBytes;
+    uploader.maximumBatchCount = self.maximumBatchCount;
+    uploader.compression = self.compression;
+    uploader.deduplicatesContext = self.deduplicatesContext;
+
+    // Once an occurrence is read for upload, a repeat coalesced into it would
+    // be journaled as an update the uploaded copy never sees, and then thrown
+    // away with it. Reading and forgetting under the coalescing lock means no
+    // repeat can slip in between.
+    // A hang still being sampled is left for a later flush, since the updates
+    // journaled after it was uploaded would be lost.
+    NSMutableArray *occurrences = [NSMutableArray array];
+    @synchronized(coalescedOccurrences) {
+        [hangMonitor performWithHangInProgress:^(NSString *hangUUID) {
+            for (SCOccurrence *occurrence in [[SCJournal sharedJournal] occurrences]) {
+                if (hangUUID && [occurrence.UUID isEqualToString:hangUUID]) continue;
+                [occurrences addObject:occurrence];
+                [self forgetOccurrence:occurrence];
+            }
+        }];
+    }
+    [[SCTelemetry sharedTelemetry] setGauge:SCTelemetryQueueDepth value:[occurrences count]];
+    if (self.uploadsClientStats && [occurrences count] > 0)
+        ((SCOccurrence *)[occurrences objectAtIndex:0]).clientStats = [self telemetry];
+    // evictions ride along with the first occurrence, and are forgotten only
+    // once it is delivered
+    SCOccurrence *evictionCarrier = nil;
+    NSDictionary *evictions = [[SCJournal sharedJournal] evictionCounts];
+    if (evictions && [occurrences count] > 0) {
+        evictionCarrier = [occurrences objectAtIndex:0];
+        evictionCarrier.evictedOccurrences = evictions;
+    }
 
-@implementation SquashCocoa (Private)
+    dispatch_group_t group = dispatch_group_create();
+    SCUploadCompletionHandler completion = ^(SCOccurrence *uploaded, BOOL success, NSInteger statusCode, NSTimeInterval retryAfter) {
+        if (success) {
+            [uploaded removeFromQueue];
+            if (uploaded == evictionCarrier)
+                [[SCJournal sharedJournal] acknowledgeEvictionCounts:uploaded.evictedOccurrences];
+            NSLog(@"Squash reported exception %@", uploaded);
+        } else {
+            NSLog(@"Squash failed to report exception %@ (status %ld)", uploaded, (long)statusCode);
+            // stop sending to a host that is failing; the rest stay queued
+            // until the scheduler's next attempt
+            if ([flushScheduler recordUploadWithStatusCode:statusCode retryAfter:retryAfter])
+                [uploader cancelPendingUploads];
+            else {
+                // rejected outright: sending it again would only be rejected
+                // again, on every flush until it ages out
+                [uploaded removeFromQueue];
+                [[SCTelemetry sharedTelemetry] incrementCounter:SCTelemetryOccurrencesRejected by:1];
+            }
+        }
+        dispatch_group_leave(group);
+    };
+
+    NSMutableArray *batch = [[NSMutableArray alloc] init];
+    for (SCOccurrence *occurrence in occurrences) {
+        dispatch_group_enter(group);
+        if (self.batchingEnabled) [batch addObject:occurrence];
+        else [uploader uploadOccurrence:occurrence completion:completion];
+    }
+    if ([batch count] > 0) [uploader uploadOccurrences:batch completion:completion];
+    [batch release];
+
+    dispatch_group_notify(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        @synchronized(self) { reporting = NO; }
+        [flushScheduler flushDidFinish];
+
+        id<SquashCocoaDelegate> observer = self.delegate;
+        if ([observer respondsToSelector:@selector(squashCocoa:didUpdateTelemetry:)]) {
+            NSDictionary *snapshot = [self telemetry];
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [observer squashCocoa:self didUpdateTelemetry:snapshot];
+            });
+        }
+    });
+    dispatch_release(group);
+}
 
 #if TARGET_OS_MAC && !TARGET_OS_IPHONE && !TARGET_IPHONE_SIMULATOR
 - (BOOL) exceptionHandler:(NSExceptionHandler *)sender shouldHandleException:(NSException *)exception mask:(NSUInteger)aMask {
@@ -21,4 +21,10 @@
 - (IBAction) exception:(id)sender;
 - (IBAction) signal:(id)sender;
 
+/*!
+ Runs STBenchmark in the background, writes its results, and exits.
+ @param path Where to write the JSON results.
+ */
+- (void) runBenchmarkWritingResultsToPath:(NSString *)path;
+
 @end
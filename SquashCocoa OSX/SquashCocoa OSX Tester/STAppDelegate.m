@@ -14,6 +14,7 @@
 
 #import "STAppDelegate.h"
 #import <SquashCocoa OSX/SquashCocoa.h>
+#import "STBenchmark.h"
 
 @implementation STAppDelegate
 
@@ -22,6 +23,12 @@
 }
 
 - (void)applicationDidFinishLaunching:(NSNotification *)aNotification {
+    NSString *benchmarkPath = [[NSUserDefaults standardUserDefaults] stringForKey:@"STBenchmark"];
+    if (benchmarkPath) {
+        [self runBenchmarkWritingResultsToPath:benchmarkPath];
+        return;
+    }
+
     [SquashCocoa sharedClient].APIKey = SQUASH_API_KEY;
     [SquashCocoa sharedClient].environment = @"development";
     [SquashCocoa sharedClient].host = @"http://localhost:3000";
@@ -48,4 +55,16 @@
     raise(SIGABRT);
 }
 
+- (void) runBenchmarkWritingResultsToPath:(NSString *)path {
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        STBenchmark *benchmark = [[STBenchmark alloc] initWithUserDefaults:[NSUserDefaults standardUserDefaults]];
+        BOOL written = [benchmark runAndWriteResultsToPath:path];
+        [benchmark release];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (!written) NSLog(@"Couldn't write benchmark results to %@", path);
+            exit(written ? 0 : 1);
+        });
+    });
+}
+
 @end
@@ -0,0 +1,73 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <Foundation/Foundation.h>
+
+@class STStubServer;
+
+/*!
+ Times and counts the allocations of each stage of SquashCocoa's capture,
+ serialization, persistence and upload paths, and writes the results as JSON so
+ that releases can be compared.
+
+ The tester runs the suite instead of its usual UI when launched with
+ `-STBenchmark <output path>`. Other launch arguments:
+
+ \li `-STBenchmarkIterations <n>`: Measured iterations per stage (default 200).
+ \li `-STBenchmarkCrashReports <directory>`: A directory of `.plcrash` files to
+     use as the `initWithCrashReport:` corpus. That stage is skipped without one.
+ \li `-STBenchmarkLatency <seconds>`, `-STBenchmarkFailureRate <0-1>`: Latency
+     and failures injected by the stand-in Squash server (STStubServer).
+
+ Allocations are counted only on the benchmarking thread, so work that
+ `NSURLConnection` does on its own threads is not included.
+ */
+@interface STBenchmark : NSObject {
+    NSUInteger iterations;
+    NSString *crashReportsDirectory;
+    STStubServer *server;
+    NSMutableDictionary *results;
+}
+
+/*! The number of measured iterations per stage. */
+@property (assign) NSUInteger iterations;
+
+/*! The directory of `.plcrash` files used by the crash report stage. */
+@property (retain) NSString *crashReportsDirectory;
+
+/*! The stand-in Squash server that occurrences are reported to. */
+@property (readonly) STStubServer *server;
+
+/*!
+ Creates a benchmark configured from the launch arguments.
+ @return The initialized instance.
+ */
+- (id) initWithUserDefaults:(NSUserDefaults *)defaults;
+
+/*!
+ Runs every stage. This method blocks, and must not be called on the main
+ thread, which `NSURLConnection` needs.
+ @return The results, keyed by stage name.
+ */
+- (NSDictionary *) run;
+
+/*!
+ Runs every stage and writes the results as JSON.
+ @param path Where to write the results.
+ @return Whether the results were written.
+ */
+- (BOOL) runAndWriteResultsToPath:(NSString *)path;
+
+@end
@@ -0,0 +1,357 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <mach/mach_time.h>
+#import <pthread.h>
+#import <libkern/OSAtomic.h>
+#import <CrashReporter/CrashReporter.h>
+#import <SquashCocoa OSX/SquashCocoa.h>
+#import <SquashCocoa OSX/SCOccurrence.h>
+#import <SquashCocoa OSX/SCFunctions.h>
+#import <SquashCocoa OSX/SCJournal.h>
+#import <SquashCocoa OSX/SCUploader.h>
+#import <SquashCocoa OSX/SCCrashReportConverter.h>
+#import "STBenchmark.h"
+#import "STStubServer.h"
+
+#pragma mark Allocation counting
+
+// libmalloc calls this hook (used by malloc_history and friends) for every
+// allocation and deallocation in the process
+typedef void (STMallocLogger)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t skip);
+extern STMallocLogger *malloc_logger;
+
+#define STMallocLogTypeAllocate 2
+#define STMallocLogTypeDeallocate 4
+
+static pthread_t STCountingThread;
+static int64_t STAllocationCount;
+static int64_t STAllocationBytes;
+
+static void STCountAllocation(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t skip) {
+    if (!(type & STMallocLogTypeAllocate)) return;
+    if (!pthread_equal(pthread_self(), STCountingThread)) return;
+    STAllocationCount++;
+    // for realloc the new size is the third argument
+    STAllocationBytes += (type & STMallocLogTypeDeallocate) ? arg3 : arg2;
+}
+
+#pragma mark -
+
+@interface STBenchmark (Private)
+- (void) measureStage:(NSString *)name block:(void (^)(NSUInteger iteration))block;
+- (void) recordSkippedStage:(NSString *)name reason:(NSString *)reason;
+- (NSException *) sampleException;
+- (NSDictionary *) sampleUserInfo;
+- (NSArray *) loadCrashReportData;
+- (NSDictionary *) exerciseContextDeduplication:(SCOccurrence *)occurrence;
+@end
+
+#pragma mark -
+
+@implementation STBenchmark
+
+#pragma mark Properties
+
+@synthesize iterations;
+@synthesize crashReportsDirectory;
+@synthesize server;
+
+#pragma mark Initializers
+
+- (id) initWithUserDefaults:(NSUserDefaults *)defaults {
+    if (self = [super init]) {
+        iterations = [defaults integerForKey:@"STBenchmarkIterations"];
+        if (iterations == 0) iterations = 200;
+        self.crashReportsDirectory = [defaults stringForKey:@"STBenchmarkCrashReports"];
+
+        server = [[STStubServer alloc] init];
+        server.latency = [defaults doubleForKey:@"STBenchmarkLatency"];
+        server.failureRate = [defaults doubleForKey:@"STBenchmarkFailureRate"];
+        results = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [crashReportsDirectory release];
+    [server release];
+    [results release];
+    [super dealloc];
+}
+
+#pragma mark Running
+
+- (NSDictionary *) run {
+    if (![server start]) NSLog(@"Couldn't start the stub Squash server");
+    [SquashCocoa sharedClient].APIKey = @"benchmark";
+    [SquashCocoa sharedClient].environment = @"benchmark";
+    [SquashCocoa sharedClient].revision = @"0000000000000000000000000000000000000000";
+    [SquashCocoa sharedClient].host = server.host;
+
+    STCountingThread = pthread_self();
+    STMallocLogger *previousLogger = malloc_logger;
+    malloc_logger = STCountAllocation;
+
+    NSException *exception = [self sampleException];
+    [self measureStage:@"init_with_exception" block:^(NSUInteger iteration) {
+        [[[SCOccurrence alloc] initWithException:exception] release];
+    }];
+
+    NSArray *reportData = [self loadCrashReportData];
+    NSMutableArray *reports = [NSMutableArray arrayWithCapacity:[reportData count]];
+    for (NSData *data in reportData)
+        [reports addObject:[[[PLCrashReport alloc] initWithData:data error:NULL] autorelease]];
+    if ([reports count] > 0) {
+        [self measureStage:@"init_with_crash_report" block:^(NSUInteger iteration) {
+            [[[SCOccurrence alloc] initWithCrashReport:[reports objectAtIndex:iteration % [reports count]]] release];
+        }];
+        // decoding included, unlike the stage above
+        [self measureStage:@"init_with_crash_report_data" block:^(NSUInteger iteration) {
+            [[[SCOccurrence alloc] initWithCrashReportData:[reportData objectAtIndex:iteration % [reportData count]]] release];
+        }];
+    } else {
+        [self recordSkippedStage:@"init_with_crash_report" reason:@"no crash report corpus (-STBenchmarkCrashReports)"];
+        [self recordSkippedStage:@"init_with_crash_report_data" reason:@"no crash report corpus (-STBenchmarkCrashReports)"];
+    }
+
+    NSDictionary *userInfo = [self sampleUserInfo];
+    [self measureStage:@"valueify" block:^(NSUInteger iteration) {
+        SCValueify(userInfo);
+    }];
+
+    SCOccurrence *occurrence = [[SCOccurrence alloc] initWithException:exception];
+    [self measureStage:@"as_json" block:^(NSUInteger iteration) {
+        [occurrence asJSON];
+    }];
+
+    // a private journal, so the tester's own queue is left alone
+    NSString *journalPath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                             [NSString stringWithFormat:@"STBenchmark-%d.journal", getpid()]];
+    SCJournal *journal = [[SCJournal alloc] initWithPath:journalPath];
+    [self measureStage:@"write_to_file" block:^(NSUInteger iteration) {
+        [journal appendOccurrence:occurrence];
+    }];
+    [journal release];
+    [[NSFileManager defaultManager] removeItemAtPath:journalPath error:NULL];
+
+    __block NSUInteger delivered = 0;
+    [self measureStage:@"report" block:^(NSUInteger iteration) {
+        if ([occurrence report]) delivered++;
+    }];
+    NSMutableDictionary *reportResults = [results objectForKey:@"report"];
+    [reportResults setObject:[NSNumber numberWithUnsignedInteger:delivered] forKey:@"delivered"];
+    [reportResults setObject:[NSNumber numberWithDouble:server.latency] forKey:@"injected_latency"];
+    [reportResults setObject:[NSNumber numberWithDouble:server.failureRate] forKey:@"injected_failure_rate"];
+    [reportResults setObject:[NSNumber numberWithLongLong:server.failureCount] forKey:@"injected_failures"];
+
+    [results setObject:[self exerciseContextDeduplication:occurrence] forKey:@"context_deduplication"];
+    [occurrence release];
+
+    malloc_logger = previousLogger;
+    [server stop];
+    return results;
+}
+
+- (BOOL) runAndWriteResultsToPath:(NSString *)path {
+    NSDictionary *stages = [self run];
+    NSDictionary *info = [[NSBundle bundleForClass:[SquashCocoa class]] infoDictionary];
+    NSDictionary *document = @{
+        @"date": SCISO8601StringFromDate([NSDate date]),
+        @"library_version": [info objectForKey:@"CFBundleShortVersionString"] ? [info objectForKey:@"CFBundleShortVersionString"] : [NSNull null],
+        @"iterations": [NSNumber numberWithUnsignedInteger:iterations],
+        @"stages": stages
+    };
+
+    NSError *error = nil;
+    NSData *JSON = [NSJSONSerialization dataWithJSONObject:document options:NSJSONWritingPrettyPrinted error:&error];
+    if (!JSON) {
+        NSLog(@"Couldn't serialize benchmark results: %@", error);
+        return NO;
+    }
+    return [JSON writeToFile:path atomically:YES];
+}
+
+@end
+
+#pragma mark -
+
+@implementation STBenchmark (Private)
+
+- (void) measureStage:(NSString *)name block:(void (^)(NSUInteger iteration))block {
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+
+    // the first run pays for lazily-built state, which is exactly what a
+    // crashing app pays, so it is reported separately
+    uint64_t start = mach_absolute_time();
+    @autoreleasepool { block(0); }
+    double first = (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom / 1000.0;
+
+    double *durations = malloc(sizeof(double) * iterations);
+    int64_t allocations = 0, bytes = 0;
+    for (NSUInteger iteration = 0; iteration < iterations; iteration++) {
+        @autoreleasepool {
+            int64_t countBefore = STAllocationCount, bytesBefore = STAllocationBytes;
+            start = mach_absolute_time();
+            block(iteration + 1);
+            uint64_t elapsed = mach_absolute_time() - start;
+            allocations += STAllocationCount - countBefore;
+            bytes += STAllocationBytes - bytesBefore;
+            durations[iteration] = (double)elapsed * timebase.numer / timebase.denom / 1000.0;
+        }
+    }
+
+    double total = 0;
+    for (NSUInteger idx = 0; idx < iterations; idx++) total += durations[idx];
+    NSMutableArray *values = [NSMutableArray arrayWithCapacity:iterations];
+    for (NSUInteger idx = 0; idx < iterations; idx++)
+        [values addObject:[NSNumber numberWithDouble:durations[idx]]];
+    NSArray *sorted = [values sortedArrayUsingSelector:@selector(compare:)];
+    free(durations);
+
+    NSMutableDictionary *stage = [NSMutableDictionary dictionary];
+    [stage setObject:[NSNumber numberWithUnsignedInteger:iterations] forKey:@"iterations"];
+    [stage setObject:[NSNumber numberWithDouble:first] forKey:@"first_us"];
+    [stage setObject:[NSNumber numberWithDouble:total/iterations] forKey:@"mean_us"];
+    [stage setObject:[sorted objectAtIndex:0] forKey:@"min_us"];
+    [stage setObject:[sorted objectAtIndex:iterations/2] forKey:@"median_us"];
+    [stage setObject:[sorted objectAtIndex:(iterations*95)/100] forKey:@"p95_us"];
+    [stage setObject:[sorted lastObject] forKey:@"max_us"];
+    [stage setObject:[NSNumber numberWithDouble:(double)allocations/iterations] forKey:@"allocations_per_iteration"];
+    [stage setObject:[NSNumber numberWithDouble:(double)bytes/iterations] forKey:@"bytes_allocated_per_iteration"];
+    [results setObject:stage forKey:name];
+    NSLog(@"%@: median %@ us, %.1f allocations", name, [stage objectForKey:@"median_us"], (double)allocations/iterations);
+}
+
+- (void) recordSkippedStage:(NSString *)name reason:(NSString *)reason {
+    [results setObject:@{@"skipped": reason} forKey:name];
+}
+
+// raised and caught so that it carries a real call stack
+- (NSException *) sampleException {
+    @try {
+        [[NSException exceptionWithName:@"STBenchmarkException" reason:@"Benchmark" userInfo:[self sampleUserInfo]] raise];
+    }
+    @catch (NSException *exception) {
+        return exception;
+    }
+    return nil;
+}
+
+// roughly what apps attach to their exceptions: strings, numbers, nested
+// collections, and a few objects that aren't JSON-compatible
+- (NSDictionary *) sampleUserInfo {
+    NSMutableArray *records = [NSMutableArray array];
+    for (NSUInteger idx = 0; idx < 20; idx++) {
+        [records addObject:@{
+            @"id": [NSNumber numberWithUnsignedInteger:idx],
+            @"name": [NSString stringWithFormat:@"Record %lu", (unsigned long)idx],
+            @"tags": @[@"alpha", @"beta", @"gamma"],
+            @"updated": [NSDate dateWithTimeIntervalSince1970:1380000000 + idx]
+        }];
+    }
+    NSError *underlying = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:@{NSLocalizedDescriptionKey: @"The request timed out."}];
+    return @{
+        NSLocalizedDescriptionKey: @"Couldn't save the document.",
+        NSUnderlyingErrorKey: underlying,
+        NSURLErrorKey: [NSURL URLWithString:@"https://example.com/documents/42"],
+        @"records": records,
+        @"payload": [NSData dataWithBytes:"0123456789abcdef" length:16],
+        @"retries": [NSNumber numberWithInt:3],
+        @"state": @{@"dirty": [NSNumber numberWithBool:YES], @"path": @[@"root", @"documents", @"42"]}
+    };
+}
+
+// Uploads copies of an occurrence in batches, then one at a time after the
+// server forgets its contexts, and reports what crossed the wire. Failures
+// aren't injected here, so every upload should be delivered, and only the
+// single uploads already in flight when the server forgot should be answered
+// with 412 (and then resent with their context).
+- (NSDictionary *) exerciseContextDeduplication:(SCOccurrence *)occurrence {
+    NSUInteger inlineBytes = [[occurrence asJSON] length];
+    NSUInteger referencedBytes = [[occurrence asJSONWithContextID:[occurrence contextID] includingContext:NO] length];
+
+    SCUploader *uploader = [[SCUploader alloc] init];
+    uploader.batchURL = [[SquashCocoa sharedClient] batchNotifyURL];
+    uploader.compression = SCCompressionNone;
+    uploader.deduplicatesContext = YES;
+    uploader.maximumBatchCount = 10;
+
+    double previousFailureRate = server.failureRate;
+    server.failureRate = 0;
+    [server forgetContexts];
+
+    NSUInteger count = 50;
+    NSMutableArray *occurrences = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger idx = 0; idx < count; idx++) [occurrences addObject:occurrence];
+
+    __block int32_t delivered = 0;
+    dispatch_group_t group = dispatch_group_create();
+    SCUploadCompletionHandler completion = ^(SCOccurrence *uploaded, BOOL success, NSInteger statusCode, NSTimeInterval retryAfter) {
+        if (success) OSAtomicIncrement32(&delivered);
+        dispatch_group_leave(group);
+    };
+
+    int64_t bytesBefore = server.bytesReceived;
+    for (NSUInteger idx = 0; idx < count; idx++) dispatch_group_enter(group);
+    [uploader uploadOccurrences:occurrences completion:completion];
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    int64_t batchBytes = server.bytesReceived - bytesBefore;
+
+    [server forgetContexts];
+    bytesBefore = server.bytesReceived;
+    for (NSUInteger idx = 0; idx < count; idx++) {
+        dispatch_group_enter(group);
+        [uploader uploadOccurrence:occurrence completion:completion];
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    int64_t singleBytes = server.bytesReceived - bytesBefore;
+
+    dispatch_release(group);
+    [uploader release];
+    server.failureRate = previousFailureRate;
+
+    return @{
+        @"inline_bytes": [NSNumber numberWithUnsignedInteger:inlineBytes],
+        @"referenced_bytes": [NSNumber numberWithUnsignedInteger:referencedBytes],
+        @"uploads": [NSNumber numberWithUnsignedInteger:count*2],
+        @"delivered": [NSNumber numberWithInt:delivered],
+        @"batch_bytes_per_occurrence": [NSNumber numberWithDouble:(double)batchBytes/count],
+        @"single_bytes_per_occurrence": [NSNumber numberWithDouble:(double)singleBytes/count],
+        @"context_rejections": [NSNumber numberWithLongLong:server.contextRejections]
+    };
+}
+
+// only reports both PLCrashReport and SCCrashReportOpen can read are used,
+// so that every stage sees the same corpus
+- (NSArray *) loadCrashReportData {
+    NSMutableArray *reports = [NSMutableArray array];
+    if (!crashReportsDirectory) return reports;
+    SCCrashReport *converted = malloc(sizeof(SCCrashReport));
+    for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:crashReportsDirectory error:NULL]) {
+        if (![[file pathExtension] isEqualToString:@"plcrash"]) continue;
+        NSData *data = [NSData dataWithContentsOfFile:[crashReportsDirectory stringByAppendingPathComponent:file]];
+        NSError *error = nil;
+        PLCrashReport *report = data ? [[[PLCrashReport alloc] initWithData:data error:&error] autorelease] : nil;
+        if (!report) NSLog(@"Skipping unreadable crash report %@: %@", file, error);
+        else if (!SCCrashReportOpen(converted, [data bytes], [data length])) NSLog(@"Skipping crash report %@ that SCCrashReportOpen can't read", file);
+        else [reports addObject:data];
+    }
+    free(converted);
+    return reports;
+}
+
+@end
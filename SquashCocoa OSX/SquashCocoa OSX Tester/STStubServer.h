@@ -0,0 +1,91 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <Foundation/Foundation.h>
+
+/*!
+ A minimal in-process HTTP server standing in for the Squash notify endpoint,
+ so that uploads can be benchmarked without a network. It listens on the
+ loopback interface, supports keep-alive connections, and answers requests
+ with an empty body. Latency and failures can be injected.
+
+ It also speaks the context deduplication protocol (see
+ SquashCocoa::deduplicatesContext): an occurrence carrying its context fields
+ registers its `context_id`, and one referencing a `context_id` that was never
+ registered is answered with 412 (per item, in a `statuses` array, for
+ batches). Only uncompressed bodies are inspected; compressed ones are
+ accepted as they are.
+ */
+@interface STStubServer : NSObject {
+    int listener;
+    uint16_t port;
+    dispatch_queue_t queue;
+    dispatch_source_t acceptSource;
+    NSTimeInterval latency;
+    double failureRate;
+    NSInteger failureStatusCode;
+    int64_t requestCount;
+    int64_t failureCount;
+    int64_t bytesReceived;
+    int64_t contextRejections;
+    NSMutableSet *contexts;
+}
+
+/*! The port the server is listening on, once started. */
+@property (readonly) uint16_t port;
+
+/*! The base URL of the server, suitable for SquashCocoa::host. */
+@property (readonly) NSString *host;
+
+/*! How long to wait before answering each request, in seconds. */
+@property (assign) NSTimeInterval latency;
+
+/*! The fraction of requests (0 to 1) answered with STStubServer::failureStatusCode. */
+@property (assign) double failureRate;
+
+/*! The status code of injected failures. By default it's 503. */
+@property (assign) NSInteger failureStatusCode;
+
+/*! The number of requests answered so far. */
+@property (readonly) int64_t requestCount;
+
+/*! The number of requests answered with an injected failure. */
+@property (readonly) int64_t failureCount;
+
+/*! The total size of the request bodies received, in bytes. */
+@property (readonly) int64_t bytesReceived;
+
+/*! The number of occurrences answered with 412 for an unknown context. */
+@property (readonly) int64_t contextRejections;
+
+/*! The number of distinct contexts registered so far. */
+@property (readonly) NSUInteger registeredContextCount;
+
+/*!
+ Binds to an ephemeral loopback port and starts accepting connections.
+ @return Whether the server could be started.
+ */
+- (BOOL) start;
+
+/*! Stops accepting connections. Open connections are closed as they finish. */
+- (void) stop;
+
+/*!
+ Forgets every registered context, as a Squash host that restarted would, so
+ that clients have to send their contexts again.
+ */
+- (void) forgetContexts;
+
+@end
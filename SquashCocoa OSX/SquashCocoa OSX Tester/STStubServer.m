@@ -0,0 +1,231 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <unistd.h>
+#import <libkern/OSAtomic.h>
+#import "STStubServer.h"
+
+@interface STStubServer (Private)
+- (void) serveConnection:(int)connection;
+- (BOOL) readRequestFromConnection:(int)connection body:(NSData **)body;
+- (void) respondOnConnection:(int)connection body:(NSData *)body;
+- (NSInteger) statusOfOccurrence:(id)occurrence;
+@end
+
+#pragma mark -
+
+@implementation STStubServer
+
+#pragma mark Properties
+
+@synthesize port;
+@synthesize latency;
+@synthesize failureRate;
+@synthesize failureStatusCode;
+@synthesize requestCount;
+@synthesize failureCount;
+@synthesize bytesReceived;
+@synthesize contextRejections;
+
+- (NSUInteger) registeredContextCount {
+    @synchronized(contexts) {
+        return [contexts count];
+    }
+}
+
+- (NSString *) host {
+    return [NSString stringWithFormat:@"http://127.0.0.1:%u", port];
+}
+
+#pragma mark Initializers
+
+- (id) init {
+    if (self = [super init]) {
+        listener = -1;
+        failureStatusCode = 503;
+        contexts = [[NSMutableSet alloc] init];
+        queue = dispatch_queue_create("com.squareup.squash.tester.stubserver", DISPATCH_QUEUE_CONCURRENT);
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [self stop];
+    dispatch_release(queue);
+    [contexts release];
+    [super dealloc];
+}
+
+#pragma mark Lifecycle
+
+- (BOOL) start {
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return NO;
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_len = sizeof(address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, 16) != 0 ||
+        getsockname(listener, (struct sockaddr *)&address, &length) != 0) {
+        close(listener);
+        listener = -1;
+        return NO;
+    }
+    port = ntohs(address.sin_port);
+
+    int socket = listener;
+    acceptSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socket, 0, queue);
+    dispatch_source_set_event_handler(acceptSource, ^{
+        int connection = accept(socket, NULL, NULL);
+        if (connection < 0) return;
+        int noSigPipe = 1;
+        setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+        dispatch_async(queue, ^{ [self serveConnection:connection]; });
+    });
+    dispatch_source_set_cancel_handler(acceptSource, ^{ close(socket); });
+    dispatch_resume(acceptSource);
+    return YES;
+}
+
+- (void) stop {
+    if (!acceptSource) return;
+    dispatch_source_cancel(acceptSource);
+    dispatch_release(acceptSource);
+    acceptSource = NULL;
+    listener = -1;
+}
+
+- (void) forgetContexts {
+    @synchronized(contexts) {
+        [contexts removeAllObjects];
+    }
+}
+
+@end
+
+#pragma mark -
+
+@implementation STStubServer (Private)
+
+- (void) serveConnection:(int)connection {
+    NSData *body = nil;
+    while ([self readRequestFromConnection:connection body:&body])
+        [self respondOnConnection:connection body:body];
+    close(connection);
+}
+
+// Reads one request, headers and body. The body is returned only if it isn't
+// compressed. Returns NO once the client has closed the connection.
+- (BOOL) readRequestFromConnection:(int)connection body:(NSData **)body {
+    NSMutableData *buffer = [[NSMutableData alloc] init];
+    char chunk[16384];
+    NSUInteger headerEnd = NSNotFound;
+    NSUInteger contentLength = 0;
+    BOOL encoded = NO;
+    BOOL complete = NO;
+
+    while (!complete) {
+        ssize_t count = read(connection, chunk, sizeof(chunk));
+        if (count <= 0) break;
+        [buffer appendBytes:chunk length:count];
+
+        if (headerEnd == NSNotFound) {
+            NSRange separator = [buffer rangeOfData:[NSData dataWithBytes:"\r\n\r\n" length:4]
+                                            options:0
+                                              range:NSMakeRange(0, [buffer length])];
+            if (separator.location == NSNotFound) continue;
+            headerEnd = NSMaxRange(separator);
+
+            NSString *headers = [[NSString alloc] initWithBytes:[buffer bytes] length:headerEnd encoding:NSISOLatin1StringEncoding];
+            for (NSString *line in [headers componentsSeparatedByString:@"\r\n"]) {
+                if ([[line lowercaseString] hasPrefix:@"content-length:"])
+                    contentLength = (NSUInteger)[[line substringFromIndex:15] integerValue];
+                else if ([[line lowercaseString] hasPrefix:@"content-encoding:"])
+                    encoded = YES;
+            }
+            [headers release];
+        }
+        complete = ([buffer length] >= headerEnd + contentLength);
+    }
+
+    *body = nil;
+    if (complete) {
+        OSAtomicAdd64(contentLength, &bytesReceived);
+        if (!encoded && contentLength > 0)
+            *body = [buffer subdataWithRange:NSMakeRange(headerEnd, contentLength)];
+    }
+    [buffer release];
+    return complete;
+}
+
+- (void) respondOnConnection:(int)connection body:(NSData *)body {
+    if (latency > 0) [NSThread sleepForTimeInterval:latency];
+
+    NSInteger status = 200;
+    NSData *responseBody = nil;
+    if (failureRate > 0 && arc4random_uniform(1000000) < failureRate*1000000) {
+        status = failureStatusCode;
+        OSAtomicIncrement64(&failureCount);
+    } else if (body) {
+        id payload = [NSJSONSerialization JSONObjectWithData:body options:0 error:NULL];
+        NSArray *occurrences = [payload isKindOfClass:[NSDictionary class]] ? [payload objectForKey:@"occurrences"] : nil;
+        if ([occurrences isKindOfClass:[NSArray class]]) {
+            NSMutableArray *statuses = [NSMutableArray arrayWithCapacity:[occurrences count]];
+            for (id occurrence in occurrences)
+                [statuses addObject:[NSNumber numberWithInteger:[self statusOfOccurrence:occurrence]]];
+            responseBody = [NSJSONSerialization dataWithJSONObject:@{@"statuses": statuses} options:0 error:NULL];
+        } else {
+            status = [self statusOfOccurrence:payload];
+        }
+    }
+    OSAtomicIncrement64(&requestCount);
+
+    NSString *response = [NSString stringWithFormat:@"HTTP/1.1 %ld Stub\r\nContent-Length: %lu\r\nContent-Type: application/json\r\nConnection: keep-alive\r\n\r\n",
+                          (long)status, (unsigned long)[responseBody length]];
+    NSMutableData *bytes = [NSMutableData dataWithData:[response dataUsingEncoding:NSUTF8StringEncoding]];
+    if (responseBody) [bytes appendData:responseBody];
+    write(connection, [bytes bytes], [bytes length]);
+}
+
+// An occurrence with its context fields (symbolication_id is always among
+// them) registers its context; one with only a context_id must reference a
+// registered context.
+- (NSInteger) statusOfOccurrence:(id)occurrence {
+    if (![occurrence isKindOfClass:[NSDictionary class]]) return 400;
+    NSString *contextID = [occurrence objectForKey:@"context_id"];
+    if (![contextID isKindOfClass:[NSString class]]) return 200;
+
+    @synchronized(contexts) {
+        if ([occurrence objectForKey:@"symbolication_id"]) {
+            [contexts addObject:contextID];
+            return 200;
+        }
+        if ([contexts containsObject:contextID]) return 200;
+    }
+    OSAtomicIncrement64(&contextRejections);
+    return 412;
+}
+
+@end
@@ -0,0 +1,250 @@
+// Copyright 2013 Square Inc.
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+// Checks SCCrashReportConverter against the saved reports in Fixtures, and
+// checks that truncated or corrupted copies of them are rejected or read
+// without touching memory outside the report. The converter is plain C, so
+// this runs anywhere; under the sanitizers, for instance:
+//
+//   cc -std=c99 -Wall -Wextra -fsanitize=address,undefined -ISource
+//      -o crash-report-tests
+//      Tests/SCCrashReportConverterTests.c Source/SCCrashReportConverter.c
+//   ./crash-report-tests Tests/Fixtures
+//
+// The fixtures describe a 64-bit Mac OS X 10.8.4 process with two images
+// (0x1000 and 0x2000, 4 KB each) and seven threads:
+//   signal.plcrash      SIGSEGV; thread 0 crashed
+//   exception.plcrash   the same, with an uncaught NSRangeException
+//   no-threads.plcrash  an exception and images but no threads, process or
+//                       machine info
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SCCrashReportConverter.h"
+
+static int SCTestFailures = 0;
+
+#define SCTestAssert(condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        SCTestFailures++; \
+    } \
+} while (0)
+
+#pragma mark Fixtures
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+} SCTestFile;
+
+static SCTestFile SCTestLoad(const char *directory, const char *name) {
+    SCTestFile file = { NULL, 0 };
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    FILE *stream = fopen(path, "rb");
+    if (!stream) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        exit(2);
+    }
+    fseek(stream, 0, SEEK_END);
+    file.length = (size_t)ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    file.bytes = malloc(file.length);
+    if (fread(file.bytes, 1, file.length, stream) != file.length) {
+        fprintf(stderr, "Couldn't read %s\n", path);
+        exit(2);
+    }
+    fclose(stream);
+    return file;
+}
+
+static bool SCTestStringEquals(SCCrashReportString string, const char *expected) {
+    return string.bytes && string.length == strlen(expected) && memcmp(string.bytes, expected, string.length) == 0;
+}
+
+#pragma mark Visitor
+
+typedef struct {
+    unsigned threads;
+    unsigned frames;
+    unsigned registers;
+    unsigned unknownImageFrames;
+    int crashedThread;
+    uint64_t firstAddress;
+    uint32_t firstImage;
+    uint64_t firstOffset;
+} SCTestCounts;
+
+static void SCTestBeginThread(void *context, uint32_t number, bool crashed, bool registers) {
+    SCTestCounts *counts = context;
+    (void)registers;
+    counts->threads++;
+    if (crashed) counts->crashedThread = (int)number;
+}
+
+static void SCTestFrame(void *context, uint64_t address, uint32_t image, uint64_t offset) {
+    SCTestCounts *counts = context;
+    if (counts->frames++ == 0) {
+        counts->firstAddress = address;
+        counts->firstImage = image;
+        counts->firstOffset = offset;
+    }
+    if (image == SCCrashReportNoImage) counts->unknownImageFrames++;
+}
+
+static void SCTestRegister(void *context, SCCrashReportString name, uint64_t value) {
+    SCTestCounts *counts = context;
+    (void)name;
+    (void)value;
+    counts->registers++;
+}
+
+static const SCCrashReportVisitor SCTestVisitor = { SCTestBeginThread, SCTestFrame, SCTestRegister };
+
+static SCTestCounts SCTestVisitThreads(const SCCrashReport *report, bool allRegisters, bool *success) {
+    SCTestCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    counts.crashedThread = -1;
+    *success = SCCrashReportVisitThreads(report, &SCTestVisitor, allRegisters, &counts);
+    return counts;
+}
+
+#pragma mark Tests
+
+static void SCTestSignalReport(SCCrashReport *report, SCTestFile file) {
+    SCTestAssert(SCCrashReportOpen(report, file.bytes, file.length), "signal.plcrash didn't open");
+
+    SCTestAssert(strcmp(SCCrashReportOperatingSystemName(report->operatingSystem), "Mac OS X") == 0, "wrong operating system");
+    SCTestAssert(SCTestStringEquals(report->operatingSystemVersion, "10.8.4"), "wrong OS version");
+    SCTestAssert(SCTestStringEquals(report->operatingSystemBuild, "12E55"), "wrong OS build");
+    SCTestAssert(report->timestamp == 1380000000, "wrong timestamp %lld", (long long)report->timestamp);
+    SCTestAssert(report->hasMachineInfo && SCTestStringEquals(report->modelName, "MacBookPro10,1"), "wrong machine info");
+    SCTestAssert(report->hasProcessInfo && report->processID == 123, "wrong process ID");
+    SCTestAssert(SCTestStringEquals(report->processPath, "/bin/app"), "wrong process path");
+    SCTestAssert(SCTestStringEquals(report->parentProcessName, "launchd"), "wrong parent process");
+    SCTestAssert(SCTestStringEquals(report->signalName, "SIGSEGV"), "wrong signal");
+    SCTestAssert(!report->hasException, "unexpected exception");
+    SCTestAssert(report->threadCount == 7, "expected 7 threads, got %zu", report->threadCount);
+    SCTestAssert(report->imageCount == 2, "expected 2 images, got %zu", report->imageCount);
+
+    char UUID[37];
+    SCTestAssert(report->images[0].UUID != NULL, "first image has no UUID");
+    if (report->images[0].UUID) {
+        SCCrashReportFormatUUID(report->images[0].UUID, UUID);
+        SCTestAssert(strcmp(UUID, "00010203-0405-0607-0809-0A0B0C0D0E0F") == 0, "wrong UUID %s", UUID);
+    }
+    SCTestAssert(report->images[1].UUID == NULL, "second image has a UUID");
+
+    bool success;
+    SCTestCounts counts = SCTestVisitThreads(report, false, &success);
+    SCTestAssert(success, "visiting threads failed");
+    SCTestAssert(counts.threads == 7, "visited %u threads", counts.threads);
+    SCTestAssert(counts.frames == 3 + 5 * 2 + 1, "visited %u frames", counts.frames);
+    SCTestAssert(counts.crashedThread == 0, "crashed thread is %d", counts.crashedThread);
+    SCTestAssert(counts.registers == 2, "visited %u registers of the crashed thread", counts.registers);
+    SCTestAssert(counts.firstAddress == 0x1000 && counts.firstImage == 0 && counts.firstOffset == 0, "wrong first frame");
+    SCTestAssert(counts.unknownImageFrames == 1, "%u frames outside any image", counts.unknownImageFrames);
+
+    counts = SCTestVisitThreads(report, true, &success);
+    SCTestAssert(success && counts.registers == 2 + 5, "visited %u registers of all threads", counts.registers);
+}
+
+static void SCTestExceptionReport(SCCrashReport *report, SCTestFile file) {
+    SCTestAssert(SCCrashReportOpen(report, file.bytes, file.length), "exception.plcrash didn't open");
+    SCTestAssert(report->hasException, "no exception");
+    SCTestAssert(SCTestStringEquals(report->exceptionName, "NSRangeException"), "wrong exception name");
+    SCTestAssert(SCTestStringEquals(report->exceptionReason, "index 3 beyond\nbounds"), "wrong exception reason");
+
+    SCTestCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    SCTestAssert(SCCrashReportVisitExceptionFrames(report, &SCTestVisitor, &counts), "visiting exception frames failed");
+    SCTestAssert(counts.frames == 2, "visited %u exception frames", counts.frames);
+    SCTestAssert(counts.firstAddress == 0x1004 && counts.firstImage == 0 && counts.firstOffset == 4, "wrong first exception frame");
+    SCTestAssert(counts.threads == 0 && counts.registers == 0, "exception frames visited threads or registers");
+}
+
+static void SCTestReportWithoutThreads(SCCrashReport *report, SCTestFile file) {
+    SCTestAssert(SCCrashReportOpen(report, file.bytes, file.length), "no-threads.plcrash didn't open");
+    SCTestAssert(report->threadCount == 0, "expected no threads");
+    SCTestAssert(!report->hasProcessInfo && !report->hasMachineInfo, "unexpected process or machine info");
+    SCTestAssert(report->hasException, "no exception");
+
+    bool success;
+    SCTestCounts counts = SCTestVisitThreads(report, true, &success);
+    SCTestAssert(success && counts.threads == 0, "visited %u threads", counts.threads);
+}
+
+// Every prefix of a report, and every single-byte corruption of it, must be
+// rejected or read without reading outside its bytes, which the sanitizers
+// catch.
+static void SCTestDamagedCopies(SCCrashReport *report, SCTestFile file, const char *name) {
+    for (size_t length = 0; length < file.length; length++) {
+        // copied so that reading past the prefix is an overflow
+        uint8_t *prefix = malloc(length ? length : 1);
+        memcpy(prefix, file.bytes, length);
+        if (SCCrashReportOpen(report, prefix, length)) {
+            bool success;
+            SCTestCounts counts = SCTestVisitThreads(report, true, &success);
+            SCTestAssert(!success || counts.threads <= 7, "%s truncated to %zu bytes visited %u threads", name, length, counts.threads);
+            SCCrashReportVisitExceptionFrames(report, &SCTestVisitor, &counts);
+        }
+        free(prefix);
+    }
+    SCTestAssert(!SCCrashReportOpen(report, file.bytes, 7), "%s opened without its version byte", name);
+
+    uint8_t *copy = malloc(file.length);
+    for (size_t offset = 0; offset < file.length; offset++) {
+        static const uint8_t patterns[] = { 0x00, 0x7F, 0x80, 0xFF };
+        for (size_t idx = 0; idx < sizeof(patterns); idx++) {
+            memcpy(copy, file.bytes, file.length);
+            copy[offset] = patterns[idx];
+            if (!SCCrashReportOpen(report, copy, file.length)) continue;
+            bool success;
+            SCTestVisitThreads(report, true, &success);
+            SCTestCounts counts;
+            memset(&counts, 0, sizeof(counts));
+            SCCrashReportVisitExceptionFrames(report, &SCTestVisitor, &counts);
+        }
+    }
+    free(copy);
+}
+
+int main(int argc, char **argv) {
+    const char *fixtures = (argc > 1) ? argv[1] : "Tests/Fixtures";
+    const char *names[] = { "signal.plcrash", "exception.plcrash", "no-threads.plcrash" };
+    SCTestFile files[3];
+    for (size_t idx = 0; idx < 3; idx++) files[idx] = SCTestLoad(fixtures, names[idx]);
+
+    // too big for the stack on some platforms
+    SCCrashReport *report = malloc(sizeof(SCCrashReport));
+    SCTestSignalReport(report, files[0]);
+    SCTestExceptionReport(report, files[1]);
+    SCTestReportWithoutThreads(report, files[2]);
+    for (size_t idx = 0; idx < 3; idx++) SCTestDamagedCopies(report, files[idx], names[idx]);
+    SCTestAssert(!SCCrashReportOpen(report, "not a crash report", 18), "opened a file that isn't a crash report");
+
+    free(report);
+    for (size_t idx = 0; idx < 3; idx++) free(files[idx].bytes);
+    if (SCTestFailures) {
+        fprintf(stderr, "%d failure(s)\n", SCTestFailures);
+        return 1;
+    }
+    printf("All crash report tests passed\n");
+    return 0;
+}